@@ -48,6 +48,7 @@ std::array<authd_cmd_handler, 256> authd_cmd_handlers =
 std::array<authd_stat_handler, 256> authd_stat_handlers =
 []{
 	std::array<authd_stat_handler, 256> ret;
+	ret['C'] = dns_cache_stats;
 	ret['D'] = enumerate_nameservers;
 	return ret;
 }();
@@ -215,6 +216,8 @@ main(int argc, char *argv[])
 	setup_signals();
 
 	authd_option_handlers = rb_dictionary_create("authd options handlers", reinterpret_cast<int (*)(const void *, const void *)>(rb_strcasecmp));
+	for(struct auth_opts_handler *handler = dns_options; handler->option != NULL; handler++)
+		rb_dictionary_add(authd_option_handlers, handler->option, handler);
 
 	init_resolver();
 	init_providers();
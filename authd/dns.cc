@@ -310,9 +310,49 @@ enumerate_nameservers(uint32_t rid, const char letter)
 	stats_result(rid, letter, "%s", buf);
 }
 
+void
+dns_cache_stats(uint32_t rid, const char letter)
+{
+	struct res_cache_stats stats;
+	unsigned long answered, lookups;
+
+	resolver_cache_stats(&stats);
+
+	answered = stats.hits + stats.negative_hits + stats.coalesced;
+	lookups = answered + stats.misses;
+
+	stats_result(rid, letter, "entries=%lu/%lu hits=%lu negative=%lu coalesced=%lu misses=%lu hitrate=%lu%% expired=%lu evicted=%lu",
+		stats.entries, stats.size, stats.hits, stats.negative_hits, stats.coalesced,
+		stats.misses, lookups ? answered * 100 / lookups : 0,
+		stats.expired, stats.evicted);
+}
+
 void
 reload_nameservers(const char letter)
 {
 	/* Not a whole lot to it */
 	restart_resolver();
 }
+
+static void
+set_dns_cache(const char *key, int parc, const char **parv)
+{
+	int size = atoi(parv[0]);
+	int max_ttl = atoi(parv[1]);
+	int negative_ttl = atoi(parv[2]);
+
+	if(size < 0 || max_ttl < 0 || negative_ttl < 0)
+	{
+		warn_opers(L_CRIT, "DNS: bad cache settings (size %d, max ttl %d, negative ttl %d)",
+			size, max_ttl, negative_ttl);
+		exit(EX_DNS_ERROR);
+	}
+
+	configure_resolver_cache(size, max_ttl, negative_ttl);
+}
+
+struct auth_opts_handler dns_options[] =
+{
+	{ "dns_cache", 3, set_dns_cache },
+	{ NULL, 0, NULL },
+};
@@ -41,6 +41,8 @@
 #include "provider.h"
 #include "notice.h"
 #include "dns.h"
+#include <string>
+#include <unordered_map>
 
 using namespace ircd::defaults;
 
@@ -67,18 +69,37 @@ struct blacklist
 	bool delete_;			/* If true delete when no clients */
 	int refcount;			/* When 0 and delete is set, remove this blacklist */
 	unsigned int hits;
+	unsigned int cache_hits;	/* Verdicts answered from the cache */
+	unsigned int cache_misses;	/* Verdicts that needed a query */
 
 	time_t lastwarning;		/* Last warning about garbage replies sent */
 };
 
+/* A DNSBL query in flight, shared by every client with the same address */
+struct blacklist_pending
+{
+	std::string name;		/* Query name, also the cache key */
+	struct dns_query *query;	/* DNS query pointer */
+	rb_dlink_list lookups;		/* Lookups waiting on the answer */
+	bool dispatching;		/* Answer is being handed out */
+};
+
 /* A lookup in progress for a particular DNSBL for a particular client */
 struct blacklist_lookup
 {
 	struct blacklist *bl;		/* Blacklist we're checking */
 	struct auth_client *auth;	/* Client */
-	struct dns_query *query;	/* DNS query pointer */
+	struct blacklist_pending *pending;	/* Shared query, NULL once answered */
 
 	rb_dlink_node node;
+	rb_dlink_node pnode;		/* Node in pending->lookups */
+};
+
+/* A cached answer for a particular DNSBL for a particular address */
+struct blacklist_verdict
+{
+	time_t expires;
+	char reply[HOSTIPLEN];		/* Empty if not listed */
 };
 
 /* A blacklist filter */
@@ -109,13 +130,22 @@ static void blacklists_cancel_none(struct auth_client *);
 static void unref_blacklist(struct blacklist *);
 static struct blacklist *new_blacklist(const char *, const char *, uint8_t, rb_dlink_list *);
 static struct blacklist *find_blacklist(const char *);
-static bool blacklist_check_reply(struct blacklist_lookup *, const char *);
+static bool blacklist_check_reply(struct blacklist *, const char *);
 static void blacklist_dns_callback(const char *, bool, query_type, void *);
-static void initiate_blacklist_dnsquery(struct blacklist *, struct auth_client *);
+static void initiate_blacklist_dnsquery(struct blacklist *, struct auth_client *, const char *);
+
+/* Verdicts are only cached while there is room; expired ones are swept out
+ * when the cache fills up */
+#define BLACKLIST_CACHE_MAX	65536
 
 /* Variables */
 static rb_dlink_list blacklist_list = { NULL, NULL, 0 };
 static int blacklist_timeout = BLACKLIST_TIMEOUT_DEFAULT;
+static int blacklist_cache_ttl = BLACKLIST_CACHE_TTL_DEFAULT;
+static int blacklist_cache_negative_ttl = BLACKLIST_CACHE_NEGATIVE_TTL_DEFAULT;
+
+static std::unordered_map<std::string, struct blacklist_verdict> blacklist_cache;
+static std::unordered_map<std::string, struct blacklist_pending *> blacklist_pending_queries;
 
 /* private interfaces */
 
@@ -182,9 +212,8 @@ find_blacklist(const char *name)
 }
 
 static inline bool
-blacklist_check_reply(struct blacklist_lookup *bllookup, const char *ipaddr)
+blacklist_check_reply(struct blacklist *bl, const char *ipaddr)
 {
-	struct blacklist *bl = bllookup->bl;
 	const char *lastoctet;
 	rb_dlink_node *ptr;
 
@@ -229,15 +258,110 @@ blwarn:
 	return false;
 }
 
+/* Find a cached verdict, dropping it if it has expired */
+static struct blacklist_verdict *
+find_verdict(const char *name)
+{
+	auto it = blacklist_cache.find(name);
+
+	if(it == blacklist_cache.end())
+		return NULL;
+
+	if(it->second.expires <= rb_current_time())
+	{
+		blacklist_cache.erase(it);
+		return NULL;
+	}
+
+	return &it->second;
+}
+
+/* Remember a blacklist's answer; reply is NULL if the address is not listed */
 static void
-blacklist_dns_callback(const char *result, bool status, query_type type, void *data)
+cache_verdict(const std::string &name, const char *reply)
+{
+	static time_t last_sweep;
+	const time_t now = rb_current_time();
+	const int ttl = reply != NULL ? blacklist_cache_ttl : blacklist_cache_negative_ttl;
+
+	if(ttl <= 0)
+		return;
+
+	if(blacklist_cache.size() >= BLACKLIST_CACHE_MAX)
+	{
+		if(last_sweep == now)
+			return;
+
+		last_sweep = now;
+		for(auto it = blacklist_cache.begin(); it != blacklist_cache.end(); )
+		{
+			if(it->second.expires <= now)
+				it = blacklist_cache.erase(it);
+			else
+				++it;
+		}
+
+		if(blacklist_cache.size() >= BLACKLIST_CACHE_MAX)
+			return;
+	}
+
+	struct blacklist_verdict &verdict = blacklist_cache[name];
+	verdict.expires = now + ttl;
+	rb_strlcpy(verdict.reply, reply != NULL ? reply : "", sizeof(verdict.reply));
+}
+
+/* Stop waiting on a shared query; it is cancelled once nobody waits on it */
+static void
+release_lookup(struct blacklist_lookup *bllookup)
+{
+	struct blacklist_pending *pending = bllookup->pending;
+
+	if(pending == NULL)
+		return;
+
+	rb_dlinkDelete(&bllookup->pnode, &pending->lookups);
+	bllookup->pending = NULL;
+
+	if(!rb_dlink_list_length(&pending->lookups) && !pending->dispatching)
+	{
+		cancel_query(pending->query);	/* Ignore future responses */
+		blacklist_pending_queries.erase(pending->name);
+		delete pending;
+	}
+}
+
+/* The client is on none of the blacklists */
+static void
+blacklists_clear(struct auth_client *auth)
+{
+	struct blacklist_user *bluser = (blacklist_user *)get_provider_data(auth, SELF_PID);
+
+	notice_client(auth->cid, "*** IP not found in DNS blacklist%s",
+			rb_dlink_list_length(&blacklist_list) > 1 ? "s" : "");
+	rb_free(bluser);
+	set_provider_data(auth, SELF_PID, NULL);
+	set_provider_timeout_absolute(auth, SELF_PID, 0);
+	provider_done(auth, SELF_PID);
+
+	auth_client_unref(auth);
+}
+
+/* The client is on a blacklist, so proceed no further */
+static void
+blacklists_reject(struct auth_client *auth, struct blacklist *bl)
+{
+	bl->hits++;
+	reject_client(auth, SELF_PID, bl->host, bl->reason);
+	blacklists_cancel(auth);
+}
+
+static void
+blacklist_lookup_done(struct blacklist_lookup *bllookup, const char *reply)
 {
-	struct blacklist_lookup *bllookup = (struct blacklist_lookup *)data;
 	struct blacklist_user *bluser;
 	struct blacklist *bl;
 	struct auth_client *auth;
 
-	lrb_assert(bllookup != NULL);
 	lrb_assert(bllookup->auth != NULL);
 
 	bl = bllookup->bl;
@@ -246,66 +370,87 @@ blacklist_dns_callback(const char *result, bool status, query_type type, void *d
 	if((bluser = (blacklist_user *)get_provider_data(auth, SELF_PID)) == NULL)
 		return;
 
-	if (result != NULL && status && blacklist_check_reply(bllookup, result))
+	if (reply != NULL && blacklist_check_reply(bl, reply))
 	{
-		/* Match found, so proceed no further */
-		bl->hits++;
-		reject_client(auth, SELF_PID, bl->host, bl->reason);
-		blacklists_cancel(auth);
+		blacklists_reject(auth, bl);
 		return;
 	}
 
 	unref_blacklist(bl);
-	cancel_query(bllookup->query);	/* Ignore future responses */
 	rb_dlinkDelete(&bllookup->node, &bluser->queries);
 	rb_free(bllookup);
 
 	if(!rb_dlink_list_length(&bluser->queries))
-	{
 		/* Done here */
-		notice_client(auth->cid, "*** IP not found in DNS blacklist%s",
-				rb_dlink_list_length(&blacklist_list) > 1 ? "s" : "");
-		rb_free(bluser);
-		set_provider_data(auth, SELF_PID, NULL);
-		set_provider_timeout_absolute(auth, SELF_PID, 0);
-		provider_done(auth, SELF_PID);
+		blacklists_clear(auth);
+}
+
+static void
+blacklist_dns_callback(const char *result, bool status, query_type type, void *data)
+{
+	struct blacklist_pending *pending = (struct blacklist_pending *)data;
+	const char *reply = result != NULL && status ? result : NULL;
+	rb_dlink_node *ptr;
+
+	lrb_assert(pending != NULL);
+
+	blacklist_pending_queries.erase(pending->name);
+	cache_verdict(pending->name, reply);
 
-		auth_client_unref(auth);
+	/* Hand the answer to every client waiting on it.  Rejecting one client
+	 * cancels its other lookups, so take them off the list one at a time. */
+	pending->dispatching = true;
+	while((ptr = pending->lookups.head) != NULL)
+	{
+		struct blacklist_lookup *bllookup = (struct blacklist_lookup *)ptr->data;
+
+		rb_dlinkDelete(&bllookup->pnode, &pending->lookups);
+		bllookup->pending = NULL;
+		blacklist_lookup_done(bllookup, reply);
 	}
+
+	delete pending;
 }
 
+/* Query a blacklist for a client, sharing any query already in flight */
 static void
-initiate_blacklist_dnsquery(struct blacklist *bl, struct auth_client *auth)
+initiate_blacklist_dnsquery(struct blacklist *bl, struct auth_client *auth, const char *name)
 {
 	struct blacklist_lookup *bllookup = (blacklist_lookup *)rb_malloc(sizeof(struct blacklist_lookup));
 	struct blacklist_user *bluser = (blacklist_user *)get_provider_data(auth, SELF_PID);
-	char buf[IRCD_RES_HOSTLEN + 1];
-	int aftype;
+	struct blacklist_pending *pending;
+	auto it = blacklist_pending_queries.find(name);
 
 	bllookup->bl = bl;
 	bllookup->auth = auth;
 
-	aftype = GET_SS_FAMILY(&auth->c_addr);
-	if((aftype == AF_INET && (bl->iptype & IPTYPE_IPV4) == 0) ||
-		(aftype == AF_INET6 && (bl->iptype & IPTYPE_IPV6) == 0))
-		/* Incorrect blacklist type for this IP... */
+	if(it != blacklist_pending_queries.end())
+		pending = it->second;
+	else
 	{
-		rb_free(bllookup);
-		return;
+		pending = new blacklist_pending();
+		pending->name = name;
+		blacklist_pending_queries[pending->name] = pending;
+		pending->query = lookup_ip(name, AF_INET, blacklist_dns_callback, pending);
 	}
 
-	build_rdns(buf, sizeof(buf), &auth->c_addr, bl->host);
-	bllookup->query = lookup_ip(buf, AF_INET, blacklist_dns_callback, bllookup);
+	bllookup->pending = pending;
+	rb_dlinkAdd(bllookup, &bllookup->pnode, &pending->lookups);
 
 	rb_dlinkAdd(bllookup, &bllookup->node, &bluser->queries);
 	bl->refcount++;
 }
 
+/* Check the client against every blacklist.  Cached verdicts are used as
+ * they are found, so this may reject or clear the client before returning.
+ * Returns false if no blacklist applies to the client's address.
+ */
 static inline bool
 lookup_all_blacklists(struct auth_client *auth)
 {
 	struct blacklist_user *bluser = (blacklist_user *)get_provider_data(auth, SELF_PID);
 	rb_dlink_node *ptr;
+	bool checked = false;
 	int iptype;
 
 	if(GET_SS_FAMILY(&auth->c_addr) == AF_INET)
@@ -324,15 +469,41 @@ lookup_all_blacklists(struct auth_client *auth)
 	RB_DLINK_FOREACH(ptr, blacklist_list.head)
 	{
 		struct blacklist *bl = (struct blacklist *)ptr->data;
+		struct blacklist_verdict *verdict;
+		char buf[IRCD_RES_HOSTLEN + 1];
+
+		if (bl->delete_ || !(bl->iptype & iptype))
+			continue;
+
+		checked = true;
+		build_rdns(buf, sizeof(buf), &auth->c_addr, bl->host);
 
-		if (!bl->delete_ && (bl->iptype & iptype))
-			initiate_blacklist_dnsquery(bl, auth);
+		if((verdict = find_verdict(buf)) == NULL)
+		{
+			bl->cache_misses++;
+			initiate_blacklist_dnsquery(bl, auth, buf);
+			continue;
+		}
+
+		bl->cache_hits++;
+		if(verdict->reply[0] != '\0' && blacklist_check_reply(bl, verdict->reply))
+		{
+			blacklists_reject(auth, bl);
+			return true;
+		}
 	}
 
-	if(!rb_dlink_list_length(&bluser->queries))
+	if(!checked)
 		/* None checked. */
 		return false;
 
+	if(!rb_dlink_list_length(&bluser->queries))
+	{
+		/* Every verdict was cached */
+		blacklists_clear(auth);
+		return true;
+	}
+
 	set_provider_timeout_relative(auth, SELF_PID, blacklist_timeout);
 
 	return true;
@@ -377,18 +548,17 @@ blacklists_start(struct auth_client *auth)
 
 	set_provider_data(auth, SELF_PID, rb_malloc(sizeof(struct blacklist_user)));
 
+	/* Mark ourselves running first: cached verdicts can finish us at once */
+	set_provider_running(auth, SELF_PID);
+
 	if((!get_provider_id("rdns", &rdns_pid) || is_provider_done(auth, rdns_pid)) &&
 		(!get_provider_id("ident", &ident_pid) || is_provider_done(auth, ident_pid)))
 	{
 		/* Start the lookup if ident and rdns are finished, or not loaded. */
 		if(!lookup_all_blacklists(auth))
-		{
 			blacklists_cancel_none(auth);
-			return true;
-		}
 	}
 
-	set_provider_running(auth, SELF_PID);
 	return true;
 }
 
@@ -406,8 +576,8 @@ blacklists_initiate(struct auth_client *auth, uint32_t provider)
 	if(bluser == NULL || rb_dlink_list_length(&bluser->queries))
 		/* Nothing to do */
 		return;
-	else if((!get_provider_id("rdns", &rdns_pid) || is_provider_done(auth, rdns_pid)) &&
-		(!get_provider_id("ident", &ident_pid) || is_provider_done(auth, ident_pid)))
+	else if((get_provider_id("rdns", &rdns_pid) && !is_provider_done(auth, rdns_pid)) ||
+		(get_provider_id("ident", &ident_pid) && !is_provider_done(auth, ident_pid)))
 	{
 		/* Don't start until ident and rdns are finished (or not loaded) */
 		return;
@@ -436,7 +606,7 @@ blacklists_generic_cancel(struct auth_client *auth, const char *message)
 		{
 			struct blacklist_lookup *bllookup = (blacklist_lookup *)ptr->data;
 
-			cancel_query(bllookup->query);
+			release_lookup(bllookup);
 			unref_blacklist(bllookup->bl);
 
 			rb_dlinkDelete(&bllookup->node, &bluser->queries);
@@ -447,7 +617,10 @@ blacklists_generic_cancel(struct auth_client *auth, const char *message)
 	rb_free(bluser);
 	set_provider_data(auth, SELF_PID, NULL);
 	set_provider_timeout_absolute(auth, SELF_PID, 0);
-	provider_done(auth, SELF_PID);
+
+	/* Not if reject_client() has already marked us done */
+	if(is_provider_running(auth, SELF_PID))
+		provider_done(auth, SELF_PID);
 
 	auth_client_unref(auth);
 }
@@ -485,6 +658,7 @@ blacklists_destroy(void)
 	}
 
 	delete_all_blacklists();
+	blacklist_cache.clear();
 }
 
 static void
@@ -580,7 +754,24 @@ add_conf_blacklist_timeout(const char *key, int parc, const char **parv)
 	blacklist_timeout = timeout;
 }
 
-#if 0
+static void
+set_conf_blacklist_cache(const char *key, int parc, const char **parv)
+{
+	int ttl = atoi(parv[0]), negative_ttl = atoi(parv[1]);
+
+	if(ttl < 0 || negative_ttl < 0)
+	{
+		warn_opers(L_CRIT, "Blacklist: blacklist cache TTL < 0 (values: %d %d)", ttl, negative_ttl);
+		exit(EX_PROVIDER_ERROR);
+	}
+
+	blacklist_cache_ttl = ttl;
+	blacklist_cache_negative_ttl = negative_ttl;
+
+	if(ttl == 0 && negative_ttl == 0)
+		blacklist_cache.clear();
+}
+
 static void
 blacklist_stats(uint32_t rid, char letter)
 {
@@ -590,15 +781,15 @@ blacklist_stats(uint32_t rid, char letter)
 	{
 		struct blacklist *bl = (blacklist *)ptr->data;
 
-		if(bl->delete)
+		if(bl->delete_)
 			continue;
 
-		stats_result(rid, letter, "%s %hhu %u", bl->host, bl->iptype, bl->hits);
+		stats_result(rid, letter, "%s %hhu %u %u %u", bl->host, bl->iptype, bl->hits,
+				bl->cache_hits, bl->cache_misses);
 	}
 
 	stats_done(rid, letter);
 }
-#endif
 
 struct auth_opts_handler blacklist_options[] =
 {
@@ -606,6 +797,7 @@ struct auth_opts_handler blacklist_options[] =
 	{ "rbl_del", 1, del_conf_blacklist },
 	{ "rbl_del_all", 0, del_conf_blacklist_all },
 	{ "rbl_timeout", 1, add_conf_blacklist_timeout },
+	{ "rbl_cache", 2, set_conf_blacklist_cache },
 	{ NULL, 0, NULL },
 };
 
@@ -620,6 +812,6 @@ struct auth_provider blacklist_provider =
 	ret.timeout = blacklists_timeout;
 	ret.completed = blacklists_initiate;
 	ret.opt_handlers = blacklist_options;
-	/* .stats_handler = { 'B', blacklist_stats }, */
+	ret.stats_handler = { 'B', blacklist_stats };
 	return ret;
 }();
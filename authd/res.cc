@@ -33,6 +33,9 @@
  */
 
 #include <rb/rb.h>
+#include <list>
+#include <string>
+#include <unordered_map>
 #include "res.h"
 #include "reslib.h"
 
@@ -43,7 +46,10 @@
 static PF res_readreply;
 
 #define MAXPACKET      1024	/* rfc sez 512 but we expand names so ... */
-#define AR_TTL         600	/* TTL in seconds for dns cache entries */
+#define AR_TTL         600	/* default cap in seconds for dns cache entries */
+#define AR_NEGATIVE_TTL 60	/* default cap for NXDOMAIN and empty answers */
+#define AR_SERVFAIL_TTL 30	/* cap for names whose servers all failed */
+#define AR_CACHE_SIZE  4096	/* default number of cached answers */
 
 /* RFC 1104/1105 wasn't very helpful about what these fields
  * should be named, so for now, we'll just name them this way.
@@ -69,25 +75,60 @@ struct reslist
 	char queryname[IRCD_RES_HOSTLEN + 1]; /* name currently being queried */
 	char retries;		/* retry counter */
 	char sends;		/* number of sends (>1 means resent) */
+	bool servfail;		/* the last failure was a SERVFAIL, not a timeout */
 	time_t sentat;
 	time_t timeout;
 	int lastns;	/* index of last server sent to */
 	struct rb_sockaddr_storage addr;
 	char *name;
-	struct DNSQuery *query;	/* query callback for this request */
+	rb_dlink_list waiters;	/* DNSQuery callbacks waiting for this answer */
 };
 
+/* An answer, positive or negative, for one question */
+struct rescache
+{
+	time_t expires;
+	bool negative;
+	char name[IRCD_RES_HOSTLEN + 1];	/* PTR result, or the name looked up */
+	struct rb_sockaddr_storage addr;	/* A or AAAA result */
+};
+
+/* A cached answer waiting to be handed to its callbacks */
+struct resanswer
+{
+	rb_dlink_node node;
+	rb_dlink_list waiters;
+	bool negative;
+	struct DNSReply reply;
+	char name[IRCD_RES_HOSTLEN + 1];
+};
+
+typedef std::list<std::pair<std::string, struct rescache>> rescache_list;
+
 static rb_fde_t *res_fd;
 static rb_dlink_list request_list = { NULL, NULL, 0 };
 static int ns_failure_count[IRCD_MAXNS]; /* timeouts and invalid/failed replies */
 
+/* in flight requests, by id and by question */
+static std::unordered_map<uint16_t, struct reslist *> request_ids;
+static std::unordered_map<std::string, struct reslist *> request_questions;
+
+/* answers by question; the most recently used are at the front */
+static rescache_list cache_list;
+static std::unordered_map<std::string, rescache_list::iterator> cache_index;
+static rb_dlink_list answer_list = { NULL, NULL, 0 };
+
+static size_t cache_size = AR_CACHE_SIZE;
+static time_t cache_max_ttl = AR_TTL;
+static time_t cache_negative_ttl = AR_NEGATIVE_TTL;
+static struct res_cache_stats cache_stats;
+
 static void rem_request(struct reslist *request);
-static struct reslist *make_request(struct DNSQuery *query);
-static void gethost_byname_type_fqdn(const char *name, struct DNSQuery *query,
-		int type);
-static void do_query_name(struct DNSQuery *query, const char *name, struct reslist *request, int);
-static void do_query_number(struct DNSQuery *query, const struct rb_sockaddr_storage *,
-			    struct reslist *request);
+static struct reslist *make_request(rb_dlink_list *waiters);
+static void start_query(rb_dlink_list *waiters, int type, const char *name,
+			const struct rb_sockaddr_storage *addr);
+static void do_query_name(const char *name, struct reslist *request, int);
+static void do_query_number(const struct rb_sockaddr_storage *, struct reslist *request);
 static void query_name(struct reslist *request);
 static int send_res_msg(const char *buf, int len, int count);
 static void resend_query(struct reslist *request);
@@ -178,6 +219,7 @@ static time_t timeout_query_list(time_t now)
 		if (now >= timeout)
 		{
 			ns_failure_count[request->lastns]++;
+			request->servfail = false;
 			request->sentat = now;
 			request->timeout += request->timeout;
 			resend_query(request);
@@ -245,6 +287,11 @@ void restart_resolver(void)
 	rb_close(res_fd);
 	res_fd = NULL;
 	rb_event_delete(timeout_resolver_ev);	/* -ddosen */
+
+	/* answers from the old servers may not hold for the new ones */
+	cache_list.clear();
+	cache_index.clear();
+
 	start_resolver();
 }
 
@@ -270,6 +317,37 @@ static void add_local_domain(char *hname, size_t size)
 	}
 }
 
+/*
+ * question_key - key a question by type and case folded name, for the
+ * cache and to find identical questions in flight
+ */
+static std::string question_key(int type, const char *name)
+{
+	std::string key(1, (char)type);
+
+	for (; *name != '\0'; name++)
+		key += (char)tolower((unsigned char)*name);
+
+	return key;
+}
+
+/*
+ * unlink_request - make a request unreachable, so that a callback
+ * asking the same question starts a new one.
+ */
+static void unlink_request(struct reslist *request)
+{
+	auto it = request_questions.find(question_key(request->type, request->queryname));
+
+	if (it != request_questions.end() && it->second == request)
+		request_questions.erase(it);
+
+	auto id = request_ids.find(request->id);
+
+	if (id != request_ids.end() && id->second == request)
+		request_ids.erase(id);
+}
+
 /*
  * rem_request - remove a request from the list.
  * This must also free any memory that has been allocated for
@@ -277,22 +355,155 @@ static void add_local_domain(char *hname, size_t size)
  */
 static void rem_request(struct reslist *request)
 {
+	rb_dlink_node *ptr, *next_ptr;
+
+	unlink_request(request);
 	rb_dlinkDelete(&request->node, &request_list);
+
+	RB_DLINK_FOREACH_SAFE(ptr, next_ptr, request->waiters.head)
+		rb_dlinkDestroy(ptr, &request->waiters);
+
 	rb_free(request->name);
 	rb_free(request);
 }
 
+/*
+ * answer_waiters - hand a reply (or NULL for failure) to every
+ * callback on the list, emptying it.
+ */
+static void answer_waiters(rb_dlink_list *waiters, struct DNSReply *reply)
+{
+	rb_dlink_node *ptr, *next_ptr;
+	struct DNSQuery *query;
+
+	RB_DLINK_FOREACH_SAFE(ptr, next_ptr, waiters->head)
+	{
+		query = (DNSQuery *)ptr->data;
+		rb_dlinkDestroy(ptr, waiters);
+		(*query->callback) (query->ptr, reply);
+	}
+}
+
+/*
+ * answer_request - answer everyone waiting on a request, and free it.
+ */
+static void answer_request(struct reslist *request, struct DNSReply *reply)
+{
+	unlink_request(request);
+	answer_waiters(&request->waiters, reply);
+	rem_request(request);
+}
+
+/*
+ * cache_find - look up a live cached answer, and mark it as used.
+ */
+static struct rescache *cache_find(const std::string &key)
+{
+	auto it = cache_index.find(key);
+
+	if (it == cache_index.end())
+		return NULL;
+
+	if (it->second->second.expires <= rb_current_time())
+	{
+		cache_list.erase(it->second);
+		cache_index.erase(it);
+		cache_stats.expired++;
+		return NULL;
+	}
+
+	cache_list.splice(cache_list.begin(), cache_list, it->second);
+	return &it->second->second;
+}
+
+/*
+ * cache_trim - evict the least recently used answers beyond the limit
+ */
+static void cache_trim(void)
+{
+	while (cache_index.size() > cache_size)
+	{
+		cache_index.erase(cache_list.back().first);
+		cache_list.pop_back();
+		cache_stats.evicted++;
+	}
+}
+
+/*
+ * cache_add - remember the answer to a request for ttl seconds.
+ * A negative answer is one that there is no such name or record.
+ */
+static void cache_add(struct reslist *request, bool negative, time_t ttl)
+{
+	std::string key = question_key(request->type, request->queryname);
+	struct rescache *entry;
+
+	if (cache_size == 0 || ttl <= 0)
+		return;
+
+	auto it = cache_index.find(key);
+	if (it != cache_index.end())
+		cache_list.splice(cache_list.begin(), cache_list, it->second);
+	else
+	{
+		cache_list.emplace_front(key, rescache());
+		cache_index[key] = cache_list.begin();
+	}
+
+	entry = &cache_list.front().second;
+	entry->expires = rb_current_time() + ttl;
+	entry->negative = negative;
+	rb_strlcpy(entry->name, request->name, sizeof(entry->name));
+	memcpy(&entry->addr, &request->addr, sizeof(entry->addr));
+
+	cache_trim();
+}
+
+/*
+ * deliver_cached_answers - hand out the answers found in the cache.
+ * Callers don't expect their callback to run before the lookup returns,
+ * so this runs from the event loop instead.
+ */
+static void deliver_cached_answers(void *unused)
+{
+	struct resanswer *answer;
+
+	while (answer_list.head != NULL)
+	{
+		answer = (resanswer *)answer_list.head->data;
+		rb_dlinkDelete(&answer->node, &answer_list);
+
+		answer->reply.h_name = answer->name;
+		answer_waiters(&answer->waiters, answer->negative ? NULL : &answer->reply);
+		rb_free(answer);
+	}
+}
+
+static void answer_cached(rb_dlink_list *waiters, const struct rescache *entry)
+{
+	struct resanswer *answer = (resanswer *)rb_malloc(sizeof(struct resanswer));
+
+	answer->negative = entry->negative;
+	rb_strlcpy(answer->name, entry->name, sizeof(answer->name));
+	memcpy(&answer->reply.addr, &entry->addr, sizeof(answer->reply.addr));
+	rb_dlinkMoveList(waiters, &answer->waiters);
+
+	if (answer_list.head == NULL)
+		rb_event_addonce("deliver_cached_answers", deliver_cached_answers, NULL, 0);
+	rb_dlinkAddTail(answer, &answer->node, &answer_list);
+}
+
 /*
  * make_request - Create a DNS request record for the server.
  */
-static struct reslist *make_request(struct DNSQuery *query)
+static struct reslist *make_request(rb_dlink_list *waiters)
 {
 	struct reslist *request = (reslist *)rb_malloc(sizeof(struct reslist));
 
 	request->sentat = rb_current_time();
 	request->retries = 3;
 	request->timeout = 4;	/* start at 4 and exponential inc. */
-	request->query = query;
+	rb_dlinkMoveList(waiters, &request->waiters);
 
 	/*
 	 * generate a unique id
@@ -304,12 +515,84 @@ static struct reslist *make_request(struct DNSQuery *query)
 	 * late replies to be used.
 	 */
 	request->id = generate_random_id();
+	request_ids[request->id] = request;
 
 	rb_dlinkAdd(request, &request->node, &request_list);
 
 	return request;
 }
 
+/*
+ * start_query - answer a question from the cache, join an identical
+ * question already in flight, or ask it.  The callbacks on waiters
+ * are taken over.
+ */
+static void start_query(rb_dlink_list *waiters, int type, const char *name,
+			const struct rb_sockaddr_storage *addr)
+{
+	char queryname[IRCD_RES_HOSTLEN + 1];
+	struct reslist *request;
+	struct rescache *entry;
+
+	if (type == T_PTR)
+		build_rdns(queryname, sizeof(queryname), addr, NULL);
+	else
+		rb_strlcpy(queryname, name, sizeof(queryname));
+
+	std::string key = question_key(type, queryname);
+
+	if ((entry = cache_find(key)) != NULL)
+	{
+		if (entry->negative)
+			cache_stats.negative_hits++;
+		else
+			cache_stats.hits++;
+
+		if (type == T_PTR && !entry->negative)
+		{
+			char hostname[IRCD_RES_HOSTLEN + 1];
+
+			/* confirm the cached name as if it had just arrived */
+			rb_strlcpy(hostname, entry->name, sizeof(hostname));
+#ifdef RB_IPV6
+			if (GET_SS_FAMILY(addr) == AF_INET6)
+				start_query(waiters, T_AAAA, hostname, NULL);
+			else
+#endif
+				start_query(waiters, T_A, hostname, NULL);
+		}
+		else
+			answer_cached(waiters, entry);
+
+		return;
+	}
+
+	auto it = request_questions.find(key);
+	if (it != request_questions.end())
+	{
+		cache_stats.coalesced++;
+		rb_dlinkMoveList(waiters, &it->second->waiters);
+		return;
+	}
+
+	cache_stats.misses++;
+
+	request = make_request(waiters);
+	request_questions[key] = request;
+
+	if (type == T_PTR)
+	{
+		memcpy(&request->addr, addr, sizeof(struct rb_sockaddr_storage));
+		request->name = (char *)rb_malloc(IRCD_RES_HOSTLEN + 1);
+		do_query_number(addr, request);
+	}
+	else
+	{
+		request->name = rb_strdup(name);
+		do_query_name(name, request, type);
+	}
+}
+
 /*
  * retryfreq - determine how many queries to wait before resending
  * if there have been that many consecutive timeouts
@@ -381,18 +664,9 @@ static int send_res_msg(const char *msg, int len, int rcount)
  */
 static struct reslist *find_id(int id)
 {
-	rb_dlink_node *ptr;
-	struct reslist *request;
-
-	RB_DLINK_FOREACH(ptr, request_list.head)
-	{
-		request = (reslist *)ptr->data;
+	auto it = request_ids.find(id);
 
-		if (request->id == id)
-			return (request);
-	}
-
-	return (NULL);
+	return it != request_ids.end() ? it->second : NULL;
 }
 
 static uint16_t
@@ -416,21 +690,14 @@ generate_random_id(void)
 void gethost_byname_type(const char *name, struct DNSQuery *query, int type)
 {
 	char fqdn[IRCD_RES_HOSTLEN + 1];
+	rb_dlink_list waiters = { NULL, NULL, 0 };
 	assert(name != 0);
 
 	rb_strlcpy(fqdn, name, sizeof fqdn);
 	add_local_domain(fqdn, IRCD_RES_HOSTLEN);
-	gethost_byname_type_fqdn(fqdn, query, type);
-}
 
-/*
- * gethost_byname_type_fqdn - get host address from fqdn
- */
-static void gethost_byname_type_fqdn(const char *name, struct DNSQuery *query,
-		int type)
-{
-	assert(name != 0);
-	do_query_name(query, name, NULL, type);
+	rb_dlinkAddAlloc(query, &waiters);
+	start_query(&waiters, type, fqdn, NULL);
 }
 
 /*
@@ -438,21 +705,17 @@ static void gethost_byname_type_fqdn(const char *name, struct DNSQuery *query,
  */
 void gethost_byaddr(const struct rb_sockaddr_storage *addr, struct DNSQuery *query)
 {
-	do_query_number(query, addr, NULL);
+	rb_dlink_list waiters = { NULL, NULL, 0 };
+
+	rb_dlinkAddAlloc(query, &waiters);
+	start_query(&waiters, T_PTR, NULL, addr);
 }
 
 /*
  * do_query_name - nameserver lookup name
  */
-static void do_query_name(struct DNSQuery *query, const char *name, struct reslist *request,
-			  int type)
+static void do_query_name(const char *name, struct reslist *request, int type)
 {
-	if (request == NULL)
-	{
-		request = make_request(query);
-		request->name = rb_strdup(name);
-	}
-
 	rb_strlcpy(request->queryname, name, sizeof(request->queryname));
 	request->type = type;
 	query_name(request);
@@ -514,16 +777,8 @@ void build_rdns(char *buf, size_t size, const struct rb_sockaddr_storage *addr,
 /*
  * do_query_number - Use this to do reverse IP# lookups.
  */
-static void do_query_number(struct DNSQuery *query, const struct rb_sockaddr_storage *addr,
-			    struct reslist *request)
+static void do_query_number(const struct rb_sockaddr_storage *addr, struct reslist *request)
 {
-	if (request == NULL)
-	{
-		request = make_request(query);
-		memcpy(&request->addr, addr, sizeof(struct rb_sockaddr_storage));
-		request->name = (char *)rb_malloc(IRCD_RES_HOSTLEN + 1);
-	}
-
 	build_rdns(request->queryname, IRCD_RES_HOSTLEN + 1, addr, NULL);
 
 	request->type = T_PTR;
@@ -558,21 +813,25 @@ static void resend_query(struct reslist *request)
 {
 	if (--request->retries <= 0)
 	{
-		(*request->query->callback) (request->query->ptr, NULL);
-		rem_request(request);
+		/* a name whose servers are broken won't be fixed by asking
+		 * again straight away, but one that timed out might be */
+		if (request->servfail)
+			cache_add(request, true, std::min<time_t>(AR_SERVFAIL_TTL, cache_negative_ttl));
+
+		answer_request(request, NULL);
 		return;
 	}
 
 	switch (request->type)
 	{
 	case T_PTR:
-		do_query_number(NULL, &request->addr, request);
+		do_query_number(&request->addr, request);
 		break;
 	case T_A:
 #ifdef RB_IPV6
 	case T_AAAA:
 #endif
-		do_query_name(NULL, request->name, request, request->type);
+		do_query_name(request->name, request, request->type);
 		break;
 	default:
 		break;
@@ -612,11 +871,13 @@ static int proc_answer(struct reslist *request, HEADER * header, char *buf, char
 	int type;		/* answer type */
 	int n;			/* temp count */
 	int rd_length;
+	unsigned long ttl;
 	struct sockaddr_in *v4;	/* conversion */
 #ifdef RB_IPV6
 	struct sockaddr_in6 *v6;
 #endif
 	current = (unsigned char *)buf + sizeof(HEADER);
+	request->ttl = cache_max_ttl;
 
 	for (; header->qdcount > 0; --header->qdcount)
 	{
@@ -668,7 +929,12 @@ static int proc_answer(struct reslist *request, HEADER * header, char *buf, char
 		(void) irc_ns_get16(current);
 		current += CLASS_SIZE;
 
-		request->ttl = irc_ns_get32(current);
+		/* the answer lasts as long as the shortest lived record in it */
+		ttl = irc_ns_get32(current);
+		if (ttl > INT32_MAX)
+			ttl = 0;
+		if ((time_t)ttl < request->ttl)
+			request->ttl = ttl;
 		current += TTL_SIZE;
 
 		rd_length = irc_ns_get16(current);
@@ -730,6 +996,56 @@ static int proc_answer(struct reslist *request, HEADER * header, char *buf, char
 	return (1);
 }
 
+/*
+ * negative_ttl - how long a reply saying there is no such name or
+ * record may be cached: the lesser of the TTL and MINIMUM of the SOA in
+ * the authority section, as in RFC 2308.
+ */
+static time_t negative_ttl(HEADER *header, char *buf, char *eob)
+{
+	unsigned char *current = (unsigned char *)buf + sizeof(HEADER);
+	unsigned long ttl, minimum;
+	int type, rd_length, n, i;
+
+	for (i = 0; i < header->qdcount; i++)
+	{
+		if ((n = irc_dn_skipname(current, (unsigned char *)eob)) < 0)
+			return cache_negative_ttl;
+
+		current += (size_t) n + QFIXEDSZ;
+	}
+
+	for (i = 0; i < header->ancount + header->nscount; i++)
+	{
+		if ((n = irc_dn_skipname(current, (unsigned char *)eob)) < 0)
+			break;
+
+		current += (size_t) n;
+		if ((char *)current + ANSWER_FIXED_SIZE > eob)
+			break;
+
+		type = irc_ns_get16(current);
+		ttl = irc_ns_get32(current + TYPE_SIZE + CLASS_SIZE);
+		rd_length = irc_ns_get16(current + TYPE_SIZE + CLASS_SIZE + TTL_SIZE);
+		current += ANSWER_FIXED_SIZE;
+
+		if ((char *)current + rd_length > eob)
+			break;
+
+		/* MINIMUM is the last field of the SOA */
+		if (type == T_SOA && rd_length >= 5 * NS_INT32SZ)
+		{
+			minimum = irc_ns_get32(current + rd_length - NS_INT32SZ);
+			ttl = std::min(ttl, minimum);
+			return std::min<time_t>(ttl > INT32_MAX ? 0 : ttl, cache_negative_ttl);
+		}
+
+		current += rd_length;
+	}
+
+	return cache_negative_ttl;
+}
+
 /*
  * res_read_single_reply - read a dns reply from the nameserver and process it.
  * Return value: 1 if a packet was read, 0 otherwise
@@ -812,6 +1128,7 @@ static int res_read_single_reply(rb_fde_t *F, void *data)
 				REFUSED == header->rcode)
 		{
 			ns_failure_count[ns]++;
+			request->servfail = (SERVFAIL == header->rcode);
 			resend_query(request);
 		}
 		else
@@ -825,8 +1142,10 @@ static int res_read_single_reply(rb_fde_t *F, void *data)
 				/* If the rcode is NXDOMAIN, treat it as a good response. */
 				ns_failure_count[ns] /= 4;
 			}
-			(*request->query->callback) (request->query->ptr, NULL);
-			rem_request(request);
+			if (NXDOMAIN == header->rcode || NO_ERRORS == header->rcode)
+				cache_add(request, true, negative_ttl(header, buf, buf + rc));
+
+			answer_request(request, NULL);
 		}
 		return 1;
 	}
@@ -851,27 +1170,34 @@ static int res_read_single_reply(rb_fde_t *F, void *data)
 				return 1;
 			}
 
+			if (request->name[0] != '\0')
+				cache_add(request, false, request->ttl);
+
 			/*
 			 * Lookup the 'authoritative' name that we were given for the
 			 * ip#.
 			 */
+			unlink_request(request);
 #ifdef RB_IPV6
 			if (GET_SS_FAMILY(&request->addr) == AF_INET6)
-				gethost_byname_type_fqdn(request->name, request->query, T_AAAA);
+				start_query(&request->waiters, T_AAAA, request->name, NULL);
 			else
 #endif
-				gethost_byname_type_fqdn(request->name, request->query, T_A);
+				start_query(&request->waiters, T_A, request->name, NULL);
 			rem_request(request);
 		}
 		else
 		{
+			/* an answer of nothing but CNAMEs leaves no address */
+			if (GET_SS_FAMILY(&request->addr) != AF_UNSPEC)
+				cache_add(request, false, request->ttl);
+
 			/*
 			 * got a name and address response, client resolved
 			 */
 			reply = make_dnsreply(request);
-			(*request->query->callback) (request->query->ptr, reply);
+			answer_request(request, reply);
 			rb_free(reply);
-			rem_request(request);
 		}
 
 		ns_failure_count[ns] /= 4;
@@ -905,3 +1231,25 @@ make_dnsreply(struct reslist *request)
 	memcpy(&cp->addr, &request->addr, sizeof(cp->addr));
 	return (cp);
 }
+
+/*
+ * configure_resolver_cache - set the number of answers kept, and caps on
+ * how long positive and negative answers are kept for.  A size of 0
+ * turns the cache off.
+ */
+void
+configure_resolver_cache(unsigned int size, time_t max_ttl, time_t negative_ttl)
+{
+	cache_size = size;
+	cache_max_ttl = max_ttl;
+	cache_negative_ttl = negative_ttl;
+	cache_trim();
+}
+
+void
+resolver_cache_stats(struct res_cache_stats *stats)
+{
+	*stats = cache_stats;
+	stats->entries = cache_index.size();
+	stats->size = cache_size;
+}
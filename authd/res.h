@@ -25,6 +25,18 @@ struct DNSQuery
   void (*callback)(void* vptr, struct DNSReply *reply); /* callback to call */
 };
 
+struct res_cache_stats
+{
+  unsigned long entries;
+  unsigned long size;
+  unsigned long hits;		/* answered from the cache */
+  unsigned long negative_hits;	/* answered that there is no such name */
+  unsigned long misses;		/* sent to a nameserver */
+  unsigned long coalesced;	/* joined an identical query in flight */
+  unsigned long expired;
+  unsigned long evicted;
+};
+
 extern struct rb_sockaddr_storage irc_nsaddr_list[];
 extern int irc_nscount;
 
@@ -33,5 +45,7 @@ extern void restart_resolver(void);
 extern void gethost_byname_type(const char *, struct DNSQuery *, int);
 extern void gethost_byaddr(const struct rb_sockaddr_storage *, struct DNSQuery *);
 extern void build_rdns(char *, size_t, const struct rb_sockaddr_storage *, const char *);
+extern void configure_resolver_cache(unsigned int, time_t, time_t);
+extern void resolver_cache_stats(struct res_cache_stats *);
 
 #endif
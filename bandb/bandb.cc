@@ -29,6 +29,7 @@
  */
 
 #include <ircd/stdinc.h>
+#include <ircd/bandbi.h>
 #include "rsdb.h"
 
 using namespace ircd::defaults;
@@ -36,6 +37,8 @@ using namespace ircd::defaults;
 #define MAXPARA 10
 
 #define COMMIT_INTERVAL 3 /* seconds */
+#define SNAPSHOT_CHANGES 1024 /* rewrite the snapshot once it is this many changes behind */
+#define CHANGELOG_MAX 65536 /* changes kept for an ircd that has not synced since */
 
 typedef enum
 {
@@ -58,13 +61,49 @@ static const char *bandb_table[LAST_BANDB_TYPE] = {
 static rb_helper *bandb_helper;
 static int in_transaction;
 
+static uint64_t db_epoch;		/* identifies this database's changelog to ircd */
+static uint64_t pruned_seq;		/* changes up to here are gone from the changelog */
+static uint64_t synced_seq;		/* last change handed to ircd */
+static uint64_t snapshot_epoch;		/* epoch of the snapshot file, 0 if there is none */
+static uint64_t snapshot_seq;		/* last change in the snapshot file */
+static char snapshot_path[PATH_MAX];
+
 static void check_schema(void);
+static void check_changelog(void);
+static uint64_t current_seq(void);
+static void write_snapshot(uint64_t seq);
+static void prune_changelog(uint64_t seq);
 
 static void
 bandb_commit(void *unused)
 {
+	uint64_t seq;
+
+	if(!in_transaction)
+		return;
+
 	rsdb_transaction(RSDB_TRANS_END);
 	in_transaction = 0;
+
+	/* ircd hasn't synced for a long while, don't let the log grow forever */
+	if((seq = current_seq()) - pruned_seq > CHANGELOG_MAX)
+	{
+		rsdb_transaction(RSDB_TRANS_START);
+		write_snapshot(seq);
+		prune_changelog(seq);
+		rsdb_transaction(RSDB_TRANS_END);
+	}
+}
+
+static void
+begin_transaction(void)
+{
+	if(in_transaction)
+		return;
+
+	rsdb_transaction(RSDB_TRANS_START);
+	in_transaction = 1;
+	rb_event_addonce("bandb_commit", bandb_commit, NULL, COMMIT_INTERVAL);
 }
 
 static void
@@ -96,13 +135,7 @@ parse_ban(bandb_type type, char *parv[], int parc)
 	perm = parv[para++];
 	reason = parv[para++];
 
-	if(!in_transaction)
-	{
-		rsdb_transaction(RSDB_TRANS_START);
-		in_transaction = 1;
-		rb_event_addonce("bandb_commit", bandb_commit, NULL,
-				COMMIT_INTERVAL);
-	}
+	begin_transaction();
 
 	rsdb_exec(NULL,
 		  "INSERT INTO %s (mask1, mask2, oper, time, perm, reason) VALUES('%Q', '%Q', '%Q', %s, %s, '%Q')",
@@ -128,51 +161,391 @@ parse_unban(bandb_type type, char *parv[], int parc)
 	if(type == BANDB_KLINE)
 		mask2 = parv[2];
 
-	if(!in_transaction)
-	{
-		rsdb_transaction(RSDB_TRANS_START);
-		in_transaction = 1;
-		rb_event_addonce("bandb_commit", bandb_commit, NULL,
-				COMMIT_INTERVAL);
-	}
+	begin_transaction();
 
 	rsdb_exec(NULL, "DELETE FROM %s WHERE mask1='%Q' AND mask2='%Q'",
 		  bandb_table[type], mask1, mask2 ? mask2 : "");
 }
 
+static bool
+get_meta(const char *key, uint64_t *value)
+{
+	struct rsdb_table table;
+	bool found = false;
+
+	rsdb_exec_fetch(&table, "SELECT value FROM meta WHERE key='%s'", key);
+
+	if(table.row_count > 0 && table.row[0][0] != NULL)
+	{
+		*value = strtoull(table.row[0][0], NULL, 16);
+		found = true;
+	}
+
+	rsdb_exec_fetch_end(&table);
+	return found;
+}
+
 static void
-list_bans(void)
+set_meta(const char *key, uint64_t value)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%llx", (unsigned long long)value);
+	rsdb_exec(NULL, "INSERT OR REPLACE INTO meta (key, value) VALUES('%s', '%s')", key, buf);
+}
+
+static uint64_t
+current_seq(void)
 {
-	static char buf[512];
 	struct rsdb_table table;
-	int i, j;
+	uint64_t seq = 0;
 
-	/* schedule a clear of anything already pending */
-	rb_helper_write_queue(bandb_helper, "C");
+	rsdb_exec_fetch(&table, "SELECT seq FROM sqlite_sequence WHERE name='changelog'");
 
-	for(i = 0; i < LAST_BANDB_TYPE; i++)
+	if(table.row_count > 0 && table.row[0][0] != NULL)
+		seq = strtoull(table.row[0][0], NULL, 10);
+
+	rsdb_exec_fetch_end(&table);
+	return seq;
+}
+
+/*
+ * check_changelog
+ *
+ * Every insert and delete on the ban tables is logged by a trigger, so
+ * changes made by bantool are seen too.  If the triggers are missing
+ * (a new database, or bantool dropped the tables) changes may have gone
+ * unlogged, so the database gets a new epoch and ircd does a full sync.
+ */
+static void
+check_changelog(void)
+{
+	struct rsdb_table table;
+	bool logged;
+	int i;
+
+	rsdb_exec(NULL, "CREATE TABLE IF NOT EXISTS meta (key TEXT PRIMARY KEY, value TEXT)");
+	rsdb_exec(NULL, "CREATE TABLE IF NOT EXISTS changelog (seq INTEGER PRIMARY KEY AUTOINCREMENT, "
+		  "type TEXT, removed INTEGER, mask1 TEXT, mask2 TEXT, oper TEXT, reason TEXT)");
+
+	rsdb_exec_fetch(&table, "SELECT COUNT(*) FROM sqlite_master WHERE type='trigger'");
+	logged = table.row_count > 0 && table.row[0][0] != NULL &&
+		atoi(table.row[0][0]) == LAST_BANDB_TYPE * 2;
+	rsdb_exec_fetch_end(&table);
+
+	if(!logged)
 	{
-		rsdb_exec_fetch(&table, "SELECT mask1,mask2,oper,reason FROM %s WHERE 1",
-				bandb_table[i]);
+		for(i = 0; i < LAST_BANDB_TYPE; i++)
+		{
+			rsdb_exec(NULL,
+				  "CREATE TRIGGER IF NOT EXISTS %s_log_add AFTER INSERT ON %s BEGIN "
+				  "INSERT INTO changelog (type, removed, mask1, mask2, oper, reason) "
+				  "VALUES('%c', 0, NEW.mask1, NEW.mask2, NEW.oper, NEW.reason); END",
+				  bandb_table[i], bandb_table[i], bandb_letter[i]);
+			rsdb_exec(NULL,
+				  "CREATE TRIGGER IF NOT EXISTS %s_log_del AFTER DELETE ON %s BEGIN "
+				  "INSERT INTO changelog (type, removed, mask1, mask2) "
+				  "VALUES('%c', 1, OLD.mask1, OLD.mask2); END",
+				  bandb_table[i], bandb_table[i], bandb_letter[i]);
+		}
+	}
 
-		for(j = 0; j < table.row_count; j++)
+	if(!logged || !get_meta("epoch", &db_epoch))
+	{
+		uint64_t epoch;
+
+		do
 		{
-			if(i == BANDB_KLINE)
-				snprintf(buf, sizeof(buf), "%c %s %s %s :%s",
-					    bandb_letter[i], table.row[j][0],
-					    table.row[j][1], table.row[j][2], table.row[j][3]);
-			else
-				snprintf(buf, sizeof(buf), "%c %s %s :%s",
-					    bandb_letter[i], table.row[j][0],
-					    table.row[j][2], table.row[j][3]);
-
-			rb_helper_write_queue(bandb_helper, "%s", buf);
+			if(!rb_get_random(&epoch, sizeof(epoch)))
+				epoch = ((uint64_t)rb_current_time() << 20) ^ (uint64_t)getpid();
 		}
+		while(epoch == 0 || epoch == db_epoch);
 
-		rsdb_exec_fetch_end(&table);
+		db_epoch = epoch;
+		set_meta("epoch", db_epoch);
+
+		/* nothing logged before now can be trusted */
+		rsdb_exec(NULL, "DELETE FROM changelog");
+		pruned_seq = current_seq();
+		set_meta("pruned", pruned_seq);
 	}
+	else if(!get_meta("pruned", &pruned_seq))
+		pruned_seq = 0;
+}
 
-	rb_helper_write(bandb_helper, "F");
+/*
+ * prune_changelog
+ *
+ * Drop the changes nobody can ask for any more: ircd has them, and so
+ * does the snapshot a restarted ircd would start from.  If ircd stays
+ * away too long, only what the snapshot lacks is kept.
+ */
+static void
+prune_changelog(uint64_t seq)
+{
+	uint64_t upto = synced_seq;
+	char buf[32];
+
+	if(snapshot_epoch == db_epoch)
+	{
+		if(snapshot_seq < upto || seq - pruned_seq > CHANGELOG_MAX)
+			upto = snapshot_seq;
+	}
+
+	if(upto <= pruned_seq)
+		return;
+
+	snprintf(buf, sizeof(buf), "%llu", (unsigned long long)upto);
+	rsdb_exec(NULL, "DELETE FROM changelog WHERE seq <= %s", buf);
+
+	pruned_seq = upto;
+	set_meta("pruned", pruned_seq);
+}
+
+static void
+read_snapshot_header(void)
+{
+	struct bandb_snapshot_header hdr;
+	FILE *f;
+
+	snapshot_epoch = snapshot_seq = 0;
+
+	if((f = fopen(snapshot_path, "rb")) == NULL)
+		return;
+
+	if(fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+	   !memcmp(hdr.magic, BANDB_SNAPSHOT_MAGIC, sizeof(hdr.magic)) &&
+	   hdr.version == BANDB_SNAPSHOT_VERSION)
+	{
+		snapshot_epoch = hdr.epoch;
+		snapshot_seq = hdr.seq;
+	}
+
+	fclose(f);
+}
+
+/* state for the row callbacks, which sqlite gives no argument */
+static char list_type;
+static bool list_to_helper;
+static FILE *snapshot_file;
+static uint32_t snapshot_count;
+static uint64_t snapshot_size;
+
+static bool
+snapshot_begin(void)
+{
+	char tmppath[PATH_MAX + sizeof(".tmp")];
+	struct bandb_snapshot_header hdr;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", snapshot_path);
+
+	if((snapshot_file = fopen(tmppath, "wb")) == NULL)
+		return false;
+
+	/* filled in by snapshot_end() */
+	memset(&hdr, 0, sizeof(hdr));
+	fwrite(&hdr, sizeof(hdr), 1, snapshot_file);
+
+	snapshot_count = 0;
+	snapshot_size = sizeof(hdr);
+	return true;
+}
+
+static void
+snapshot_add(const char *field[4])
+{
+	static const char zero[BANDB_SNAPSHOT_ALIGN] = { 0 };
+	struct bandb_snapshot_record rec;
+	size_t len = sizeof(rec), pad;
+	int i;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = (uint8_t)list_type;
+
+	for(i = 0; i < 4; i++)
+	{
+		size_t flen = strlen(field[i]);
+
+		if(flen > UINT16_MAX)
+			return;
+
+		rec.len[i] = (uint16_t)flen;
+		len += flen + 1;
+	}
+
+	pad = (BANDB_SNAPSHOT_ALIGN - len % BANDB_SNAPSHOT_ALIGN) % BANDB_SNAPSHOT_ALIGN;
+
+	fwrite(&rec, sizeof(rec), 1, snapshot_file);
+	for(i = 0; i < 4; i++)
+		fwrite(field[i], rec.len[i] + 1, 1, snapshot_file);
+	fwrite(zero, pad, 1, snapshot_file);
+
+	snapshot_count++;
+	snapshot_size += len + pad;
+}
+
+static void
+snapshot_end(uint64_t seq)
+{
+	char tmppath[PATH_MAX + sizeof(".tmp")];
+	struct bandb_snapshot_header hdr;
+	bool ok;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", snapshot_path);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BANDB_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = BANDB_SNAPSHOT_VERSION;
+	hdr.count = snapshot_count;
+	hdr.epoch = db_epoch;
+	hdr.seq = seq;
+	hdr.size = snapshot_size;
+
+	rewind(snapshot_file);
+	fwrite(&hdr, sizeof(hdr), 1, snapshot_file);
+
+	ok = fflush(snapshot_file) == 0 && !ferror(snapshot_file) && fsync(fileno(snapshot_file)) == 0;
+	ok = fclose(snapshot_file) == 0 && ok;
+	snapshot_file = NULL;
+
+	/* a snapshot is only a shortcut; if it can't be written, ircd does without */
+	if(!ok || rename(tmppath, snapshot_path) != 0)
+	{
+		unlink(tmppath);
+		return;
+	}
+
+	snapshot_epoch = db_epoch;
+	snapshot_seq = seq;
+}
+
+static void
+send_ban(char type, const char *mask1, const char *mask2, const char *oper, const char *reason)
+{
+	if(type == 'K')
+		rb_helper_write_queue(bandb_helper, "%c %s %s %s :%s", type, mask1, mask2, oper, reason);
+	else
+		rb_helper_write_queue(bandb_helper, "%c %s %s :%s", type, mask1, oper, reason);
+}
+
+static int
+list_ban_cb(int argc, const char **argv)
+{
+	const char *field[4];
+	int i;
+
+	for(i = 0; i < 4; i++)
+		field[i] = i < argc && argv[i] != NULL ? argv[i] : "";
+
+	if(list_to_helper)
+		send_ban(list_type, field[0], field[1], field[2], field[3]);
+
+	if(snapshot_file != NULL)
+		snapshot_add(field);
+
+	return 0;
+}
+
+/* walk every ban, to ircd and/or into a new snapshot */
+static void
+list_all(uint64_t seq, bool to_helper)
+{
+	bool snapshot = snapshot_begin();
+	int i;
+
+	list_to_helper = to_helper;
+
+	for(i = 0; i < LAST_BANDB_TYPE; i++)
+	{
+		list_type = bandb_letter[i];
+		rsdb_exec(list_ban_cb, "SELECT mask1,mask2,oper,reason FROM %s", bandb_table[i]);
+	}
+
+	if(snapshot)
+		snapshot_end(seq);
+}
+
+static void
+write_snapshot(uint64_t seq)
+{
+	list_all(seq, false);
+}
+
+static int
+list_change_cb(int argc, const char **argv)
+{
+	const char *field[6];
+	char type;
+	int i;
+
+	for(i = 0; i < 6; i++)
+		field[i] = i < argc && argv[i] != NULL ? argv[i] : "";
+
+	/* type, removed, mask1, mask2, oper, reason */
+	type = *field[0];
+
+	if(atoi(field[1]) == 0)
+		send_ban(type, field[2], field[3], field[4], field[5]);
+	else if(type == 'K')
+		rb_helper_write_queue(bandb_helper, "k %s %s", field[2], field[3]);
+	else
+		rb_helper_write_queue(bandb_helper, "%c %s", tolower((unsigned char)type), field[2]);
+
+	return 0;
+}
+
+/*
+ * list_bans
+ *
+ * "L" asks for every ban: a "C", all the bans, then "F <epoch> <seq>".
+ * "L <epoch> <seq>" asks only for what changed after seq; if that is
+ * still in the changelog the reply is an "I", the bans added or removed
+ * in order, then "F".  Otherwise everything is sent as for a plain "L".
+ */
+static void
+list_bans(char *parv[], int parc)
+{
+	uint64_t seq, from = 0;
+	bool incremental = false;
+	char buf[32];
+
+	/* work from committed data, so the sequence numbers handed out stick */
+	bandb_commit(NULL);
+
+	rsdb_transaction(RSDB_TRANS_START);
+	check_changelog();
+	seq = current_seq();
+
+	if(parc >= 3 && strtoull(parv[1], NULL, 16) == db_epoch)
+	{
+		from = strtoull(parv[2], NULL, 10);
+		incremental = from >= pruned_seq && from <= seq;
+	}
+
+	if(incremental)
+	{
+		rb_helper_write_queue(bandb_helper, "I");
+
+		snprintf(buf, sizeof(buf), "%llu", (unsigned long long)from);
+		rsdb_exec(list_change_cb,
+			  "SELECT type,removed,mask1,mask2,oper,reason FROM changelog WHERE seq > %s ORDER BY seq",
+			  buf);
+
+		if(snapshot_epoch != db_epoch || seq - snapshot_seq >= SNAPSHOT_CHANGES)
+			write_snapshot(seq);
+	}
+	else
+	{
+		/* schedule a clear of anything already pending */
+		rb_helper_write_queue(bandb_helper, "C");
+		list_all(seq, true);
+	}
+
+	synced_seq = seq;
+	prune_changelog(seq);
+	rsdb_transaction(RSDB_TRANS_END);
+
+	rb_helper_write(bandb_helper, "F %llx %llu", (unsigned long long)db_epoch, (unsigned long long)seq);
 }
 
 static void
@@ -226,7 +599,7 @@ parse_request(rb_helper *helper)
 			break;
 
 		case 'L':
-			list_bans();
+			list_bans(parv, parc);
 			break;
 		default:
 			break;
@@ -312,6 +685,10 @@ main(int argc, char *argv[])
 	}
 	rsdb_init(db_error_cb);
 	check_schema();
+
+	snprintf(snapshot_path, sizeof(snapshot_path), "%s%s", rsdb_path(), BANDB_SNAPSHOT_SUFFIX);
+	check_changelog();
+	read_snapshot_header();
 	rb_helper_loop(bandb_helper, 0);
 
 	return 0;
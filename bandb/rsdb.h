@@ -27,6 +27,7 @@ struct rsdb_table
 
 int rsdb_init(rsdb_error_cb *);
 void rsdb_shutdown(void);
+const char *rsdb_path(void);
 
 const char *rsdb_quote(const char *src);
 
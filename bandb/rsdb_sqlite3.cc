@@ -35,6 +35,7 @@
 using namespace ircd::defaults;
 
 struct sqlite3 *rb_bandb;
+static char rb_bandb_path[PATH_MAX];
 
 rsdb_error_cb *error_cb;
 
@@ -58,7 +59,7 @@ int
 rsdb_init(rsdb_error_cb * ecb)
 {
 	const char *bandb_dbpath_env;
-	char dbpath[PATH_MAX];
+	char *dbpath = rb_bandb_path;
 	char errbuf[1024];
 	error_cb = ecb;
 
@@ -66,9 +67,9 @@ rsdb_init(rsdb_error_cb * ecb)
 	bandb_dbpath_env = getenv("BANDB_DBPATH");
 
 	if(bandb_dbpath_env != NULL)
-		rb_strlcpy(dbpath, bandb_dbpath_env, sizeof(dbpath));
+		rb_strlcpy(dbpath, bandb_dbpath_env, sizeof(rb_bandb_path));
 	else
-		rb_strlcpy(dbpath, DBPATH, sizeof(dbpath));
+		rb_strlcpy(dbpath, DBPATH, sizeof(rb_bandb_path));
 
 	if(sqlite3_open(dbpath, &rb_bandb) != SQLITE_OK)
 	{
@@ -87,6 +88,12 @@ rsdb_init(rsdb_error_cb * ecb)
 	return 0;
 }
 
+const char *
+rsdb_path(void)
+{
+	return rb_bandb_path;
+}
+
 void
 rsdb_shutdown(void)
 {
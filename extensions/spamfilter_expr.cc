@@ -59,6 +59,7 @@
 #define DEFAULT_RECURSION_LIMIT     512
 #define DEFAULT_PARENS_NEST_LIMIT   32
 #define PATTERN_HASH_BITS           18
+#define LITERAL_MAX                 32
 
 
 #define EXPR_ERROR_TOOMANY          -256
@@ -75,6 +76,7 @@ struct Expr
 	unsigned int match_opts;
 	unsigned int jit_opts;
 	char *pattern;
+	char *literal;              /* Folded text every match contains, or NULL */
 	pcre2_compile_context *cctx;
 	pcre2_code *expr;
 	pcre2_match_context *mctx;
@@ -110,6 +112,32 @@ pcre2_general_context *gctx;
 pcre2_jit_stack *jstack;
 
 
+/*
+ * Literal prefilter
+ *
+ * The literals of all expressions are compiled into one Aho-Corasick automaton
+ * which is run once over each message. Only expressions whose literal was seen,
+ * and those without a literal, are then given to PCRE2. Bytes are mapped to
+ * classes first so the transition table stays small; the class map also folds
+ * ASCII case, so a literal is only a necessary condition and PCRE2 still
+ * decides the match.
+ */
+
+struct
+{
+	bool dirty;                             /* Rebuild before the next match */
+	std::vector<Expr *> order;              /* Expressions in dictionary order */
+	std::vector<uint32_t> seen;             /* Generation in which each literal was seen */
+	uint32_t generation;
+	uint8_t cls[256];                       /* Byte to class */
+	unsigned int nclass;
+	std::vector<uint32_t> delta;            /* Transition table, nclass per state */
+	std::vector<uint32_t> link;             /* Nearest proper suffix state with output */
+	std::vector<std::vector<uint32_t>> out; /* Indexes into order ending at each state */
+}
+pf;
+
+
 
 static inline
 unsigned int hash_pattern(const char *const pattern)
@@ -140,11 +168,243 @@ void free_expr(struct Expr *const expr)
 	pcre2_code_free(expr->expr);
 	pcre2_match_context_free(expr->mctx);
 	pcre2_compile_context_free(expr->cctx);
+	rb_free(expr->literal);
 	rb_free(expr->pattern);
 	rb_free(expr);
 }
 
 
+static inline
+uint8_t fold_ascii(const uint8_t c)
+{
+	return c >= 'A' && c <= 'Z'? c + ('a' - 'A') : c;
+}
+
+
+static
+const char *skip_class(const char *p)
+{
+	p++;
+	if(*p == '^')
+		p++;
+
+	if(*p == ']')
+		p++;
+
+	while(*p && *p != ']')
+	{
+		if(*p == '\\' && p[1])
+			p += 2;
+		else if(*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+		{
+			const char close[] = { p[1], ']', '\0' };
+			const char *const end = strstr(p + 2, close);
+			if(!end)
+				return NULL;
+
+			p = end + 2;
+		}
+		else p++;
+	}
+
+	return *p? p + 1 : NULL;
+}
+
+
+/* Length of the quantifier at p, 0 if there is none, -1 if it can't be read.
+ * optional is set when the quantified atom may match zero times.
+ */
+static
+int parse_quantifier(const char *const p, bool *const optional)
+{
+	const char *q = p;
+	*optional = false;
+	switch(*q)
+	{
+		case '*':
+		case '?':
+			*optional = true;
+			q++;
+			break;
+
+		case '+':
+			q++;
+			break;
+
+		case '{':
+		{
+			const char *const min = ++q;
+			while(*q >= '0' && *q <= '9')
+				q++;
+
+			const bool has_min = q > min;
+			bool has_max = false;
+			if(*q == ',')
+				for(q++; *q >= '0' && *q <= '9'; q++)
+					has_max = true;
+
+			if(*q != '}' || (!has_min && !has_max))
+				return -1;
+
+			*optional = !has_min || atoi(min) == 0;
+			q++;
+			break;
+		}
+
+		default:
+			return 0;
+	}
+
+	if(*q == '+' || *q == '?')
+		q++;
+
+	return q - p;
+}
+
+
+/* Find the longest run of plain characters that every match of the pattern
+ * must contain. Anything the scan doesn't fully understand makes it give up,
+ * which only costs the expression its place in the prefilter.
+ */
+static
+char *extract_literal(const char *const pattern, const unsigned int comp_opts)
+{
+	static const char ctrl_esc[] = "ntrfae";
+	static const char ctrl_val[] = "\n\t\r\f\x1b\a";
+
+	/* Inline options, verbs and quoting change how the rest of the pattern
+	 * reads; extended mode makes whitespace insignificant. */
+	if(comp_opts & PCRE2_EXTENDED)
+		return NULL;
+
+	if(strstr(pattern, "(?") || strstr(pattern, "(*") || strstr(pattern, "\\Q"))
+		return NULL;
+
+	const bool caseless = comp_opts & PCRE2_CASELESS;
+	const bool unicode = comp_opts & (PCRE2_UTF | PCRE2_UCP);
+	std::string best, run;
+	int depth = 0;
+
+	const char *p = pattern;
+	while(*p)
+	{
+		std::string atom;
+		bool literal = true;
+		switch(*p)
+		{
+			case '\\':
+			{
+				const uint8_t c = p[1];
+				const char *esc;
+				if(c == '\0' || c >= 0x80)
+					return NULL;
+
+				if(!isalnum(c))
+					atom = c;
+				else if((esc = strchr(ctrl_esc, c)))
+					atom = ctrl_val[esc - ctrl_esc];
+				else if(strchr("dDwWsShHvVRXAzZGbBKC", c))
+					literal = false;
+				else
+					return NULL;
+
+				p += 2;
+				break;
+			}
+
+			case '[':
+				if(!(p = skip_class(p)))
+					return NULL;
+
+				literal = false;
+				break;
+
+			case '(':
+				depth++;
+				p++;
+				if(run.size() > best.size())
+					best = run;
+
+				run.clear();
+				continue;
+
+			case ')':
+				if(depth-- == 0)
+					return NULL;
+
+				literal = false;
+				p++;
+				break;
+
+			case '|':
+				if(depth == 0)
+					return NULL;
+
+				literal = false;
+				p++;
+				break;
+
+			case '.':
+			case '^':
+			case '$':
+				literal = false;
+				p++;
+				break;
+
+			case '*':
+			case '+':
+			case '?':
+			case '{':
+				return NULL;
+
+			default:
+				atom = *p++;
+				if(unicode && (uint8_t)atom[0] >= 0xc0)
+					for(; ((uint8_t)*p & 0xc0) == 0x80; p++)
+						atom += *p;
+				break;
+		}
+
+		bool optional;
+		const int qlen = parse_quantifier(p, &optional);
+		if(qlen < 0)
+			return NULL;
+
+		p += qlen;
+		if(depth > 0 || optional)
+			literal = false;
+
+		for(size_t i = 0; literal && i < atom.size(); i++)
+		{
+			const uint8_t c = fold_ascii(atom[i]);
+			if(caseless && (c >= 0x80 || (unicode && (c == 'k' || c == 's'))))
+				literal = false;
+		}
+
+		if(literal)
+			for(const char c : atom)
+				run += fold_ascii(c);
+
+		if(!literal || qlen > 0)
+		{
+			if(run.size() > best.size())
+				best = run;
+
+			run.clear();
+		}
+	}
+
+	if(run.size() > best.size())
+		best = run;
+
+	if(best.empty())
+		return NULL;
+
+	best.resize(std::min(best.size(), size_t(LITERAL_MAX)));
+	return rb_strdup(best.c_str());
+}
+
+
 static
 struct Expr *new_expr(const char *const pattern,
                       const unsigned int comp_opts,
@@ -160,6 +420,7 @@ struct Expr *new_expr(const char *const pattern,
 	ret->match_opts = match_opts;
 	ret->jit_opts = jit_opts;
 	ret->pattern = rb_strdup(pattern);
+	ret->literal = extract_literal(pattern, comp_opts);
 
 	if((ret->cctx = pcre2_compile_context_create(gctx)))
 	{
@@ -252,6 +513,7 @@ int activate_expr(struct Expr *const expr,
 	}
 
 	expr->added = rb_current_time();
+	pf.dirty = true;
 	return 1;
 }
 
@@ -259,6 +521,7 @@ int activate_expr(struct Expr *const expr,
 static
 struct Expr *deactivate_expr(const unsigned int id)
 {
+	pf.dirty = true;
 	return (Expr *)rb_dictionary_delete(exprs, &id);
 }
 
@@ -297,7 +560,7 @@ struct Expr *activate_new_expr(const char *const pattern,
 static
 int deactivate_and_free_expr(const unsigned int id)
 {
-	struct Expr *const expr = (Expr *)rb_dictionary_delete(exprs, &id);
+	struct Expr *const expr = deactivate_expr(id);
 	free_expr(expr);
 	return expr != NULL;
 }
@@ -603,17 +866,118 @@ int match_expr(struct Expr *const expr,
 }
 
 
+static
+void build_prefilter(void)
+{
+	static const uint32_t none = UINT32_MAX;
+
+	pf.order.clear();
+	void *elem;
+	rb_dictionary_iter state;
+	RB_DICTIONARY_FOREACH(elem, &state, exprs)
+		pf.order.push_back(reinterpret_cast<Expr *>(elem));
+
+	pf.seen.assign(pf.order.size(), 0);
+	pf.generation = 0;
+
+	/* Class 0 is every byte no literal uses */
+	memset(pf.cls, 0, sizeof(pf.cls));
+	pf.nclass = 1;
+	for(const auto *const expr : pf.order)
+		for(const char *c = expr->literal; c && *c; c++)
+			if(!pf.cls[(uint8_t)*c])
+				pf.cls[(uint8_t)*c] = pf.nclass++;
+
+	for(unsigned int c = 'A'; c <= 'Z'; c++)
+		pf.cls[c] = pf.cls[fold_ascii(c)];
+
+	/* Trie of the literals, state 0 is the root */
+	pf.delta.assign(pf.nclass, none);
+	pf.out.assign(1, std::vector<uint32_t>());
+	for(size_t i = 0; i < pf.order.size(); i++)
+	{
+		uint32_t s = 0;
+		for(const char *c = pf.order[i]->literal; c && *c; c++)
+		{
+			uint32_t &next = pf.delta[s * pf.nclass + pf.cls[(uint8_t)*c]];
+			if(next == none)
+			{
+				next = pf.out.size();
+				pf.out.emplace_back();
+				pf.delta.resize(pf.delta.size() + pf.nclass, none);
+			}
+
+			s = pf.delta[s * pf.nclass + pf.cls[(uint8_t)*c]];
+		}
+
+		if(s != 0)
+			pf.out[s].push_back(i);
+	}
+
+	/* Fill in the failure transitions breadth first, turning the trie into a DFA */
+	std::vector<uint32_t> fail(pf.out.size(), 0), queue;
+	pf.link.assign(pf.out.size(), 0);
+	for(unsigned int k = 0; k < pf.nclass; k++)
+	{
+		uint32_t &next = pf.delta[k];
+		if(next == none)
+			next = 0;
+		else
+			queue.push_back(next);
+	}
+
+	for(size_t head = 0; head < queue.size(); head++)
+	{
+		const uint32_t s = queue[head];
+		pf.link[s] = pf.out[fail[s]].empty()? pf.link[fail[s]] : fail[s];
+		for(unsigned int k = 0; k < pf.nclass; k++)
+		{
+			uint32_t &next = pf.delta[s * pf.nclass + k];
+			const uint32_t alt = pf.delta[fail[s] * pf.nclass + k];
+			if(next == none)
+				next = alt;
+			else
+			{
+				fail[next] = alt;
+				queue.push_back(next);
+			}
+		}
+	}
+
+	pf.dirty = false;
+}
+
+
 static
 struct Expr *match_any_expr(const char *const text,
                             const size_t len,
                             const size_t off,
                             const unsigned int options)
 {
-	void *elem;
-	rb_dictionary_iter state;
-	RB_DICTIONARY_FOREACH(elem, &state, exprs)
+	if(pf.dirty)
+		build_prefilter();
+
+	if(++pf.generation == 0)
 	{
-		auto *const expr(reinterpret_cast<Expr *>(elem));
+		std::fill(pf.seen.begin(), pf.seen.end(), 0);
+		pf.generation = 1;
+	}
+
+	uint32_t s = 0;
+	for(size_t i = off; i < len; i++)
+	{
+		s = pf.delta[s * pf.nclass + pf.cls[(uint8_t)text[i]]];
+		for(uint32_t t = pf.out[s].empty()? pf.link[s] : s; t; t = pf.link[t])
+			for(const uint32_t idx : pf.out[t])
+				pf.seen[idx] = pf.generation;
+	}
+
+	for(size_t i = 0; i < pf.order.size(); i++)
+	{
+		Expr *const expr = pf.order[i];
+		if(expr->literal && pf.seen[i] != pf.generation)
+			continue;
+
 		if(match_expr(expr, text, len, off, options) > 0)
 			return expr;
 	}
@@ -746,11 +1110,12 @@ int spamexpr_info(struct Client *client_p, struct Client *source_p, int parc, co
 	strlcat_pcre_opts(expr->comp_opts, comp_opts, sizeof(comp_opts), str_pcre_comp);
 	strlcat_pcre_opts(expr->match_opts, match_opts, sizeof(match_opts), str_pcre_match);
 	strlcat_pcre_opts(expr->jit_opts, jit_opts, sizeof(jit_opts), str_pcre_jit);
-	sendto_one_notice(source_p, ":#%u time[%lu] last[%lu] hits[%d] [%s][%s][%s] %s %s",
+	sendto_one_notice(source_p, ":#%u time[%lu] last[%lu] hits[%d] literal[%s] [%s][%s][%s] %s %s",
 	                  expr->id,
 	                  expr->added,
 	                  expr->last,
 	                  expr->hits,
+	                  expr->literal? expr->literal : "",
 	                  comp_opts,
 	                  match_opts,
 	                  jit_opts,
@@ -1316,6 +1681,7 @@ static
 int modinit(void)
 {
 	exprs = rb_dictionary_create("exprs", exprs_comparator);
+	pf.dirty = true;
 	gctx = pcre2_general_context_create(expr_malloc_cb, expr_free_cb, NULL);
 
 	/* Block for general configuration */
@@ -1341,6 +1707,8 @@ void modfini(void)
 	remove_top_conf("spamfilter_expr");
 	pcre2_general_context_free(gctx);
 	rb_dictionary_destroy(exprs, exprs_destructor, NULL);
+	pf.order.clear();
+	pf.dirty = true;
 }
 
 
@@ -37,6 +37,8 @@ struct BlacklistStats
 	char *host;
 	uint8_t iptype;
 	unsigned int hits;
+	unsigned int cache_hits;	/* Last reported by authd */
+	unsigned int cache_misses;
 };
 
 struct OPMScanner
@@ -83,6 +85,9 @@ void del_blacklist(const char *host);
 void del_blacklist_all(void);
 
 bool set_authd_timeout(const char *key, int timeout);
+void set_authd_dns_cache(int size, int max_ttl, int negative_ttl);
+void set_authd_blacklist_cache(int ttl, int negative_ttl);
+void refresh_blacklist_stats(void);
 void ident_check_enable(bool enabled);
 
 void conf_create_opm_listener(const char *ip, uint16_t port);
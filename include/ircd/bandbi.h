@@ -21,6 +21,37 @@
 #pragma once
 #define HAVE_BANDBI_H
 
+/* bandb keeps a snapshot of the permanent bans beside its database, at the
+ * database path with BANDB_SNAPSHOT_SUFFIX appended.  ircd maps it at
+ * startup rather than having every ban streamed through the helper, then
+ * asks bandb only for the changes made after the snapshot's sequence number.
+ *
+ * The file is a header followed by count records.  Each record is followed
+ * by its four strings, each NUL terminated, padded out to a multiple of
+ * BANDB_SNAPSHOT_ALIGN bytes.  Fields are in host byte order.
+ */
+#define BANDB_SNAPSHOT_SUFFIX	".snap"
+#define BANDB_SNAPSHOT_MAGIC	"BANDBSNP"
+#define BANDB_SNAPSHOT_VERSION	1
+#define BANDB_SNAPSHOT_ALIGN	8
+
+struct bandb_snapshot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t count;			/* number of records */
+	uint64_t epoch;			/* identifies the database seq belongs to */
+	uint64_t seq;			/* last change included */
+	uint64_t size;			/* size of the whole file */
+};
+
+struct bandb_snapshot_record
+{
+	uint8_t type;			/* 'K', 'D', 'X' or 'R' */
+	uint8_t pad;
+	uint16_t len[4];		/* mask1, mask2, oper, reason; without the NUL */
+};
+
 #ifdef __cplusplus
 namespace ircd {
 
@@ -0,0 +1,54 @@
+/*
+ *  charybdis: an advanced ircd.
+ *  banmatch.h: Compiled channel ban list matching.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ *  USA
+ */
+
+#pragma once
+#define HAVE_IRCD_BANMATCH_H
+
+#ifdef __cplusplus
+namespace ircd {
+
+struct Ban;
+struct Channel;
+struct Client;
+struct ban_matcher;
+
+/* The strings a ban list is checked against: nick!user@host,
+ * nick!user@ip, the alternate (real or mangled) host and the IPv4 form
+ * of a 6to4/mapped address.  althost and ip4host may be NULL.
+ */
+struct ban_subject
+{
+	const char *host;
+	const char *iphost;
+	const char *althost;
+	const char *ip4host;
+};
+
+/* First ban on list (in list order) matching the subject, or NULL.
+ * list must be one of chptr->banlist, exceptlist or quietlist; the
+ * compiled form is rebuilt whenever chptr->bants has moved.
+ */
+struct Ban *find_ban_match(struct Channel *chptr, rb_dlink_list *list, struct Client *who,
+			   const struct ban_subject *subject, long mode_type);
+
+void free_ban_matcher(struct Channel *chptr);
+
+}      // namespace ircd
+#endif // __cplusplus
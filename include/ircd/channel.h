@@ -59,6 +59,8 @@ struct Mode
 	char forward[LOC_CHANNELLEN + 1];
 };
 
+struct ban_matcher;
+
 /* channel structure */
 struct Channel
 {
@@ -73,6 +75,9 @@ struct Channel
 	rb_dlink_list members;	/* channel members */
 	rb_dlink_list locmembers;	/* local channel members */
 
+	struct membership **member_index;	/* open-addressed client -> membership map */
+	unsigned int member_index_mask;	/* slots - 1, 0 while unindexed */
+
 	rb_dlink_list invites;
 	rb_dlink_list banlist;
 	rb_dlink_list exceptlist;
@@ -87,6 +92,7 @@ struct Channel
 	unsigned int join_delta;  /* last ts of join */
 
 	time_t bants;
+	struct ban_matcher *ban_matcher;	/* compiled b/e/q lists, see banmatch.cc */
 	time_t channelts;
 	char *chname;
 
@@ -189,7 +195,9 @@ extern const char *find_channel_status(struct membership *msptr, int combine);
 extern void add_user_to_channel(struct Channel *, struct Client *, int flags);
 extern void remove_user_from_channel(struct membership *);
 extern void remove_user_from_channels(struct Client *);
+extern void remove_users_from_channels(struct Client **, size_t count);
 extern void invalidate_bancache_user(struct Client *);
+extern void invalidate_bancache_channel(struct Channel *);
 
 extern void free_channel_list(rb_dlink_list *);
 
@@ -69,6 +69,7 @@ struct PreClient;
 struct ListClient;
 struct scache_entry;
 struct ws_ctl;
+struct Burst;
 
 typedef int SSL_OPEN_CB(struct Client *, int status);
 
@@ -96,6 +97,20 @@ struct Server
 	struct scache_entry *nameinfo;
 };
 
+/* Receive buffer for connections from a listener with ring_recvq; see
+ * packet.cc.  Offsets are into buf.
+ */
+struct RecvRing
+{
+	char *buf;
+	unsigned int size;
+	unsigned int head;	/* first byte not yet parsed */
+	unsigned int tail;	/* end of received data */
+	unsigned int linestart;	/* start of the incomplete last line */
+	unsigned int numlines;	/* complete lines in head..linestart */
+	bool skip;		/* dropping the rest of an overlong line */
+};
+
 struct ZipStats
 {
 	unsigned long long in;
@@ -193,6 +208,7 @@ struct LocalUser
 	/* Send and receive linebuf queues .. */
 	buf_head_t buf_sendq;
 	buf_head_t buf_recvq;
+	struct RecvRing *recv_ring;	/* used instead of buf_recvq if set */
 
 	/*
 	 * we want to use unsigned int here so the sizes have a better chance of
@@ -253,8 +269,15 @@ struct LocalUser
 	 * many we were allowed in the current second, and apply a simple decay
 	 * to avoid flooding.
 	 *   -- adrian
+	 *
+	 * The decay is applied lazily from flood_time when the client is next
+	 * parsed; a client with throttled lines waiting sits on the flood
+	 * wheel until flood_wakeup.
 	 */
 	int sent_parsed;	/* how many messages we've parsed in this second */
+	time_t flood_time;	/* when sent_parsed was last decayed */
+	time_t flood_wakeup;	/* when to retry queued lines, 0 if none */
+	rb_dlink_node flood_node;
 	time_t last_knock;	/* time of last knock */
 	uint32_t random_ping;
 
@@ -280,10 +303,12 @@ struct LocalUser
 	struct _ssl_ctl *z_ctl;			/* second ctl for ssl+zlib */
 	struct ws_ctl *ws_ctl;			/* ctl for wsockd */
 	SSL_OPEN_CB *ssl_callback;		/* ssl connection is now open */
+	rb_fde_t *ktls_F;			/* kernel TLS socket ssld is handing over */
 	uint32_t localflags;
 	struct ZipStats *zipstats;		/* zipstats */
 	uint16_t cork_count;			/* used for corking/uncorking connections */
 	struct ev_entry *event;			/* used for associated events */
+	struct Burst *burst;			/* connect burst, servers only */
 
 	struct PrivilegeSet *privset;		/* privset... */
 
@@ -439,6 +464,8 @@ struct ListClient
 #define LFLAGS_SSL		0x00000001
 #define LFLAGS_FLUSH		0x00000002
 #define LFLAGS_CORK		0x00000004
+#define LFLAGS_BATCH		0x00000008	/* inside a netsplit BATCH */
+#define LFLAGS_KTLS		0x00000010	/* TLS done by the kernel, not ssld */
 
 /* umodes, settable flags */
 /* lots of this moved to snomask -- jilles */
@@ -505,6 +532,9 @@ struct ListClient
 #define SetSSL(x)		((x)->localClient->localflags |= LFLAGS_SSL)
 #define ClearSSL(x)		((x)->localClient->localflags &= ~LFLAGS_SSL)
 
+#define IsKTLS(x)		((x)->localClient->localflags & LFLAGS_KTLS)
+#define SetKTLS(x)		((x)->localClient->localflags |= LFLAGS_KTLS)
+
 #define IsFlush(x)		((x)->localClient->localflags & LFLAGS_FLUSH)
 #define SetFlush(x)		((x)->localClient->localflags |= LFLAGS_FLUSH)
 #define ClearFlush(x)		((x)->localClient->localflags &= ~LFLAGS_FLUSH)
@@ -579,6 +609,10 @@ extern void check_klines_event(void *unused);
 extern void check_klines(void);
 extern void check_dlines(void);
 extern void check_xlines(void);
+extern void check_one_kline(struct ConfItem *);
+extern void check_one_dline(struct ConfItem *);
+extern void check_one_xline(struct ConfItem *);
+extern void queue_kline_check(struct ConfItem *, int delay);
 extern void resv_nick_fnc(const char *mask, const char *reason, int temp_time);
 
 extern const char *get_client_name(struct Client *client, int show_ip);
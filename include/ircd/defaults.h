@@ -44,6 +44,8 @@ constexpr auto LINKS_DELAY_DEFAULT = 300;
 constexpr auto MAX_TARGETS_DEFAULT = 4;                // default for max_targets */
 constexpr auto IDENT_TIMEOUT_DEFAULT = 5;
 constexpr auto BLACKLIST_TIMEOUT_DEFAULT = 10;
+constexpr auto BLACKLIST_CACHE_TTL_DEFAULT = 600;
+constexpr auto BLACKLIST_CACHE_NEGATIVE_TTL_DEFAULT = 60;
 constexpr auto OPM_TIMEOUT_DEFAULT = 10;
 constexpr auto RDNS_TIMEOUT_DEFAULT = 5;
 constexpr auto MIN_JOIN_LEAVE_TIME = 60;
@@ -33,6 +33,8 @@
 namespace ircd {
 
 extern rb_dlink_list nameservers;
+extern char dns_cache_stats[BUFSIZE];
+extern time_t dns_cache_stats_time;
 
 typedef void (*DNSCB)(const char *res, int status, int aftype, void *data);
 typedef void (*DNSLISTCB)(int resc, const char *resv[], int status, void *data);
@@ -47,6 +49,7 @@ void dns_stats_results_callback(const char *callid, const char *status, int resc
 
 void init_dns(void);
 void reload_nameservers(void);
+void refresh_dns_cache_stats(void);
 
 }      // namespace ircd
 #endif // __cplusplus
@@ -67,6 +67,21 @@ struct Channel;
 struct ConfItem;
 struct nd_entry;
 
+/* A name folded once for the case insensitive trees, so that several
+ * lookups of it skip the per-lookup copy and fold.  Names too long for
+ * buf leave canon NULL and are looked up the ordinary way.
+ */
+#define HASH_KEY_LEN 256
+
+struct hash_key
+{
+	const char *name;
+	const char *canon;
+	char buf[HASH_KEY_LEN];
+};
+
+extern void hash_key_init(struct hash_key *key, const char *name);
+
 extern uint32_t fnv_hash_upper(const unsigned char *s, int bits);
 extern uint32_t fnv_hash(const unsigned char *s, int bits);
 extern uint32_t fnv_hash_len(const unsigned char *s, int bits, int len);
@@ -78,6 +93,7 @@ extern void add_to_client_hash(const char *name, struct Client *client);
 extern void del_from_client_hash(const char *name, struct Client *client);
 extern struct Client *find_client(const char *name);
 extern struct Client *find_named_client(const char *name);
+extern struct Client *find_named_client_key(const struct hash_key *key);
 extern struct Client *find_server(struct Client *source_p, const char *name);
 
 extern void add_to_id_hash(const char *, struct Client *);
@@ -87,6 +103,8 @@ extern struct Client *find_id(const char *name);
 extern struct Channel *get_or_create_channel(struct Client *client_p, const char *chname, bool *isnew);
 extern void del_from_channel_hash(const char *name, struct Channel *chan);
 extern struct Channel *find_channel(const char *name);
+extern struct Channel *find_channel_key(const struct hash_key *key);
+extern struct Channel *get_or_create_channel_key(struct Client *client_p, const struct hash_key *key, bool *isnew);
 
 extern void add_to_hostname_hash(const char *, struct Client *);
 extern void del_from_hostname_hash(const char *, struct Client *);
@@ -95,6 +113,7 @@ extern rb_dlink_node *find_hostname(const char *);
 extern void add_to_resv_hash(const char *name, struct ConfItem *aconf);
 extern void del_from_resv_hash(const char *name, struct ConfItem *aconf);
 extern struct ConfItem *hash_find_resv(const char *name);
+extern struct ConfItem *hash_find_resv_key(const struct hash_key *key);
 extern void clear_resv_hash(void);
 
 void add_to_cli_connid_hash(struct Client *client_p, uint32_t id);
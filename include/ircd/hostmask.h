@@ -72,6 +72,8 @@ int match_ipv4(struct sockaddr *, struct sockaddr *, int);
 
 extern struct AddressRec *atable[ATABLE_SIZE];
 
+struct hostmask_node;
+
 struct AddressRec
 {
 	/* masktype: HM_HOST, HM_IPV4, HM_IPV6 -A1kmm */
@@ -106,6 +108,13 @@ struct AddressRec
 
 	/* The next record in this hash bucket. */
 	struct AddressRec *next;
+
+	/* Where find_conf_by_address() keeps this record: a list hung off
+	 * either a patricia node (IP masks) or a host label trie node. */
+	rb_dlink_node inode;
+	rb_dlink_list *ilist;
+	rb_patricia_node_t *pnode;
+	struct hostmask_node *hnode;
 };
 
 }      // namespace ircd
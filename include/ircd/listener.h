@@ -42,11 +42,12 @@ struct Listener
 	int ssl;		/* ssl listener */
 	int defer_accept;	/* use TCP_DEFER_ACCEPT */
 	int wsock;		/* wsock listener */
+	int ring_recvq;		/* clients parse in place from a RecvRing */
 	struct rb_sockaddr_storage addr;
 	char vhost[HOSTLEN + 1];	/* virtual name of listener */
 };
 
-extern void add_listener(int port, const char *vaddr_ip, int family, int ssl, int defer_accept, int wsock);
+extern void add_listener(int port, const char *vaddr_ip, int family, int ssl, int defer_accept, int wsock, int ring_recvq);
 extern void close_listener(struct Listener *listener);
 extern void close_listeners(void);
 extern const char *get_listener_name(const struct Listener *listener);
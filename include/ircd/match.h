@@ -69,6 +69,10 @@ extern int irccmp(const char *s1, const char *s2);
  * ircncmp - counted case insensitive comparison of s1 and s2
  */
 extern int ircncmp(const char *s1, const char *s2, int n);
+/*
+ * irccasefold - rfc1459 fold len bytes of src into dst (which may be src)
+ */
+extern void irccasefold(char *dst, const char *src, size_t len);
 
 #define EmptyString(x) ((x) == NULL || *(x) == '\0')
 #define CheckEmpty(x) EmptyString(x) ? "" : x
@@ -136,12 +140,7 @@ extern const unsigned int CharAttrs[];
 /* Below are used for radix trees and the like */
 static inline void irccasecanon(char *str)
 {
-        while (*str)
-        {
-                *str = irctoupper(*str);
-                str++;
-        }
-        return;
+        irccasefold(str, str, strlen(str));
 }
 
 static inline void strcasecanon(char *str)
@@ -31,6 +31,13 @@ namespace ircd {
 extern PF read_packet;
 extern EVH flood_recalc;
 extern void flood_endgrace(struct Client *);
+extern void flood_dequeue(struct Client *);
+
+extern void recvq_use_ring(struct Client *);
+extern void recvq_free(struct Client *);
+extern void recvq_clear(struct Client *);
+extern size_t recvq_length(struct Client *);
+extern size_t recvq_take(struct Client *, char *, size_t);
 
 }      // namespace ircd
 #endif // __cplusplus
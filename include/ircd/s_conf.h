@@ -214,6 +214,11 @@ struct config_file_entry
 	int tkline_expire_notices;
 	int use_whois_actually;
 	int disable_auth;
+	int dns_cache_size;
+	int dns_cache_max_ttl;
+	int dns_cache_negative_ttl;
+	int blacklist_cache_ttl;
+	int blacklist_cache_negative_ttl;
 	int connect_timeout;
 	int burst_away;
 	int reject_ban_time;
@@ -295,6 +300,7 @@ struct server_info
 	char *ssl_cert;
 	char *ssl_dh_params;
 	char *ssl_cipher_list;
+	int ssl_ktls;
 	int ssld_count;
 	int wsockd_count;
 };
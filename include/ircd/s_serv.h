@@ -70,6 +70,7 @@ extern unsigned int CLICAP_USERHOST_IN_NAMES;
 extern unsigned int CLICAP_CAP_NOTIFY;
 extern unsigned int CLICAP_CHGHOST;
 extern unsigned int CLICAP_ECHO_MESSAGE;
+extern unsigned int CLICAP_BATCH;
 
 /*
  * XXX: this is kind of ugly, but this allows us to have backwards
@@ -120,6 +121,25 @@ extern unsigned int CAP_MLOCK;			/* supports MLOCK messages */
  * because all servers that we talk to already do TS, and the kludged
  * extra argument to "PASS" takes care of checking that.  -orabidoo
  */
+/* an outgoing connect burst, see burst_continue() */
+struct Burst
+{
+	rb_dlink_node node;		/* on the list of running bursts */
+	rb_dlink_node *client_next;	/* next global_client_list entry to send */
+	rb_dlink_node *client_last;	/* last entry present at the start */
+	rb_dlink_node *channel_next;	/* next global_channel_list entry to send */
+	buf_head_t held;		/* other traffic, queued after the burst */
+	struct ev_entry *ev;		/* next chunk, when no write is blocked */
+	bool active;
+	bool emitting;			/* the burst itself is being sent */
+	struct timeval start;
+	unsigned long msec;		/* duration, once finished */
+	unsigned int users;
+	unsigned int channels;
+	unsigned int lines;
+	unsigned long bytes;
+};
+
 extern int MaxClientCount;	/* GLOBAL - highest number of clients */
 extern int MaxConnectionCount;	/* GLOBAL - highest number of connections */
 
@@ -143,6 +163,10 @@ extern void try_connections(void *unused);
 
 extern int check_server(const char *name, struct Client *server);
 extern int server_estab(struct Client *client_p);
+extern void burst_continue(struct Client *client_p);
+extern void burst_client_unlink(struct Client *target_p);
+extern void burst_channel_unlink(struct Channel *chptr);
+extern void burst_free(struct Client *client_p);
 
 extern int serv_connect(struct server_conf *, struct Client *);
 
@@ -69,6 +69,8 @@ struct ServerStatistics
 	unsigned int is_sbad;	/* failed sasl authentications */
 	unsigned int is_tgch;	/* messages blocked due to target change */
 	unsigned int is_rl;     /* commands blocked due to ratelimit */
+	unsigned long long int is_fanout;	/* channel messages fanned out to local members */
+	unsigned long long int is_fanout_renders;	/* distinct tag renderings for those */
 };
 
 extern struct ServerStatistics ServerStats;
@@ -69,6 +69,7 @@ extern void sendto_channel_local_with_capability_butone(struct Client *, int typ
 
 extern void sendto_common_channels_local(struct Client *, int cap, int negcap, const char *, ...) AFP(4, 5);
 extern void sendto_common_channels_local_butone(struct Client *, int cap, int negcap, const char *, ...) AFP(4, 5);
+extern void sendto_netsplit_local(struct Client **users, size_t count, const char *servers);
 
 
 extern void sendto_match_butone(struct Client *, struct Client *,
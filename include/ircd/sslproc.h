@@ -43,7 +43,7 @@ void start_zlib_session(void *data);
 void ssld_update_config(void);
 void ssld_decrement_clicount(ssl_ctl_t *ctl);
 int get_ssld_count(void);
-void ssld_foreach_info(void (*func)(void *data, pid_t pid, int cli_count, enum ssld_status status, const char *version), void *data);
+void ssld_foreach_info(void (*func)(void *data, pid_t pid, int cli_count, int ktls_count, enum ssld_status status, const char *version), void *data);
 
 }      // namespace ircd
 #endif // __cplusplus
@@ -0,0 +1,40 @@
+/*
+ *  charybdis: an advanced ircd.
+ *  userindex.h: Secondary indexes over users for mask searches.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ *  USA
+ */
+
+#pragma once
+#define HAVE_IRCD_USERINDEX_H
+
+#ifdef __cplusplus
+namespace ircd {
+
+struct Client;
+
+typedef void userindex_cb(struct Client *, void *);
+
+extern void init_userindex(void);
+extern void userindex_add(struct Client *);
+extern void userindex_del(struct Client *);
+extern void userindex_update(struct Client *);
+extern void userindex_scan(const char *username, const char *hostname,
+			   userindex_cb *cb, void *data);
+extern void userindex_scan_gecos(const char *mask, userindex_cb *cb, void *data);
+
+}      // namespace ircd
+#endif // __cplusplus
@@ -122,7 +122,6 @@ int rb_set_buffers(rb_fde_t *, int);
 int rb_get_sockerr(rb_fde_t *);
 
 void rb_settimeout(rb_fde_t *, time_t, PF *, void *);
-void rb_checktimeouts(void *);
 void rb_connect_tcp(rb_fde_t *, struct sockaddr *, struct sockaddr *, CNCB *, void *, int);
 void rb_connect_tcp_ssl(rb_fde_t *, struct sockaddr *, struct sockaddr *, CNCB *, void *, int);
 int rb_connect_sockaddr(rb_fde_t *, struct sockaddr *addr, int len);
@@ -169,6 +168,7 @@ void rb_set_type(rb_fde_t *F, uint8_t type);
 uint8_t rb_get_type(rb_fde_t *F);
 
 const char *rb_get_iotype(void);
+int rb_get_io_counts(unsigned long *ctl, unsigned long *waits);
 
 typedef enum
 {
@@ -193,6 +193,10 @@ rb_fde_t *rb_recv_fd(rb_fde_t *);
 
 const char *rb_ssl_get_cipher(rb_fde_t *F);
 
+void rb_ssl_set_ktls(int enable);
+int rb_ssl_ktls(rb_fde_t *F);
+void rb_ssl_ktls_release(rb_fde_t *F);
+
 int rb_ipv4_from_ipv6(const struct sockaddr_in6 *__restrict__ ip6, struct sockaddr_in *__restrict__ ip4);
 
 #ifdef __cplusplus
@@ -88,6 +88,7 @@ struct _fde
 	void *ssl;
 	unsigned int handshake_count;
 	unsigned long ssl_errno;
+	rb_dlink_node pending_node;	/* backends that queue ready fds */
 };
 
 typedef void (*comm_event_cb_t) (void *);
@@ -130,12 +131,12 @@ rb_find_fd(rb_platform_fd_t fd)
 
 int rb_setup_fd(rb_fde_t *F);
 void rb_connect_callback(rb_fde_t *F, int status);
+void rb_accept_tryaccept(rb_fde_t *F, void *data);
+void rb_accept_fd(rb_fde_t *F, rb_platform_fd_t new_fd, struct sockaddr *st, rb_socklen_t addrlen);
 
-
-int rb_io_sched_event(struct ev_entry *ev, int when);
-void rb_io_unsched_event(struct ev_entry *ev);
-int rb_io_supports_event(void);
-void rb_io_init_event(void);
+/* kernel calls the epoll backends make, see rb_get_io_counts() */
+extern unsigned long rb_io_ctl_count;
+extern unsigned long rb_io_wait_count;
 
 /* epoll versions */
 void rb_setselect_epoll(rb_fde_t *F, unsigned int type, PF * handler, void *client_data);
@@ -143,10 +144,18 @@ int rb_init_netio_epoll(void);
 int rb_select_epoll(long);
 int rb_setup_fd_epoll(rb_fde_t *F);
 
-void rb_epoll_init_event(void);
-int rb_epoll_sched_event(struct ev_entry *event, int when);
-void rb_epoll_unsched_event(struct ev_entry *event);
-int rb_epoll_supports_event(void);
+void rb_setselect_epoll_persist(rb_fde_t *F, unsigned int type, PF * handler, void *client_data);
+int rb_init_netio_epoll_persist(void);
+int rb_select_epoll_persist(long);
+
+/* io_uring versions */
+void rb_setselect_uring(rb_fde_t *F, unsigned int type, PF * handler, void *client_data);
+int rb_init_netio_uring(void);
+int rb_select_uring(long);
+int rb_setup_fd_uring(rb_fde_t *F);
+int rb_accept_uring(rb_fde_t *F);
+ssize_t rb_writev_uring(rb_fde_t *F, struct rb_iovec *vector, int count);
+void rb_close_uring(rb_fde_t *F);
 
 
 /* poll versions */
@@ -167,11 +176,6 @@ int rb_init_netio_sigio(void);
 int rb_select_sigio(long);
 int rb_setup_fd_sigio(rb_fde_t *F);
 
-void rb_sigio_init_event(void);
-int rb_sigio_sched_event(struct ev_entry *event, int when);
-void rb_sigio_unsched_event(struct ev_entry *event);
-int rb_sigio_supports_event(void);
-
 
 /* ports versions */
 void rb_setselect_ports(rb_fde_t *F, unsigned int type, PF * handler, void *client_data);
@@ -179,11 +183,6 @@ int rb_init_netio_ports(void);
 int rb_select_ports(long);
 int rb_setup_fd_ports(rb_fde_t *F);
 
-void rb_ports_init_event(void);
-int rb_ports_sched_event(struct ev_entry *event, int when);
-void rb_ports_unsched_event(struct ev_entry *event);
-int rb_ports_supports_event(void);
-
 
 /* kqueue versions */
 void rb_setselect_kqueue(rb_fde_t *F, unsigned int type, PF * handler, void *client_data);
@@ -191,11 +190,6 @@ int rb_init_netio_kqueue(void);
 int rb_select_kqueue(long);
 int rb_setup_fd_kqueue(rb_fde_t *F);
 
-void rb_kqueue_init_event(void);
-int rb_kqueue_sched_event(struct ev_entry *event, int when);
-void rb_kqueue_unsched_event(struct ev_entry *event);
-int rb_kqueue_supports_event(void);
-
 
 /* select versions */
 void rb_setselect_select(rb_fde_t *F, unsigned int type, PF * handler, void *client_data);
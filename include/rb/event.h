@@ -44,6 +44,7 @@ void rb_set_back_events(time_t);
 void rb_dump_events(void (*func) (char *, void *), void *ptr);
 void rb_run_one_event(struct ev_entry *);
 time_t rb_event_next(void);
+long rb_event_next_delay(void);
 
 #ifdef __cplusplus
 } // extern "C"
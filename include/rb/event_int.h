@@ -28,19 +28,28 @@
 extern "C" {
 #endif
 
+/* a timer on the wheel; embed it first in whatever owns it */
+struct rb_timer
+{
+	rb_dlink_node node;
+	rb_dlink_list *slot;	/* wheel slot we are on, NULL if not pending */
+	uint64_t expires;	/* in ticks */
+	void (*func)(struct rb_timer *);
+};
+
 struct ev_entry
 {
+	struct rb_timer timer;
 	rb_dlink_node node;
 	EVH *func;
 	void *arg;
 	char *name;
 	time_t frequency;
-	time_t when;
-	time_t next;
-	void *data;
-	void *comm_ptr;
 };
-void rb_event_io_register_all(void);
+
+void rb_timer_add(struct rb_timer *, long msec);
+void rb_timer_del(struct rb_timer *);
+long rb_timer_left(struct rb_timer *);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -40,14 +40,15 @@ struct _buf_head;
 /* How big we want a buffer - 510 data bytes, plus space for a '\0' */
 #define BUF_DATA_SIZE		511
 
-typedef struct _buf_line
-{
-	char buf[BUF_DATA_SIZE + 2];
-	uint8_t terminated;	/* Whether we've terminated the buffer */
-	uint8_t raw;		/* Whether this linebuf may hold 8-bit data */
-	int len;		/* How much data we've got */
-	int refcount;		/* how many linked lists are we in? */
-} buf_line_t;
+/* Room for an IRCv3 message-tags section ("@...; ") that an outbound
+ * line may carry on top of its BUF_DATA_SIZE bytes of message.
+ */
+#define LINEBUF_TAGS_SIZE	8192
+
+/* Lines are variable length and refcounted; they are carved from a set
+ * of size-classed heaps so a short PING doesn't pin a full 513 byte slot.
+ */
+typedef struct _buf_line buf_line_t;
 
 typedef struct _buf_head
 {
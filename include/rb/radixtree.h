@@ -140,6 +140,12 @@ extern int rb_radixtree_add(rb_radixtree *dtree, const char *key, void *data);
  */
 extern void *rb_radixtree_retrieve(rb_radixtree *dtree, const char *key);
 
+/*
+ * rb_radixtree_retrieve_canon() is rb_radixtree_retrieve() for a key the
+ * caller has already put through the tree's canonize callback.
+ */
+extern void *rb_radixtree_retrieve_canon(rb_radixtree *dtree, const char *ckey);
+
 /*
  * rb_radixtree_delete() deletes a key->value entry from the patricia tree.
  */
@@ -148,6 +154,7 @@ extern void *rb_radixtree_delete(rb_radixtree *dtree, const char *key);
 /* Low-level functions */
 rb_radixtree_leaf *rb_radixtree_elem_add(rb_radixtree *dtree, const char *key, void *data);
 rb_radixtree_leaf *rb_radixtree_elem_find(rb_radixtree *dtree, const char *key, int fuzzy);
+rb_radixtree_leaf *rb_radixtree_elem_find_canon(rb_radixtree *dtree, const char *ckey, int fuzzy);
 void rb_radixtree_elem_delete(rb_radixtree *dtree, rb_radixtree_leaf *elem);
 const char *rb_radixtree_elem_get_key(rb_radixtree_leaf *elem);
 void rb_radixtree_elem_set_data(rb_radixtree_leaf *elem, void *data);
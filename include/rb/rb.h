@@ -56,6 +56,7 @@ void rb_backtrace_log_symbols(void);                 // rb_backtrace_symbols pip
 #include "event.h"
 #include "helper.h"
 #include "rawbuf.h"
+#include "scan.h"
 #include "patricia.h"
 #include "dictionary.h"
 #include "radixtree.h"
@@ -0,0 +1,40 @@
+/*
+ *  librb: a library used by charybdis and other things
+ *  scan.h: Vectorised byte scanning for the line and message parsers.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ *  USA
+ *
+ */
+
+#ifndef INCLUDED_SCAN_H__
+#define INCLUDED_SCAN_H__
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* First '\r' or '\n' in p[0..len), or NULL. */
+const char *rb_find_eol(const char *p, size_t len);
+
+/* First c1 or c2 in the string s, or its terminating NUL. */
+char *rb_strchr2(const char *s, int c1, int c2);
+
+/* Which kernel the scanners use: "avx2", "sse2" or "scalar". */
+const char *rb_scan_kernel(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+#endif
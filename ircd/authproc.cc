@@ -256,6 +256,7 @@ cmd_stats_results(int parc, char **parv)
 	/* Select by type */
 	switch(*parv[2])
 	{
+	case 'C':
 	case 'D':
 		/* parv[0] conveys status */
 		if(parc < 4)
@@ -266,6 +267,19 @@ cmd_stats_results(int parc, char **parv)
 		}
 		dns_stats_results_callback(parv[1], parv[0], parc - 3, (const char **)&parv[3]);
 		break;
+	case 'B':
+		/* One result per blacklist: host iptype hits cache_hits cache_misses */
+		if(*parv[0] == 'Y' && parc >= 8 && bl_stats != NULL)
+		{
+			struct BlacklistStats *stats = (BlacklistStats *)rb_dictionary_retrieve(bl_stats, parv[3]);
+
+			if(stats != NULL)
+			{
+				stats->cache_hits = (unsigned int)strtoul(parv[6], NULL, 10);
+				stats->cache_misses = (unsigned int)strtoul(parv[7], NULL, 10);
+			}
+		}
+		break;
 	default:
 		break;
 	}
@@ -325,6 +339,11 @@ ircd::configure_authd(void)
 	set_authd_timeout("rbl_timeout", ConfigFileEntry.connect_timeout);
 
 	ident_check_enable(!ConfigFileEntry.disable_auth);
+	set_authd_dns_cache(ConfigFileEntry.dns_cache_size,
+		ConfigFileEntry.dns_cache_max_ttl,
+		ConfigFileEntry.dns_cache_negative_ttl);
+	set_authd_blacklist_cache(ConfigFileEntry.blacklist_cache_ttl,
+		ConfigFileEntry.blacklist_cache_negative_ttl);
 
 	/* Configure OPM */
 	if(rb_dlink_list_length(&opm_list) > 0 &&
@@ -496,7 +515,10 @@ authd_read_client(struct Client *client_p)
 	 * --Elizafox
 	 */
 	rb_dlinkAddTail(client_p, &client_p->node, &global_client_list);
-	read_packet(client_p->localClient->F, client_p);
+
+	/* ssl_ktls_switch() starts reading once the new socket is in place */
+	if(client_p->localClient->ktls_F == NULL)
+		read_packet(client_p->localClient->F, client_p);
 }
 
 /* When this is called we have a decision on client acceptance.
@@ -619,6 +641,7 @@ ircd::add_blacklist(const char *host, const char *reason, uint8_t iptype, rb_dli
 	stats->host = rb_strdup(host);
 	stats->iptype = iptype;
 	stats->hits = 0;
+	stats->cache_hits = stats->cache_misses = 0;
 	rb_dictionary_add(bl_stats, stats->host, stats);
 
 	rb_helper_write(authd_helper, "O rbl %s %hhu %s :%s", host, iptype, filterbuf, reason);
@@ -670,6 +693,30 @@ ircd::set_authd_timeout(const char *key, int timeout)
 	return true;
 }
 
+/* Size the DNS answer cache, and cap how long answers are kept */
+void
+ircd::set_authd_dns_cache(int size, int max_ttl, int negative_ttl)
+{
+	rb_helper_write(authd_helper, "O dns_cache %d %d %d",
+		size < 0 ? 0 : size, max_ttl < 0 ? 0 : max_ttl,
+		negative_ttl < 0 ? 0 : negative_ttl);
+}
+
+/* Set how long authd remembers blacklist verdicts */
+void
+ircd::set_authd_blacklist_cache(int ttl, int negative_ttl)
+{
+	rb_helper_write(authd_helper, "O rbl_cache %d %d",
+		ttl < 0 ? 0 : ttl, negative_ttl < 0 ? 0 : negative_ttl);
+}
+
+/* Ask authd for its blacklist cache counters; they arrive in bl_stats */
+void
+ircd::refresh_blacklist_stats(void)
+{
+	rb_helper_write(authd_helper, "S 0 B");
+}
+
 /* Enable identd checks */
 void
 ircd::ident_check_enable(bool enabled)
@@ -45,6 +45,10 @@
 #include <ircd/msg.h>	/* XXX: MAXPARA */
 #include <ircd/operhash.h>
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 namespace ircd {
 
 static void
@@ -59,6 +63,11 @@ rb_dlink_list bandb_pending;
 static rb_helper *bandb_helper;
 static int start_bandb(void);
 
+static char bandb_epoch[32];		/* database our bans are synced with, empty until the first sync */
+static unsigned long long bandb_seq;	/* last change we have from it */
+static bool bandb_incremental;		/* receiving changes, not the whole ban list */
+static unsigned int bandb_added;	/* bans added by this sync */
+
 static void bandb_parse(rb_helper *);
 static void bandb_restart_cb(rb_helper *);
 static char *bandb_path;
@@ -165,23 +174,26 @@ bandb_del(bandb_type type, const char *mask1, const char *mask2)
 	rb_helper_write(bandb_helper, "%s", buf);
 }
 
-static void
-bandb_handle_ban(char *parv[], int parc)
+static struct ConfItem *
+bandb_make_ban(char type, const char *mask1, const char *mask2, const char *oper, const char *reason)
 {
 	struct ConfItem *aconf;
-	char *p;
-	int para = 1;
+	const char *p;
 
 	aconf = make_conf();
 	aconf->port = 0;
 
-	if(parv[0][0] == 'K')
-		aconf->user = rb_strdup(parv[para++]);
+	if(type == 'K')
+	{
+		aconf->user = rb_strdup(mask1);
+		aconf->host = rb_strdup(mask2);
+	}
+	else
+		aconf->host = rb_strdup(mask1);
 
-	aconf->host = rb_strdup(parv[para++]);
-	aconf->info.oper = operhash_add(parv[para++]);
+	aconf->info.oper = operhash_add(oper);
 
-	switch (parv[0][0])
+	switch (type)
 	{
 	case 'K':
 		aconf->status = CONF_KILL;
@@ -204,13 +216,26 @@ bandb_handle_ban(char *parv[], int parc)
 		break;
 	}
 
-	if((p = strchr(parv[para], '|')))
+	if((p = strchr(reason, '|')))
 	{
-		*p++ = '\0';
-		aconf->spasswd = rb_strdup(p);
+		aconf->passwd = rb_strndup(reason, p - reason + 1);
+		aconf->spasswd = rb_strdup(p + 1);
 	}
+	else
+		aconf->passwd = rb_strdup(reason);
 
-	aconf->passwd = rb_strdup(parv[para]);
+	return aconf;
+}
+
+static void
+bandb_handle_ban(char *parv[], int parc)
+{
+	struct ConfItem *aconf;
+
+	if(parv[0][0] == 'K')
+		aconf = bandb_make_ban('K', parv[1], parv[2], parv[3], parv[4]);
+	else
+		aconf = bandb_make_ban(parv[0][0], parv[1], NULL, parv[2], parv[3]);
 
 	rb_dlinkAddAlloc(aconf, &bandb_pending);
 }
@@ -262,11 +287,17 @@ static int
 bandb_check_dline(struct ConfItem *aconf)
 {
 	struct rb_sockaddr_storage daddr;
+	struct ConfItem *dconf;
 	int bits;
 
 	if(!parse_netmask(aconf->host, &daddr, &bits))
 		return 0;
 
+	/* an incremental sync hands back the D-lines we added ourselves */
+	dconf = find_exact_conf_by_address(aconf->host, CONF_DLINE, NULL);
+	if(dconf != NULL && !(dconf->flags & CONF_FLAGS_TEMPORARY))
+		return 0;
+
 	return 1;
 }
 
@@ -325,14 +356,11 @@ bandb_handle_clear(void)
 }
 
 static void
-bandb_handle_finish(void)
+bandb_apply_pending(void)
 {
 	struct ConfItem *aconf;
 	rb_dlink_node *ptr, *next_ptr;
 
-	clear_out_address_conf_bans();
-	clear_s_newconf_bans();
-
 	RB_DLINK_FOREACH_SAFE(ptr, next_ptr, bandb_pending.head)
 	{
 		aconf = (ConfItem *)ptr->data;
@@ -343,7 +371,10 @@ bandb_handle_finish(void)
 		{
 		case CONF_KILL:
 			if(bandb_check_kline(aconf))
+			{
 				add_conf_by_address(aconf->host, CONF_KILL, aconf->user, NULL, aconf);
+				bandb_added++;
+			}
 			else
 				free_conf(aconf);
 
@@ -351,7 +382,10 @@ bandb_handle_finish(void)
 
 		case CONF_DLINE:
 			if(bandb_check_dline(aconf))
+			{
 				add_conf_by_address(aconf->host, CONF_DLINE, aconf->user, NULL, aconf);
+				bandb_added++;
+			}
 			else
 				free_conf(aconf);
 
@@ -359,7 +393,10 @@ bandb_handle_finish(void)
 
 		case CONF_XLINE:
 			if(bandb_check_xline(aconf))
+			{
 				rb_dlinkAddAlloc(aconf, &xline_conf_list);
+				bandb_added++;
+			}
 			else
 				free_conf(aconf);
 
@@ -367,7 +404,10 @@ bandb_handle_finish(void)
 
 		case CONF_RESV_CHANNEL:
 			if(bandb_check_resv_channel(aconf))
+			{
 				add_to_resv_hash(aconf->host, aconf);
+				bandb_added++;
+			}
 			else
 				free_conf(aconf);
 
@@ -375,15 +415,219 @@ bandb_handle_finish(void)
 
 		case CONF_RESV_NICK:
 			if(bandb_check_resv_nick(aconf))
+			{
 				rb_dlinkAddAlloc(aconf, &resv_conf_list);
+				bandb_added++;
+			}
 			else
 				free_conf(aconf);
 
 			break;
 		}
 	}
+}
+
+/* A ban removed from the database since our last sync.  Bans we removed
+ * ourselves come back here too, and are simply not found. */
+static void
+bandb_handle_unban(char *parv[], int parc)
+{
+	struct ConfItem *aconf;
+	rb_dlink_node *ptr;
+
+	if(!bandb_incremental || parc < 2)
+		return;
+
+	/* keep the database's order: adds before this one go in first */
+	bandb_apply_pending();
+
+	switch (parv[0][0])
+	{
+	case 'k':
+		if(parc < 3)
+			return;
+
+		aconf = find_exact_conf_by_address(parv[2], CONF_KILL, parv[1]);
+		if(aconf != NULL && !(aconf->flags & CONF_FLAGS_TEMPORARY))
+		{
+			remove_reject_mask(aconf->user, aconf->host);
+			delete_one_address_conf(aconf->host, aconf);
+		}
+
+		break;
+
+	case 'd':
+		aconf = find_exact_conf_by_address(parv[1], CONF_DLINE, NULL);
+		if(aconf != NULL && !(aconf->flags & CONF_FLAGS_TEMPORARY))
+			delete_one_address_conf(aconf->host, aconf);
+
+		break;
+
+	case 'x':
+		RB_DLINK_FOREACH(ptr, xline_conf_list.head)
+		{
+			aconf = (ConfItem *)ptr->data;
+
+			if(aconf->hold || irccmp(aconf->host, parv[1]))
+				continue;
+
+			remove_reject_mask(aconf->host, NULL);
+			free_conf(aconf);
+			rb_dlinkDestroy(ptr, &xline_conf_list);
+			break;
+		}
+
+		break;
+
+	case 'r':
+		if(IsChannelName(parv[1]))
+		{
+			aconf = hash_find_resv(parv[1]);
+			if(aconf != NULL && !aconf->hold)
+			{
+				del_from_resv_hash(parv[1], aconf);
+				free_conf(aconf);
+			}
 
-	check_banned_lines();
+			break;
+		}
+
+		RB_DLINK_FOREACH(ptr, resv_conf_list.head)
+		{
+			aconf = (ConfItem *)ptr->data;
+
+			if(aconf->hold || irccmp(aconf->host, parv[1]))
+				continue;
+
+			rb_dlinkDestroy(ptr, &resv_conf_list);
+			free_conf(aconf);
+			break;
+		}
+
+		break;
+	}
+}
+
+static void
+bandb_handle_finish(char *parv[], int parc)
+{
+	/* a full list replaces every permanent ban we have */
+	if(!bandb_incremental)
+	{
+		clear_out_address_conf_bans();
+		clear_s_newconf_bans();
+	}
+
+	bandb_apply_pending();
+
+	if(!bandb_incremental || bandb_added > 0)
+		check_banned_lines();
+
+	bandb_incremental = false;
+	bandb_added = 0;
+
+	if(parc >= 3)
+	{
+		rb_strlcpy(bandb_epoch, parv[1], sizeof(bandb_epoch));
+		bandb_seq = strtoull(parv[2], NULL, 10);
+	}
+}
+
+/*
+ * bandb_load_snapshot
+ *
+ * Map the snapshot bandb keeps beside the database and load its bans as
+ * a full sync would, without them passing through the helper.  Returns
+ * false, having changed nothing, if there is no usable snapshot.
+ */
+static bool
+bandb_load_snapshot(void)
+{
+#ifndef _WIN32
+	char path[PATH_MAX];
+	struct bandb_snapshot_header hdr;
+	struct stat st;
+	const char *base, *p, *end;
+	void *map;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s%s", fs::paths[IRCD_PATH_BANDB], BANDB_SNAPSHOT_SUFFIX);
+
+	if((fd = open(path, O_RDONLY)) < 0)
+		return false;
+
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr) ||
+	   (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	base = (const char *)map;
+	end = base + st.st_size;
+	memcpy(&hdr, base, sizeof(hdr));
+
+	if(memcmp(hdr.magic, BANDB_SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+	   hdr.version != BANDB_SNAPSHOT_VERSION || hdr.size != (uint64_t)st.st_size)
+		goto fail;
+
+	bandb_handle_clear();
+
+	p = base + sizeof(hdr);
+	for(uint32_t i = 0; i < hdr.count; i++)
+	{
+		struct bandb_snapshot_record rec;
+		const char *field[4];
+		size_t len = sizeof(rec), pad;
+
+		if((size_t)(end - p) < sizeof(rec))
+			goto fail;
+
+		memcpy(&rec, p, sizeof(rec));
+		p += sizeof(rec);
+
+		if(rec.type != 'K' && rec.type != 'D' && rec.type != 'X' && rec.type != 'R')
+			goto fail;
+
+		for(int j = 0; j < 4; j++)
+		{
+			if((size_t)(end - p) <= rec.len[j] || p[rec.len[j]] != '\0')
+				goto fail;
+
+			field[j] = p;
+			p += rec.len[j] + 1;
+			len += rec.len[j] + 1;
+		}
+
+		pad = (BANDB_SNAPSHOT_ALIGN - len % BANDB_SNAPSHOT_ALIGN) % BANDB_SNAPSHOT_ALIGN;
+		if((size_t)(end - p) < pad)
+			goto fail;
+
+		p += pad;
+
+		rb_dlinkAddAlloc(bandb_make_ban(rec.type, field[0], field[1], field[2], field[3]),
+				 &bandb_pending);
+	}
+
+	munmap(map, st.st_size);
+
+	bandb_incremental = false;
+	bandb_handle_finish(NULL, 0);
+
+	snprintf(bandb_epoch, sizeof(bandb_epoch), "%llx", (unsigned long long)hdr.epoch);
+	bandb_seq = hdr.seq;
+
+	ilog(L_MAIN, "bandb - loaded %u bans from %s", hdr.count, path);
+	return true;
+
+fail:
+	bandb_handle_clear();
+	munmap(map, st.st_size);
+	ilog(L_MAIN, "bandb - ignoring damaged snapshot %s", path);
+#endif
+	return false;
 }
 
 static void
@@ -423,11 +667,23 @@ bandb_parse(rb_helper *helper)
 			bandb_handle_ban(parv, parc);
 			break;
 
+		case 'k':
+		case 'd':
+		case 'x':
+		case 'r':
+			bandb_handle_unban(parv, parc);
+			break;
+
 		case 'C':
 			bandb_handle_clear();
+			bandb_incremental = false;
+			break;
+		case 'I':
+			bandb_handle_clear();
+			bandb_incremental = true;
 			break;
 		case 'F':
-			bandb_handle_finish();
+			bandb_handle_finish(parv, parc);
 			break;
 		}
 	}
@@ -436,7 +692,17 @@ bandb_parse(rb_helper *helper)
 void
 bandb_rehash_bans(void)
 {
-	if(bandb_helper != NULL)
+	if(bandb_helper == NULL)
+		return;
+
+	/* the first time round, start from bandb's snapshot */
+	if(bandb_epoch[0] == '\0')
+		bandb_load_snapshot();
+
+	/* and from then on ask only for what changed */
+	if(bandb_epoch[0] != '\0')
+		rb_helper_write(bandb_helper, "L %s %llu", bandb_epoch, bandb_seq);
+	else
 		rb_helper_write(bandb_helper, "L");
 }
 
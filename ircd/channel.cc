@@ -23,6 +23,7 @@
  */
 
 #include <ircd/stdinc.h>
+#include <ircd/banmatch.h>
 #include <ircd/channel.h>
 #include <ircd/chmode.h>
 #include <ircd/client.h>
@@ -139,6 +140,173 @@ send_channel_join(struct Channel *chptr, struct Client *client_p)
 							    client_p->host, client_p->user->away);
 }
 
+/* Channels at or above this size get a hashed membership index; below
+ * it, walking the shorter of the two membership lists is just as cheap.
+ * The index is dropped again once the channel shrinks to half of this.
+ */
+#define MEMBER_INDEX_MIN	16
+
+static inline unsigned int
+member_index_hash(const struct Client *client_p, unsigned int mask)
+{
+	/* fibonacci hashing, the low bits of a heap pointer carry no entropy */
+	uint64_t h = (uint64_t)(uintptr_t)client_p * UINT64_C(0x9E3779B97F4A7C15);
+	return (unsigned int)(h >> 32) & mask;
+}
+
+static void
+member_index_insert(struct membership **table, unsigned int mask, struct membership *msptr)
+{
+	unsigned int i = member_index_hash(msptr->client_p, mask);
+
+	while(table[i] != NULL)
+		i = (i + 1) & mask;
+
+	table[i] = msptr;
+}
+
+/* member_index_rebuild()
+ *
+ * input	- channel, number of slots (power of two)
+ * output	-
+ * side effects - membership index is reallocated and refilled from
+ *		  chptr->members
+ */
+static void
+member_index_rebuild(struct Channel *chptr, unsigned int slots)
+{
+	struct membership **table;
+	rb_dlink_node *ptr;
+
+	table = (membership **)rb_malloc(sizeof(struct membership *) * slots);
+
+	RB_DLINK_FOREACH(ptr, chptr->members.head)
+		member_index_insert(table, slots - 1, (membership *)ptr->data);
+
+	rb_free(chptr->member_index);
+	chptr->member_index = table;
+	chptr->member_index_mask = slots - 1;
+}
+
+static void
+member_index_free(struct Channel *chptr)
+{
+	rb_free(chptr->member_index);
+	chptr->member_index = NULL;
+	chptr->member_index_mask = 0;
+}
+
+/* member_index_add()
+ *
+ * input	- channel, membership already linked into chptr->members
+ * output	-
+ * side effects - membership is added to the index, which is created or
+ *		  grown to keep the load factor at or below one half
+ */
+static void
+member_index_add(struct Channel *chptr, struct membership *msptr)
+{
+	unsigned long count = rb_dlink_list_length(&chptr->members);
+	unsigned int slots = chptr->member_index_mask + 1;
+
+	if(chptr->member_index == NULL)
+	{
+		if(count >= MEMBER_INDEX_MIN)
+			member_index_rebuild(chptr, MEMBER_INDEX_MIN * 4);
+		return;
+	}
+
+	if(count * 2 > slots)
+	{
+		member_index_rebuild(chptr, slots * 2);
+		return;
+	}
+
+	member_index_insert(chptr->member_index, chptr->member_index_mask, msptr);
+}
+
+/* member_index_del()
+ *
+ * input	- channel, membership already unlinked from chptr->members
+ * output	-
+ * side effects - membership is removed from the index, which is shrunk
+ *		  or dropped as the channel empties
+ */
+static void
+member_index_del(struct Channel *chptr, struct membership *msptr)
+{
+	struct membership **table = chptr->member_index;
+	unsigned int mask = chptr->member_index_mask;
+	unsigned long count = rb_dlink_list_length(&chptr->members);
+	unsigned int i, j, k;
+
+	if(table == NULL)
+		return;
+
+	if(count < MEMBER_INDEX_MIN / 2)
+	{
+		member_index_free(chptr);
+		return;
+	}
+
+	i = member_index_hash(msptr->client_p, mask);
+	while(table[i] != msptr)
+	{
+		if(table[i] == NULL)
+		{
+			s_assert(0);
+			return;
+		}
+		i = (i + 1) & mask;
+	}
+
+	/* backward shift deletion: pull later entries of the probe run into
+	 * the hole unless their home slot lies cyclically within (i, j]
+	 */
+	for(j = (i + 1) & mask; table[j] != NULL; j = (j + 1) & mask)
+	{
+		k = member_index_hash(table[j]->client_p, mask);
+
+		if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		table[i] = table[j];
+		i = j;
+	}
+	table[i] = NULL;
+
+	if(mask + 1 > MEMBER_INDEX_MIN * 4 && count * 8 < mask + 1)
+		member_index_rebuild(chptr, (mask + 1) / 2);
+}
+
+/* member_index_resize()
+ *
+ * input	- channel whose members were unlinked without member_index_del()
+ * output	-
+ * side effects - membership index is rebuilt for the remaining members,
+ *		  or dropped if there are too few of them
+ */
+static void
+member_index_resize(struct Channel *chptr)
+{
+	unsigned long count = rb_dlink_list_length(&chptr->members);
+	unsigned int slots = MEMBER_INDEX_MIN * 4;
+
+	if(chptr->member_index == NULL)
+		return;
+
+	if(count < MEMBER_INDEX_MIN / 2)
+	{
+		member_index_free(chptr);
+		return;
+	}
+
+	while(count * 2 > slots)
+		slots *= 2;
+
+	member_index_rebuild(chptr, slots);
+}
+
 /* find_channel_membership()
  *
  * input	- channel to find them in, client to find
@@ -154,6 +322,22 @@ find_channel_membership(struct Channel *chptr, struct Client *client_p)
 	if(!IsClient(client_p))
 		return NULL;
 
+	if(chptr->member_index != NULL)
+	{
+		unsigned int mask = chptr->member_index_mask;
+		unsigned int i = member_index_hash(client_p, mask);
+
+		while((msptr = chptr->member_index[i]) != NULL)
+		{
+			if(msptr->client_p == client_p)
+				return msptr;
+
+			i = (i + 1) & mask;
+		}
+
+		return NULL;
+	}
+
 	/* Pick the most efficient list to use to be nice to things like
 	 * CHANSERV which could be in a large number of channels
 	 */
@@ -232,6 +416,7 @@ add_user_to_channel(struct Channel *chptr, struct Client *client_p, int flags)
 
 	rb_dlinkAdd(msptr, &msptr->usernode, &client_p->user->channel);
 	rb_dlinkAdd(msptr, &msptr->channode, &chptr->members);
+	member_index_add(chptr, msptr);
 
 	if(MyClient(client_p))
 		rb_dlinkAdd(msptr, &msptr->locchannode, &chptr->locmembers);
@@ -257,6 +442,7 @@ remove_user_from_channel(struct membership *msptr)
 
 	rb_dlinkDelete(&msptr->usernode, &client_p->user->channel);
 	rb_dlinkDelete(&msptr->channode, &chptr->members);
+	member_index_del(chptr, msptr);
 
 	if(client_p->servptr == &me)
 		rb_dlinkDelete(&msptr->locchannode, &chptr->locmembers);
@@ -292,6 +478,7 @@ remove_user_from_channels(struct Client *client_p)
 		chptr = msptr->chptr;
 
 		rb_dlinkDelete(&msptr->channode, &chptr->members);
+		member_index_del(chptr, msptr);
 
 		if(client_p->servptr == &me)
 			rb_dlinkDelete(&msptr->locchannode, &chptr->locmembers);
@@ -306,6 +493,60 @@ remove_user_from_channels(struct Client *client_p)
 	client_p->user->channel.length = 0;
 }
 
+/* remove_users_from_channels()
+ *
+ * input	- users leaving together (e.g. in a netsplit), count
+ * output	-
+ * side effects - all their memberships are removed; each channel
+ *		  touched has its member index resized, or is destroyed,
+ *		  once rather than per user
+ */
+void
+remove_users_from_channels(struct Client **users, size_t count)
+{
+	std::vector<struct Channel *> channels;
+	struct Client *client_p;
+	struct Channel *chptr;
+	struct membership *msptr;
+	rb_dlink_node *ptr;
+	rb_dlink_node *next_ptr;
+
+	for(size_t i = 0; i < count; i++)
+	{
+		client_p = users[i];
+
+		RB_DLINK_FOREACH_SAFE(ptr, next_ptr, client_p->user->channel.head)
+		{
+			msptr = (membership *)ptr->data;
+			chptr = msptr->chptr;
+
+			rb_dlinkDelete(&msptr->channode, &chptr->members);
+
+			if(client_p->servptr == &me)
+				rb_dlinkDelete(&msptr->locchannode, &chptr->locmembers);
+
+			channels.push_back(chptr);
+			rb_bh_free(member_heap, msptr);
+		}
+
+		client_p->user->channel.head = client_p->user->channel.tail = NULL;
+		client_p->user->channel.length = 0;
+	}
+
+	std::sort(channels.begin(), channels.end());
+	channels.erase(std::unique(channels.begin(), channels.end()), channels.end());
+
+	for(size_t i = 0; i < channels.size(); i++)
+	{
+		chptr = channels[i];
+
+		if(!(chptr->mode.mode & MODE_PERMANENT) && rb_dlink_list_length(&chptr->members) <= 0)
+			destroy_channel(chptr);
+		else
+			member_index_resize(chptr);
+	}
+}
+
 /* invalidate_bancache_user()
  *
  * input	- user to invalidate ban cache for
@@ -330,6 +571,22 @@ invalidate_bancache_user(struct Client *client_p)
 	}
 }
 
+/* invalidate_bancache_channel()
+ *
+ * input	- channel whose ban, quiet or exception list changed
+ * output	-
+ * side effects - chptr->bants is moved strictly forward, invalidating
+ *                the can_send() cache and the compiled ban lists
+ */
+void
+invalidate_bancache_channel(struct Channel *chptr)
+{
+	if(chptr->bants < rb_current_time())
+		chptr->bants = rb_current_time();
+	else
+		chptr->bants++;
+}
+
 /* check_channel_name()
  *
  * input	- channel name
@@ -400,6 +657,10 @@ destroy_channel(struct Channel *chptr)
 	/* Free the topic */
 	free_topic(chptr);
 
+	member_index_free(chptr);
+	free_ban_matcher(chptr);
+
+	burst_channel_unlink(chptr);
 	rb_dlinkDelete(&chptr->node, &global_channel_list);
 	del_from_channel_hash(chptr->chname, chptr);
 	free_channel(chptr);
@@ -544,9 +805,8 @@ is_banned_list(struct Channel *chptr, rb_dlink_list *list,
 	char *s3 = NULL;
 	char *s4 = NULL;
 	struct sockaddr_in ip4;
-	rb_dlink_node *ptr;
+	struct ban_subject subject;
 	struct Ban *actualBan = NULL;
-	struct Ban *actualExcept = NULL;
 
 	if(!MyClient(who))
 		return 0;
@@ -588,46 +848,29 @@ is_banned_list(struct Channel *chptr, rb_dlink_list *list,
 	}
 #endif
 
-	RB_DLINK_FOREACH(ptr, list->head)
-	{
-		actualBan = (Ban *)ptr->data;
-		if(match(actualBan->banstr, s) ||
-		   match(actualBan->banstr, s2) ||
-		   match_cidr(actualBan->banstr, s2) ||
-		   match_extban(actualBan->banstr, who, chptr, CHFL_BAN) ||
-		   (s3 != NULL && match(actualBan->banstr, s3))
-#ifdef RB_IPV6
-		   ||
-		   (s4 != NULL && (match(actualBan->banstr, s4) || match_cidr(actualBan->banstr, s4)))
-#endif
-		   )
-			break;
-		else
-			actualBan = NULL;
-	}
+	subject.host = s;
+	subject.iphost = s2;
+	subject.althost = s3;
+	subject.ip4host = s4;
+
+	actualBan = find_ban_match(chptr, list, who, &subject, CHFL_BAN);
 
 	if((actualBan != NULL) && ConfigChannel.use_except)
 	{
-		RB_DLINK_FOREACH(ptr, chptr->exceptlist.head)
+		/* exceptions have never been checked against the IPv4 form */
+		subject.ip4host = NULL;
+
+		/* theyre exempted.. */
+		if(find_ban_match(chptr, &chptr->exceptlist, who, &subject, CHFL_EXCEPTION) != NULL)
 		{
-			actualExcept = (Ban *)ptr->data;
-
-			/* theyre exempted.. */
-			if(match(actualExcept->banstr, s) ||
-			   match(actualExcept->banstr, s2) ||
-			   match_cidr(actualExcept->banstr, s2) ||
-			   match_extban(actualExcept->banstr, who, chptr, CHFL_EXCEPTION) ||
-			   (s3 != NULL && match(actualExcept->banstr, s3)))
+			/* cache the fact theyre not banned */
+			if(msptr != NULL)
 			{
-				/* cache the fact theyre not banned */
-				if(msptr != NULL)
-				{
-					msptr->bants = chptr->bants;
-					msptr->flags &= ~CHFL_BANNED;
-				}
-
-				return CHFL_EXCEPTION;
+				msptr->bants = chptr->bants;
+				msptr->flags &= ~CHFL_BANNED;
 			}
+
+			return CHFL_EXCEPTION;
 		}
 	}
 
@@ -22,6 +22,8 @@
  *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
  *  USA
  */
+#include <algorithm>
+
 #include <ircd/stdinc.h>
 #include <ircd/client.h>
 #include <ircd/class.h>
@@ -49,6 +51,7 @@
 #include <ircd/scache.h>
 #include <ircd/sslproc.h>
 #include <ircd/wsproc.h>
+#include <ircd/userindex.h>
 #include <ircd/s_assert.h>
 
 namespace ircd {
@@ -275,6 +278,9 @@ free_local_client(struct Client *client_p)
 	if(client_p->localClient == NULL)
 		return;
 
+	flood_dequeue(client_p);
+	recvq_free(client_p);
+
 	/*
 	 * clean up extra sockets from P-lines which have been discarded.
 	 */
@@ -317,6 +323,8 @@ free_local_client(struct Client *client_p)
 	if (client_p->localClient->ws_ctl != NULL)
 		wsockd_decrement_clicount(client_p->localClient->ws_ctl);
 
+	burst_free(client_p);
+
 	rb_bh_free(lclient_heap, client_p->localClient);
 	client_p->localClient = NULL;
 }
@@ -525,33 +533,261 @@ check_banned_lines(void)
 	check_xlines();
 }
 
+/* K-line masks waiting for kline_delay, checked together by
+ * check_klines_event().  Past PENDING_KLINES_MAX the event does a full
+ * sweep instead, which is cheaper than that many index scans.
+ */
+#define PENDING_KLINES_MAX	256
+
+static std::vector<std::pair<std::string, std::string>> pending_klines;
+static bool pending_klines_sweep;
+
+/* enforce_kline()
+ *
+ * inputs	- local user
+ * outputs	-
+ * side effects - user is exited if a K-line matches it
+ */
+static void
+enforce_kline(struct Client *client_p)
+{
+	struct ConfItem *aconf;
+
+	if((aconf = find_kline(client_p)) == NULL)
+		return;
+
+	if(IsExemptKline(client_p))
+	{
+		sendto_realops_snomask(SNO_GENERAL, L_ALL,
+				     "KLINE over-ruled for %s, client is kline_exempt [%s@%s]",
+				     get_client_name(client_p, HIDE_IP),
+				     aconf->user, aconf->host);
+		return;
+	}
+
+	sendto_realops_snomask(SNO_GENERAL, L_ALL,
+			     "KLINE active for %s",
+			     get_client_name(client_p, HIDE_IP));
+
+	notify_banned_client(client_p, aconf, K_LINED);
+}
+
+/* enforce_dline()
+ *
+ * inputs	- local connection, whether to tell opers
+ * outputs	-
+ * side effects - connection is exited if a D-line matches it
+ */
+static void
+enforce_dline(struct Client *client_p, bool notify)
+{
+	struct ConfItem *aconf;
+
+	if((aconf = find_dline((struct sockaddr *)&client_p->localClient->ip, GET_SS_FAMILY(&client_p->localClient->ip))) == NULL)
+		return;
+
+	if(aconf->status & CONF_EXEMPTDLINE)
+		return;
+
+	if(notify)
+		sendto_realops_snomask(SNO_GENERAL, L_ALL,
+				     "DLINE active for %s",
+				     get_client_name(client_p, HIDE_IP));
+
+	notify_banned_client(client_p, aconf, D_LINED);
+}
+
+/* enforce_xline()
+ *
+ * inputs	- local user
+ * outputs	-
+ * side effects - user is exited if an X-line matches it
+ */
+static void
+enforce_xline(struct Client *client_p)
+{
+	struct ConfItem *aconf;
+
+	if((aconf = find_xline(client_p->info, 1)) == NULL)
+		return;
+
+	if(IsExemptKline(client_p))
+	{
+		sendto_realops_snomask(SNO_GENERAL, L_ALL,
+				     "XLINE over-ruled for %s, client is kline_exempt [%s]",
+				     get_client_name(client_p, HIDE_IP),
+				     aconf->host);
+		return;
+	}
+
+	sendto_realops_snomask(SNO_GENERAL, L_ALL, "XLINE active for %s",
+			     get_client_name(client_p, HIDE_IP));
+
+	(void) exit_client(client_p, client_p, &me, "Bad user info");
+}
+
+static void
+collect_local_user(struct Client *target_p, void *data)
+{
+	if(MyClient(target_p))
+		reinterpret_cast<std::vector<struct Client *> *>(data)->push_back(target_p);
+}
+
+/* scan_ban_mask()
+ *
+ * inputs	- user and host of a K- or D-line, list to fill
+ * outputs	- false if the mask can't be planned through the user index
+ * side effects - local users the mask may cover are added to the list
+ */
+static bool
+scan_ban_mask(const char *user, const char *host, std::vector<struct Client *> &hits)
+{
+	struct rb_sockaddr_storage addr;
+	char cidr[HOSTIPLEN + 5];
+	int bits;
+	int type;
+
+	/* address bans match the address, however the mask was written */
+	switch((type = parse_netmask(host, &addr, &bits)))
+	{
+		case HM_IPV4:
+		case HM_IPV6:
+			if(bits <= 0)
+				return false;
+
+			if(!rb_inet_ntop_sock((struct sockaddr *)&addr, cidr, sizeof(cidr)))
+				return false;
+
+			rb_snprintf_append(cidr, sizeof(cidr), "/%d", bits);
+			host = cidr;
+			break;
+
+		default:
+			break;
+	}
+
+	userindex_scan(user, host, collect_local_user, &hits);
+
+#ifdef RB_IPV6
+	/* find_kline() and find_dline() also try IPv4 bans against the
+	 * address inside 6to4 and Teredo clients.  6to4 carries it as a
+	 * prefix; Teredo obscures it, so take every Teredo client.
+	 */
+	if(type == HM_IPV4)
+	{
+		const unsigned char *ip4 = (const unsigned char *)&((struct sockaddr_in *)&addr)->sin_addr;
+
+		snprintf(cidr, sizeof(cidr), "2002:%02x%02x:%02x%02x::/%d",
+			 ip4[0], ip4[1], ip4[2], ip4[3], 16 + bits);
+		userindex_scan(user, cidr, collect_local_user, &hits);
+		userindex_scan(user, "2001::/32", collect_local_user, &hits);
+
+		std::sort(hits.begin(), hits.end());
+		hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+	}
+#endif
+
+	return true;
+}
+
+/* check_kline_mask()
+ *
+ * inputs	- user and host of a new K-line
+ * outputs	-
+ * side effects - local users the K-line may cover are checked, and
+ *		  exited once they have all been found
+ */
+static void
+check_kline_mask(const char *user, const char *host)
+{
+	std::vector<struct Client *> hits;
+
+	if(!scan_ban_mask(user, host, hits))
+	{
+		check_klines();
+		return;
+	}
+
+	for(auto *const client_p : hits)
+		if(!IsAnyDead(client_p))
+			enforce_kline(client_p);
+}
+
+/* check_one_kline()
+ *
+ * inputs	- new K-line
+ * outputs	-
+ * side effects - only clients the K-line may cover are checked
+ */
+void
+check_one_kline(struct ConfItem *aconf)
+{
+	check_kline_mask(EmptyString(aconf->user) ? "*" : aconf->user, aconf->host);
+}
+
+/* queue_kline_check()
+ *
+ * inputs	- new K-line, seconds to wait
+ * outputs	-
+ * side effects - the K-line is checked by check_klines_event(), which
+ *		  is scheduled if it isn't already
+ */
+void
+queue_kline_check(struct ConfItem *aconf, int delay)
+{
+	if(pending_klines.size() < PENDING_KLINES_MAX)
+		pending_klines.emplace_back(EmptyString(aconf->user) ? "*" : aconf->user, aconf->host);
+	else
+		pending_klines_sweep = true;
+
+	if(!kline_queued)
+	{
+		rb_event_addonce("check_klines", check_klines_event, NULL, delay);
+		kline_queued = true;
+	}
+}
+
 /* check_klines_event()
  *
  * inputs	-
  * outputs	-
- * side effects - check_klines() is called, kline_queued unset
+ * side effects - queued K-lines are checked, kline_queued unset
  */
 void
 check_klines_event(void *unused)
 {
 	kline_queued = false;
-	check_klines();
+
+	if(pending_klines_sweep)
+	{
+		check_klines();
+		return;
+	}
+
+	std::vector<std::pair<std::string, std::string>> pending;
+	pending.swap(pending_klines);
+
+	for(const auto &kline : pending)
+		check_kline_mask(kline.first.c_str(), kline.second.c_str());
 }
 
 /* check_klines
  *
  * inputs       -
  * outputs      -
- * side effects - all clients will be checked for klines
+ * side effects - all clients will be checked for klines; this is the
+ *		  fallback for rehashes and ban database reloads
  */
 void
 check_klines(void)
 {
 	struct Client *client_p;
-	struct ConfItem *aconf;
 	rb_dlink_node *ptr;
 	rb_dlink_node *next_ptr;
 
+	pending_klines.clear();
+	pending_klines_sweep = false;
+
 	RB_DLINK_FOREACH_SAFE(ptr, next_ptr, lclient_list.head)
 	{
 		client_p = reinterpret_cast<Client *>(ptr->data);
@@ -559,24 +795,39 @@ check_klines(void)
 		if(IsMe(client_p) || !IsPerson(client_p))
 			continue;
 
-		if((aconf = find_kline(client_p)) != NULL)
-		{
-			if(IsExemptKline(client_p))
-			{
-				sendto_realops_snomask(SNO_GENERAL, L_ALL,
-						     "KLINE over-ruled for %s, client is kline_exempt [%s@%s]",
-						     get_client_name(client_p, HIDE_IP),
-						     aconf->user, aconf->host);
-				continue;
-			}
+		enforce_kline(client_p);
+	}
+}
 
-			sendto_realops_snomask(SNO_GENERAL, L_ALL,
-					     "KLINE active for %s",
-					     get_client_name(client_p, HIDE_IP));
+/* check_one_dline()
+ *
+ * inputs	- new D-line
+ * outputs	-
+ * side effects - users on the D-lined addresses, and all unknowns,
+ *		  are checked
+ */
+void
+check_one_dline(struct ConfItem *aconf)
+{
+	std::vector<struct Client *> hits;
+	struct Client *client_p;
+	rb_dlink_node *ptr;
+	rb_dlink_node *next_ptr;
 
-			notify_banned_client(client_p, aconf, K_LINED);
-			continue;
-		}
+	if(!scan_ban_mask("*", aconf->host, hits))
+	{
+		check_dlines();
+		return;
+	}
+
+	for(auto *const target_p : hits)
+		if(!IsAnyDead(target_p))
+			enforce_dline(target_p, true);
+
+	RB_DLINK_FOREACH_SAFE(ptr, next_ptr, unknown_list.head)
+	{
+		client_p = reinterpret_cast<Client *>(ptr->data);
+		enforce_dline(client_p, false);
 	}
 }
 
@@ -590,7 +841,6 @@ void
 check_dlines(void)
 {
 	struct Client *client_p;
-	struct ConfItem *aconf;
 	rb_dlink_node *ptr;
 	rb_dlink_node *next_ptr;
 
@@ -601,33 +851,33 @@ check_dlines(void)
 		if(IsMe(client_p))
 			continue;
 
-		if((aconf = find_dline((struct sockaddr *)&client_p->localClient->ip, GET_SS_FAMILY(&client_p->localClient->ip))) != NULL)
-		{
-			if(aconf->status & CONF_EXEMPTDLINE)
-				continue;
-
-			sendto_realops_snomask(SNO_GENERAL, L_ALL,
-					     "DLINE active for %s",
-					     get_client_name(client_p, HIDE_IP));
-
-			notify_banned_client(client_p, aconf, D_LINED);
-			continue;
-		}
+		enforce_dline(client_p, true);
 	}
 
 	/* dlines need to be checked against unknowns too */
 	RB_DLINK_FOREACH_SAFE(ptr, next_ptr, unknown_list.head)
 	{
 		client_p = reinterpret_cast<Client *>(ptr->data);
+		enforce_dline(client_p, false);
+	}
+}
 
-		if((aconf = find_dline((struct sockaddr *)&client_p->localClient->ip, GET_SS_FAMILY(&client_p->localClient->ip))) != NULL)
-		{
-			if(aconf->status & CONF_EXEMPTDLINE)
-				continue;
+/* check_one_xline()
+ *
+ * inputs	- new X-line
+ * outputs	-
+ * side effects - only users whose gecos the X-line may match are checked
+ */
+void
+check_one_xline(struct ConfItem *aconf)
+{
+	std::vector<struct Client *> hits;
 
-			notify_banned_client(client_p, aconf, D_LINED);
-		}
-	}
+	userindex_scan_gecos(aconf->host, collect_local_user, &hits);
+
+	for(auto *const client_p : hits)
+		if(!IsAnyDead(client_p))
+			enforce_xline(client_p);
 }
 
 /* check_xlines
@@ -640,7 +890,6 @@ void
 check_xlines(void)
 {
 	struct Client *client_p;
-	struct ConfItem *aconf;
 	rb_dlink_node *ptr;
 	rb_dlink_node *next_ptr;
 
@@ -651,23 +900,7 @@ check_xlines(void)
 		if(IsMe(client_p) || !IsPerson(client_p))
 			continue;
 
-		if((aconf = find_xline(client_p->info, 1)) != NULL)
-		{
-			if(IsExemptKline(client_p))
-			{
-				sendto_realops_snomask(SNO_GENERAL, L_ALL,
-						     "XLINE over-ruled for %s, client is kline_exempt [%s]",
-						     get_client_name(client_p, HIDE_IP),
-						     aconf->host);
-				continue;
-			}
-
-			sendto_realops_snomask(SNO_GENERAL, L_ALL, "XLINE active for %s",
-					     get_client_name(client_p, HIDE_IP));
-
-			(void) exit_client(client_p, client_p, &me, "Bad user info");
-			continue;
-		}
+		enforce_xline(client_p);
 	}
 }
 
@@ -838,6 +1071,7 @@ remove_client_from_list(struct Client *client_p)
 	if(client_p->node.prev == NULL && client_p->node.next == NULL)
 		return;
 
+	burst_client_unlink(client_p);
 	rb_dlinkDelete(&client_p->node, &global_client_list);
 
 	update_client_exit_stats(client_p);
@@ -1126,59 +1360,87 @@ free_exited_clients(void *unused)
 }
 
 /*
-** Remove all clients that depend on source_p; assumes all (S)QUITs have
-** already been sent.  we make sure to exit a server's dependent clients
-** and servers before the server itself; exit_one_client takes care of
-** actually removing things off llists.   tweaked from +CSr31  -orabidoo
- */
-/*
- * added sanity test code.... source_p->serv might be NULL...
+ * collect_split_users - gather the users behind source_p, marking them
+ * killed so no QUITs are propagated for them
  */
 static void
-recurse_remove_clients(struct Client *source_p, const char *comment)
+collect_split_users(struct Client *source_p, std::vector<struct Client *> &users)
 {
 	struct Client *target_p;
-	rb_dlink_node *ptr, *ptr_next;
-
-	if(IsMe(source_p))
-		return;
+	rb_dlink_node *ptr;
 
 	if(source_p->serv == NULL)	/* oooops. uh this is actually a major bug */
 		return;
 
-	/* this is very ugly, but it saves cpu :P */
-	if(ConfigFileEntry.nick_delay > 0)
+	RB_DLINK_FOREACH(ptr, source_p->serv->users.head)
 	{
-		RB_DLINK_FOREACH_SAFE(ptr, ptr_next, source_p->serv->users.head)
-		{
-			target_p = reinterpret_cast<Client *>(ptr->data);
-			target_p->flags |= FLAGS_KILLED;
+		target_p = reinterpret_cast<Client *>(ptr->data);
+		target_p->flags |= FLAGS_KILLED;
+
+		if(ConfigFileEntry.nick_delay > 0)
 			add_nd_entry(target_p->name);
 
-			if(!IsDead(target_p) && !IsClosing(target_p))
-				exit_remote_client(NULL, target_p, &me, comment);
-		}
+		if(!IsDead(target_p) && !IsClosing(target_p))
+			users.push_back(target_p);
 	}
-	else
-	{
-		RB_DLINK_FOREACH_SAFE(ptr, ptr_next, source_p->serv->users.head)
-		{
-			target_p = reinterpret_cast<Client *>(ptr->data);
-			target_p->flags |= FLAGS_KILLED;
 
-			if(!IsDead(target_p) && !IsClosing(target_p))
-				exit_remote_client(NULL, target_p, &me, comment);
-		}
-	}
+	RB_DLINK_FOREACH(ptr, source_p->serv->servers.head)
+		collect_split_users(reinterpret_cast<Client *>(ptr->data), users);
+}
+
+/*
+ * recurse_remove_servers - remove the servers behind source_p, whose
+ * users have already gone
+ */
+static void
+recurse_remove_servers(struct Client *source_p, const char *comment)
+{
+	struct Client *target_p;
+	rb_dlink_node *ptr, *ptr_next;
+
+	if(source_p->serv == NULL)
+		return;
 
 	RB_DLINK_FOREACH_SAFE(ptr, ptr_next, source_p->serv->servers.head)
 	{
 		target_p = reinterpret_cast<Client *>(ptr->data);
-		recurse_remove_clients(target_p, comment);
+		recurse_remove_servers(target_p, comment);
 		qs_server(NULL, target_p, &me, comment);
 	}
 }
 
+/*
+** Remove all clients that depend on source_p; assumes all (S)QUITs have
+** already been sent.  we make sure to exit a server's dependent clients
+** and servers before the server itself; exit_one_client takes care of
+** actually removing things off llists.   tweaked from +CSr31  -orabidoo
+ */
+/*
+ * added sanity test code.... source_p->serv might be NULL...
+ *
+ * The users are exited together: local clients get every QUIT in one
+ * pass (in a netsplit BATCH if they asked for it), and each channel's
+ * memberships are torn down once instead of per user.
+ */
+static void
+recurse_remove_clients(struct Client *source_p, const char *comment)
+{
+	std::vector<struct Client *> users;
+
+	if(IsMe(source_p))
+		return;
+
+	collect_split_users(source_p, users);
+
+	sendto_netsplit_local(users.data(), users.size(), comment);
+	remove_users_from_channels(users.data(), users.size());
+
+	for(auto target_p : users)
+		exit_remote_client(NULL, target_p, &me, comment);
+
+	recurse_remove_servers(source_p, comment);
+}
+
 /*
 ** Remove *everything* that depends on source_p, from all lists, and sending
 ** all necessary SQUITs.  source_p itself is still on the lists,
@@ -1285,9 +1547,11 @@ exit_generic_client(struct Client *client_p, struct Client *source_p, struct Cli
 	if(IsOper(source_p))
 		rb_dlinkFindDestroy(source_p, &oper_list);
 
-	sendto_common_channels_local(source_p, NOCAPS, NOCAPS, ":%s!%s@%s QUIT :%s",
-				     source_p->name,
-				     source_p->username, source_p->host, comment);
+	/* a netsplit has already sent this and parted their channels */
+	if(MyConnect(source_p) || source_p->user->channel.head != NULL)
+		sendto_common_channels_local(source_p, NOCAPS, NOCAPS, ":%s!%s@%s QUIT :%s",
+					     source_p->name,
+					     source_p->username, source_p->host, comment);
 
 	remove_user_from_channels(source_p);
 
@@ -1312,6 +1576,7 @@ exit_generic_client(struct Client *client_p, struct Client *source_p, struct Cli
 		del_from_id_hash(source_p->id, source_p);
 
 	del_from_hostname_hash(source_p->orighost, source_p);
+	userindex_del(source_p);
 	del_from_client_hash(source_p->name, source_p);
 	remove_client_from_list(source_p);
 }
@@ -1861,7 +2126,7 @@ free_user(struct User *user, struct Client *client_p)
 	if(--user->refcnt <= 0)
 	{
 		if(user->away)
-			rb_free((char *) user->away);
+			rb_bh_free(away_heap, user->away);
 		/*
 		 * sanity check
 		 */
@@ -2028,8 +2293,14 @@ close_connection(struct Client *client_p)
 		client_p->localClient->F = NULL;
 	}
 
+	if(client_p->localClient->ktls_F != NULL)
+	{
+		rb_close(client_p->localClient->ktls_F);
+		client_p->localClient->ktls_F = NULL;
+	}
+
 	rb_linebuf_donebuf(&client_p->localClient->buf_sendq);
-	rb_linebuf_donebuf(&client_p->localClient->buf_recvq);
+	recvq_clear(client_p);
 	detach_conf(client_p);
 
 	/* XXX shouldnt really be done here. */
@@ -43,7 +43,7 @@ namespace ircd {
 #define DNS_REVERSE_IPV6	((char)'S')
 
 static void submit_dns(uint32_t uid, char type, const char *addr);
-static void submit_dns_stat(uint32_t uid);
+static void submit_dns_stat(uint32_t uid, char letter);
 
 struct dnsreq
 {
@@ -62,6 +62,8 @@ static rb_dictionary *query_dict;
 static rb_dictionary *stat_dict;
 
 rb_dlink_list nameservers;
+char dns_cache_stats[BUFSIZE];
+time_t dns_cache_stats_time;
 
 static uint32_t query_id = 0;
 static uint32_t stat_id = 0;
@@ -175,7 +177,7 @@ lookup_ip(const char *addr, int aftype, DNSCB callback, void *data)
 }
 
 static uint32_t
-get_nameservers(DNSLISTCB callback, void *data)
+get_dns_stats(char letter, DNSLISTCB callback, void *data)
 {
 	struct dnsstatreq *req = (dnsstatreq *)rb_malloc(sizeof(struct dnsstatreq));
 	uint32_t qid = assign_id(&stat_id);
@@ -187,10 +189,16 @@ get_nameservers(DNSLISTCB callback, void *data)
 	req->callback = callback;
 	req->data = data;
 
-	submit_dns_stat(qid);
+	submit_dns_stat(qid, letter);
 	return (qid);
 }
 
+static uint32_t
+get_nameservers(DNSLISTCB callback, void *data)
+{
+	return get_dns_stats('D', callback, data);
+}
+
 
 void
 dns_results_callback(const char *callid, const char *status, const char *type, const char *results)
@@ -298,6 +306,30 @@ stats_results_callback(int resc, const char *resv[], int status, void *data)
 }
 
 
+static void
+cache_stats_callback(int resc, const char *resv[], int status, void *data)
+{
+	if(status != 0)
+		return;
+
+	dns_cache_stats[0] = '\0';
+	for(int i = 0; i < resc; i++)
+	{
+		if(i > 0)
+			rb_strlcat(dns_cache_stats, " ", sizeof(dns_cache_stats));
+		rb_strlcat(dns_cache_stats, resv[i], sizeof(dns_cache_stats));
+	}
+
+	dns_cache_stats_time = rb_current_time();
+}
+
+/* Ask authd for its DNS cache counters; they arrive in dns_cache_stats */
+void
+refresh_dns_cache_stats(void)
+{
+	(void)get_dns_stats('C', cache_stats_callback, NULL);
+}
+
 void
 init_dns(void)
 {
@@ -327,14 +359,14 @@ submit_dns(uint32_t nid, char type, const char *addr)
 }
 
 static void
-submit_dns_stat(uint32_t nid)
+submit_dns_stat(uint32_t nid, char letter)
 {
 	if(authd_helper == NULL)
 	{
 		handle_dns_stat_failure(nid);
 		return;
 	}
-	rb_helper_write(authd_helper, "S %x D", nid);
+	rb_helper_write(authd_helper, "S %x %c", nid, letter);
 }
 
 } // namespace ircd
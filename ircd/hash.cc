@@ -127,6 +127,36 @@ fnv_hash_upper_len(const unsigned char *s, int bits, int len)
 	return h;
 }
 
+/* hash_key_init()
+ *
+ * input	- key to fill in, name to fold into it
+ * output	- none
+ * side effects - key refers to name, which must outlive it
+ */
+void
+hash_key_init(struct hash_key *key, const char *name)
+{
+	size_t len = strlen(name);
+
+	key->name = name;
+	key->canon = NULL;
+
+	if(len >= sizeof(key->buf))
+		return;
+
+	irccasefold(key->buf, name, len + 1);
+	key->canon = key->buf;
+}
+
+static void *
+hash_key_retrieve(rb_radixtree *tree, const struct hash_key *key)
+{
+	if(key->canon != NULL)
+		return rb_radixtree_retrieve_canon(tree, key->canon);
+
+	return rb_radixtree_retrieve(tree, key->name);
+}
+
 /* add_to_id_hash()
  *
  * adds an entry to the id hash table
@@ -328,6 +358,19 @@ find_named_client(const char *name)
 	return (Client *)rb_radixtree_retrieve(client_name_tree, name);
 }
 
+/* find_named_client_key()
+ *
+ * finds a client/server entry from the client hash table by folded key
+ */
+struct Client *
+find_named_client_key(const struct hash_key *key)
+{
+	if(EmptyString(key->name))
+		return NULL;
+
+	return (Client *)hash_key_retrieve(client_name_tree, key);
+}
+
 /* find_server()
  *
  * finds a server from the client hash table
@@ -392,6 +435,19 @@ find_channel(const char *name)
 	return (Channel *)rb_radixtree_retrieve(channel_tree, name);
 }
 
+/* find_channel_key()
+ *
+ * finds a channel from the channel hash table by folded key
+ */
+struct Channel *
+find_channel_key(const struct hash_key *key)
+{
+	if(EmptyString(key->name))
+		return NULL;
+
+	return (Channel *)hash_key_retrieve(channel_tree, key);
+}
+
 /*
  * get_or_create_channel
  * inputs       - client pointer
@@ -406,7 +462,7 @@ find_channel(const char *name)
 struct Channel *
 get_or_create_channel(struct Client *client_p, const char *chname, bool *isnew)
 {
-	struct Channel *chptr;
+	struct hash_key key;
 	int len;
 	const char *s = chname;
 
@@ -429,7 +485,26 @@ get_or_create_channel(struct Client *client_p, const char *chname, bool *isnew)
 		s = t;
 	}
 
-	chptr = (Channel *)rb_radixtree_retrieve(channel_tree, s);
+	hash_key_init(&key, s);
+	return get_or_create_channel_key(client_p, &key, isnew);
+}
+
+/* get_or_create_channel_key()
+ *
+ * as get_or_create_channel(), for a name already folded into key
+ */
+struct Channel *
+get_or_create_channel_key(struct Client *client_p, const struct hash_key *key, bool *isnew)
+{
+	struct Channel *chptr;
+
+	if(EmptyString(key->name))
+		return NULL;
+
+	if(strlen(key->name) > CHANNELLEN)
+		return get_or_create_channel(client_p, key->name, isnew);
+
+	chptr = (Channel *)hash_key_retrieve(channel_tree, key);
 	if (chptr != NULL)
 	{
 		if (isnew != NULL)
@@ -440,7 +515,7 @@ get_or_create_channel(struct Client *client_p, const char *chname, bool *isnew)
 	if(isnew != NULL)
 		*isnew = true;
 
-	chptr = allocate_channel(s);
+	chptr = allocate_channel(key->name);
 	chptr->channelts = rb_current_time();	/* doesn't hurt to set it here */
 
 	rb_dlinkAdd(chptr, &chptr->node, &global_channel_list);
@@ -472,6 +547,28 @@ hash_find_resv(const char *name)
 	return NULL;
 }
 
+/* hash_find_resv_key()
+ *
+ * as hash_find_resv(), by folded key
+ */
+struct ConfItem *
+hash_find_resv_key(const struct hash_key *key)
+{
+	struct ConfItem *aconf;
+
+	if(EmptyString(key->name))
+		return NULL;
+
+	aconf = (ConfItem *)hash_key_retrieve(resv_tree, key);
+	if (aconf != NULL)
+	{
+		aconf->port++;
+		return aconf;
+	}
+
+	return NULL;
+}
+
 void
 clear_resv_hash(void)
 {
@@ -184,178 +184,401 @@ hash_text(const char *start)
 	return (h & (ATABLE_SIZE - 1));
 }
 
-/* unsigned long get_hash_mask(const char *)
- * Input: The text to hash.
- * Output: The hash of the string right of the first '.' past the last
- *         wildcard in the string.
+/* const char *get_mask_suffix(const char *)
+ * Input: A host mask.
+ * Output: The part of the mask right of the first '.' past the last
+ *         wildcard, or the whole mask if it has no wildcards.
  * Side-effects: None.
  */
-static unsigned long
-get_mask_hash(const char *text)
+static const char *
+get_mask_suffix(const char *text)
 {
 	const char *hp = "", *p;
 
 	for (p = text + strlen(text) - 1; p >= text; p--)
 		if(*p == '*' || *p == '?')
-			return hash_text(hp);
+			return hp;
 		else if(*p == '.')
 			hp = p + 1;
-	return hash_text(text);
+	return text;
 }
 
-/* struct ConfItem* find_conf_by_address(const char*, struct rb_sockaddr_storage*,
- *         int type, int fam, const char *username)
- * Input: The hostname, the address, the type of mask to find, the address
- *        family, the username.
- * Output: The matching value with the highest precedence.
- * Side-effects: None
- * Note: Setting bit 0 of the type means that the username is ignored.
+/* unsigned long get_hash_mask(const char *)
+ * Input: The text to hash.
+ * Output: The hash of the mask's literal suffix, see get_mask_suffix().
+ * Side-effects: None.
  */
-struct ConfItem *
-find_conf_by_address(const char *name, const char *sockhost,
-			const char *orighost,
-			struct sockaddr *addr, int type, int fam,
-			const char *username, const char *auth_user)
+static unsigned long
+get_mask_hash(const char *text)
 {
-	unsigned long hprecv = 0;
-	struct ConfItem *hprec = NULL;
-	struct AddressRec *arec;
-	int b;
+	return hash_text(get_mask_suffix(text));
+}
 
-	if(username == NULL)
-		username = "";
+/*
+ * The hash table above is only used to enumerate and delete records.
+ * find_conf_by_address() instead looks in a per-type index:
+ *
+ *  - IP masks hang off a patricia trie per address family, so every
+ *    covering prefix of any length is found on the path to the most
+ *    specific one.
+ *  - host masks hang off a trie of case folded labels, keyed right to
+ *    left on the literal suffix of the mask.  A host visits one node per
+ *    label; masks with no literal suffix ("*", "1.2.3.*") sit at the root.
+ *
+ * Each node's list is kept in descending precedence (records are appended
+ * and precedence only ever decreases), so a scan stops at the first record
+ * that could not beat the best match so far.
+ */
+struct hostmask_node
+{
+	struct hostmask_node *parent;
+	std::string label;
+	std::map<std::string, struct hostmask_node *> children;
+	rb_dlink_list recs;
+};
 
-	if(addr)
-	{
-		/* Check for IPV6 matches... */
+struct address_index
+{
+	rb_patricia_tree_t *ip4;
 #ifdef RB_IPV6
-		if(fam == AF_INET6)
+	rb_patricia_tree_t *ip6;
+#endif
+	struct hostmask_node hosts;
+};
+
+static std::map<int, struct address_index> aindex;
+
+/* fold_label()
+ *
+ * input	- pointer to a label and its length
+ * output	- the label, lowercased with irctolower()
+ * side effects - none
+ */
+static std::string
+fold_label(const char *label, size_t len)
+{
+	std::string folded(label, len);
+
+	for(auto &c : folded)
+		c = irctolower(c);
+
+	return folded;
+}
+
+/* index_address_rec()
+ *
+ * input	- address record, the mask it was parsed from
+ * output	- none
+ * side effects - record is appended to the lookup index for its type
+ */
+static void
+index_address_rec(struct AddressRec *arec, const char *address)
+{
+	struct address_index &idx = aindex[arec->type];
+
+	arec->pnode = NULL;
+	arec->hnode = NULL;
+
+	if(arec->masktype == HM_HOST)
+	{
+		struct hostmask_node *node = &idx.hosts;
+		const char *suffix = get_mask_suffix(address);
+		const char *end = suffix + strlen(suffix);
+
+		/* labels right to left, exactly as find_host_conf() walks them */
+		while(*suffix != '\0')
 		{
+			const char *p = end;
 
-			for (b = 128; b >= 0; b -= 16)
+			while(p > suffix && p[-1] != '.')
+				p--;
+
+			std::string label = fold_label(p, end - p);
+			auto it = node->children.find(label);
+			if(it == node->children.end())
 			{
-				for (arec = atable[hash_ipv6(addr, b)]; arec; arec = arec->next)
-					if(arec->type == (type & ~0x1) &&
-					   arec->masktype == HM_IPV6 &&
-					   comp_with_mask_sock(addr, (struct sockaddr *)&arec->Mask.ipa.addr,
-						arec->Mask.ipa.bits) &&
-						(type & 0x1 || match(arec-> username, username)) &&
-						(type != CONF_CLIENT || !arec->auth_user ||
-						(auth_user && match(arec->auth_user, auth_user))) &&
-						arec->precedence > hprecv)
-					{
-						hprecv = arec->precedence;
-						hprec = arec->aconf;
-					}
+				struct hostmask_node *child = new hostmask_node();
+
+				child->parent = node;
+				child->label = label;
+				it = node->children.emplace(label, child).first;
 			}
+			node = it->second;
+
+			if(p == suffix)
+				break;
+
+			end = p - 1;
 		}
+
+		arec->hnode = node;
+		arec->ilist = &node->recs;
+	}
+	else
+	{
+		rb_patricia_tree_t **tree;
+
+#ifdef RB_IPV6
+		if(arec->masktype == HM_IPV6)
+			tree = &idx.ip6;
 		else
 #endif
-		if(fam == AF_INET)
+			tree = &idx.ip4;
+
+		if(*tree == NULL)
+			*tree = rb_new_patricia(arec->masktype == HM_IPV4 ? 32 : 128);
+
+		arec->pnode = make_and_lookup_ip(*tree, (struct sockaddr *)&arec->Mask.ipa.addr,
+						 arec->Mask.ipa.bits);
+		if(arec->pnode == NULL)
 		{
-			for (b = 32; b >= 0; b -= 8)
-			{
-				for (arec = atable[hash_ipv4(addr, b)]; arec; arec = arec->next)
-					if(arec->type == (type & ~0x1) &&
-					   arec->masktype == HM_IPV4 &&
-					   comp_with_mask_sock(addr, (struct sockaddr *)&arec->Mask.ipa.addr,
-							       arec->Mask.ipa.bits) &&
-						(type & 0x1 || match(arec->username, username)) &&
-						(type != CONF_CLIENT || !arec->auth_user ||
-						(auth_user && match(arec->auth_user, auth_user))) &&
-						arec->precedence > hprecv)
-					{
-						hprecv = arec->precedence;
-						hprec = arec->aconf;
-					}
-			}
+			arec->ilist = NULL;
+			return;
 		}
+
+		if(arec->pnode->data == NULL)
+			arec->pnode->data = rb_malloc(sizeof(rb_dlink_list));
+		arec->ilist = (rb_dlink_list *)arec->pnode->data;
 	}
 
-	if(orighost != NULL)
-	{
-		const char *p;
+	rb_dlinkAddTail(arec, &arec->inode, arec->ilist);
+}
 
-		for (p = orighost; p != NULL;)
+/* unindex_address_rec()
+ *
+ * input	- address record
+ * output	- none
+ * side effects - record is removed from the lookup index, and any trie
+ *		  node left empty is released
+ */
+static void
+unindex_address_rec(struct AddressRec *arec)
+{
+	struct address_index &idx = aindex[arec->type];
+
+	if(arec->ilist == NULL)
+		return;
+
+	rb_dlinkDelete(&arec->inode, arec->ilist);
+
+	if(arec->pnode != NULL)
+	{
+		if(rb_dlink_list_length(arec->ilist) == 0)
 		{
-			for (arec = atable[hash_text(p)]; arec; arec = arec->next)
-
-				if((arec->type == (type & ~0x1)) &&
-				   (arec->masktype == HM_HOST) &&
-				   arec->precedence > hprecv &&
-				   match(arec->Mask.hostname, orighost) &&
-				   (type != CONF_CLIENT || !arec->auth_user ||
-				   (auth_user && match(arec->auth_user, auth_user))) &&
-				   (type & 0x1 || match(arec->username, username)))
-				{
-					hprecv = arec->precedence;
-					hprec = arec->aconf;
-				}
-			p = strchr(p, '.');
-			if(p != NULL)
-				p++;
+			rb_patricia_tree_t *tree;
+
+#ifdef RB_IPV6
+			if(arec->masktype == HM_IPV6)
+				tree = idx.ip6;
 			else
-				break;
+#endif
+				tree = idx.ip4;
+
+			rb_free(arec->pnode->data);
+			arec->pnode->data = NULL;
+			rb_patricia_remove(tree, arec->pnode);
 		}
-		for (arec = atable[0]; arec; arec = arec->next)
+	}
+	else
+	{
+		struct hostmask_node *node = arec->hnode;
+
+		while(node->parent != NULL && node->children.empty() &&
+		      rb_dlink_list_length(&node->recs) == 0)
 		{
-			if(arec->type == (type & ~0x1) &&
-			   arec->masktype == HM_HOST &&
-			   arec->precedence > hprecv &&
-			   (match(arec->Mask.hostname, orighost) ||
-			    (sockhost && match(arec->Mask.hostname, sockhost))) &&
-			    (type != CONF_CLIENT || !arec->auth_user ||
-			    (auth_user && match(arec->auth_user, auth_user))) &&
-			   (type & 0x1 || match(arec->username, username)))
-			{
-				hprecv = arec->precedence;
-				hprec = arec->aconf;
-			}
+			struct hostmask_node *parent = node->parent;
+
+			parent->children.erase(node->label);
+			delete node;
+			node = parent;
 		}
 	}
 
-	if(name != NULL)
+	arec->ilist = NULL;
+	arec->pnode = NULL;
+	arec->hnode = NULL;
+}
+
+/* address_rec_matches()
+ *
+ * input	- address record, lookup type, username, auth username
+ * output	- whether the user and auth user parts of the record match
+ * side effects - none
+ */
+static inline bool
+address_rec_matches(struct AddressRec *arec, int type,
+		const char *username, const char *auth_user)
+{
+	return (type & 0x1 || match(arec->username, username)) &&
+	       (type != CONF_CLIENT || !arec->auth_user ||
+		(auth_user && match(arec->auth_user, auth_user)));
+}
+
+/* find_ip_conf()
+ *
+ * input	- patricia tree, address, lookup type, username, auth username,
+ *		  best match so far
+ * output	- none
+ * side effects - best match is updated from every prefix covering addr
+ */
+static void
+find_ip_conf(rb_patricia_tree_t *tree, struct sockaddr *addr, int type,
+		const char *username, const char *auth_user,
+		struct AddressRec **best)
+{
+	rb_patricia_node_t *pnode;
+	rb_dlink_node *ptr;
+	void *ipptr;
+
+	if(tree == NULL)
+		return;
+
+#ifdef RB_IPV6
+	if(addr->sa_family == AF_INET6)
+		ipptr = &((struct sockaddr_in6 *)(void *)addr)->sin6_addr;
+	else
+#endif
+		ipptr = &((struct sockaddr_in *)(void *)addr)->sin_addr;
+
+	for(pnode = rb_match_ip(tree, addr); pnode != NULL; pnode = pnode->parent)
 	{
-		const char *p;
-		/* And yes - we have to check p after strchr and p after increment for
-		 * NULL -kre */
-		for (p = name; p != NULL;)
+		if(pnode->prefix == NULL || pnode->data == NULL)
+			continue;
+
+		if(!comp_with_mask(rb_prefix_touchar(pnode->prefix), ipptr, pnode->prefix->bitlen))
+			continue;
+
+		RB_DLINK_FOREACH(ptr, ((rb_dlink_list *)pnode->data)->head)
 		{
-			for (arec = atable[hash_text(p)]; arec; arec = arec->next)
-				if((arec->type == (type & ~0x1)) &&
-				   (arec->masktype == HM_HOST) &&
-				   arec->precedence > hprecv &&
-				   match(arec->Mask.hostname, name) &&
-				   (type != CONF_CLIENT || !arec->auth_user ||
-				   (auth_user && match(arec->auth_user, auth_user))) &&
-				   (type & 0x1 || match(arec->username, username)))
-				{
-					hprecv = arec->precedence;
-					hprec = arec->aconf;
-				}
-			p = strchr(p, '.');
-			if(p != NULL)
-				p++;
-			else
+			struct AddressRec *arec = (struct AddressRec *)ptr->data;
+
+			if(*best != NULL && arec->precedence <= (*best)->precedence)
 				break;
-		}
-		for (arec = atable[0]; arec; arec = arec->next)
-		{
-			if(arec->type == (type & ~0x1) &&
-			   arec->masktype == HM_HOST &&
-			   arec->precedence > hprecv &&
-			   (match(arec->Mask.hostname, name) ||
-			    (sockhost && match(arec->Mask.hostname, sockhost))) &&
-			    (type != CONF_CLIENT || !arec->auth_user ||
-			    (auth_user && match(arec->auth_user, auth_user))) &&
-			   (type & 0x1 || match(arec->username, username)))
+
+			if(address_rec_matches(arec, type, username, auth_user))
 			{
-				hprecv = arec->precedence;
-				hprec = arec->aconf;
+				*best = arec;
+				break;
 			}
 		}
 	}
-	return hprec;
+}
+
+/* find_host_conf_list()
+ *
+ * input	- list of host records at one trie node, host, sockhost (or
+ *		  NULL), lookup type, username, auth username, best match so far
+ * output	- none
+ * side effects - best match is updated from the list
+ */
+static void
+find_host_conf_list(rb_dlink_list *list, const char *host, const char *sockhost,
+		int type, const char *username, const char *auth_user,
+		struct AddressRec **best)
+{
+	rb_dlink_node *ptr;
+
+	RB_DLINK_FOREACH(ptr, list->head)
+	{
+		struct AddressRec *arec = (struct AddressRec *)ptr->data;
+
+		if(*best != NULL && arec->precedence <= (*best)->precedence)
+			break;
+
+		if((match(arec->Mask.hostname, host) ||
+		    (sockhost && match(arec->Mask.hostname, sockhost))) &&
+		   address_rec_matches(arec, type, username, auth_user))
+		{
+			*best = arec;
+			break;
+		}
+	}
+}
+
+/* find_host_conf()
+ *
+ * input	- host label trie, host, sockhost (or NULL), lookup type,
+ *		  username, auth username, best match so far
+ * output	- none
+ * side effects - best match is updated from every node whose suffix the
+ *		  host ends in.  sockhost is only tried against masks with
+ *		  no literal suffix.
+ */
+static void
+find_host_conf(struct hostmask_node *root, const char *host, const char *sockhost,
+		int type, const char *username, const char *auth_user,
+		struct AddressRec **best)
+{
+	struct hostmask_node *node = root;
+	const char *end = host + strlen(host);
+
+	find_host_conf_list(&root->recs, host, sockhost, type, username, auth_user, best);
+
+	while(*host != '\0')
+	{
+		const char *p = end;
+
+		while(p > host && p[-1] != '.')
+			p--;
+
+		auto it = node->children.find(fold_label(p, end - p));
+		if(it == node->children.end())
+			return;
+
+		node = it->second;
+		find_host_conf_list(&node->recs, host, NULL, type, username, auth_user, best);
+
+		if(p == host)
+			return;
+
+		end = p - 1;
+	}
+}
+
+/* struct ConfItem* find_conf_by_address(const char*, struct rb_sockaddr_storage*,
+ *         int type, int fam, const char *username)
+ * Input: The hostname, the address, the type of mask to find, the address
+ *        family, the username.
+ * Output: The matching value with the highest precedence.
+ * Side-effects: None
+ * Note: Setting bit 0 of the type means that the username is ignored.
+ */
+struct ConfItem *
+find_conf_by_address(const char *name, const char *sockhost,
+			const char *orighost,
+			struct sockaddr *addr, int type, int fam,
+			const char *username, const char *auth_user)
+{
+	struct AddressRec *best = NULL;
+
+	if(username == NULL)
+		username = "";
+
+	auto it = aindex.find(type & ~0x1);
+	if(it == aindex.end())
+		return NULL;
+
+	struct address_index &idx = it->second;
+
+	if(addr)
+	{
+		/* Check for IPV6 matches... */
+#ifdef RB_IPV6
+		if(fam == AF_INET6)
+			find_ip_conf(idx.ip6, addr, type, username, auth_user, &best);
+		else
+#endif
+		if(fam == AF_INET)
+			find_ip_conf(idx.ip4, addr, type, username, auth_user, &best);
+	}
+
+	if(orighost != NULL)
+		find_host_conf(&idx.hosts, orighost, sockhost, type, username, auth_user, &best);
+
+	if(name != NULL)
+		find_host_conf(&idx.hosts, name, sockhost, type, username, auth_user, &best);
+
+	return best != NULL ? best->aconf : NULL;
 }
 
 /* struct ConfItem* find_address_conf(const char*, const char*,
@@ -570,6 +793,7 @@ add_conf_by_address(const char *address, int type, const char *username, const c
 	arec->aconf = aconf;
 	arec->precedence = prec_value--;
 	arec->type = type;
+	index_address_rec(arec, address);
 }
 
 /* void delete_one_address(const char*, struct ConfItem*)
@@ -611,6 +835,7 @@ delete_one_address_conf(const char *address, struct ConfItem *aconf)
 				arecl->next = arec->next;
 			else
 				atable[hv] = arec->next;
+			unindex_address_rec(arec);
 			aconf->status |= CONF_ILLEGAL;
 			if(!aconf->clients)
 				free_conf(aconf);
@@ -651,6 +876,7 @@ clear_out_address_conf(void)
 			}
 			else
 			{
+				unindex_address_rec(arec);
 				arec->aconf->status |= CONF_ILLEGAL;
 				if(!arec->aconf->clients)
 					free_conf(arec->aconf);
@@ -684,6 +910,7 @@ clear_out_address_conf_bans(void)
 			}
 			else
 			{
+				unindex_address_rec(arec);
 				arec->aconf->status |= CONF_ILLEGAL;
 				if(!arec->aconf->clients)
 					free_conf(arec->aconf);
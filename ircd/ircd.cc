@@ -62,6 +62,7 @@
 #include <ircd/bandbi.h>
 #include <ircd/authproc.h>
 #include <ircd/operhash.h>
+#include <ircd/userindex.h>
 
 namespace ircd {
 
@@ -648,6 +649,7 @@ charybdis_main(int argc, char * const argv[])
 			make_daemon();
 		inotice("starting %s ...", ircd_version);
 		inotice("%s", rb_lib_version());
+		inotice("scanning with the %s kernel", rb_scan_kernel());
 	}
 
 	/* Init the event subsystem */
@@ -674,6 +676,7 @@ charybdis_main(int argc, char * const argv[])
 	initclass();
 	whowas_init();
 	init_reject();
+	init_userindex();
 	init_cache();
 	init_monitor();
 	chmode_init();
@@ -37,6 +37,7 @@
 #include <ircd/hostmask.h>
 #include <ircd/sslproc.h>
 #include <ircd/wsproc.h>
+#include <ircd/packet.h>
 #include <ircd/hash.h>
 #include <ircd/s_assert.h>
 #include <ircd/logger.h>
@@ -314,7 +315,7 @@ find_listener(struct rb_sockaddr_storage *addr)
  * the format "255.255.255.255"
  */
 void
-add_listener(int port, const char *vhost_ip, int family, int ssl, int defer_accept, int wsock)
+add_listener(int port, const char *vhost_ip, int family, int ssl, int defer_accept, int wsock, int ring_recvq)
 {
 	struct Listener *listener;
 	struct rb_sockaddr_storage vaddr;
@@ -391,6 +392,7 @@ add_listener(int port, const char *vhost_ip, int family, int ssl, int defer_acce
 	listener->ssl = ssl;
 	listener->defer_accept = defer_accept;
 	listener->wsock = wsock;
+	listener->ring_recvq = ring_recvq;
 
 	if(inetport(listener))
 		listener->active = 1;
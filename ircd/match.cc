@@ -24,6 +24,11 @@
 #include <ircd/match.h>
 #include <ircd/s_assert.h>
 
+#if defined(__SSE2__) && !defined(__SANITIZE_ADDRESS__)
+#include <emmintrin.h>
+#define MATCH_FOLD_SSE2 1
+#endif
+
 namespace ircd {
 
 /*
@@ -551,6 +556,64 @@ char *collapse_esc(char *pattern)
 	return pattern;
 }
 
+/*
+ * Under rfc1459 casemapping, irctoupper() is exactly "subtract 0x20 from
+ * anything in 0x61 ('a') .. 0x7e ('~')", which lets sixteen bytes be
+ * folded at once with SSE2.
+ *
+ * irccmp() does not know the lengths of its strings, so it reads sixteen
+ * bytes at a time as long as neither read can cross into the next page,
+ * and goes a byte at a time near page ends.  The over-read can never
+ * fault, but it is disabled for address sanitizer builds.
+ */
+#ifdef MATCH_FOLD_SSE2
+#define FOLD_PAGE_OK(p)	(((uintptr_t)(p) & 4095) <= 4096 - 16)
+
+static inline __m128i
+fold_sse2(__m128i v)
+{
+	const __m128i lo = _mm_set1_epi8(0x61);
+	const __m128i span = _mm_set1_epi8(0x7e - 0x61);
+	const __m128i bit = _mm_set1_epi8(0x20);
+	__m128i t = _mm_sub_epi8(v, lo);
+	__m128i in = _mm_cmpeq_epi8(_mm_min_epu8(t, span), t);
+
+	return _mm_sub_epi8(v, _mm_and_si128(in, bit));
+}
+
+/* bitmask of the first sixteen bytes where s1 and s2 fold differently
+ * or s1 has its terminating NUL
+ */
+static inline unsigned int
+fold_stop_sse2(const unsigned char *s1, const unsigned char *s2)
+{
+	__m128i a = _mm_loadu_si128((const __m128i *)(const void *)s1);
+	__m128i b = _mm_loadu_si128((const __m128i *)(const void *)s2);
+	unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(fold_sse2(a), fold_sse2(b)));
+	unsigned int nul = _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128()));
+
+	return (~eq & 0xffff) | nul;
+}
+#endif
+
+/*
+ * irccasefold - rfc1459 fold len bytes of src into dst, which may be
+ * the same buffer.
+ */
+void
+irccasefold(char *dst, const char *src, size_t len)
+{
+#ifdef MATCH_FOLD_SSE2
+	for (; len >= 16; len -= 16, src += 16, dst += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(const void *)src);
+		_mm_storeu_si128((__m128i *)(void *)dst, fold_sse2(v));
+	}
+#endif
+	for (; len > 0; len--)
+		*dst++ = irctoupper(*src++);
+}
+
 /*
  * irccmp - case insensitive comparison of two 0 terminated strings.
  *
@@ -567,14 +630,32 @@ int irccmp(const char *s1, const char *s2)
 	s_assert(s1 != NULL);
 	s_assert(s2 != NULL);
 
-	while ((res = irctoupper(*str1) - irctoupper(*str2)) == 0)
+	for (;;)
 	{
+#ifdef MATCH_FOLD_SSE2
+		if (FOLD_PAGE_OK(str1) && FOLD_PAGE_OK(str2))
+		{
+			unsigned int stop = fold_stop_sse2(str1, str2);
+
+			if (stop == 0)
+			{
+				str1 += 16;
+				str2 += 16;
+				continue;
+			}
+
+			str1 += __builtin_ctz(stop);
+			str2 += __builtin_ctz(stop);
+			return irctoupper(*str1) - irctoupper(*str2);
+		}
+#endif
+		if ((res = irctoupper(*str1) - irctoupper(*str2)) != 0)
+			return (res);
 		if (*str1 == '\0')
 			return 0;
 		str1++;
 		str2++;
 	}
-	return (res);
 }
 
 int ircncmp(const char *s1, const char *s2, int n)
@@ -585,15 +666,44 @@ int ircncmp(const char *s1, const char *s2, int n)
 	s_assert(s1 != NULL);
 	s_assert(s2 != NULL);
 
-	while ((res = irctoupper(*str1) - irctoupper(*str2)) == 0)
+	/* n <= 0 never runs out, so it compares like irccmp() */
+	if (n <= 0)
+		return irccmp(s1, s2);
+
+	for (;;)
 	{
+#ifdef MATCH_FOLD_SSE2
+		if (FOLD_PAGE_OK(str1) && FOLD_PAGE_OK(str2))
+		{
+			unsigned int stop = fold_stop_sse2(str1, str2);
+
+			if (n < 16)
+				stop &= (1U << n) - 1;
+
+			if (stop == 0)
+			{
+				if (n <= 16)
+					return 0;
+
+				str1 += 16;
+				str2 += 16;
+				n -= 16;
+				continue;
+			}
+
+			str1 += __builtin_ctz(stop);
+			str2 += __builtin_ctz(stop);
+			return irctoupper(*str1) - irctoupper(*str2);
+		}
+#endif
+		if ((res = irctoupper(*str1) - irctoupper(*str2)) != 0)
+			return (res);
 		str1++;
 		str2++;
 		n--;
-		if (n == 0 || (*str1 == '\0' && *str2 == '\0'))
+		if (n == 0 || (str1[-1] == '\0'))
 			return 0;
 	}
-	return (res);
 }
 
 const unsigned char irctolower_tab[] = {
@@ -47,37 +47,38 @@ msgbuf_parse(struct MsgBuf *msgbuf, char *line)
 	{
 		char *t = ch + 1;
 
-		ch = strchr(ch, ' ');
-		if (ch != NULL)
+		ch = rb_strchr2(ch, ' ', ' ');
+		if (*ch != '\0')
 		{
+			/* end the tag section first, so the delimiter scans
+			 * below cannot run on into the message itself */
+			*ch++ = '\0';
+
 			while (1)
 			{
-				char *next = strchr(t, ';');
-				char *eq = strchr(t, '=');
+				char *next = rb_strchr2(t, ';', '=');
+				char *eq = NULL;
 
-				if (next != NULL)
+				if (*next == '=')
 				{
+					eq = next + 1;
 					*next = '\0';
-
-					if (eq > next)
-						eq = NULL;
+					next = rb_strchr2(eq, ';', ';');
 				}
 
-				if (eq != NULL)
-					*eq++ = '\0';
+				bool last = *next == '\0';
+				*next = '\0';
 
-				if (*t && *t != ' ')
+				if (*t)
 					msgbuf_append_tag(msgbuf, t, eq, 0);
 				else
 					break;
 
-				if (next != NULL)
-					t = next + 1;
-				else
+				if (last)
 					break;
-			}
 
-			*ch++ = '\0';
+				t = next + 1;
+			}
 		}
 	}
 
@@ -90,8 +91,8 @@ msgbuf_parse(struct MsgBuf *msgbuf, char *line)
 		ch++;
 		msgbuf->origin = ch;
 
-		char *end = strchr(ch, ' ');
-		if (end == NULL)
+		char *end = rb_strchr2(ch, ' ', ' ');
+		if (*end == '\0')
 			return 1;
 
 		*end = '\0';
@@ -132,7 +133,8 @@ msgbuf_unparse_tags(char *buf, size_t buflen, struct MsgBuf *msgbuf, unsigned in
 	if (!msgbuf_has_matching_tags(msgbuf, capmask))
 		return;
 
-	*buf = '@';
+	buf[0] = '@';
+	buf[1] = '\0';
 
 	for (size_t i = 0; i < msgbuf->n_tags; i++)
 	{
@@ -158,7 +160,7 @@ msgbuf_unparse_tags(char *buf, size_t buflen, struct MsgBuf *msgbuf, unsigned in
 void
 msgbuf_unparse_prefix(char *buf, size_t buflen, struct MsgBuf *msgbuf, unsigned int capmask)
 {
-	memset(buf, 0, buflen);
+	*buf = '\0';
 
 	if (msgbuf->n_tags > 0)
 		msgbuf_unparse_tags(buf, buflen, msgbuf, capmask);
@@ -35,6 +35,7 @@ namespace ircd {
 
 static int yy_defer_accept = 1;
 static int yy_wsock = 0;
+static int yy_ring_recvq = 0;
 
 struct TopConf *conf_cur_block;
 static char *conf_cur_block_name = NULL;
@@ -844,6 +845,7 @@ conf_begin_listen(struct TopConf *tc)
 	rb_free(listener_address);
 	listener_address = NULL;
 	yy_wsock = 0;
+	yy_ring_recvq = 0;
 	yy_defer_accept = 0;
 	return 0;
 }
@@ -854,6 +856,7 @@ conf_end_listen(struct TopConf *tc)
 	rb_free(listener_address);
 	listener_address = NULL;
 	yy_wsock = 0;
+	yy_ring_recvq = 0;
 	yy_defer_accept = 0;
 	return 0;
 }
@@ -870,6 +873,12 @@ conf_set_listen_wsock(void *data)
 	yy_wsock = *(unsigned int *) data;
 }
 
+static void
+conf_set_listen_ring_recvq(void *data)
+{
+	yy_ring_recvq = *(unsigned int *) data;
+}
+
 static void
 conf_set_listen_port_both(void *data, int ssl)
 {
@@ -889,9 +898,9 @@ conf_set_listen_port_both(void *data, int ssl)
 				conf_report_warning("listener 'ANY/%d': support for plaintext listeners may be removed in a future release per RFCs 7194 & 7258.  "
                                                     "It is suggested that users be migrated to SSL/TLS connections.", args->v.number);
 			}
-			add_listener(args->v.number, listener_address, AF_INET, ssl, ssl || yy_defer_accept, yy_wsock);
+			add_listener(args->v.number, listener_address, AF_INET, ssl, ssl || yy_defer_accept, yy_wsock, yy_ring_recvq);
 #ifdef RB_IPV6
-			add_listener(args->v.number, listener_address, AF_INET6, ssl, ssl || yy_defer_accept, yy_wsock);
+			add_listener(args->v.number, listener_address, AF_INET6, ssl, ssl || yy_defer_accept, yy_wsock, yy_ring_recvq);
 #endif
                 }
 		else
@@ -910,7 +919,7 @@ conf_set_listen_port_both(void *data, int ssl)
                                                     "It is suggested that users be migrated to SSL/TLS connections.", listener_address, args->v.number);
 			}
 
-			add_listener(args->v.number, listener_address, family, ssl, ssl || yy_defer_accept, yy_wsock);
+			add_listener(args->v.number, listener_address, family, ssl, ssl || yy_defer_accept, yy_wsock, yy_ring_recvq);
                 }
 	}
 }
@@ -2635,6 +2644,7 @@ static struct ConfEntry conf_serverinfo_table[] =
 	{ "ssl_cert",           CF_QSTRING, NULL, 0, &ServerInfo.ssl_cert },
 	{ "ssl_dh_params",      CF_QSTRING, NULL, 0, &ServerInfo.ssl_dh_params },
 	{ "ssl_cipher_list",	CF_QSTRING, NULL, 0, &ServerInfo.ssl_cipher_list },
+	{ "ssl_ktls",		CF_YESNO,   NULL, 0, &ServerInfo.ssl_ktls },
 	{ "ssld_count",		CF_INT,	    NULL, 0, &ServerInfo.ssld_count },
 
 	{ "default_max_clients",CF_INT,     NULL, 0, &ServerInfo.default_max_clients },
@@ -2769,6 +2779,11 @@ static struct ConfEntry conf_general_table[] =
 	{ "default_floodcount", CF_INT,   NULL, 0, &ConfigFileEntry.default_floodcount	},
 	{ "default_ident_timeout",	CF_INT, NULL, 0, &ConfigFileEntry.default_ident_timeout		},
 	{ "disable_auth",	CF_YESNO, NULL, 0, &ConfigFileEntry.disable_auth	},
+	{ "dns_cache_size",	CF_INT,   NULL, 0, &ConfigFileEntry.dns_cache_size	},
+	{ "dns_cache_max_ttl",	CF_TIME,  NULL, 0, &ConfigFileEntry.dns_cache_max_ttl	},
+	{ "dns_cache_negative_ttl",	CF_TIME,  NULL, 0, &ConfigFileEntry.dns_cache_negative_ttl	},
+	{ "blacklist_cache_ttl",	CF_TIME,  NULL, 0, &ConfigFileEntry.blacklist_cache_ttl	},
+	{ "blacklist_cache_negative_ttl",	CF_TIME,  NULL, 0, &ConfigFileEntry.blacklist_cache_negative_ttl	},
 	{ "dots_in_ident",	CF_INT,   NULL, 0, &ConfigFileEntry.dots_in_ident	},
 	{ "failed_oper_notice",	CF_YESNO, NULL, 0, &ConfigFileEntry.failed_oper_notice	},
 	{ "global_snotices",	CF_YESNO, NULL, 0, &ConfigFileEntry.global_snotices	},
@@ -2874,6 +2889,7 @@ newconf_init()
 	add_top_conf("listen", conf_begin_listen, conf_end_listen, NULL);
 	add_conf_item("listen", "defer_accept", CF_YESNO, conf_set_listen_defer_accept);
 	add_conf_item("listen", "wsock", CF_YESNO, conf_set_listen_wsock);
+	add_conf_item("listen", "ring_recvq", CF_YESNO, conf_set_listen_ring_recvq);
 	add_conf_item("listen", "port", CF_INT | CF_FLIST, conf_set_listen_port);
 	add_conf_item("listen", "sslport", CF_INT | CF_FLIST, conf_set_listen_sslport);
 	add_conf_item("listen", "ip", CF_QSTRING, conf_set_listen_address);
@@ -38,6 +38,378 @@ namespace ircd {
 static char readBuf[READBUF_SIZE];
 static void client_dopacket(struct Client *client_p, char *buffer, size_t length);
 
+/*
+ * Clients whose flood limit left complete lines in their recvq wait on a
+ * hashed wheel of one second slots, in the slot for their flood_wakeup.
+ * flood_recalc() only visits the slots for the seconds that have passed,
+ * so clients with nothing queued cost nothing per tick.  Wakeups more
+ * than a lap away stay in their slot until their second comes round.
+ */
+#define FLOOD_WHEEL_SIZE	64	/* power of two */
+
+static rb_dlink_list flood_wheel[FLOOD_WHEEL_SIZE];
+static time_t flood_wheel_time;
+
+/* flood_dequeue()
+ *
+ * input	- client
+ * output	- none
+ * side effects - client is taken off the flood wheel, if it was on it
+ */
+void
+flood_dequeue(struct Client *client_p)
+{
+	struct LocalUser *lclient_p = client_p->localClient;
+
+	if(lclient_p == NULL || lclient_p->flood_wakeup == 0)
+		return;
+
+	rb_dlinkDelete(&lclient_p->flood_node,
+		       &flood_wheel[lclient_p->flood_wakeup & (FLOOD_WHEEL_SIZE - 1)]);
+	lclient_p->flood_wakeup = 0;
+}
+
+/* flood_enqueue()
+ *
+ * input	- client, seconds until it may parse again
+ * output	- none
+ * side effects - client is (re)placed on the flood wheel
+ */
+static void
+flood_enqueue(struct Client *client_p, time_t delay)
+{
+	struct LocalUser *lclient_p = client_p->localClient;
+	time_t wakeup = rb_current_time() + (delay > 0 ? delay : 1);
+
+	if(lclient_p->flood_wakeup == wakeup)
+		return;
+
+	flood_dequeue(client_p);
+	lclient_p->flood_wakeup = wakeup;
+	rb_dlinkAddTail(client_p, &lclient_p->flood_node,
+			&flood_wheel[wakeup & (FLOOD_WHEEL_SIZE - 1)]);
+}
+
+/* flood_decay()
+ *
+ * input	- client
+ * output	- none
+ * side effects - sent_parsed is decayed for every second since it was
+ *		  last decayed: by one for unknowns, by client_flood_message_num
+ *		  for clients, and reset for clients still in their grace period
+ */
+static void
+flood_decay(struct Client *client_p)
+{
+	struct LocalUser *lclient_p = client_p->localClient;
+	time_t elapsed = rb_current_time() - lclient_p->flood_time;
+	time_t decay;
+
+	if(elapsed <= 0)
+		return;
+
+	lclient_p->flood_time = rb_current_time();
+
+	if(IsUnknown(client_p))
+		decay = elapsed;
+	else if(IsClient(client_p) && IsFloodDone(client_p))
+		decay = elapsed * ConfigFileEntry.client_flood_message_num;
+	else
+		decay = lclient_p->sent_parsed;
+
+	if(decay >= lclient_p->sent_parsed)
+		lclient_p->sent_parsed = 0;
+	else if(decay > 0)
+		lclient_p->sent_parsed -= decay;
+}
+
+/*
+ * Users registered through a listener with ring_recvq set read straight into
+ * a contiguous per connection buffer instead of buf_recvq.  Lines are
+ * delimited as they arrive and handed to parse() where they lie, so they
+ * are never copied into buf_line_t objects and back out into readBuf.
+ * Parsed data is compacted away before a read rather than wrapped round,
+ * which keeps every line contiguous for msgbuf_parse().
+ *
+ * As with buf_recvq, runs of CR/LF are collapsed, no empty lines are
+ * queued and lines are cut at BUF_DATA_SIZE - 1 bytes.  That is lossy, so
+ * a connection only moves onto the ring once it has registered as a user;
+ * until then it may yet become a server, whose bytes must be kept exactly
+ * for the ziplinks handoff.
+ */
+#define RECV_RING_MIN	2048
+#define RECV_RING_READ	512	/* least free space worth reading into */
+
+static void recv_ring_reserve(struct RecvRing *ring);
+static void recv_ring_scan(struct RecvRing *ring, unsigned int len);
+
+/* recvq_use_ring()
+ *
+ * input	- local client
+ * output	- none
+ * side effects - client's receive queue becomes a RecvRing, and
+ *		  anything still in buf_recvq is moved across
+ */
+void
+recvq_use_ring(struct Client *client_p)
+{
+	struct RecvRing *ring;
+	int len;
+
+	if(client_p->localClient->recv_ring != NULL)
+		return;
+
+	ring = (RecvRing *)rb_malloc(sizeof(struct RecvRing));
+	ring->size = RECV_RING_MIN;
+	ring->buf = (char *)rb_malloc(ring->size);
+	client_p->localClient->recv_ring = ring;
+
+	/* unregistered connections queue raw lines of at most
+	 * BUF_DATA_SIZE - 1 bytes, so each fits in the RECV_RING_READ
+	 * bytes reserved and is delimited afresh, terminators and all
+	 */
+	for(;;)
+	{
+		recv_ring_reserve(ring);
+		len = rb_linebuf_get(&client_p->localClient->buf_recvq, ring->buf + ring->tail,
+				     ring->size - ring->tail, LINEBUF_PARTIAL, LINEBUF_RAW);
+		if(len <= 0)
+			break;
+		recv_ring_scan(ring, len);
+	}
+}
+
+/* recvq_free()
+ *
+ * input	- local client
+ * output	- none
+ * side effects - receive queue is emptied and its memory released
+ */
+void
+recvq_free(struct Client *client_p)
+{
+	struct RecvRing *ring = client_p->localClient->recv_ring;
+
+	rb_linebuf_donebuf(&client_p->localClient->buf_recvq);
+
+	if(ring == NULL)
+		return;
+
+	rb_free(ring->buf);
+	rb_free(ring);
+	client_p->localClient->recv_ring = NULL;
+}
+
+/* recvq_clear()
+ *
+ * input	- local client
+ * output	- none
+ * side effects - anything in the receive queue is thrown away
+ */
+void
+recvq_clear(struct Client *client_p)
+{
+	struct RecvRing *ring = client_p->localClient->recv_ring;
+
+	rb_linebuf_donebuf(&client_p->localClient->buf_recvq);
+
+	if(ring == NULL)
+		return;
+
+	ring->head = ring->tail = ring->linestart = ring->numlines = 0;
+	ring->skip = false;
+}
+
+/* recvq_length()
+ *
+ * input	- local client
+ * output	- bytes waiting in the receive queue
+ * side effects - none
+ */
+size_t
+recvq_length(struct Client *client_p)
+{
+	struct RecvRing *ring = client_p->localClient->recv_ring;
+
+	if(ring == NULL)
+		return rb_linebuf_len(&client_p->localClient->buf_recvq);
+
+	return ring->tail - ring->head;
+}
+
+/* recvq_take()
+ *
+ * input	- local client, buffer and its size
+ * output	- bytes copied
+ * side effects - receive queue is moved, unparsed, into the buffer
+ */
+size_t
+recvq_take(struct Client *client_p, char *buf, size_t len)
+{
+	struct RecvRing *ring = client_p->localClient->recv_ring;
+	size_t cpylen = 0;
+	int ret;
+
+	if(ring == NULL)
+	{
+		while(cpylen < len &&
+		      (ret = rb_linebuf_get(&client_p->localClient->buf_recvq, buf + cpylen,
+					    len - cpylen, LINEBUF_PARTIAL, LINEBUF_RAW)) > 0)
+			cpylen += ret;
+		return cpylen;
+	}
+
+	cpylen = ring->tail - ring->head;
+	if(cpylen > len)
+		cpylen = len;
+
+	memcpy(buf, ring->buf + ring->head, cpylen);
+	recvq_clear(client_p);
+	return cpylen;
+}
+
+/* recv_ring_reserve()
+ *
+ * input	- ring
+ * output	- none
+ * side effects - parsed data is compacted away, and the ring grown if
+ *		  that still leaves less than RECV_RING_READ free
+ */
+static void
+recv_ring_reserve(struct RecvRing *ring)
+{
+	if(ring->size - ring->tail >= RECV_RING_READ)
+		return;
+
+	if(ring->head > 0)
+	{
+		memmove(ring->buf, ring->buf + ring->head, ring->tail - ring->head);
+		ring->tail -= ring->head;
+		ring->linestart -= ring->head;
+		ring->head = 0;
+	}
+
+	if(ring->size - ring->tail < RECV_RING_READ)
+	{
+		ring->size *= 2;
+		ring->buf = (char *)rb_realloc(ring->buf, ring->size);
+	}
+}
+
+/* recv_ring_scan()
+ *
+ * input	- ring, number of bytes just read in at its tail
+ * output	- none
+ * side effects - the new bytes are delimited into lines in place
+ */
+static void
+recv_ring_scan(struct RecvRing *ring, unsigned int len)
+{
+	char *src = ring->buf + ring->tail;
+	char *end = src + len;
+	char *dst = src;
+	char *linestart = ring->buf + ring->linestart;
+	const char *eol;
+
+	while(src < end)
+	{
+		/* move the run up to the next terminator down in one go */
+		eol = rb_find_eol(src, end - src);
+		size_t n = (eol != NULL ? eol : end) - src;
+
+		if(!ring->skip)
+		{
+			size_t room = BUF_DATA_SIZE - 1 - (dst - linestart);
+
+			if(n > room)
+				ring->skip = true;
+			else
+				room = n;
+
+			memmove(dst, src, room);
+			dst += room;
+		}
+
+		src += n;
+		if(eol == NULL)
+			break;
+
+		/* keep one terminator per non-empty line */
+		if(dst > linestart)
+		{
+			*dst++ = *src;
+			linestart = dst;
+			ring->numlines++;
+		}
+		ring->skip = false;
+		src++;
+	}
+
+	ring->tail = dst - ring->buf;
+	ring->linestart = linestart - ring->buf;
+}
+
+/* recv_ring_get()
+ *
+ * input	- ring, pointer to store the line in
+ * output	- length of the next complete line, 0 if there is none
+ * side effects - the line is NUL terminated in place and dequeued; it
+ *		  stays valid until the next read into the ring
+ */
+static int
+recv_ring_get(struct RecvRing *ring, char **line)
+{
+	char *p, *q;
+
+	if(ring->numlines == 0)
+		return 0;
+
+	p = ring->buf + ring->head;
+	q = p + (rb_find_eol(p, ring->tail - ring->head) - p);
+
+	*q = '\0';
+	ring->numlines--;
+	ring->head = q + 1 - ring->buf;
+
+	if(ring->head == ring->tail)
+		ring->head = ring->tail = ring->linestart = 0;
+
+	*line = p;
+	return q - p;
+}
+
+/* recvq_get()
+ *
+ * input	- local client, pointer to store the line in
+ * output	- length of the next complete line from the receive queue
+ * side effects - the line is dequeued
+ */
+static int
+recvq_get(struct Client *client_p, char **line)
+{
+	if(client_p->localClient->recv_ring != NULL)
+		return recv_ring_get(client_p->localClient->recv_ring, line);
+
+	*line = readBuf;
+	return rb_linebuf_get(&client_p->localClient->buf_recvq, readBuf, READBUF_SIZE,
+			      LINEBUF_COMPLETE, LINEBUF_PARSED);
+}
+
+/* recvq_numlines()
+ *
+ * input	- local client
+ * output	- number of lines waiting in the receive queue
+ * side effects - none
+ */
+static unsigned int
+recvq_numlines(struct Client *client_p)
+{
+	if(client_p->localClient->recv_ring != NULL)
+		return client_p->localClient->recv_ring->numlines;
+
+	return rb_linebuf_numlines(&client_p->localClient->buf_recvq);
+}
+
 /*
  * parse_client_queued - parse client queued messages
  */
@@ -46,26 +418,32 @@ parse_client_queued(struct Client *client_p)
 {
 	int dolen = 0;
 	int allow_read;
+	char *line;
 
 	if(IsAnyDead(client_p))
 		return;
 
+	flood_decay(client_p);
+
 	if(IsUnknown(client_p))
 	{
 		allow_read = ConfigFileEntry.client_flood_burst_max;
 		for (;;)
 		{
 			if(client_p->localClient->sent_parsed >= allow_read)
+			{
+				/* one more line per second */
+				if(recvq_numlines(client_p) > 0)
+					flood_enqueue(client_p, client_p->localClient->sent_parsed - allow_read + 1);
 				break;
+			}
 
-			dolen = rb_linebuf_get(&client_p->localClient->
-					    buf_recvq, readBuf, READBUF_SIZE,
-					    LINEBUF_COMPLETE, LINEBUF_PARSED);
+			dolen = recvq_get(client_p, &line);
 
 			if(dolen <= 0 || IsDead(client_p))
 				break;
 
-			client_dopacket(client_p, readBuf, dolen);
+			client_dopacket(client_p, line, dolen);
 			client_p->localClient->sent_parsed++;
 
 			/* He's dead cap'n */
@@ -93,11 +471,11 @@ parse_client_queued(struct Client *client_p)
 
 	if(IsAnyServer(client_p) || IsExemptFlood(client_p))
 	{
-		while (!IsAnyDead(client_p) && (dolen = rb_linebuf_get(&client_p->localClient->buf_recvq,
-					   readBuf, READBUF_SIZE, LINEBUF_COMPLETE,
-					   LINEBUF_PARSED)) > 0)
+		flood_dequeue(client_p);
+
+		while (!IsAnyDead(client_p) && (dolen = recvq_get(client_p, &line)) > 0)
 		{
-			client_dopacket(client_p, readBuf, dolen);
+			client_dopacket(client_p, line, dolen);
 		}
 	}
 	else if(IsClient(client_p))
@@ -123,26 +501,41 @@ parse_client_queued(struct Client *client_p)
 			 *
 			 * A client is given allow_read lines to send to the server.  Every
 			 * time a line is parsed, sent_parsed is increased.  sent_parsed
-			 * is decreased by 1 every time flood_recalc is called.
+			 * is decreased by client_flood_message_num for every second
+			 * that passes (see flood_decay()).
 			 *
 			 * Thus a client can 'burst' allow_read lines to the server, any
-			 * excess lines will be parsed one per flood_recalc() call.
+			 * excess lines wait on the flood wheel and are parsed as
+			 * sent_parsed decays.
 			 *
 			 * Therefore a client will be penalised more if they keep flooding,
 			 * as sent_parsed will always hover around the allow_read limit
 			 * and no 'bursts' will be permitted.
 			 */
 			if(client_p->localClient->sent_parsed >= allow_read)
+			{
+				if(recvq_numlines(client_p) > 0)
+				{
+					time_t delay = 1;
+
+					if(IsFloodDone(client_p) && ConfigFileEntry.client_flood_message_num > 0)
+						delay = (client_p->localClient->sent_parsed - allow_read) /
+							ConfigFileEntry.client_flood_message_num + 1;
+
+					flood_enqueue(client_p, delay);
+				}
 				break;
+			}
 
-			dolen = rb_linebuf_get(&client_p->localClient->
-					    buf_recvq, readBuf, READBUF_SIZE,
-					    LINEBUF_COMPLETE, LINEBUF_PARSED);
+			dolen = recvq_get(client_p, &line);
 
 			if(!dolen)
+			{
+				flood_dequeue(client_p);
 				break;
+			}
 
-			client_dopacket(client_p, readBuf, dolen);
+			client_dopacket(client_p, line, dolen);
 			if(IsAnyDead(client_p))
 				return;
 
@@ -171,58 +564,46 @@ flood_endgrace(struct Client *client_p)
 	 * client_flood_burst_rate so reset it.
 	 */
 	client_p->localClient->sent_parsed = 0;
+
+	/* and anything they had queued may go on the next tick */
+	if(client_p->localClient->flood_wakeup != 0)
+		flood_enqueue(client_p, 1);
 }
 
 /*
  * flood_recalc
  *
- * recalculate the number of allowed flood lines. this should be called
- * once a second on any given client. We then attempt to flush some data.
+ * called once a second, retries the clients on the flood wheel whose
+ * wakeup time has come.  Flood counters themselves decay lazily in
+ * flood_decay().
  */
 void
 flood_recalc(void *unused)
 {
 	rb_dlink_node *ptr, *next;
 	struct Client *client_p;
+	time_t now = rb_current_time();
 
-	RB_DLINK_FOREACH_SAFE(ptr, next, lclient_list.head)
-	{
-		client_p = (Client *)ptr->data;
-
-		if(rb_unlikely(IsMe(client_p)))
-			continue;
-
-		if(rb_unlikely(client_p->localClient == NULL))
-			continue;
+	/* catch up on seconds the event loop missed, at most a full lap */
+	if(now - flood_wheel_time > FLOOD_WHEEL_SIZE)
+		flood_wheel_time = now - FLOOD_WHEEL_SIZE;
 
-		if(IsFloodDone(client_p))
-			client_p->localClient->sent_parsed -= ConfigFileEntry.client_flood_message_num;
-		else
-			client_p->localClient->sent_parsed = 0;
-
-		if(client_p->localClient->sent_parsed < 0)
-			client_p->localClient->sent_parsed = 0;
-
-		parse_client_queued(client_p);
-
-		if(rb_unlikely(IsAnyDead(client_p)))
-			continue;
-
-	}
-
-	RB_DLINK_FOREACH_SAFE(ptr, next, unknown_list.head)
+	while(flood_wheel_time < now)
 	{
-		client_p = (Client *)ptr->data;
-
-		if(client_p->localClient == NULL)
-			continue;
+		rb_dlink_list *slot = &flood_wheel[++flood_wheel_time & (FLOOD_WHEEL_SIZE - 1)];
 
-		client_p->localClient->sent_parsed--;
+		/* clients rescheduled into this slot land behind us with a
+		 * later wakeup, and are skipped */
+		RB_DLINK_FOREACH_SAFE(ptr, next, slot->head)
+		{
+			client_p = (Client *)ptr->data;
 
-		if(client_p->localClient->sent_parsed < 0)
-			client_p->localClient->sent_parsed = 0;
+			if(client_p->localClient->flood_wakeup > now)
+				continue;
 
-		parse_client_queued(client_p);
+			flood_dequeue(client_p);
+			parse_client_queued(client_p);
+		}
 	}
 }
 
@@ -233,8 +614,10 @@ void
 read_packet(rb_fde_t * F, void *data)
 {
 	struct Client *client_p = (Client *)data;
+	struct RecvRing *ring;
 	int length = 0;
 	int binary = 0;
+	int want;
 
 	while(1)
 	{
@@ -246,7 +629,17 @@ read_packet(rb_fde_t * F, void *data)
 		 * I personally think it makes the code too hairy to make sane.
 		 *     -- adrian
 		 */
-		length = rb_read(client_p->localClient->F, readBuf, READBUF_SIZE);
+		if((ring = client_p->localClient->recv_ring) != NULL)
+		{
+			recv_ring_reserve(ring);
+			want = ring->size - ring->tail;
+			length = rb_read(client_p->localClient->F, ring->buf + ring->tail, want);
+		}
+		else
+		{
+			want = READBUF_SIZE;
+			length = rb_read(client_p->localClient->F, readBuf, READBUF_SIZE);
+		}
 
 		if(length < 0)
 		{
@@ -272,10 +665,15 @@ read_packet(rb_fde_t * F, void *data)
 		 * it on the end of the receive queue and do it when its
 		 * turn comes around.
 		 */
-		if(IsHandshake(client_p) || IsUnknown(client_p))
-			binary = 1;
+		if(ring != NULL)
+			recv_ring_scan(ring, length);
+		else
+		{
+			if(IsHandshake(client_p) || IsUnknown(client_p))
+				binary = 1;
 
-		(void) rb_linebuf_parse(&client_p->localClient->buf_recvq, readBuf, length, binary);
+			(void) rb_linebuf_parse(&client_p->localClient->buf_recvq, readBuf, length, binary);
+		}
 
 		if(IsAnyDead(client_p))
 			return;
@@ -288,7 +686,8 @@ read_packet(rb_fde_t * F, void *data)
 
 		/* Check to make sure we're not flooding */
 		if(!IsAnyServer(client_p) &&
-		   (rb_linebuf_alloclen(&client_p->localClient->buf_recvq) > ConfigFileEntry.client_flood_max_lines))
+		   ((ring != NULL ? ring->numlines : rb_linebuf_alloclen(&client_p->localClient->buf_recvq)) >
+		    (unsigned int)ConfigFileEntry.client_flood_max_lines))
 		{
 			if(!(ConfigFileEntry.no_oper_flood && IsOper(client_p)))
 			{
@@ -298,8 +697,16 @@ read_packet(rb_fde_t * F, void *data)
 		}
 
 		/* bail if short read */
-		if(length < READBUF_SIZE)
+		if(length < want)
 		{
+			/* give back what a burst grew the ring to */
+			if(ring != NULL && ring->tail == 0 && ring->size > RECV_RING_MIN &&
+			   !IsAnyServer(client_p))
+			{
+				ring->size = RECV_RING_MIN;
+				ring->buf = (char *)rb_realloc(ring->buf, ring->size);
+			}
+
 			rb_setselect(client_p->localClient->F, RB_SELECT_READ, read_packet, client_p);
 			return;
 		}
@@ -52,9 +52,38 @@ static void remove_unknown(struct Client *, const char *, char *);
 static void do_numeric(int, struct Client *, struct Client *, int, const char **);
 
 static int handle_command(struct Message *, struct MsgBuf *, struct Client *, struct Client *);
+static struct Message *find_cmd(const char *);
 
 static char buffer[1024];
 
+/*
+ * cmd_dict holds the registered commands; parse() and handle_encap() look
+ * them up in cmd_table instead, an open addressed table rebuilt from
+ * cmd_dict whenever the command set changes.  It is kept at most a
+ * quarter full and each slot carries the full hash, so a lookup is one
+ * pass over the command name and usually one compare.
+ */
+struct cmd_slot
+{
+	uint32_t hash;
+	uint32_t len;
+	struct Message *msg;
+};
+
+#define CMD_TABLE_MIN	64
+
+static struct cmd_slot *cmd_table;
+static unsigned int cmd_table_mask;
+
+/* Inserted first, so they always sit in their home slot.  These make up
+ * nearly all of the traffic on a server link, bursts included.
+ */
+static const char *const cmd_table_hot[] =
+{
+	"PRIVMSG", "NOTICE", "PING", "PONG", "JOIN", "MODE", "TMODE",
+	"EUID", "UID", "SJOIN", "BMASK", "ENCAP", NULL
+};
+
 /* turn a string into a parc/parv pair */
 
 char *reconstruct_parv(int parc, const char *parv[])
@@ -133,7 +162,7 @@ parse(struct Client *client_p, char *pbuffer, char *bufend)
 	}
 	else
 	{
-		mptr = cmd_dict[msgbuf.cmd];
+		mptr = find_cmd(msgbuf.cmd);
 
 		/* no command or its encap only, error */
 		if(!mptr || !mptr->cmd)
@@ -252,7 +281,7 @@ handle_encap(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *so
 	struct MessageEntry ehandler;
 	MessageHandler handler = 0;
 
-	mptr = cmd_dict[command];
+	mptr = find_cmd(command);
 	if(mptr == NULL || mptr->cmd == NULL)
 		return;
 
@@ -266,6 +295,113 @@ handle_encap(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *so
 	(*handler) (msgbuf_p, client_p, source_p, parc, parv);
 }
 
+/* cmd_hash()
+ *
+ * inputs	- command name
+ *		- pointer to store the name's length in
+ * output	- case insensitive hash of the name
+ * side effects - none
+ */
+static inline uint32_t
+cmd_hash(const char *name, uint32_t *len)
+{
+	const unsigned char *p;
+	uint32_t h = 2166136261U;
+
+	for(p = (const unsigned char *)name; *p != '\0'; p++)
+	{
+		h ^= tolower(*p);
+		h *= 16777619U;
+	}
+
+	*len = p - (const unsigned char *)name;
+	return h;
+}
+
+/* find_cmd()
+ *
+ * inputs	- command name
+ * output	- the registered command of that name, or NULL
+ * side effects - none
+ */
+static struct Message *
+find_cmd(const char *name)
+{
+	struct cmd_slot *slot;
+	uint32_t hash, len;
+	unsigned int i;
+
+	if(cmd_table == NULL)
+		return NULL;
+
+	hash = cmd_hash(name, &len);
+
+	for(i = hash & cmd_table_mask; (slot = &cmd_table[i])->msg != NULL; i = (i + 1) & cmd_table_mask)
+	{
+		if(slot->hash != hash || slot->len != len)
+			continue;
+
+		/* servers send commands in the case they were registered in */
+		if(!memcmp(slot->msg->cmd, name, len) || !rb_strcasecmp(slot->msg->cmd, name))
+			return slot->msg;
+	}
+
+	return NULL;
+}
+
+/* cmd_table_insert()
+ *
+ * inputs	- command
+ * output	- none
+ * side effects - command is added to cmd_table, which must have room
+ */
+static void
+cmd_table_insert(struct Message *msg)
+{
+	uint32_t hash, len;
+	unsigned int i;
+
+	hash = cmd_hash(msg->cmd, &len);
+
+	for(i = hash & cmd_table_mask; cmd_table[i].msg != NULL; i = (i + 1) & cmd_table_mask)
+		;
+
+	cmd_table[i].hash = hash;
+	cmd_table[i].len = len;
+	cmd_table[i].msg = msg;
+}
+
+/* rebuild_cmd_table()
+ *
+ * inputs	- none
+ * output	- none
+ * side effects - cmd_table is rebuilt from cmd_dict
+ */
+static void
+rebuild_cmd_table(void)
+{
+	size_t size = CMD_TABLE_MIN;
+	int i;
+
+	while(size < cmd_dict.size() * 4)
+		size <<= 1;
+
+	rb_free(cmd_table);
+	cmd_table = (struct cmd_slot *)rb_malloc(sizeof(struct cmd_slot) * size);
+	cmd_table_mask = size - 1;
+
+	for(i = 0; cmd_table_hot[i] != NULL; i++)
+	{
+		auto it = cmd_dict.find(cmd_table_hot[i]);
+		if(it != cmd_dict.end())
+			cmd_table_insert(it->second);
+	}
+
+	for(const auto &it : cmd_dict)
+		if(find_cmd(it.second->cmd) != it.second)
+			cmd_table_insert(it.second);
+}
+
 /* mod_add_cmd
  *
  * inputs	- command name
@@ -282,7 +418,7 @@ mod_add_cmd(struct Message *msg)
 	if(msg == NULL)
 		return;
 
-	if (cmd_dict[msg->cmd] != NULL)
+	if (cmd_dict.count(msg->cmd))
 	{
 		s_assert(0);
 		return;
@@ -293,6 +429,7 @@ mod_add_cmd(struct Message *msg)
 	msg->bytes = 0;
 
 	cmd_dict[msg->cmd] = msg;
+	rebuild_cmd_table();
 }
 
 /* mod_del_cmd
@@ -309,6 +446,7 @@ mod_del_cmd(struct Message *msg)
 		return;
 
 	cmd_dict.erase(msg->cmd);
+	rebuild_cmd_table();
 }
 
 /* cancel_clients()
@@ -641,6 +641,12 @@ rehash(bool sig)
 	/* don't close listeners until we know we can go ahead with the rehash */
 	read_conf_files(false);
 
+	set_authd_dns_cache(ConfigFileEntry.dns_cache_size,
+		ConfigFileEntry.dns_cache_max_ttl,
+		ConfigFileEntry.dns_cache_negative_ttl);
+	set_authd_blacklist_cache(ConfigFileEntry.blacklist_cache_ttl,
+		ConfigFileEntry.blacklist_cache_negative_ttl);
+
 	if(ServerInfo.description != NULL)
 		rb_strlcpy(me.info, ServerInfo.description, sizeof(me.info));
 	else
@@ -793,6 +799,11 @@ set_default_conf(void)
 	ConfigFileEntry.min_nonwildcard_simple = 3;
 	ConfigFileEntry.default_floodcount = 8;
 	ConfigFileEntry.default_ident_timeout = IDENT_TIMEOUT_DEFAULT;
+	ConfigFileEntry.dns_cache_size = 4096;
+	ConfigFileEntry.dns_cache_max_ttl = 600;
+	ConfigFileEntry.dns_cache_negative_ttl = 60;
+	ConfigFileEntry.blacklist_cache_ttl = BLACKLIST_CACHE_TTL_DEFAULT;
+	ConfigFileEntry.blacklist_cache_negative_ttl = BLACKLIST_CACHE_NEGATIVE_TTL_DEFAULT;
 	ConfigFileEntry.tkline_expire_notices = 0;
 
         ConfigFileEntry.reject_after_count = 5;
@@ -1454,6 +1465,7 @@ clear_out_old_conf(void)
 	ServerInfo.network_name = NULL;
 
 	ServerInfo.ssld_count = 1;
+	ServerInfo.ssl_ktls = 0;
 
 	/* clean out AdminInfo */
 	rb_free(AdminInfo.name);
@@ -98,6 +98,7 @@ unsigned int CLICAP_USERHOST_IN_NAMES;
 unsigned int CLICAP_CAP_NOTIFY;
 unsigned int CLICAP_CHGHOST;
 unsigned int CLICAP_ECHO_MESSAGE;
+unsigned int CLICAP_BATCH;
 
 /*
  * initialize our builtin capability table. --nenolod
@@ -141,6 +142,7 @@ init_builtin_capabs(void)
 	CLICAP_CAP_NOTIFY = cli_capindex.put("cap-notify", NULL);
 	CLICAP_CHGHOST = cli_capindex.put("chghost", NULL);
 	CLICAP_ECHO_MESSAGE = cli_capindex.put("echo-message", NULL);
+	CLICAP_BATCH = cli_capindex.put("batch", NULL);
 }
 
 static CNCB serv_connect_callback;
@@ -430,7 +432,7 @@ check_server(const char *name, struct Client *client_p)
 		return error;
 	}
 
-	if(ServerConfSSL(server_p) && client_p->localClient->ssl_ctl == NULL)
+	if(ServerConfSSL(server_p) && client_p->localClient->ssl_ctl == NULL && !IsKTLS(client_p))
 	{
 		return -5;
 	}
@@ -584,164 +586,423 @@ burst_modes_TS6(struct Client *client_p, struct Channel *chptr,
 }
 
 /*
- * burst_TS6
+ * The connect burst is sent a chunk at a time from the link's write
+ * callback, so a large network does not stall the event loop or fill the
+ * sendq in one go.  The burst covers the users and channels that exist
+ * when it starts; anything sent to the link in the meantime (including
+ * users who register and channels created during the burst) is held and
+ * queued behind it.
+ */
+#define BURST_CHUNK		512	/* users/channels per write event */
+#define BURST_SENDQ_HIGH	4	/* stop at 1/4 of the sendq limit */
+
+static rb_dlink_list burst_list;
+
+/*
+ * burst_client
  *
  * inputs	- client (server) to send nick towards
  * 		- client to send nick for
  * output	- NONE
- * side effects	- NICK message is sent towards given client_p
+ * side effects	- UID/EUID and the user's extra state are sent to client_p
  */
 static void
-burst_TS6(struct Client *client_p)
+burst_client(struct Client *client_p, struct Client *target_p)
 {
 	char ubuf[BUFSIZE];
-	struct Client *target_p;
-	struct Channel *chptr;
-	struct membership *msptr;
 	hook_data_client hclientinfo;
+
+	send_umode(NULL, target_p, 0, ubuf);
+	if(!*ubuf)
+	{
+		ubuf[0] = '+';
+		ubuf[1] = '\0';
+	}
+
+	if(IsCapable(client_p, CAP_EUID))
+		sendto_one(client_p, ":%s EUID %s %d %ld %s %s %s %s %s %s %s :%s",
+			   target_p->servptr->id, target_p->name,
+			   target_p->hopcount + 1,
+			   (long) target_p->tsinfo, ubuf,
+			   target_p->username, target_p->host,
+			   IsIPSpoof(target_p) ? "0" : target_p->sockhost,
+			   target_p->id,
+			   IsDynSpoof(target_p) ? target_p->orighost : "*",
+			   EmptyString(target_p->user->suser) ? "*" : target_p->user->suser,
+			   target_p->info);
+	else
+		sendto_one(client_p, ":%s UID %s %d %ld %s %s %s %s %s :%s",
+			   target_p->servptr->id, target_p->name,
+			   target_p->hopcount + 1,
+			   (long) target_p->tsinfo, ubuf,
+			   target_p->username, target_p->host,
+			   IsIPSpoof(target_p) ? "0" : target_p->sockhost,
+			   target_p->id, target_p->info);
+
+	if(!EmptyString(target_p->certfp))
+		sendto_one(client_p, ":%s ENCAP * CERTFP :%s",
+				use_id(target_p), target_p->certfp);
+
+	if(!IsCapable(client_p, CAP_EUID))
+	{
+		if(IsDynSpoof(target_p))
+			sendto_one(client_p, ":%s ENCAP * REALHOST %s",
+					use_id(target_p), target_p->orighost);
+		if(!EmptyString(target_p->user->suser))
+			sendto_one(client_p, ":%s ENCAP * LOGIN %s",
+					use_id(target_p), target_p->user->suser);
+	}
+
+	if(ConfigFileEntry.burst_away && !EmptyString(target_p->user->away))
+		sendto_one(client_p, ":%s AWAY :%s",
+			   use_id(target_p),
+			   target_p->user->away);
+
+	hclientinfo.client = client_p;
+	hclientinfo.target = target_p;
+	call_hook(h_burst_client, &hclientinfo);
+}
+
+/*
+ * burst_channel
+ *
+ * inputs	- client (server) to send channel towards
+ * 		- channel to send
+ * output	- NONE
+ * side effects	- SJOIN, bans, topic and mlock are sent to client_p
+ */
+static void
+burst_channel(struct Client *client_p, struct Channel *chptr)
+{
+	struct membership *msptr;
 	hook_data_channel hchaninfo;
-	rb_dlink_node *ptr;
 	rb_dlink_node *uptr;
 	char *t;
 	int tlen, mlen;
 	int cur_len = 0;
 
-	hclientinfo.client = hchaninfo.client = client_p;
+	cur_len = mlen = sprintf(buf, ":%s SJOIN %ld %s %s :", me.id,
+			(long) chptr->channelts, chptr->chname,
+			channel_modes(chptr, client_p));
 
-	RB_DLINK_FOREACH(ptr, global_client_list.head)
+	t = buf + mlen;
+
+	RB_DLINK_FOREACH(uptr, chptr->members.head)
 	{
-		target_p = (Client *)ptr->data;
+		msptr = (membership *)uptr->data;
 
-		if(!IsPerson(target_p))
-			continue;
+		tlen = strlen(use_id(msptr->client_p)) + 1;
+		if(is_chanop(msptr))
+			tlen++;
+		if(is_voiced(msptr))
+			tlen++;
 
-		send_umode(NULL, target_p, 0, ubuf);
-		if(!*ubuf)
+		if(cur_len + tlen >= BUFSIZE - 3)
 		{
-			ubuf[0] = '+';
-			ubuf[1] = '\0';
+			*(t-1) = '\0';
+			sendto_one(client_p, "%s", buf);
+			cur_len = mlen;
+			t = buf + mlen;
 		}
 
-		if(IsCapable(client_p, CAP_EUID))
-			sendto_one(client_p, ":%s EUID %s %d %ld %s %s %s %s %s %s %s :%s",
-				   target_p->servptr->id, target_p->name,
-				   target_p->hopcount + 1,
-				   (long) target_p->tsinfo, ubuf,
-				   target_p->username, target_p->host,
-				   IsIPSpoof(target_p) ? "0" : target_p->sockhost,
-				   target_p->id,
-				   IsDynSpoof(target_p) ? target_p->orighost : "*",
-				   EmptyString(target_p->user->suser) ? "*" : target_p->user->suser,
-				   target_p->info);
-		else
-			sendto_one(client_p, ":%s UID %s %d %ld %s %s %s %s %s :%s",
-				   target_p->servptr->id, target_p->name,
-				   target_p->hopcount + 1,
-				   (long) target_p->tsinfo, ubuf,
-				   target_p->username, target_p->host,
-				   IsIPSpoof(target_p) ? "0" : target_p->sockhost,
-				   target_p->id, target_p->info);
+		sprintf(t, "%s%s ", find_channel_status(msptr, 1),
+			   use_id(msptr->client_p));
 
-		if(!EmptyString(target_p->certfp))
-			sendto_one(client_p, ":%s ENCAP * CERTFP :%s",
-					use_id(target_p), target_p->certfp);
+		cur_len += tlen;
+		t += tlen;
+	}
 
-		if(!IsCapable(client_p, CAP_EUID))
-		{
-			if(IsDynSpoof(target_p))
-				sendto_one(client_p, ":%s ENCAP * REALHOST %s",
-						use_id(target_p), target_p->orighost);
-			if(!EmptyString(target_p->user->suser))
-				sendto_one(client_p, ":%s ENCAP * LOGIN %s",
-						use_id(target_p), target_p->user->suser);
-		}
+	if (rb_dlink_list_length(&chptr->members) > 0)
+	{
+		/* remove trailing space */
+		*(t-1) = '\0';
+	}
+	sendto_one(client_p, "%s", buf);
 
-		if(ConfigFileEntry.burst_away && !EmptyString(target_p->user->away))
-			sendto_one(client_p, ":%s AWAY :%s",
-				   use_id(target_p),
-				   target_p->user->away);
+	if(rb_dlink_list_length(&chptr->banlist) > 0)
+		burst_modes_TS6(client_p, chptr, &chptr->banlist, 'b');
 
-		hclientinfo.target = target_p;
-		call_hook(h_burst_client, &hclientinfo);
-	}
+	if(IsCapable(client_p, CAP_EX) &&
+	   rb_dlink_list_length(&chptr->exceptlist) > 0)
+		burst_modes_TS6(client_p, chptr, &chptr->exceptlist, 'e');
+
+	if(IsCapable(client_p, CAP_IE) &&
+	   rb_dlink_list_length(&chptr->invexlist) > 0)
+		burst_modes_TS6(client_p, chptr, &chptr->invexlist, 'I');
+
+	if(rb_dlink_list_length(&chptr->quietlist) > 0)
+		burst_modes_TS6(client_p, chptr, &chptr->quietlist, 'q');
+
+	if(IsCapable(client_p, CAP_TB) && chptr->topic != NULL)
+		sendto_one(client_p, ":%s TB %s %ld %s%s:%s",
+			   me.id, chptr->chname, (long) chptr->topic_time,
+			   ConfigChannel.burst_topicwho ? chptr->topic_info : "",
+			   ConfigChannel.burst_topicwho ? " " : "",
+			   chptr->topic);
+
+	if(IsCapable(client_p, CAP_MLOCK))
+		sendto_one(client_p, ":%s MLOCK %ld %s :%s",
+			   me.id, (long) chptr->channelts, chptr->chname,
+			   EmptyString(chptr->mode_lock) ? "" : chptr->mode_lock);
+
+	hchaninfo.client = client_p;
+	hchaninfo.chptr = chptr;
+	call_hook(h_burst_channel, &hchaninfo);
+}
+
+/*
+ * burst_finish
+ *
+ * inputs	- client (server) whose burst has been sent
+ * output	- NONE
+ * side effects	- PING is sent, held traffic is queued and the
+ *		  burst statistics are recorded
+ */
+static void
+burst_finish(struct Client *client_p)
+{
+	struct Burst *burst = client_p->localClient->burst;
+	const struct timeval *now = rb_current_time_tv();
+	hook_data_client hclientinfo;
+
+	hclientinfo.client = client_p;
+	hclientinfo.target = NULL;
+	call_hook(h_burst_finished, &hclientinfo);
 
-	RB_DLINK_FOREACH(ptr, global_channel_list.head)
+	if(burst->ev != NULL)
 	{
-		chptr = (Channel *)ptr->data;
+		rb_event_delete(burst->ev);
+		burst->ev = NULL;
+	}
 
-		if(*chptr->chname != '#')
-			continue;
+	/* Always send a PING after connect burst is done */
+	sendto_one(client_p, "PING :%s", get_id(&me, client_p));
 
-		cur_len = mlen = sprintf(buf, ":%s SJOIN %ld %s %s :", me.id,
-				(long) chptr->channelts, chptr->chname,
-				channel_modes(chptr, client_p));
+	burst->emitting = false;
+	burst->active = false;
+	rb_dlinkDelete(&burst->node, &burst_list);
 
-		t = buf + mlen;
+	burst->msec = (now->tv_sec - burst->start.tv_sec) * 1000 +
+		      (now->tv_usec - burst->start.tv_usec) / 1000;
 
-		RB_DLINK_FOREACH(uptr, chptr->members.head)
-		{
-			msptr = (membership *)uptr->data;
+	rb_linebuf_attach(&client_p->localClient->buf_sendq, &burst->held);
+	rb_linebuf_donebuf(&burst->held);
+	send_queued(client_p);
+}
 
-			tlen = strlen(use_id(msptr->client_p)) + 1;
-			if(is_chanop(msptr))
-				tlen++;
-			if(is_voiced(msptr))
-				tlen++;
+/*
+ * burst_start
+ *
+ * inputs	- client (server) to burst to
+ * output	- NONE
+ * side effects	- the burst is set up and its first chunk is sent
+ */
+static void
+burst_start(struct Client *client_p)
+{
+	struct Burst *burst = (struct Burst *)rb_malloc(sizeof(struct Burst));
 
-			if(cur_len + tlen >= BUFSIZE - 3)
-			{
-				*(t-1) = '\0';
-				sendto_one(client_p, "%s", buf);
-				cur_len = mlen;
-				t = buf + mlen;
-			}
+	burst->client_next = global_client_list.head;
+	burst->client_last = global_client_list.tail;
+	burst->channel_next = global_channel_list.head;
+	rb_linebuf_newbuf(&burst->held);
+	burst->start = *rb_current_time_tv();
+	burst->active = true;
+
+	rb_dlinkAdd(burst, &burst->node, &burst_list);
+	client_p->localClient->burst = burst;
+
+	burst_continue(client_p);
+}
+
+static void
+burst_continue_event(void *data)
+{
+	struct Client *client_p = (Client *)data;
 
-			sprintf(t, "%s%s ", find_channel_status(msptr, 1),
-				   use_id(msptr->client_p));
+	client_p->localClient->burst->ev = NULL;
+	burst_continue(client_p);
+}
+
+/*
+ * burst_wait
+ *
+ * inputs	- client (server) being burst to
+ * output	- NONE
+ * side effects	- the next chunk is sent from the write callback if a
+ *		  write to the link has blocked, otherwise from the next
+ *		  pass of the event loop
+ */
+static void
+burst_wait(struct Client *client_p)
+{
+	struct Burst *burst = client_p->localClient->burst;
+
+	/* an edge triggered backend only reports the socket writable
+	 * again after a write to it has blocked, so with nothing waiting
+	 * there would be no write callback to continue from
+	 */
+	send_queued(client_p);
+	if(IsFlush(client_p) || IsAnyDead(client_p) || burst->ev != NULL)
+		return;
+
+	/* kTLS handoff holds the sendq back for a moment */
+	burst->ev = rb_event_addonce("burst_continue", burst_continue_event, client_p,
+				     rb_linebuf_len(&client_p->localClient->buf_sendq) > 0 ? 1 : 0);
+}
+
+/*
+ * burst_continue
+ *
+ * inputs	- client (server) being burst to
+ * output	- NONE
+ * side effects	- sends the next chunk of the burst, unless the sendq
+ *		  is still draining from the last one
+ */
+void
+burst_continue(struct Client *client_p)
+{
+	struct Burst *burst = client_p->localClient->burst;
+	buf_head_t *sendq = &client_p->localClient->buf_sendq;
+	struct Client *target_p;
+	struct Channel *chptr;
+	rb_dlink_node *ptr;
+	long hiwat;
+	int count = 0;
+
+	if(burst == NULL || !burst->active || IsAnyDead(client_p))
+		return;
+
+	hiwat = get_sendq(client_p) / BURST_SENDQ_HIGH;
 
-			cur_len += tlen;
-			t += tlen;
+	/* wait for the sendq to drain to half the high mark */
+	if(rb_linebuf_len(sendq) > hiwat / 2)
+	{
+		burst_wait(client_p);
+		return;
+	}
+
+	burst->emitting = true;
+
+	while(count++ < BURST_CHUNK && rb_linebuf_len(sendq) < hiwat &&
+	      !IsAnyDead(client_p))
+	{
+		if(burst->client_next != NULL)
+		{
+			ptr = burst->client_next;
+			target_p = (Client *)ptr->data;
+
+			if(ptr == burst->client_last)
+				burst->client_next = burst->client_last = NULL;
+			else
+				burst->client_next = ptr->next;
+
+			if(!IsPerson(target_p))
+				continue;
+
+			burst_client(client_p, target_p);
+			burst->users++;
 		}
+		else if(burst->channel_next != NULL)
+		{
+			ptr = burst->channel_next;
+			chptr = (Channel *)ptr->data;
+			burst->channel_next = ptr->next;
+
+			if(*chptr->chname != '#')
+				continue;
 
-		if (rb_dlink_list_length(&chptr->members) > 0)
+			burst_channel(client_p, chptr);
+			burst->channels++;
+		}
+		else
 		{
-			/* remove trailing space */
-			*(t-1) = '\0';
+			burst_finish(client_p);
+			return;
 		}
-		sendto_one(client_p, "%s", buf);
+	}
+
+	burst->emitting = false;
+	burst_wait(client_p);
+}
 
-		if(rb_dlink_list_length(&chptr->banlist) > 0)
-			burst_modes_TS6(client_p, chptr, &chptr->banlist, 'b');
+/*
+ * burst_client_unlink
+ *
+ * inputs	- client about to be removed from global_client_list
+ * output	- NONE
+ * side effects	- running bursts step past the client
+ */
+void
+burst_client_unlink(struct Client *target_p)
+{
+	struct Burst *burst;
+	rb_dlink_node *ptr;
 
-		if(IsCapable(client_p, CAP_EX) &&
-		   rb_dlink_list_length(&chptr->exceptlist) > 0)
-			burst_modes_TS6(client_p, chptr, &chptr->exceptlist, 'e');
+	RB_DLINK_FOREACH(ptr, burst_list.head)
+	{
+		burst = (Burst *)ptr->data;
+
+		if(burst->client_next == &target_p->node)
+		{
+			if(burst->client_last == &target_p->node)
+				burst->client_next = burst->client_last = NULL;
+			else
+				burst->client_next = target_p->node.next;
+		}
+		else if(burst->client_last == &target_p->node)
+			burst->client_last = target_p->node.prev;
+	}
+}
+
+/*
+ * burst_channel_unlink
+ *
+ * inputs	- channel about to be removed from global_channel_list
+ * output	- NONE
+ * side effects	- running bursts step past the channel
+ */
+void
+burst_channel_unlink(struct Channel *chptr)
+{
+	struct Burst *burst;
+	rb_dlink_node *ptr;
 
-		if(IsCapable(client_p, CAP_IE) &&
-		   rb_dlink_list_length(&chptr->invexlist) > 0)
-			burst_modes_TS6(client_p, chptr, &chptr->invexlist, 'I');
+	RB_DLINK_FOREACH(ptr, burst_list.head)
+	{
+		burst = (Burst *)ptr->data;
 
-		if(rb_dlink_list_length(&chptr->quietlist) > 0)
-			burst_modes_TS6(client_p, chptr, &chptr->quietlist, 'q');
+		if(burst->channel_next == &chptr->node)
+			burst->channel_next = chptr->node.next;
+	}
+}
 
-		if(IsCapable(client_p, CAP_TB) && chptr->topic != NULL)
-			sendto_one(client_p, ":%s TB %s %ld %s%s:%s",
-				   me.id, chptr->chname, (long) chptr->topic_time,
-				   ConfigChannel.burst_topicwho ? chptr->topic_info : "",
-				   ConfigChannel.burst_topicwho ? " " : "",
-				   chptr->topic);
+/*
+ * burst_free
+ *
+ * inputs	- client (server) whose local data is being freed
+ * output	- NONE
+ * side effects	- any burst state, running or finished, is released
+ */
+void
+burst_free(struct Client *client_p)
+{
+	struct Burst *burst = client_p->localClient->burst;
 
-		if(IsCapable(client_p, CAP_MLOCK))
-			sendto_one(client_p, ":%s MLOCK %ld %s :%s",
-				   me.id, (long) chptr->channelts, chptr->chname,
-				   EmptyString(chptr->mode_lock) ? "" : chptr->mode_lock);
+	if(burst == NULL)
+		return;
 
-		hchaninfo.chptr = chptr;
-		call_hook(h_burst_channel, &hchaninfo);
+	if(burst->active)
+	{
+		rb_dlinkDelete(&burst->node, &burst_list);
+		rb_linebuf_donebuf(&burst->held);
 	}
 
-	hclientinfo.target = NULL;
-	call_hook(h_burst_finished, &hclientinfo);
+	if(burst->ev != NULL)
+		rb_event_delete(burst->ev);
+
+	rb_free(burst);
+	client_p->localClient->burst = NULL;
 }
 
 /*
@@ -977,10 +1238,7 @@ server_estab(struct Client *client_p)
 	if(IsCapable(client_p, CAP_BAN))
 		burst_ban(client_p);
 
-	burst_TS6(client_p);
-
-	/* Always send a PING after connect burst is done */
-	sendto_one(client_p, "PING :%s", get_id(&me, client_p));
+	burst_start(client_p);
 
 	free_pre_client(client_p);
 
@@ -49,6 +49,7 @@
 #include <ircd/monitor.h>
 #include <ircd/snomask.h>
 #include <ircd/substitution.h>
+#include <ircd/userindex.h>
 #include <ircd/chmode.h>
 #include <ircd/s_assert.h>
 
@@ -617,6 +618,7 @@ register_local_user(struct Client *client_p, struct Client *source_p)
 			source_p->info);
 
 	add_to_hostname_hash(source_p->orighost, source_p);
+	userindex_add(source_p);
 
 	/* Allocate a UID if it was not previously allocated.
 	 * If this already occured, it was probably during SASL auth...
@@ -637,6 +639,16 @@ register_local_user(struct Client *client_p, struct Client *source_p)
 	rb_dlinkMoveNode(&source_p->localClient->tnode, &unknown_list, &lclient_list);
 	SetClient(source_p);
 
+	if(source_p->localClient->listener != NULL && source_p->localClient->listener->ring_recvq)
+		recvq_use_ring(source_p);
+
+	/* global_client_list stays in the order users were introduced, so
+	 * a running server burst leaves this one to be introduced live
+	 */
+	burst_client_unlink(source_p);
+	rb_dlinkDelete(&source_p->node, &global_client_list);
+	rb_dlinkAddTail(source_p, &source_p->node, &global_client_list);
+
 	source_p->servptr = &me;
 	rb_dlinkAdd(source_p, &source_p->lnode, &source_p->servptr->serv->users);
 
@@ -1596,6 +1608,7 @@ change_nick_user_host(struct Client *target_p,	const char *nick, const char *use
 		rb_strlcpy(target_p->username, user, sizeof target_p->username);
 
 	rb_strlcpy(target_p->host, host, sizeof target_p->host);
+	userindex_update(target_p);
 
 	if (changed)
 		whowas_add_history(target_p, 1);
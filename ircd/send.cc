@@ -36,6 +36,7 @@
 #include <ircd/hook.h>
 #include <ircd/monitor.h>
 #include <ircd/msgbuf.h>
+#include <ircd/s_stats.h>
 
 namespace ircd {
 
@@ -57,6 +58,9 @@ struct Client *remote_rehash_oper_p;
 static int
 _send_linebuf(struct Client *to, buf_head_t *linebuf)
 {
+	struct Burst *burst;
+	long queued;
+
 	if(IsMe(to))
 	{
 		sendto_realops_snomask(SNO_GENERAL, L_ALL, "Trying to send message to myself!");
@@ -66,27 +70,43 @@ _send_linebuf(struct Client *to, buf_head_t *linebuf)
 	if(!MyConnect(to) || IsIOError(to))
 		return 0;
 
-	if(rb_linebuf_len(&to->localClient->buf_sendq) > get_sendq(to))
+	burst = to->localClient->burst;
+	if(burst != NULL && !burst->active)
+		burst = NULL;
+
+	queued = rb_linebuf_len(&to->localClient->buf_sendq);
+	if(burst != NULL)
+		queued += rb_linebuf_len(&burst->held);
+
+	if(queued > get_sendq(to))
 	{
 		if(IsServer(to))
 		{
 			sendto_realops_snomask(SNO_GENERAL, L_ALL,
-					     "Max SendQ limit exceeded for %s: %u > %lu",
-					     to->name,
-					     rb_linebuf_len(&to->localClient->buf_sendq),
-					     get_sendq(to));
+					     "Max SendQ limit exceeded for %s: %ld > %ld",
+					     to->name, queued, get_sendq(to));
 
-			ilog(L_SERVER, "Max SendQ limit exceeded for %s: %u > %lu",
+			ilog(L_SERVER, "Max SendQ limit exceeded for %s: %ld > %ld",
 			     log_client_name(to, SHOW_IP),
-			     rb_linebuf_len(&to->localClient->buf_sendq),
-			     get_sendq(to));
+			     queued, get_sendq(to));
 		}
 
 		dead_link(to, 1);
 		return -1;
 	}
+	else if(burst != NULL && !burst->emitting)
+	{
+		/* other traffic waits until the burst has been sent */
+		rb_linebuf_attach(&burst->held, linebuf);
+	}
 	else
 	{
+		if(burst != NULL)
+		{
+			burst->lines++;
+			burst->bytes += rb_linebuf_len(linebuf);
+		}
+
 		/* just attach the linebuf to the sendq instead of
 		 * generating a new one
 		 */
@@ -144,6 +164,10 @@ send_queued(struct Client *to)
 	if(IsFlush(to))
 		return;
 
+	/* ssld is passing on the last of what we wrote through it */
+	if(to->localClient->ktls_F != NULL)
+		return;
+
 	if(rb_linebuf_len(&to->localClient->buf_sendq))
 	{
 		while ((retlen =
@@ -206,6 +230,9 @@ send_queued_write(rb_fde_t *F, void *data)
 	struct Client *to = (Client *)data;
 	ClearFlush(to);
 	send_queued(to);
+
+	if(to->localClient != NULL && to->localClient->burst != NULL)
+		burst_continue(to);
 }
 
 /*
@@ -218,7 +245,7 @@ send_queued_write(rb_fde_t *F, void *data)
 static void
 linebuf_put_msgvbuf(struct MsgBuf *msgbuf, buf_head_t *linebuf, unsigned int capmask, const char *pattern, va_list *va)
 {
-	char buf[BUFSIZE];
+	char buf[LINEBUF_TAGS_SIZE + BUFSIZE];
 
 	rb_linebuf_newbuf(linebuf);
 	msgbuf_unparse_prefix(buf, sizeof buf, msgbuf, capmask);
@@ -486,6 +513,51 @@ sendto_server(struct Client *one, struct Channel *chptr, unsigned long caps,
 	rb_linebuf_donebuf(&linebuf);
 }
 
+/* Distinct tag renderings kept per channel message.  Once these are all
+ * in use, the last slot is re-rendered on demand as before.
+ */
+#define FANOUT_RENDER_SLOTS	8
+
+struct fanout_render
+{
+	unsigned int capmask;
+	buf_head_t linebuf;
+};
+
+/* fanout_render_get()
+ *
+ * inputs	- render cache, entries in use, msgbuf header, client caps
+ *		  projected onto the message's tag caps, message body
+ * outputs	- linebuf rendered for that projection
+ * side effects - a new rendering is made if none is cached yet
+ */
+static buf_head_t *
+fanout_render_get(struct fanout_render *renders, size_t *n_renders, struct MsgBuf *msgbuf,
+		  unsigned int capmask, const char *buf)
+{
+	size_t i;
+
+	for(i = 0; i < *n_renders; i++)
+	{
+		if(renders[i].capmask == capmask)
+			return &renders[i].linebuf;
+	}
+
+	if(*n_renders < FANOUT_RENDER_SLOTS)
+		i = (*n_renders)++;
+	else
+	{
+		i = FANOUT_RENDER_SLOTS - 1;
+		rb_linebuf_donebuf(&renders[i].linebuf);
+	}
+
+	linebuf_put_msgbuf(msgbuf, &renders[i].linebuf, capmask, "%s", buf);
+	renders[i].capmask = capmask;
+	ServerStats.is_fanout_renders++;
+
+	return &renders[i].linebuf;
+}
+
 /* sendto_channel_flags()
  *
  * inputs	- server not to send to, flags needed, source, channel, va_args
@@ -498,27 +570,30 @@ sendto_channel_flags(struct Client *one, int type, struct Client *source_p,
 {
 	char buf[BUFSIZE];
 	va_list args;
-	buf_head_t rb_linebuf_local;
+	struct fanout_render renders[FANOUT_RENDER_SLOTS];
+	size_t n_renders = 0;
 	buf_head_t rb_linebuf_id;
 	struct Client *target_p;
 	struct membership *msptr;
 	rb_dlink_node *ptr;
 	rb_dlink_node *next_ptr;
-	int current_capmask = 0;
+	unsigned int tagcaps = 0;
 	struct MsgBuf msgbuf;
 
-	rb_linebuf_newbuf(&rb_linebuf_local);
 	rb_linebuf_newbuf(&rb_linebuf_id);
 
 	current_serial++;
 
 	build_msgbuf_from(&msgbuf, source_p, NULL);
 
+	/* only the caps some tag belongs to change the rendered line */
+	for(size_t i = 0; i < msgbuf.n_tags; i++)
+		tagcaps |= msgbuf.tags[i].capmask;
+
 	va_start(args, pattern);
 	vsnprintf(buf, sizeof buf, pattern, args);
 	va_end(args);
 
-	linebuf_put_msgbuf(&msgbuf, &rb_linebuf_local, NOCAPS, "%s", buf);
 	rb_linebuf_putmsg(&rb_linebuf_id, NULL, NULL, ":%s %s", use_id(source_p), buf);
 
 	RB_DLINK_FOREACH_SAFE(ptr, next_ptr, chptr->members.head)
@@ -554,22 +629,16 @@ sendto_channel_flags(struct Client *one, int type, struct Client *source_p,
 		}
 		else
 		{
-			if (target_p->localClient->caps != current_capmask)
-			{
-				/* reset the linebuf */
-				rb_linebuf_donebuf(&rb_linebuf_local);
-				rb_linebuf_newbuf(&rb_linebuf_local);
-
-				/* render the new linebuf and attach it */
-				linebuf_put_msgbuf(&msgbuf, &rb_linebuf_local, target_p->localClient->caps, "%s", buf);
-				current_capmask = target_p->localClient->caps;
-			}
-
-			_send_linebuf(target_p, &rb_linebuf_local);
+			_send_linebuf(target_p, fanout_render_get(renders, &n_renders, &msgbuf,
+					target_p->localClient->caps & tagcaps, buf));
 		}
 	}
 
-	rb_linebuf_donebuf(&rb_linebuf_local);
+	if(n_renders > 0)
+		ServerStats.is_fanout++;
+
+	for(size_t i = 0; i < n_renders; i++)
+		rb_linebuf_donebuf(&renders[i].linebuf);
 	rb_linebuf_donebuf(&rb_linebuf_id);
 }
 
@@ -952,6 +1021,101 @@ sendto_common_channels_local_butone(struct Client *user, int cap, int negcap, co
 	rb_linebuf_donebuf(&linebuf);
 }
 
+/*
+ * sendto_netsplit_local()
+ *
+ * inputs	- users lost in a netsplit, count, the two server names
+ *		  (also used as the QUIT reason)
+ * output	- NONE
+ * side effects	- every local client sharing a channel with one of the
+ *		  users gets its QUIT once; clients with the batch
+ *		  capability get all of theirs inside one netsplit BATCH
+ */
+void
+sendto_netsplit_local(struct Client **users, size_t count, const char *servers)
+{
+	static unsigned long batch_serial;
+	char batch[16];
+	rb_dlink_list batched = { NULL, NULL, 0 };
+	rb_dlink_node *ptr;
+	rb_dlink_node *next_ptr;
+	rb_dlink_node *uptr;
+	struct Client *user;
+	struct Client *target_p;
+	struct membership *msptr;
+	struct membership *mscptr;
+	buf_head_t linebuf;
+	buf_head_t batchbuf;
+
+	snprintf(batch, sizeof batch, "ns%lu", ++batch_serial);
+
+	for(size_t i = 0; i < count; i++)
+	{
+		user = users[i];
+
+		if(user->user->channel.head == NULL)
+			continue;
+
+		rb_linebuf_newbuf(&linebuf);
+		rb_linebuf_newbuf(&batchbuf);
+
+		++current_serial;
+
+		RB_DLINK_FOREACH(ptr, user->user->channel.head)
+		{
+			mscptr = (membership *)ptr->data;
+
+			RB_DLINK_FOREACH(uptr, mscptr->chptr->locmembers.head)
+			{
+				msptr = (membership *)uptr->data;
+				target_p = msptr->client_p;
+
+				if(IsIOError(target_p) || target_p->serial == current_serial)
+					continue;
+
+				target_p->serial = current_serial;
+
+				if(!IsCapable(target_p, CLICAP_BATCH))
+				{
+					if(rb_linebuf_len(&linebuf) == 0)
+						rb_linebuf_putmsg(&linebuf, NULL, NULL,
+								  ":%s!%s@%s QUIT :%s",
+								  user->name, user->username,
+								  user->host, servers);
+					send_linebuf(target_p, &linebuf);
+					continue;
+				}
+
+				if(!(target_p->localClient->localflags & LFLAGS_BATCH))
+				{
+					sendto_one(target_p, ":%s BATCH +%s netsplit %s",
+						   me.name, batch, servers);
+					target_p->localClient->localflags |= LFLAGS_BATCH;
+					rb_dlinkAddAlloc(target_p, &batched);
+				}
+
+				if(rb_linebuf_len(&batchbuf) == 0)
+					rb_linebuf_putmsg(&batchbuf, NULL, NULL,
+							  "@batch=%s :%s!%s@%s QUIT :%s",
+							  batch, user->name, user->username,
+							  user->host, servers);
+				send_linebuf(target_p, &batchbuf);
+			}
+		}
+
+		rb_linebuf_donebuf(&linebuf);
+		rb_linebuf_donebuf(&batchbuf);
+	}
+
+	RB_DLINK_FOREACH_SAFE(ptr, next_ptr, batched.head)
+	{
+		target_p = (Client *)ptr->data;
+		target_p->localClient->localflags &= ~LFLAGS_BATCH;
+		sendto_one(target_p, ":%s BATCH -%s", me.name, batch);
+		rb_dlinkDestroy(ptr, &batched);
+	}
+}
+
 /* sendto_match_butone()
  *
  * inputs	- server not to send to, source, mask, type of mask, va_args
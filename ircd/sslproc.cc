@@ -67,11 +67,14 @@ struct _ssl_ctl
 	uint8_t shutdown;
 	uint8_t dead;
 	char version[256];
+	int ktls_count;		/* connections handed over to kernel TLS */
 };
 
 static void ssld_update_config_one(ssl_ctl_t *ctl);
 static void send_new_ssl_certs_one(ssl_ctl_t * ctl);
 static void send_certfp_method(ssl_ctl_t *ctl);
+static void send_ktls(ssl_ctl_t *ctl);
+static void ssl_cmd_write_queue(ssl_ctl_t *ctl, rb_fde_t **F, int count, const void *buf, size_t buflen);
 
 
 static rb_dlink_list ssl_daemons;
@@ -380,6 +383,90 @@ ssl_process_zipstats(ssl_ctl_t * ctl, ssl_ctl_buf_t * ctl_buf)
 		zips->out_ratio = 0;
 }
 
+/*
+ * ssld has finished a handshake with the kernel doing TLS on the socket,
+ * and offers us a copy of it.  We take it if nothing is reading the plain
+ * side yet and no wsockd sits between us and ssld.  Until ssld says the
+ * connection is open, we write nothing, so that what it is still passing
+ * on from the plain side goes out first.
+ */
+static void
+ssl_process_ktls(ssl_ctl_t * ctl, ssl_ctl_buf_t * ctl_buf)
+{
+	struct Client *client_p;
+	char buf[6];
+	uint32_t fd;
+
+	if(ctl_buf->F[0] == NULL)
+		return;		/* bogus message..drop it.. XXX should warn here */
+
+	if(ctl_buf->buflen < 5)
+	{
+		rb_close(ctl_buf->F[0]);
+		return;
+	}
+
+	fd = buf_to_uint32(&ctl_buf->buf[1]);
+	client_p = find_cli_connid_hash(fd);
+	if(client_p == NULL || client_p->localClient == NULL)
+	{
+		rb_close(ctl_buf->F[0]);
+		return;
+	}
+
+	buf[0] = 'T';
+	uint32_to_buf(&buf[1], fd);
+
+	if(client_p->localClient->ssl_callback == NULL || client_p->localClient->ws_ctl != NULL ||
+	   client_p->localClient->ktls_F != NULL)
+	{
+		rb_close(ctl_buf->F[0]);
+		buf[5] = 0;
+	}
+	else
+	{
+		rb_set_type(ctl_buf->F[0], RB_FD_SOCKET);
+		rb_set_nb(ctl_buf->F[0]);
+		client_p->localClient->ktls_F = ctl_buf->F[0];
+		buf[5] = 1;
+
+		/* ssld closes the plaintext side straight after its 'O', and
+		 * that EOF must not be taken for the client going away */
+		rb_setselect(client_p->localClient->F, RB_SELECT_READ, NULL, NULL);
+	}
+
+	ssl_cmd_write_queue(ctl, NULL, 0, buf, sizeof(buf));
+}
+
+/* switch a client over to the socket taken in ssl_process_ktls() */
+static void
+ssl_ktls_switch(ssl_ctl_t * ctl, struct Client *client_p)
+{
+	rb_close(client_p->localClient->F);
+	client_p->localClient->F = client_p->localClient->ktls_F;
+	client_p->localClient->ktls_F = NULL;
+	SetKTLS(client_p);
+	ClearFlush(client_p);
+
+	/* ssld is done with it.  We are walking ctl's readq, so a retiring
+	 * ssld is left for cleanup_dead_ssl() to free */
+	ctl->ktls_count++;
+	ctl->cli_count--;
+	client_p->localClient->ssl_ctl = NULL;
+	if(ctl->shutdown && !ctl->cli_count)
+	{
+		ctl->dead = 1;
+		rb_kill(ctl->pid, SIGKILL);
+	}
+
+	/* authd_read_client() leaves a pending switch to start reading */
+	if(client_p->preClient == NULL ||
+	   (client_p->preClient->auth.flags & (AUTHC_F_COMPLETE | AUTHC_F_DEFERRED)) == AUTHC_F_COMPLETE)
+		rb_setselect(client_p->localClient->F, RB_SELECT_READ, read_packet, client_p);
+
+	send_queued(client_p);
+}
+
 static void
 ssl_process_open_fd(ssl_ctl_t * ctl, ssl_ctl_buf_t * ctl_buf)
 {
@@ -394,6 +481,9 @@ ssl_process_open_fd(ssl_ctl_t * ctl, ssl_ctl_buf_t * ctl_buf)
 	if(client_p == NULL || client_p->localClient == NULL)
 		return;
 
+	if(client_p->localClient->ktls_F != NULL)
+		ssl_ktls_switch(ctl, client_p);
+
 	if(client_p->localClient->ssl_callback)
 	{
 		SSL_OPEN_CB *hdl = client_p->localClient->ssl_callback;
@@ -553,6 +643,9 @@ ssl_process_cmd_recv(ssl_ctl_t * ctl)
 		case 'O':
 			ssl_process_open_fd(ctl, ctl_buf);
 			break;
+		case 'T':
+			ssl_process_ktls(ctl, ctl_buf);
+			break;
 		case 'D':
 			ssl_process_dead_fd(ctl, ctl_buf);
 			break;
@@ -768,10 +861,21 @@ send_certfp_method(ssl_ctl_t *ctl)
 	ssl_cmd_write_queue(ctl, NULL, 0, buf, sizeof(buf));
 }
 
+static void
+send_ktls(ssl_ctl_t *ctl)
+{
+	char buf[5];
+
+	buf[0] = 'E';
+	uint32_to_buf(&buf[1], ServerInfo.ssl_ktls);
+	ssl_cmd_write_queue(ctl, NULL, 0, buf, sizeof(buf));
+}
+
 static void
 ssld_update_config_one(ssl_ctl_t *ctl)
 {
 	send_certfp_method(ctl);
+	send_ktls(ctl);
 	send_new_ssl_certs_one(ctl);
 }
 
@@ -863,7 +967,6 @@ start_zlib_session(void *data)
 	struct Client *server = (struct Client *) data;
 	uint16_t recvqlen;
 	uint8_t level;
-	void *xbuf;
 
 	rb_fde_t *F[2];
 	rb_fde_t *xF1, *xF2;
@@ -872,11 +975,10 @@ start_zlib_session(void *data)
 
 	size_t hdr = (sizeof(uint8_t) * 2) + sizeof(uint32_t);
 	size_t len;
-	int cpylen, left;
 
 	server->localClient->event = NULL;
 
-	recvqlen = rb_linebuf_len(&server->localClient->buf_recvq);
+	recvqlen = recvq_length(server);
 
 	len = recvqlen + hdr;
 
@@ -899,16 +1001,7 @@ start_zlib_session(void *data)
 	recvq_start = &buf[6];
 	server->localClient->zipstats = (ZipStats *)rb_malloc(sizeof(struct ZipStats));
 
-	xbuf = recvq_start;
-	left = recvqlen;
-
-	do
-	{
-		cpylen = rb_linebuf_get(&server->localClient->buf_recvq, (char *)xbuf, left, LINEBUF_PARTIAL, LINEBUF_RAW);
-		left -= cpylen;
-		xbuf = (void *) (((uintptr_t) xbuf) + cpylen);
-	}
-	while(cpylen > 0);
+	recvq_take(server, (char *)recvq_start, recvqlen);
 
 	/* Pass the socket to ssld. */
 	*buf = 'Z';
@@ -990,14 +1083,14 @@ get_ssld_count(void)
 }
 
 void
-ssld_foreach_info(void (*func)(void *data, pid_t pid, int cli_count, enum ssld_status status, const char *version), void *data)
+ssld_foreach_info(void (*func)(void *data, pid_t pid, int cli_count, int ktls_count, enum ssld_status status, const char *version), void *data)
 {
 	rb_dlink_node *ptr, *next;
 	ssl_ctl_t *ctl;
 	RB_DLINK_FOREACH_SAFE(ptr, next, ssl_daemons.head)
 	{
 		ctl = (ssl_ctl_t *)ptr->data;
-		func(data, ctl->pid, ctl->cli_count,
+		func(data, ctl->pid, ctl->cli_count, ctl->ktls_count,
 			ctl->dead ? SSLD_DEAD :
 				(ctl->shutdown ? SSLD_SHUTDOWN : SSLD_ACTIVE),
 			ctl->version);
@@ -0,0 +1,471 @@
+/*
+ *  charybdis: an advanced ircd.
+ *  userindex.cc: Secondary indexes over users for mask searches.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ *  USA
+ */
+
+/*
+ * Every user is filed, case folded, under:
+ *
+ *  - its host, orighost and sockhost, in one ordered map,
+ *  - the same strings reversed, so "*.example.com" is a prefix scan,
+ *  - its username,
+ *  - its gecos, forwards and reversed,
+ *  - its address, in a patricia trie per address family.
+ *
+ * userindex_scan() turns a user@host mask, as used by TESTMASK, MASKTRACE
+ * and K-lines, into a scan of whichever index its longest literal part
+ * allows; userindex_scan_gecos() does the same for X-line masks.  Both
+ * return a superset of the matching users; callers still apply their
+ * own match.
+ */
+
+#include <ircd/stdinc.h>
+#include <ircd/userindex.h>
+#include <ircd/client.h>
+#include <ircd/match.h>
+#include <ircd/send.h>
+#include <ircd/s_assert.h>
+
+namespace ircd {
+
+namespace {
+
+/* the host strings a user is filed under */
+enum { UI_HOST, UI_ORIGHOST, UI_SOCKHOST, UI_NUMHOSTS };
+
+struct userindex_bucket
+{
+	rb_dlink_list clients;
+};
+
+typedef std::map<std::string, userindex_bucket> userindex_map;
+
+struct userindex_entry
+{
+	bool filed[UI_NUMHOSTS];
+	userindex_map::iterator host[UI_NUMHOSTS];
+	userindex_map::iterator rhost[UI_NUMHOSTS];
+	rb_dlink_node host_node[UI_NUMHOSTS];
+	rb_dlink_node rhost_node[UI_NUMHOSTS];
+
+	userindex_map::iterator user;
+	rb_dlink_node user_node;
+
+	userindex_map::iterator gecos;
+	userindex_map::iterator rgecos;
+	rb_dlink_node gecos_node;
+	rb_dlink_node rgecos_node;
+
+	rb_patricia_tree_t *ip_tree;
+	rb_patricia_node_t *ip;
+	rb_dlink_node ip_node;
+};
+
+userindex_map host_index;
+userindex_map rhost_index;
+userindex_map user_index;
+userindex_map gecos_index;
+userindex_map rgecos_index;
+rb_patricia_tree_t *ip4_index;
+rb_patricia_tree_t *ip6_index;
+std::unordered_map<struct Client *, userindex_entry> entries;
+
+/* match() wildcards, and match_esc() ones with its escape character */
+const char host_wild[] = "*?";
+const char gecos_wild[] = "*?#@\\";
+
+std::string
+fold(const char *s, bool reverse)
+{
+	std::string key(s);
+
+	for(auto &c : key)
+		c = irctolower(c);
+
+	if(reverse)
+		std::reverse(key.begin(), key.end());
+
+	return key;
+}
+
+/* literal()
+ *
+ * input	- mask, whether to take the end of it, wildcard characters
+ * output	- the folded characters before the first (or after the
+ *		  last) wildcard; a suffix is returned reversed
+ */
+std::string
+literal(const char *mask, bool suffix, const char *wild)
+{
+	std::string out;
+	const char *p;
+
+	if(!suffix)
+	{
+		for(p = mask; *p != '\0' && !strchr(wild, *p); p++)
+			out += irctolower(*p);
+	}
+	else
+	{
+		for(p = mask + strlen(mask); p > mask && !strchr(wild, p[-1]); p--)
+			out += irctolower(p[-1]);
+	}
+
+	return out;
+}
+
+userindex_map::iterator
+file(userindex_map &map, std::string key, rb_dlink_node *node, struct Client *client_p)
+{
+	auto it = map.emplace(std::move(key), userindex_bucket()).first;
+
+	rb_dlinkAdd(client_p, node, &it->second.clients);
+	return it;
+}
+
+void
+unfile(userindex_map &map, userindex_map::iterator it, rb_dlink_node *node)
+{
+	rb_dlinkDelete(node, &it->second.clients);
+
+	if(rb_dlink_list_length(&it->second.clients) == 0)
+		map.erase(it);
+}
+
+void
+visit(userindex_bucket *bucket, userindex_cb *cb, void *data)
+{
+	struct Client *target_p;
+	rb_dlink_node *ptr;
+
+	RB_DLINK_FOREACH(ptr, bucket->clients.head)
+	{
+		target_p = (Client *)ptr->data;
+
+		if(target_p->serial == current_serial)
+			continue;
+
+		target_p->serial = current_serial;
+		cb(target_p, data);
+	}
+}
+
+void
+scan_prefix(userindex_map &map, const std::string &prefix, userindex_cb *cb, void *data)
+{
+	auto it = map.lower_bound(prefix);
+
+	for(; it != map.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+		visit(&it->second, cb, data);
+}
+
+/* parse_cidr()
+ *
+ * input	- host mask, address buffer, family and prefix length storage
+ * output	- true if the mask is a CIDR mask, as understood by match_ips()
+ */
+bool
+parse_cidr(const char *mask, unsigned char *addr, int *family, int *bitlen)
+{
+	char buf[BUFSIZE];
+	char *len;
+
+	rb_strlcpy(buf, mask, sizeof(buf));
+
+	if((len = strrchr(buf, '/')) == NULL)
+		return false;
+	*len++ = '\0';
+
+	*bitlen = atoi(len);
+	if(*bitlen <= 0)
+		return false;
+
+#ifdef RB_IPV6
+	if(strchr(buf, ':'))
+	{
+		*family = AF_INET6;
+		return *bitlen <= 128 && rb_inet_pton(AF_INET6, buf, addr) > 0;
+	}
+#endif
+
+	*family = AF_INET;
+	return *bitlen <= 32 && rb_inet_pton(AF_INET, buf, addr) > 0;
+}
+
+/* scan_cidr()
+ *
+ * Descend to the subtree that holds every address under the prefix, then
+ * walk it.  Patricia skips bits, so each address is still checked.
+ */
+void
+scan_cidr(rb_patricia_tree_t *tree, unsigned char *addr, int bitlen,
+	  userindex_cb *cb, void *data)
+{
+	rb_patricia_node_t *node = tree->head;
+	rb_patricia_node_t *xnode;
+
+	while(node != NULL && node->bit < (unsigned int)bitlen)
+	{
+		if(BIT_TEST(addr[node->bit >> 3], 0x80 >> (node->bit & 0x07)))
+			node = node->r;
+		else
+			node = node->l;
+	}
+
+	if(node == NULL)
+		return;
+
+	RB_PATRICIA_WALK(node, xnode)
+	{
+		if(xnode->data != NULL &&
+		   comp_with_mask(rb_prefix_touchar(xnode->prefix), addr, bitlen))
+			visit((userindex_bucket *)xnode->data, cb, data);
+	}
+	RB_PATRICIA_WALK_END;
+}
+
+} // namespace
+
+void
+init_userindex(void)
+{
+	ip4_index = rb_new_patricia(32);
+	ip6_index = rb_new_patricia(128);
+}
+
+/* userindex_add()
+ *
+ * input	- user to index
+ * output	-
+ * side effects - user is filed under its current host, orighost,
+ *		  sockhost, username and address
+ */
+void
+userindex_add(struct Client *client_p)
+{
+	const char *hosts[UI_NUMHOSTS] = { client_p->host, client_p->orighost, client_p->sockhost };
+	struct rb_sockaddr_storage addr;
+	userindex_bucket *bucket;
+
+	auto res = entries.emplace(client_p, userindex_entry());
+	if(!res.second)
+		return;
+
+	userindex_entry &e = res.first->second;
+
+	for(int i = 0; i < UI_NUMHOSTS; i++)
+	{
+		bool repeat = EmptyString(hosts[i]);
+
+		for(int j = 0; j < i && !repeat; j++)
+			repeat = e.filed[j] && !irccmp(hosts[i], hosts[j]);
+
+		e.filed[i] = !repeat;
+		if(repeat)
+			continue;
+
+		e.host[i] = file(host_index, fold(hosts[i], false), &e.host_node[i], client_p);
+		e.rhost[i] = file(rhost_index, fold(hosts[i], true), &e.rhost_node[i], client_p);
+	}
+
+	e.user = file(user_index, fold(client_p->username, false), &e.user_node, client_p);
+	e.gecos = file(gecos_index, fold(client_p->info, false), &e.gecos_node, client_p);
+	e.rgecos = file(rgecos_index, fold(client_p->info, true), &e.rgecos_node, client_p);
+
+	e.ip = NULL;
+	memset(&addr, 0, sizeof(addr));
+	if(rb_inet_pton_sock(client_p->sockhost, (struct sockaddr *)&addr) > 0)
+	{
+		if(GET_SS_FAMILY(&addr) == AF_INET)
+			e.ip_tree = ip4_index;
+		else
+			e.ip_tree = ip6_index;
+
+		e.ip = make_and_lookup_ip(e.ip_tree, (struct sockaddr *)&addr,
+					  GET_SS_FAMILY(&addr) == AF_INET ? 32 : 128);
+		if(e.ip != NULL)
+		{
+			if(e.ip->data == NULL)
+				e.ip->data = new userindex_bucket();
+
+			bucket = (userindex_bucket *)e.ip->data;
+			rb_dlinkAdd(client_p, &e.ip_node, &bucket->clients);
+		}
+	}
+}
+
+/* userindex_del()
+ *
+ * input	- user to remove
+ * output	-
+ * side effects - user is removed from every index it was filed in
+ */
+void
+userindex_del(struct Client *client_p)
+{
+	userindex_bucket *bucket;
+
+	auto it = entries.find(client_p);
+	if(it == entries.end())
+		return;
+
+	userindex_entry &e = it->second;
+
+	for(int i = 0; i < UI_NUMHOSTS; i++)
+	{
+		if(!e.filed[i])
+			continue;
+
+		unfile(host_index, e.host[i], &e.host_node[i]);
+		unfile(rhost_index, e.rhost[i], &e.rhost_node[i]);
+	}
+
+	unfile(user_index, e.user, &e.user_node);
+	unfile(gecos_index, e.gecos, &e.gecos_node);
+	unfile(rgecos_index, e.rgecos, &e.rgecos_node);
+
+	if(e.ip != NULL)
+	{
+		bucket = (userindex_bucket *)e.ip->data;
+		rb_dlinkDelete(&e.ip_node, &bucket->clients);
+
+		if(rb_dlink_list_length(&bucket->clients) == 0)
+		{
+			delete bucket;
+			e.ip->data = NULL;
+			rb_patricia_remove(e.ip_tree, e.ip);
+		}
+	}
+
+	entries.erase(it);
+}
+
+/* userindex_update()
+ *
+ * input	- user whose host or username has changed
+ * output	-
+ * side effects - an indexed user is refiled under its new strings
+ */
+void
+userindex_update(struct Client *client_p)
+{
+	if(entries.find(client_p) == entries.end())
+		return;
+
+	userindex_del(client_p);
+	userindex_add(client_p);
+}
+
+/* userindex_scan()
+ *
+ * input	- username mask, host mask, callback, callback data
+ * output	-
+ * side effects - cb is called once for every user that may match the
+ *		  username mask and, against its host, orighost or
+ *		  sockhost, the host mask (textually or as CIDR).  cb must
+ *		  not exit clients.
+ */
+void
+userindex_scan(const char *username, const char *hostname, userindex_cb *cb, void *data)
+{
+	unsigned char addr[16];
+	int family, bitlen;
+	struct Client *target_p;
+	rb_dlink_node *ptr;
+
+	std::string uprefix = literal(username, false, host_wild);
+	std::string hprefix = literal(hostname, false, host_wild);
+	std::string hsuffix = literal(hostname, true, host_wild);
+	size_t hlen = std::max(hprefix.size(), hsuffix.size());
+
+	++current_serial;
+
+	/* users whose IP is hidden are matched against these instead */
+	if(match(hostname, "0") || match(hostname, "255.255.255.255"))
+		hlen = 0;
+	else if(parse_cidr(hostname, addr, &family, &bitlen))
+	{
+		scan_cidr(family == AF_INET ? ip4_index : ip6_index, addr, bitlen, cb, data);
+		scan_prefix(host_index, hprefix, cb, data);
+		return;
+	}
+
+	if(hlen > 0 && hlen >= uprefix.size())
+	{
+		if(hprefix.size() >= hsuffix.size())
+			scan_prefix(host_index, hprefix, cb, data);
+		else
+			scan_prefix(rhost_index, hsuffix, cb, data);
+		return;
+	}
+
+	if(!uprefix.empty())
+	{
+		scan_prefix(user_index, uprefix, cb, data);
+		return;
+	}
+
+	RB_DLINK_FOREACH(ptr, global_client_list.head)
+	{
+		target_p = (Client *)ptr->data;
+
+		if(IsPerson(target_p))
+			cb(target_p, data);
+	}
+}
+
+/* userindex_scan_gecos()
+ *
+ * input	- gecos mask as used by match_esc(), callback, callback data
+ * output	-
+ * side effects - cb is called once for every user whose gecos may
+ *		  match the mask.  cb must not exit clients.
+ */
+void
+userindex_scan_gecos(const char *mask, userindex_cb *cb, void *data)
+{
+	struct Client *target_p;
+	rb_dlink_node *ptr;
+
+	std::string prefix = literal(mask, false, gecos_wild);
+	std::string suffix = literal(mask, true, gecos_wild);
+
+	++current_serial;
+
+	if(!prefix.empty() && prefix.size() >= suffix.size())
+	{
+		scan_prefix(gecos_index, prefix, cb, data);
+		return;
+	}
+
+	if(!suffix.empty())
+	{
+		scan_prefix(rgecos_index, suffix, cb, data);
+		return;
+	}
+
+	RB_DLINK_FOREACH(ptr, global_client_list.head)
+	{
+		target_p = (Client *)ptr->data;
+
+		if(IsPerson(target_p))
+			cb(target_p, data);
+	}
+}
+
+} // namespace ircd
@@ -291,17 +291,11 @@ ms_ban(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *source_p
 				if(ConfigFileEntry.kline_delay ||
 						(IsServer(source_p) &&
 						 !HasSentEob(source_p)))
-				{
-					if(kline_queued == 0)
-					{
-						rb_event_addonce("check_klines", check_klines_event, NULL,
-							ConfigFileEntry.kline_delay ?
-								ConfigFileEntry.kline_delay : 1);
-						kline_queued = 1;
-					}
-				}
+					queue_kline_check(aconf,
+						ConfigFileEntry.kline_delay ?
+							ConfigFileEntry.kline_delay : 1);
 				else
-					check_klines();
+					check_one_kline(aconf);
 			}
 			break;
 		case CONF_XLINE:
@@ -310,7 +304,7 @@ ms_ban(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *source_p
 			else
 			{
 				rb_dlinkAddAlloc(aconf, &xline_conf_list);
-				check_xlines();
+				check_one_xline(aconf);
 			}
 			break;
 		case CONF_RESV_CHANNEL:
@@ -238,6 +238,7 @@ m_join(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *source_p
 	    key = (key) ? rb_strtok_r(NULL, ",", &p2) : NULL, name = rb_strtok_r(NULL, ",", &p))
 	{
 		hook_data_channel_activity hook_info;
+		struct hash_key chkey;
 
 		/* JOIN 0 simply parts all channels the user is in */
 		if(*name == '0' && !atoi(name))
@@ -250,7 +251,8 @@ m_join(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *source_p
 		}
 
 		/* look for the channel */
-		if((chptr = find_channel(name)) != NULL)
+		hash_key_init(&chkey, name);
+		if((chptr = find_channel_key(&chkey)) != NULL)
 		{
 			if(IsMember(source_p, chptr))
 				continue;
@@ -299,7 +301,7 @@ m_join(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *source_p
 
 		if(chptr == NULL)	/* If I already have a chptr, no point doing this */
 		{
-			chptr = get_or_create_channel(source_p, name, NULL);
+			chptr = get_or_create_channel_key(source_p, &chkey, NULL);
 
 			if(chptr == NULL)
 			{
@@ -259,6 +259,7 @@ possibly_remove_lower_forward(struct Client *fakesource_p, int mems,
 					actualBan->forward ? actualBan->forward : "");
 			rb_dlinkDelete(&actualBan->node, banlist);
 			free_ban(actualBan);
+			invalidate_bancache_channel(chptr);
 			return;
 		}
 	}
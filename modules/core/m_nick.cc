@@ -44,6 +44,7 @@
 #include <ircd/scache.h>
 #include <ircd/s_newconf.h>
 #include <ircd/monitor.h>
+#include <ircd/userindex.h>
 #include <ircd/s_assert.h>
 
 using namespace ircd;
@@ -1063,6 +1064,7 @@ register_client(struct Client *client_p, struct Client *server,
 
 	add_to_client_hash(nick, source_p);
 	add_to_hostname_hash(source_p->orighost, source_p);
+	userindex_add(source_p);
 	monitor_signon(source_p);
 
 	m = &parv[4][1];
@@ -26,6 +26,7 @@
 #include <ircd/modules.h>
 #include <ircd/whowas.h>
 #include <ircd/monitor.h>
+#include <ircd/userindex.h>
 
 using namespace ircd;
 
@@ -107,6 +108,7 @@ me_realhost(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *sou
 	else
 		ClearDynSpoof(source_p);
 	add_to_hostname_hash(source_p->orighost, source_p);
+	userindex_update(source_p);
 }
 
 static bool
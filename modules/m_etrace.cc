@@ -48,6 +48,7 @@
 #include <ircd/modules.h>
 #include <ircd/logger.h>
 #include <ircd/supported.h>
+#include <ircd/userindex.h>
 
 using namespace ircd;
 
@@ -294,48 +295,74 @@ m_chantrace(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *sou
 	sendto_one_numeric(source_p, RPL_ENDOFTRACE, form_str(RPL_ENDOFTRACE), me.name);
 }
 
+struct masktrace_query
+{
+	struct Client *source_p;
+	const char *username;
+	const char *hostname;
+	const char *name;
+	const char *gecos;
+};
+
 static void
-match_masktrace(struct Client *source_p, rb_dlink_list *list,
-	const char *username, const char *hostname, const char *name,
-	const char *gecos)
+masktrace_client(struct Client *target_p, void *data)
 {
-	struct Client *target_p;
-	rb_dlink_node *ptr;
+	struct masktrace_query *q = (struct masktrace_query *)data;
+	struct Client *source_p = q->source_p;
 	const char *sockhost;
 
-	RB_DLINK_FOREACH(ptr, list->head)
+	if(!IsPerson(target_p))
+		return;
+
+	if(EmptyString(target_p->sockhost))
+		sockhost = empty_sockhost;
+	else if(!show_ip(source_p, target_p))
+		sockhost = spoofed_sockhost;
+	else
+		sockhost = target_p->sockhost;
+
+	if(match(q->username, target_p->username) &&
+	   (match(q->hostname, target_p->host) ||
+	    match(q->hostname, target_p->orighost) ||
+	    match(q->hostname, sockhost) || match_ips(q->hostname, sockhost)))
 	{
-		target_p = (Client *)ptr->data;
-		if(!IsPerson(target_p))
-			continue;
+		if(q->name != NULL && !match(q->name, target_p->name))
+			return;
 
-		if(EmptyString(target_p->sockhost))
-			sockhost = empty_sockhost;
-		else if(!show_ip(source_p, target_p))
-			sockhost = spoofed_sockhost;
-		else
-			sockhost = target_p->sockhost;
+		if(q->gecos != NULL && !match_esc(q->gecos, target_p->info))
+			return;
 
-		if(match(username, target_p->username) &&
-		   (match(hostname, target_p->host) ||
-		    match(hostname, target_p->orighost) ||
-		    match(hostname, sockhost) || match_ips(hostname, sockhost)))
-		{
-			if(name != NULL && !match(name, target_p->name))
-				continue;
+		sendto_one(source_p, form_str(RPL_ETRACE),
+			me.name, source_p->name,
+			IsOper(target_p) ? "Oper" : "User",
+			/* class field -- pretend its server.. */
+			target_p->servptr->name,
+			target_p->name, target_p->username, target_p->host,
+			sockhost, target_p->info);
+	}
+}
 
-			if(gecos != NULL && !match_esc(gecos, target_p->info))
-				continue;
+/* match_masktrace()
+ *
+ * A global trace is planned through the user index; a local one only
+ * has lclient_list to walk, which is already small.
+ */
+static void
+match_masktrace(struct Client *source_p, int global,
+	const char *username, const char *hostname, const char *name,
+	const char *gecos)
+{
+	struct masktrace_query q = { source_p, username, hostname, name, gecos };
+	rb_dlink_node *ptr;
 
-			sendto_one(source_p, form_str(RPL_ETRACE),
-				me.name, source_p->name,
-				IsOper(target_p) ? "Oper" : "User",
-				/* class field -- pretend its server.. */
-				target_p->servptr->name,
-				target_p->name, target_p->username, target_p->host,
-				sockhost, target_p->info);
-		}
+	if(global)
+	{
+		userindex_scan(username, hostname, masktrace_client, &q);
+		return;
 	}
+
+	RB_DLINK_FOREACH(ptr, lclient_list.head)
+		masktrace_client((Client *)ptr->data, &q);
 }
 
 static void
@@ -398,9 +425,9 @@ mo_masktrace(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *so
 
 			report_operspy(source_p, "MASKTRACE", buf);
 		}
-		match_masktrace(source_p, &global_client_list, username, hostname, name, gecos);
+		match_masktrace(source_p, 1, username, hostname, name, gecos);
 	} else
-		match_masktrace(source_p, &lclient_list, username, hostname, name, gecos);
+		match_masktrace(source_p, 0, username, hostname, name, gecos);
 
 	sendto_one_numeric(source_p, RPL_ENDOFTRACE, form_str(RPL_ENDOFTRACE), me.name);
 }
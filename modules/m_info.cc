@@ -195,6 +195,36 @@ static struct InfoStruct info_table[] = {
 		&ConfigFileEntry.disable_auth,
 		"Controls whether auth checking is disabled or not"
 	},
+	{
+		"dns_cache_size",
+		OUTPUT_DECIMAL,
+		&ConfigFileEntry.dns_cache_size,
+		"Number of DNS answers authd keeps"
+	},
+	{
+		"dns_cache_max_ttl",
+		OUTPUT_DECIMAL,
+		&ConfigFileEntry.dns_cache_max_ttl,
+		"Longest time authd keeps a DNS answer"
+	},
+	{
+		"dns_cache_negative_ttl",
+		OUTPUT_DECIMAL,
+		&ConfigFileEntry.dns_cache_negative_ttl,
+		"Longest time authd keeps a DNS answer that a name does not exist"
+	},
+	{
+		"blacklist_cache_ttl",
+		OUTPUT_DECIMAL,
+		&ConfigFileEntry.blacklist_cache_ttl,
+		"How long authd remembers that an address is blacklisted"
+	},
+	{
+		"blacklist_cache_negative_ttl",
+		OUTPUT_DECIMAL,
+		&ConfigFileEntry.blacklist_cache_negative_ttl,
+		"How long authd remembers that an address is not blacklisted"
+	},
 	{
 		"disable_fake_channels",
 		OUTPUT_BOOLEAN_YN,
@@ -711,6 +741,8 @@ mo_info(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *source_
 			send_conf_options(source_p);
 			sendto_one_numeric(source_p, RPL_INFO, ":%s",
 					rb_lib_version());
+			sendto_one_numeric(source_p, RPL_INFO, ":librb scan kernel: %s",
+					rb_scan_kernel());
 		}
 
 		send_birthdate_online_time(source_p);
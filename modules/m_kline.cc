@@ -218,16 +218,9 @@ mo_kline(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *source
 		apply_kline(source_p, aconf, reason, oper_reason);
 
 	if(ConfigFileEntry.kline_delay)
-	{
-		if(!kline_queued)
-		{
-			rb_event_addonce("check_klines", check_klines_event, NULL,
-					 ConfigFileEntry.kline_delay);
-			kline_queued = true;
-		}
-	}
+		queue_kline_check(aconf, ConfigFileEntry.kline_delay);
 	else
-		check_klines();
+		check_one_kline(aconf);
 }
 
 /* ms_kline()
@@ -328,16 +321,9 @@ handle_remote_kline(struct Client *source_p, int tkline_time,
 		apply_kline(source_p, aconf, reason, oper_reason);
 
 	if(ConfigFileEntry.kline_delay)
-	{
-		if(!kline_queued)
-		{
-			rb_event_addonce("check_klines", check_klines_event, NULL,
-					 ConfigFileEntry.kline_delay);
-			kline_queued = true;
-		}
-	}
+		queue_kline_check(aconf, ConfigFileEntry.kline_delay);
 	else
-		check_klines();
+		check_one_kline(aconf);
 }
 
 /* mo_unkline()
@@ -28,6 +28,7 @@
 #include <ircd/msg.h>
 #include <ircd/modules.h>
 #include <ircd/sslproc.h>
+#include <ircd/packet.h>
 #include <ircd/s_assert.h>
 #include <ircd/s_serv.h>
 #include <ircd/logger.h>
@@ -85,7 +86,7 @@ mr_starttls(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *sou
 	s_assert(client_p->localClient != NULL);
 
 	/* clear out any remaining plaintext lines */
-	rb_linebuf_donebuf(&client_p->localClient->buf_recvq);
+	recvq_clear(client_p);
 
 	sendto_one_numeric(client_p, RPL_STARTTLS, form_str(RPL_STARTTLS));
 	send_queued(client_p);
@@ -306,6 +306,13 @@ stats_dns_servers (struct Client *source_p)
 	{
 		sendto_one_numeric(source_p, RPL_STATSDEBUG, "A %s", (char *)n->data);
 	}
+
+	/* authd answers asynchronously, so show the last counters we have */
+	if(dns_cache_stats[0] != '\0')
+		sendto_one_numeric(source_p, RPL_STATSDEBUG, "A cache %s (%ld seconds ago)",
+				   dns_cache_stats, (long)(rb_current_time() - dns_cache_stats_time));
+
+	refresh_dns_cache_stats();
 }
 
 static void
@@ -791,9 +798,13 @@ stats_dnsbl(struct Client *source_p)
 		stats = (BlacklistStats *)elem;
 
 		/* use RPL_STATSDEBUG for now -- jilles */
-		sendto_one_numeric(source_p, RPL_STATSDEBUG, "n :%d %s",
-				stats->hits, (const char *)iter.cur->key);
+		sendto_one_numeric(source_p, RPL_STATSDEBUG, "n :%d %s (cache %u hits, %u misses)",
+				stats->hits, (const char *)iter.cur->key,
+				stats->cache_hits, stats->cache_misses);
 	}
+
+	/* Cache counters shown are from the previous request */
+	refresh_blacklist_stats();
 }
 
 static void
@@ -943,15 +954,16 @@ stats_resv(struct Client *source_p)
 }
 
 static void
-stats_ssld_foreach(void *data, pid_t pid, int cli_count, enum ssld_status status, const char *version)
+stats_ssld_foreach(void *data, pid_t pid, int cli_count, int ktls_count, enum ssld_status status, const char *version)
 {
 	struct Client *source_p = (Client *)data;
 
 	sendto_one_numeric(source_p, RPL_STATSDEBUG,
-			"S :%u %c %u :%s",
+			"S :%u %c %u %u :%s",
 			pid,
 			status == SSLD_DEAD ? 'D' : (status == SSLD_SHUTDOWN ? 'S' : 'A'),
 			cli_count,
+			ktls_count,
 			version);
 }
 
@@ -964,6 +976,7 @@ stats_ssld(struct Client *source_p)
 static void
 stats_usage (struct Client *source_p)
 {
+	unsigned long ctl, waits;
 #ifndef _WIN32
 	struct rusage rus;
 	time_t secs;
@@ -1017,6 +1030,11 @@ stats_usage (struct Client *source_p)
 			   (int) rus.ru_nsignals, (int) rus.ru_nvcsw,
 			   (int) rus.ru_nivcsw);
 #endif
+
+	if(rb_get_io_counts(&ctl, &waits))
+		sendto_one_numeric(source_p, RPL_STATSDEBUG,
+				   "R :IO %s: %lu interest changes, %lu waits",
+				   rb_get_iotype(), ctl, waits);
 }
 
 static void
@@ -1079,6 +1097,10 @@ stats_tstats (struct Client *source_p)
 			   sp.is_tgch, rb_dlink_list_length(&tgchange_list));
 	sendto_one_numeric(source_p, RPL_STATSDEBUG,
 			   "T :ratelimit blocked commands %u", sp.is_rl);
+	sendto_one_numeric(source_p, RPL_STATSDEBUG,
+			   "T :channel fanout messages %llu renders %llu (%.2f per message)",
+			   sp.is_fanout, sp.is_fanout_renders,
+			   sp.is_fanout ? (double) sp.is_fanout_renders / sp.is_fanout : 0.0);
 	sendto_one_numeric(source_p, RPL_STATSDEBUG,
 			   "T :auth successes %u fails %u",
 			   sp.is_asuc, sp.is_abad);
@@ -1295,6 +1317,19 @@ stats_class(struct Client *source_p)
 		report_classes(source_p);
 }
 
+static void
+stats_memory_heap(size_t used, size_t freem, size_t memusage, size_t heapalloc,
+		  size_t high, const char *desc, void *data)
+{
+	struct Client *source_p = (Client *)data;
+
+	sendto_one_numeric(source_p, RPL_STATSDEBUG,
+			   "z :Heap %s used %lu(%lu) free %lu peak %lu allocated %lu",
+			   desc, (unsigned long)used, (unsigned long)memusage,
+			   (unsigned long)freem, (unsigned long)high,
+			   (unsigned long)heapalloc);
+}
+
 static void
 stats_memory (struct Client *source_p)
 {
@@ -1375,6 +1410,8 @@ stats_memory (struct Client *source_p)
 		chptr = (Channel *)ptr->data;
 		channel_count++;
 		channel_memory += (strlen(chptr->chname) + sizeof(struct Channel));
+		if(chptr->member_index != NULL)
+			channel_memory += (chptr->member_index_mask + 1) * sizeof(struct membership *);
 
 		channel_users += rb_dlink_list_length(&chptr->members);
 		channel_invites += rb_dlink_list_length(&chptr->invites);
@@ -1511,6 +1548,8 @@ stats_memory (struct Client *source_p)
 			   "z :Remote client Memory in use: %ld(%ld)",
 			   (long)remote_client_count,
 			   (long)remote_client_memory_used);
+
+	rb_bh_usage_all(stats_memory_heap, source_p);
 }
 
 static void
@@ -1545,6 +1584,28 @@ stats_ziplinks (struct Client *source_p)
 			   "Z :%u ziplink(s)", sent_data);
 }
 
+static void
+stats_servlink_burst(struct Client *source_p, struct Client *target_p)
+{
+	struct Burst *burst = target_p->localClient->burst;
+
+	if(burst->active)
+	{
+		sendto_one_numeric(source_p, RPL_STATSDEBUG,
+				   "? :Burst %s: %u users %u channels %u lines %lu bytes (in progress)",
+				   target_p->name, burst->users, burst->channels,
+				   burst->lines, burst->bytes);
+		return;
+	}
+
+	sendto_one_numeric(source_p, RPL_STATSDEBUG,
+			   "? :Burst %s: %u users %u channels %u lines %lu bytes in %lu.%03lus (%.1f K/s)",
+			   target_p->name, burst->users, burst->channels,
+			   burst->lines, burst->bytes,
+			   burst->msec / 1000, burst->msec % 1000,
+			   burst->msec ? (double) burst->bytes / 1.024 / burst->msec : 0.0);
+}
+
 static void
 stats_servlinks (struct Client *source_p)
 {
@@ -1585,6 +1646,9 @@ stats_servlinks (struct Client *source_p)
 			(rb_current_time() > target_p->localClient->lasttime) ?
 			 (rb_current_time() - target_p->localClient->lasttime) : 0,
 			IsOper (source_p) ? show_capabilities (target_p) : "TS");
+
+		if(IsOper(source_p) && target_p->localClient->burst != NULL)
+			stats_servlink_burst(source_p, target_p);
 	}
 
 	sendto_one_numeric(source_p, RPL_STATSDEBUG,
@@ -1763,7 +1827,7 @@ stats_l_client(struct Client *source_p, struct Client *target_p,
 				    rb_current_time() - target_p->localClient->firsttime,
 				    (rb_current_time() > target_p->localClient->lasttime) ?
 				     (rb_current_time() - target_p->localClient->lasttime) : 0,
-				    "-");
+				    IsKTLS(target_p) ? "kTLS" : (IsSSL(target_p) ? "TLS" : "-"));
 	}
 }
 
@@ -44,6 +44,7 @@
 #include <ircd/msg.h>
 #include <ircd/parse.h>
 #include <ircd/modules.h>
+#include <ircd/userindex.h>
 
 using namespace ircd;
 
@@ -64,17 +65,58 @@ DECLARE_MODULE_AV2(testmask, NULL, NULL, testmask_clist, NULL, NULL, NULL, NULL,
 static const char *empty_sockhost = "255.255.255.255";
 static const char *spoofed_sockhost = "0";
 
+struct testmask_query
+{
+	struct Client *source_p;
+	const char *name;
+	const char *username;
+	const char *hostname;
+	const char *gecos;
+	int lcount;
+	int gcount;
+};
+
+static void
+testmask_client(struct Client *target_p, void *data)
+{
+	struct testmask_query *q = (struct testmask_query *)data;
+	const char *sockhost;
+
+	if(!IsPerson(target_p))
+		return;
+
+	if(EmptyString(target_p->sockhost))
+		sockhost = empty_sockhost;
+	else if(!show_ip(q->source_p, target_p))
+		sockhost = spoofed_sockhost;
+	else
+		sockhost = target_p->sockhost;
+
+	if(match(q->username, target_p->username) &&
+	   (match(q->hostname, target_p->host) ||
+	    match(q->hostname, target_p->orighost) ||
+	    match(q->hostname, sockhost) || match_ips(q->hostname, sockhost)))
+	{
+		if(q->name && !match(q->name, target_p->name))
+			return;
+
+		if(q->gecos && !match_esc(q->gecos, target_p->info))
+			return;
+
+		if(MyClient(target_p))
+			q->lcount++;
+		else
+			q->gcount++;
+	}
+}
+
 static void
 mo_testmask(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *source_p,
                         int parc, const char *parv[])
 {
-	struct Client *target_p;
-	int lcount = 0;
-	int gcount = 0;
+	struct testmask_query q;
 	char *name, *username, *hostname;
-	const char *sockhost;
 	char *gecos = NULL;
-	rb_dlink_node *ptr;
 
 	name = LOCAL_COPY(parv[1]);
 	collapse(name);
@@ -109,40 +151,17 @@ mo_testmask(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *sou
 		collapse_esc(gecos);
 	}
 
-	RB_DLINK_FOREACH(ptr, global_client_list.head)
-	{
-		target_p = (Client *)ptr->data;
-
-		if(!IsPerson(target_p))
-			continue;
+	q.source_p = source_p;
+	q.name = name;
+	q.username = username;
+	q.hostname = hostname;
+	q.gecos = gecos;
+	q.lcount = q.gcount = 0;
 
-		if(EmptyString(target_p->sockhost))
-			sockhost = empty_sockhost;
-		else if(!show_ip(source_p, target_p))
-			sockhost = spoofed_sockhost;
-		else
-			sockhost = target_p->sockhost;
-
-		if(match(username, target_p->username) &&
-		   (match(hostname, target_p->host) ||
-		    match(hostname, target_p->orighost) ||
-		    match(hostname, sockhost) || match_ips(hostname, sockhost)))
-		{
-			if(name && !match(name, target_p->name))
-				continue;
-
-			if(gecos && !match_esc(gecos, target_p->info))
-				continue;
-
-			if(MyClient(target_p))
-				lcount++;
-			else
-				gcount++;
-		}
-	}
+	userindex_scan(username, hostname, testmask_client, &q);
 
 	sendto_one(source_p, form_str(RPL_TESTMASKGECOS),
 			me.name, source_p->name,
-			lcount, gcount, name ? name : "*",
+			q.lcount, q.gcount, name ? name : "*",
 			username, hostname, gecos ? gecos : "*");
 }
@@ -288,6 +288,51 @@ m_who(struct MsgBuf *msgbuf_p, struct Client *client_p, struct Client *source_p,
 		   me.name, source_p->name, mask);
 }
 
+/* who_field
+ * inputs	- mask, length of its literal tail, field to match
+ * output	- 1 if the field matches the mask
+ * side effects - a field whose end cannot be the mask's literal tail
+ *		  is rejected before match() backtracks over it; this is
+ *		  what makes "*.example.com" cheap across every user
+ */
+static int
+who_field(const char *mask, size_t masklen, size_t taillen, const char *field)
+{
+	size_t len = strlen(field);
+
+	if(taillen > len)
+		return 0;
+
+	if(taillen > 0 && irccmp(mask + masklen - taillen, field + len - taillen))
+		return 0;
+
+	return match(mask, field);
+}
+
+/* who_matches
+ * inputs	- pointer to client requesting who
+ *		- pointer to client to match
+ *		- mask to match
+ * output	- 1 if the mask matches any of the fields WHO searches
+ */
+static int
+who_matches(struct Client *source_p, struct Client *target_p, const char *mask)
+{
+	size_t masklen = strlen(mask);
+	size_t taillen = 0;
+
+	while(taillen < masklen && mask[masklen - taillen - 1] != '*' &&
+	      mask[masklen - taillen - 1] != '?')
+		taillen++;
+
+	return who_field(mask, masklen, taillen, target_p->name) ||
+		who_field(mask, masklen, taillen, target_p->username) ||
+		who_field(mask, masklen, taillen, target_p->host) ||
+		who_field(mask, masklen, taillen, target_p->servptr->name) ||
+		(IsOper(source_p) && who_field(mask, masklen, taillen, target_p->orighost)) ||
+		who_field(mask, masklen, taillen, target_p->info);
+}
+
 /* who_common_channel
  * inputs	- pointer to client requesting who
  * 		- pointer to channel member chain.
@@ -323,11 +368,7 @@ who_common_channel(struct Client *source_p, struct Channel *chptr,
 
 		if(*maxmatches > 0)
 		{
-			if((mask == NULL) ||
-					match(mask, target_p->name) || match(mask, target_p->username) ||
-					match(mask, target_p->host) || match(mask, target_p->servptr->name) ||
-					(IsOper(source_p) && match(mask, target_p->orighost)) ||
-					match(mask, target_p->info))
+			if(mask == NULL || who_matches(source_p, target_p, mask))
 			{
 				do_who(source_p, target_p, NULL, fmt);
 				--(*maxmatches);
@@ -348,14 +389,17 @@ who_common_channel(struct Client *source_p, struct Channel *chptr,
  * side effects - do a global scan of all clients looking for match
  *		  this is slightly expensive on EFnet ...
  *		  marks assumed cleared for all clients initially
- *		  and will be left cleared on return
+ *		  and will be left cleared on return; once the match
+ *		  limit is hit, the only marked clients left are on the
+ *		  requester's channels, so those are cleared instead of
+ *		  finishing the scan
  */
 static void
 who_global(struct Client *source_p, const char *mask, int server_oper, int operspy, struct who_format *fmt)
 {
 	struct membership *msptr;
 	struct Client *target_p;
-	rb_dlink_node *lp, *ptr;
+	rb_dlink_node *lp, *ptr, *mp;
 	int maxmatches = 500;
 
 	/* first, list all matching INvisible clients on common channels
@@ -392,17 +436,24 @@ who_global(struct Client *source_p, const char *mask, int server_oper, int opers
 		if(server_oper && !IsOper(target_p))
 			continue;
 
-		if(maxmatches > 0)
+		if(maxmatches <= 0)
+			break;
+
+		if(!mask || who_matches(source_p, target_p, mask))
 		{
-			if(!mask ||
-					match(mask, target_p->name) || match(mask, target_p->username) ||
-					match(mask, target_p->host) || match(mask, target_p->servptr->name) ||
-					(IsOper(source_p) && match(mask, target_p->orighost)) ||
-					match(mask, target_p->info))
-			{
-				do_who(source_p, target_p, NULL, fmt);
-				--maxmatches;
-			}
+			do_who(source_p, target_p, NULL, fmt);
+			--maxmatches;
+		}
+	}
+
+	if(ptr != NULL && !operspy)
+	{
+		RB_DLINK_FOREACH(lp, source_p->user->channel.head)
+		{
+			msptr = (membership *)lp->data;
+
+			RB_DLINK_FOREACH(mp, msptr->chptr->members.head)
+				ClearMark(((membership *)mp->data)->client_p);
 		}
 	}
 
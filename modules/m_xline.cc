@@ -328,7 +328,7 @@ apply_xline(struct Client *source_p, const char *name, const char *reason, int t
 	}
 
 	rb_dlinkAddAlloc(aconf, &xline_conf_list);
-	check_xlines();
+	check_one_xline(aconf);
 }
 
 static void
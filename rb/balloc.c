@@ -52,14 +52,31 @@
  * the block and return it back to the OS, thus causing our memory consumption to go
  * down after we no longer need it.
  *
- *
+ * Each heap carves its blocks into fixed size slots.  A slot is a pointer
+ * back to its block, padded to offset_pad, followed by the element.  Slots
+ * are handed out from a block's intrusive free list, or failing that from
+ * the block's never used tail, so a new block only touches the pages it
+ * actually hands out.  Blocks with free slots sit on the heap's block_list
+ * and full ones on its full_list.  A block whose slots are all free again
+ * is given back, unless it is the only block left with room.
  *
  */
 #include <rb/rb.h>
 
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#if !defined(MAP_ANON) && defined(MAP_ANONYMOUS)
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+#ifdef MAP_ANON
+#define RB_BH_MMAP 1
+#endif
+#endif
+
 static void _rb_bh_fail(const char *reason, const char *file, int line) __attribute__((noreturn));
 
 static uintptr_t offset_pad;
+static size_t bh_pagesize;
 
 /* status information for an allocated block in heap */
 struct rb_heap_block
@@ -68,6 +85,9 @@ struct rb_heap_block
 	rb_dlink_node node;
 	unsigned long free_count;
 	void *elems;		/* Points to allocated memory */
+	void *free_elems;	/* freed elements, linked through their first word */
+	unsigned long fresh;	/* slots from here on have never been used */
+	struct rb_bh *heap;
 };
 typedef struct rb_heap_block rb_heap_block;
 
@@ -76,9 +96,13 @@ struct rb_bh
 {
 	rb_dlink_node hlist;
 	size_t elemSize;	/* Size of each element to be stored */
+	size_t slotSize;	/* elemSize plus the block pointer */
+	size_t blockSize;	/* bytes per block, header included */
 	unsigned long elemsPerBlock;	/* Number of elements per block */
-	rb_dlink_list block_list;
-	rb_dlink_list free_list;
+	rb_dlink_list block_list;	/* blocks with free slots */
+	rb_dlink_list full_list;	/* blocks without */
+	size_t used;		/* elements handed out */
+	size_t high;		/* most elements ever handed out at once */
 	char *desc;
 };
 
@@ -86,6 +110,10 @@ static rb_dlink_list *heap_lists;
 
 #define rb_bh_fail(x) _rb_bh_fail(x, __FILE__, __LINE__)
 
+#define BH_ALIGN(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+#define BH_BLOCK_HEADER BH_ALIGN(sizeof(rb_heap_block), 16)
+#define BH_SLOT_BLOCK(ptr) (*(rb_heap_block **)(void *)((char *)(ptr) - offset_pad))
+
 static void
 _rb_bh_fail(const char *reason, const char *file, int line)
 {
@@ -116,6 +144,54 @@ rb_init_bh(void)
 		offset_pad &= ~(__alignof__(long long) - 1);
 	}
 #endif
+
+#ifdef RB_BH_MMAP
+	bh_pagesize = sysconf(_SC_PAGESIZE);
+#endif
+	if(bh_pagesize == 0 || (bh_pagesize & (bh_pagesize - 1)) != 0)
+		bh_pagesize = 4096;
+}
+
+/*
+ * newblock - get a block of memory off the system for bh and put it at
+ * the head of the heap's block_list
+ */
+static rb_heap_block *
+newblock(rb_bh *bh)
+{
+	rb_heap_block *b;
+	void *mem;
+
+#ifdef RB_BH_MMAP
+	mem = mmap(NULL, bh->blockSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if(mem == MAP_FAILED)
+		rb_outofmemory();
+#else
+	mem = rb_malloc(bh->blockSize);
+#endif
+
+	b = mem;
+	b->alloc_size = bh->blockSize;
+	b->free_count = bh->elemsPerBlock;
+	b->elems = (char *)mem + BH_BLOCK_HEADER;
+	b->free_elems = NULL;
+	b->fresh = 0;
+	b->heap = bh;
+	rb_dlinkAdd(b, &b->node, &bh->block_list);
+	return b;
+}
+
+/*
+ * freeblock - give an unused block back to the system
+ */
+static void
+freeblock(rb_heap_block *b)
+{
+#ifdef RB_BH_MMAP
+	munmap((void *)b, b->alloc_size);
+#else
+	rb_free(b);
+#endif
 }
 
 /* ************************************************************************ */
@@ -129,7 +205,8 @@ rb_init_bh(void)
 /*   elemsize (IN):  Size of the basic element to be stored                 */
 /*   elemsperblock (IN):  Number of elements to be stored in a single block */
 /*         of memory.  When the blockheap runs out of free memory, it will  */
-/*         allocate elemsize * elemsperblock more.                          */
+/*         allocate elemsize * elemsperblock more, rounded up to whole      */
+/*         pages, and the spare room is used for more elements.             */
 /* Returns:                                                                 */
 /*   Pointer to new rb_bh, or NULL if unsuccessful                      */
 /* ************************************************************************ */
@@ -152,7 +229,9 @@ rb_bh_create(size_t elemsize, int elemsperblock, const char *desc)
 	/* Allocate our new rb_bh */
 	bh = rb_malloc(sizeof(rb_bh));
 	bh->elemSize = elemsize;
-	bh->elemsPerBlock = elemsperblock;
+	bh->slotSize = offset_pad + BH_ALIGN(elemsize, offset_pad);
+	bh->blockSize = BH_ALIGN(BH_BLOCK_HEADER + bh->slotSize * elemsperblock, bh_pagesize);
+	bh->elemsPerBlock = (bh->blockSize - BH_BLOCK_HEADER) / bh->slotSize;
 	if(desc != NULL)
 		bh->desc = rb_strdup(desc);
 
@@ -169,7 +248,7 @@ rb_bh_create(size_t elemsize, int elemsperblock, const char *desc)
 /*    rb_bh_alloc                                                        */
 /* Description:                                                             */
 /*    Returns a pointer to a struct within our rb_bh that's free for    */
-/*    the taking.                                                           */
+/*    the taking.  The memory is zeroed.                                    */
 /* Parameters:                                                              */
 /*    bh (IN):  Pointer to the Blockheap.                                   */
 /* Returns:                                                                 */
@@ -179,13 +258,41 @@ rb_bh_create(size_t elemsize, int elemsperblock, const char *desc)
 void *
 rb_bh_alloc(rb_bh *bh)
 {
+	rb_heap_block *b;
+	void *data;
+
 	lrb_assert(bh != NULL);
 	if(rb_unlikely(bh == NULL))
 	{
 		rb_bh_fail("Cannot allocate if bh == NULL");
 	}
 
-	return (rb_malloc(bh->elemSize));
+	if(bh->block_list.head != NULL)
+		b = bh->block_list.head->data;
+	else
+		b = newblock(bh);
+
+	if(b->free_elems != NULL)
+	{
+		data = b->free_elems;
+		b->free_elems = *(void **)data;
+	}
+	else
+	{
+		char *slot = (char *)b->elems + b->fresh++ * bh->slotSize;
+
+		*(rb_heap_block **)(void *)slot = b;
+		data = slot + offset_pad;
+	}
+
+	if(--b->free_count == 0)
+		rb_dlinkMoveNode(&b->node, &bh->block_list, &bh->full_list);
+
+	if(++bh->used > bh->high)
+		bh->high = bh->used;
+
+	memset(data, 0, bh->elemSize);
+	return (data);
 }
 
 
@@ -193,7 +300,8 @@ rb_bh_alloc(rb_bh *bh)
 /* FUNCTION DOCUMENTATION:                                                  */
 /*    rb_bh_free                                                          */
 /* Description:                                                             */
-/*    Returns an element to the free pool, does not free()                  */
+/*    Returns an element to the free pool.  When that leaves its block     */
+/*    empty and another block has room, the block is released.            */
 /* Parameters:                                                              */
 /*    bh (IN): Pointer to rb_bh containing element                        */
 /*    ptr (in):  Pointer to element to be "freed"                           */
@@ -203,6 +311,8 @@ rb_bh_alloc(rb_bh *bh)
 int
 rb_bh_free(rb_bh *bh, void *ptr)
 {
+	rb_heap_block *b;
+
 	lrb_assert(bh != NULL);
 	lrb_assert(ptr != NULL);
 
@@ -218,7 +328,28 @@ rb_bh_free(rb_bh *bh, void *ptr)
 		return (1);
 	}
 
-	rb_free(ptr);
+	b = BH_SLOT_BLOCK(ptr);
+	if(rb_unlikely(b->heap != bh))
+	{
+		rb_lib_log("balloc.c:rb_bhFree() %p not in heap %s", ptr,
+			   bh->desc != NULL ? bh->desc : "(unnamed_heap)");
+		return (1);
+	}
+
+	*(void **)ptr = b->free_elems;
+	b->free_elems = ptr;
+
+	if(b->free_count++ == 0)
+		rb_dlinkMoveNode(&b->node, &bh->full_list, &bh->block_list);
+
+	bh->used--;
+
+	if(b->free_count == bh->elemsPerBlock && rb_dlink_list_length(&bh->block_list) > 1)
+	{
+		rb_dlinkDelete(&b->node, &bh->block_list);
+		freeblock(b);
+	}
+
 	return (0);
 }
 
@@ -236,9 +367,17 @@ rb_bh_free(rb_bh *bh, void *ptr)
 int
 rb_bh_destroy(rb_bh *bh)
 {
+	rb_dlink_node *ptr, *next;
+
 	if(bh == NULL)
 		return (1);
 
+	RB_DLINK_FOREACH_SAFE(ptr, next, bh->block_list.head)
+		freeblock(ptr->data);
+
+	RB_DLINK_FOREACH_SAFE(ptr, next, bh->full_list.head)
+		freeblock(ptr->data);
+
 	rb_dlinkDelete(&bh->hlist, heap_lists);
 	rb_free(bh->desc);
 	rb_free(bh);
@@ -246,17 +385,23 @@ rb_bh_destroy(rb_bh *bh)
 	return (0);
 }
 
+static size_t
+rb_bh_blocks(rb_bh *bh)
+{
+	return rb_dlink_list_length(&bh->block_list) + rb_dlink_list_length(&bh->full_list);
+}
+
 void
 rb_bh_usage(rb_bh *bh, size_t *bused, size_t *bfree, size_t *bmemusage, const char **desc)
 {
 	if(bused != NULL)
-		*bused = 0;
+		*bused = bh->used;
 	if(bfree != NULL)
-		*bfree = 0;
+		*bfree = rb_bh_blocks(bh) * bh->elemsPerBlock - bh->used;
 	if(bmemusage != NULL)
-		*bmemusage = 0;
+		*bmemusage = bh->used * bh->elemSize;
 	if(desc != NULL)
-		*desc = "no blockheap";
+		*desc = bh->desc;
 }
 
 void
@@ -266,7 +411,7 @@ rb_bh_usage_all(rb_bh_usage_cb *cb, void *data)
 	rb_bh *bh;
 	size_t used, freem, memusage, heapalloc;
 	static const char *unnamed = "(unnamed_heap)";
-	const char *desc = unnamed;
+	const char *desc;
 
 	if(cb == NULL)
 		return;
@@ -274,13 +419,12 @@ rb_bh_usage_all(rb_bh_usage_cb *cb, void *data)
 	RB_DLINK_FOREACH(ptr, heap_lists->head)
 	{
 		bh = (rb_bh *)ptr->data;
-		freem = rb_dlink_list_length(&bh->free_list);
-		used = (rb_dlink_list_length(&bh->block_list) * bh->elemsPerBlock) - freem;
+		used = bh->used;
+		freem = rb_bh_blocks(bh) * bh->elemsPerBlock - used;
 		memusage = used * bh->elemSize;
-		heapalloc = (freem + used) * bh->elemSize;
-		if(bh->desc != NULL)
-			desc = bh->desc;
-		cb(used, freem, memusage, heapalloc, desc, data);
+		heapalloc = rb_bh_blocks(bh) * bh->blockSize;
+		desc = bh->desc != NULL ? bh->desc : unnamed;
+		cb(used, freem, memusage, heapalloc, bh->high, desc, data);
 	}
 	return;
 }
@@ -289,16 +433,14 @@ void
 rb_bh_total_usage(size_t *total_alloc, size_t *total_used)
 {
 	rb_dlink_node *ptr;
-	size_t total_memory = 0, used_memory = 0, used, freem;
+	size_t total_memory = 0, used_memory = 0;
 	rb_bh *bh;
 
 	RB_DLINK_FOREACH(ptr, heap_lists->head)
 	{
 		bh = (rb_bh *)ptr->data;
-		freem = rb_dlink_list_length(&bh->free_list);
-		used = (rb_dlink_list_length(&bh->block_list) * bh->elemsPerBlock) - freem;
-		used_memory += used * bh->elemSize;
-		total_memory += (freem + used) * bh->elemSize;
+		used_memory += bh->used * bh->elemSize;
+		total_memory += rb_bh_blocks(bh) * bh->blockSize;
 	}
 
 	if(total_alloc != NULL)
@@ -40,9 +40,8 @@
 
 struct timeout_data
 {
+	struct rb_timer timer;
 	rb_fde_t *F;
-	rb_dlink_node node;
-	time_t timeout;
 	PF *timeout_handler;
 	void *timeout_data;
 };
@@ -50,11 +49,12 @@ struct timeout_data
 rb_dlink_list *rb_fd_table;
 static rb_bh *fd_heap;
 
-static rb_dlink_list timeout_list;
 static rb_dlink_list closed_list;
 
-static struct ev_entry *rb_timeout_ev;
-
+/* completion-style extras, only set by backends that do the io themselves */
+static int (*io_accept) (rb_fde_t *);
+static ssize_t (*io_writev) (rb_fde_t *, struct rb_iovec *, int);
+static void (*io_close) (rb_fde_t *);
 
 static const char *rb_err_str[] = { "Comm OK", "Error during bind()",
 	"Error during DNS lookup", "connect timeout",
@@ -69,6 +69,7 @@ int rb_maxconnections = 0;
 
 static PF rb_connect_timeout;
 static PF rb_connect_tryconnect;
+static void rb_timeout_fire(struct rb_timer *);
 #ifdef RB_IPV6
 static void mangle_mapped_sockaddr(struct sockaddr *in);
 #endif
@@ -281,76 +282,106 @@ rb_settimeout(rb_fde_t *F, time_t timeout, PF * callback, void *cbdata)
 	{
 		if(td == NULL)
 			return;
-		rb_dlinkDelete(&td->node, &timeout_list);
+		rb_timer_del(&td->timer);
 		rb_free(td);
 		F->timeout = NULL;
-		if(rb_dlink_list_length(&timeout_list) == 0)
-		{
-			rb_event_delete(rb_timeout_ev);
-			rb_timeout_ev = NULL;
-		}
 		return;
 	}
 
 	if(F->timeout == NULL)
+	{
 		td = F->timeout = rb_malloc(sizeof(struct timeout_data));
+		td->timer.func = rb_timeout_fire;
+	}
 
 	td->F = F;
-	td->timeout = rb_current_time() + timeout;
 	td->timeout_handler = callback;
 	td->timeout_data = cbdata;
-	rb_dlinkAdd(td, &td->node, &timeout_list);
-	if(rb_timeout_ev == NULL)
-	{
-		rb_timeout_ev = rb_event_add("rb_checktimeouts", rb_checktimeouts, NULL, 5);
-	}
+	rb_timer_add(&td->timer, timeout * 1000);
 }
 
 /*
- * rb_checktimeouts() - check the socket timeouts
+ * rb_timeout_fire() - a socket timeout has expired
  *
  * All this routine does is call the given callback/cbdata, without closing
  * down the file descriptor. When close handlers have been implemented,
  * this will happen.
  */
+static void
+rb_timeout_fire(struct rb_timer *timer)
+{
+	struct timeout_data *td = (struct timeout_data *)timer;
+	rb_fde_t *F = td->F;
+	PF *hdl = td->timeout_handler;
+	void *data = td->timeout_data;
+
+	F->timeout = NULL;
+	rb_free(td);
+	hdl(F, data);
+}
+
+/*
+ * rb_accept_fd() - set up a newly accepted fd and hand it to the listener's
+ * callbacks.  Shared by rb_accept_tryaccept() and backends that accept for
+ * us.
+ */
 void
-rb_checktimeouts(void *notused)
+rb_accept_fd(rb_fde_t *F, rb_platform_fd_t new_fd, struct sockaddr *st, rb_socklen_t addrlen)
 {
-	rb_dlink_node *ptr, *next;
-	struct timeout_data *td;
-	rb_fde_t *F;
-	PF *hdl;
-	void *data;
+	rb_fde_t *new_F;
+
+	rb_fd_hack(&new_fd);
 
-	RB_DLINK_FOREACH_SAFE(ptr, next, timeout_list.head)
+	new_F = rb_open(new_fd, RB_FD_SOCKET, "Incoming Connection");
+
+	if(new_F == NULL)
 	{
-		td = ptr->data;
-		F = td->F;
-		if(F == NULL || !IsFDOpen(F))
-			continue;
+		rb_lib_log
+			("rb_accept: new_F == NULL on incoming connection. Closing new_fd == %d\n",
+			 new_fd);
+		close(new_fd);
+		return;
+	}
 
-		if(td->timeout < rb_current_time())
-		{
-			hdl = td->timeout_handler;
-			data = td->timeout_data;
-			rb_dlinkDelete(&td->node, &timeout_list);
-			F->timeout = NULL;
-			rb_free(td);
-			hdl(F, data);
-		}
+	if(rb_unlikely(!rb_set_nb(new_F)))
+	{
+		rb_get_errno();
+		rb_lib_log("rb_accept: Couldn't set FD %d non blocking!", new_F->fd);
+		rb_close(new_F);
+		return;
+	}
+
+#ifdef RB_IPV6
+	mangle_mapped_sockaddr(st);
+#endif
+
+	if(F->accept->precb != NULL)
+	{
+		if(!F->accept->precb(new_F, st, addrlen, F->accept->data))	/* pre-callback decided to drop it */
+			return;
+	}
+#ifdef HAVE_SSL
+	if(F->type & RB_FD_SSL)
+	{
+		rb_ssl_accept_setup(F, new_F, st, addrlen);
+	}
+	else
+#endif /* HAVE_SSL */
+	{
+		F->accept->callback(new_F, RB_OK, st, addrlen, F->accept->data);
 	}
 }
 
-static void
+void
 rb_accept_tryaccept(rb_fde_t *F, void *data)
 {
 	struct rb_sockaddr_storage st;
-	rb_fde_t *new_F;
-	rb_socklen_t addrlen = sizeof(st);
+	rb_socklen_t addrlen;
 	int new_fd;
 
 	while(1)
 	{
+		addrlen = sizeof(st);
 		new_fd = accept(F->fd, (struct sockaddr *)&st, &addrlen);
 		rb_get_errno();
 		if(new_fd < 0)
@@ -359,46 +390,11 @@ rb_accept_tryaccept(rb_fde_t *F, void *data)
 			return;
 		}
 
-		rb_fd_hack(&new_fd);
-
-		new_F = rb_open(new_fd, RB_FD_SOCKET, "Incoming Connection");
+		rb_accept_fd(F, new_fd, (struct sockaddr *)&st, addrlen);
 
-		if(new_F == NULL)
-		{
-			rb_lib_log
-				("rb_accept: new_F == NULL on incoming connection. Closing new_fd == %d\n",
-				 new_fd);
-			close(new_fd);
-			continue;
-		}
-
-		if(rb_unlikely(!rb_set_nb(new_F)))
-		{
-			rb_get_errno();
-			rb_lib_log("rb_accept: Couldn't set FD %d non blocking!", new_F->fd);
-			rb_close(new_F);
-		}
-
-#ifdef RB_IPV6
-		mangle_mapped_sockaddr((struct sockaddr *)&st);
-#endif
-
-		if(F->accept->precb != NULL)
-		{
-			if(!F->accept->precb(new_F, (struct sockaddr *)&st, addrlen, F->accept->data))	/* pre-callback decided to drop it */
-				continue;
-		}
-#ifdef HAVE_SSL
-		if(F->type & RB_FD_SSL)
-		{
-			rb_ssl_accept_setup(F, new_F, (struct sockaddr *)&st, addrlen);
-		}
-		else
-#endif /* HAVE_SSL */
-		{
-			F->accept->callback(new_F, RB_OK, (struct sockaddr *)&st, addrlen,
-					    F->accept->data);
-		}
+		/* the callbacks may have closed the listener */
+		if(!IsFDOpen(F))
+			return;
 	}
 
 }
@@ -415,6 +411,10 @@ rb_accept_tcp(rb_fde_t *F, ACPRE * precb, ACCB * callback, void *data)
 	F->accept->callback = callback;
 	F->accept->data = data;
 	F->accept->precb = precb;
+
+	if(io_accept != NULL && !io_accept(F))
+		return;
+
 	rb_accept_tryaccept(F, NULL);
 }
 
@@ -880,6 +880,8 @@ rb_close(rb_fde_t *F)
 		lrb_assert(F->write_handler == NULL);
 	}
 	rb_setselect(F, RB_SELECT_WRITE | RB_SELECT_READ, NULL, NULL);
+	if(io_close != NULL)
+		io_close(F);
 	rb_settimeout(F, 0, NULL, NULL);
 	rb_free(F->accept);
 	rb_free(F->connect);
@@ -1032,6 +1034,14 @@ rb_write(rb_fde_t *F, const void *buf, int count)
 #endif
 	if(F->type & RB_FD_SOCKET)
 	{
+		if(io_writev != NULL)
+		{
+			struct rb_iovec vec;
+
+			vec.iov_base = (void *)(uintptr_t)buf;
+			vec.iov_len = count;
+			return io_writev(F, &vec, 1);
+		}
 		ret = send(F->fd, buf, count, MSG_NOSIGNAL);
 		if(ret < 0)
 		{
@@ -1093,6 +1103,10 @@ rb_writev(rb_fde_t *F, struct rb_iovec * vector, int count)
 	if(F->type & RB_FD_SOCKET)
 	{
 		struct msghdr msg;
+
+		if(io_writev != NULL)
+			return io_writev(F, vector, count);
+
 		memset(&msg, 0, sizeof(msg));
 		msg.msg_iov = (struct iovec *)vector;
 		msg.msg_iovlen = count;
@@ -1801,11 +1815,11 @@ rb_inet_socketpair(int family, int type, int protocol, rb_platform_fd_t fd[2])
 static void (*setselect_handler) (rb_fde_t *, unsigned int, PF *, void *);
 static int (*select_handler) (long);
 static int (*setup_fd_handler) (rb_fde_t *);
-static int (*io_sched_event) (struct ev_entry *, int);
-static void (*io_unsched_event) (struct ev_entry *);
-static int (*io_supports_event) (void);
-static void (*io_init_event) (void);
 static char iotype[25];
+static int io_counted;
+
+unsigned long rb_io_ctl_count;
+unsigned long rb_io_wait_count;
 
 const char *
 rb_get_iotype(void)
@@ -1813,10 +1827,19 @@ rb_get_iotype(void)
 	return iotype;
 }
 
-static int
-rb_unsupported_event(void)
+/*
+ * rb_get_io_counts
+ *
+ * The interest changes (epoll_ctl()) and waits the io backend has made
+ * since startup.  Only the epoll backends count them; for the others
+ * this returns 0.
+ */
+int
+rb_get_io_counts(unsigned long *ctl, unsigned long *waits)
 {
-	return 0;
+	*ctl = rb_io_ctl_count;
+	*waits = rb_io_wait_count;
+	return io_counted;
 }
 
 static int
@@ -1827,10 +1850,6 @@ try_kqueue(void)
 		setselect_handler = rb_setselect_kqueue;
 		select_handler = rb_select_kqueue;
 		setup_fd_handler = rb_setup_fd_kqueue;
-		io_sched_event = rb_kqueue_sched_event;
-		io_unsched_event = rb_kqueue_unsched_event;
-		io_init_event = rb_kqueue_init_event;
-		io_supports_event = rb_kqueue_supports_event;
 		rb_strlcpy(iotype, "kqueue", sizeof(iotype));
 		return 0;
 	}
@@ -1845,11 +1864,40 @@ try_epoll(void)
 		setselect_handler = rb_setselect_epoll;
 		select_handler = rb_select_epoll;
 		setup_fd_handler = rb_setup_fd_epoll;
-		io_sched_event = rb_epoll_sched_event;
-		io_unsched_event = rb_epoll_unsched_event;
-		io_supports_event = rb_epoll_supports_event;
-		io_init_event = rb_epoll_init_event;
 		rb_strlcpy(iotype, "epoll", sizeof(iotype));
+		io_counted = 1;
+		return 0;
+	}
+	return -1;
+}
+
+static int
+try_epoll_persist(void)
+{
+	if(!rb_init_netio_epoll_persist())
+	{
+		setselect_handler = rb_setselect_epoll_persist;
+		select_handler = rb_select_epoll_persist;
+		setup_fd_handler = rb_setup_fd_epoll;
+		rb_strlcpy(iotype, "epoll-persist", sizeof(iotype));
+		io_counted = 1;
+		return 0;
+	}
+	return -1;
+}
+
+static int
+try_uring(void)
+{
+	if(!rb_init_netio_uring())
+	{
+		setselect_handler = rb_setselect_uring;
+		select_handler = rb_select_uring;
+		setup_fd_handler = rb_setup_fd_uring;
+		io_accept = rb_accept_uring;
+		io_writev = rb_writev_uring;
+		io_close = rb_close_uring;
+		rb_strlcpy(iotype, "io_uring", sizeof(iotype));
 		return 0;
 	}
 	return -1;
@@ -1863,10 +1911,6 @@ try_ports(void)
 		setselect_handler = rb_setselect_ports;
 		select_handler = rb_select_ports;
 		setup_fd_handler = rb_setup_fd_ports;
-		io_sched_event = rb_ports_sched_event;
-		io_unsched_event = rb_ports_unsched_event;
-		io_init_event =  rb_ports_init_event;
-		io_supports_event = rb_ports_supports_event;
 		rb_strlcpy(iotype, "ports", sizeof(iotype));
 		return 0;
 	}
@@ -1881,10 +1925,6 @@ try_devpoll(void)
 		setselect_handler = rb_setselect_devpoll;
 		select_handler = rb_select_devpoll;
 		setup_fd_handler = rb_setup_fd_devpoll;
-		io_sched_event = NULL;
-		io_unsched_event = NULL;
-		io_init_event = NULL;
-		io_supports_event = rb_unsupported_event;
 		rb_strlcpy(iotype, "devpoll", sizeof(iotype));
 		return 0;
 	}
@@ -1899,10 +1939,6 @@ try_sigio(void)
 		setselect_handler = rb_setselect_sigio;
 		select_handler = rb_select_sigio;
 		setup_fd_handler = rb_setup_fd_sigio;
-		io_sched_event = rb_sigio_sched_event;
-		io_unsched_event = rb_sigio_unsched_event;
-		io_supports_event = rb_sigio_supports_event;
-		io_init_event = rb_sigio_init_event;
 
 		rb_strlcpy(iotype, "sigio", sizeof(iotype));
 		return 0;
@@ -1918,10 +1954,6 @@ try_poll(void)
 		setselect_handler = rb_setselect_poll;
 		select_handler = rb_select_poll;
 		setup_fd_handler = rb_setup_fd_poll;
-		io_sched_event = NULL;
-		io_unsched_event = NULL;
-		io_init_event = NULL;
-		io_supports_event = rb_unsupported_event;
 		rb_strlcpy(iotype, "poll", sizeof(iotype));
 		return 0;
 	}
@@ -1936,10 +1968,6 @@ try_win32(void)
 		setselect_handler = rb_setselect_win32;
 		select_handler = rb_select_win32;
 		setup_fd_handler = rb_setup_fd_win32;
-		io_sched_event = NULL;
-		io_unsched_event = NULL;
-		io_init_event = NULL;
-		io_supports_event = rb_unsupported_event;
 		rb_strlcpy(iotype, "win32", sizeof(iotype));
 		return 0;
 	}
@@ -1954,10 +1982,6 @@ try_select(void)
 		setselect_handler = rb_setselect_select;
 		select_handler = rb_select_select;
 		setup_fd_handler = rb_setup_fd_select;
-		io_sched_event = NULL;
-		io_unsched_event = NULL;
-		io_init_event = NULL;
-		io_supports_event = rb_unsupported_event;
 		rb_strlcpy(iotype, "select", sizeof(iotype));
 		return 0;
 	}
@@ -1965,38 +1989,6 @@ try_select(void)
 }
 
 
-int
-rb_io_sched_event(struct ev_entry *ev, int when)
-{
-	if(ev == NULL || io_supports_event == NULL || io_sched_event == NULL
-	   || !io_supports_event())
-		return 0;
-	return io_sched_event(ev, when);
-}
-
-void
-rb_io_unsched_event(struct ev_entry *ev)
-{
-	if(ev == NULL || io_supports_event == NULL || io_unsched_event == NULL
-	   || !io_supports_event())
-		return;
-	io_unsched_event(ev);
-}
-
-int
-rb_io_supports_event(void)
-{
-	if(io_supports_event == NULL)
-		return 0;
-	return io_supports_event();
-}
-
-void
-rb_io_init_event(void)
-{
-	io_init_event();
-	rb_event_io_register_all();
-}
 
 void
 rb_init_netio(void)
@@ -2012,6 +2004,16 @@ rb_init_netio(void)
 			if(!try_epoll())
 				return;
 		}
+		else if(!strcmp("epoll-persist", ioenv))
+		{
+			if(!try_epoll_persist())
+				return;
+		}
+		else if(!strcmp("io_uring", ioenv))
+		{
+			if(!try_uring())
+				return;
+		}
 		else if(!strcmp("kqueue", ioenv))
 		{
 			if(!try_kqueue())
@@ -35,17 +35,6 @@
 #define USING_EPOLL
 #include <sys/epoll.h>
 
-#if defined(HAVE_SIGNALFD) && (HAVE_SYS_SIGNALFD_H) && (USE_TIMER_CREATE) && (HAVE_SYS_UIO_H)
-#include <sys/signalfd.h>
-#include <sys/uio.h>
-#define EPOLL_SCHED_EVENT 1
-#endif
-
-#if defined(USE_TIMERFD_CREATE)
-#include <sys/timerfd.h>
-#endif
-
-#define RTSIGNAL SIGRTMIN
 struct epoll_info
 {
 	int ep;
@@ -54,8 +43,6 @@ struct epoll_info
 };
 
 static struct epoll_info *ep_info;
-static int can_do_event;
-static int can_do_timerfd;
 
 /*
  * rb_init_netio
@@ -66,8 +53,6 @@ static int can_do_timerfd;
 int
 rb_init_netio_epoll(void)
 {
-	can_do_event = 0;	/* shut up gcc */
-	can_do_timerfd = 0;
 	ep_info = rb_malloc(sizeof(struct epoll_info));
 	ep_info->pfd_size = getdtablesize();
 	ep_info->ep = epoll_create(ep_info->pfd_size);
@@ -142,6 +127,7 @@ rb_setselect_epoll(rb_fde_t *F, unsigned int type, PF * handler, void *client_da
 	if(op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD)
 		ep_event.events |= EPOLLET;
 
+	rb_io_ctl_count++;
 	if(epoll_ctl(ep_info->ep, op, F->fd, &ep_event) != 0)
 	{
 		rb_lib_log("rb_setselect_epoll(): epoll_ctl failed: %s", strerror(errno));
@@ -168,6 +154,7 @@ rb_select_epoll(long delay)
 	int o_errno;
 	void *data;
 
+	rb_io_wait_count++;
 	num = epoll_wait(ep_info->ep, ep_info->pfd, ep_info->pfd_size, delay);
 
 	/* save errno as rb_set_time() will likely clobber it */
@@ -234,6 +221,7 @@ rb_select_epoll(long delay)
 			if(op == EPOLL_CTL_MOD || op == EPOLL_CTL_ADD)
 				ep_event.events |= EPOLLET;
 
+			rb_io_ctl_count++;
 			if(epoll_ctl(ep_info->ep, op, F->fd, &ep_event) != 0)
 			{
 				rb_lib_log("rb_select_epoll(): epoll_ctl failed: %s",
@@ -245,283 +233,186 @@ rb_select_epoll(long delay)
 	return RB_OK;
 }
 
-#ifdef EPOLL_SCHED_EVENT
+/*
+ * Persistent mode: an fd is added once, for EPOLLIN|EPOLLOUT|EPOLLET,
+ * and left alone until both of its handlers are cleared with
+ * rb_setselect() (as rb_close() does).  Edges are remembered in pflags,
+ * and a handler set while its edge is pending is run from the next
+ * rb_select() without asking the kernel again.  As with the ordinary
+ * epoll code, a handler must read or write until EAGAIN before it
+ * re-arms, or it will wait for the next edge.
+ */
+#define EP_REGISTERED	0x1
+#define EP_READ_READY	0x2
+#define EP_WRITE_READY	0x4
+#define EP_PENDING	0x8
+
+static rb_dlink_list ep_pending;
+
 int
-rb_epoll_supports_event(void)
+rb_init_netio_epoll_persist(void)
 {
-	/* try to detect at runtime if everything we need actually works */
-	timer_t timer;
-	struct sigevent ev;
-	struct stat st;
-	int fd;
-	sigset_t set;
-
-	if(can_do_event == 1)
-		return 1;
-	if(can_do_event == -1)
-		return 0;
-
-	/* Check for openvz..it has a broken timerfd.. */
-	if(stat("/proc/user_beancounters", &st) == 0)
-	{
-		can_do_event = -1;
-		return 0;
-	}
+	return rb_init_netio_epoll();
+}
 
-#ifdef USE_TIMERFD_CREATE
-	if((fd = timerfd_create(CLOCK_REALTIME, 0)) >= 0)
-	{
-		close(fd);
-		can_do_event = 1;
-		can_do_timerfd = 1;
-		return 1;
-	}
-#endif
+static void
+ep_pending_add(rb_fde_t *F)
+{
+	if(F->pflags & EP_PENDING)
+		return;
 
-	ev.sigev_signo = SIGVTALRM;
-	ev.sigev_notify = SIGEV_SIGNAL;
-	if(timer_create(CLOCK_REALTIME, &ev, &timer) != 0)
-	{
-		can_do_event = -1;
-		return 0;
-	}
-	timer_delete(timer);
-	sigemptyset(&set);
-	fd = signalfd(-1, &set, 0);
-	if(fd < 0)
-	{
-		can_do_event = -1;
-		return 0;
-	}
-	close(fd);
-	can_do_event = 1;
-	return 1;
+	F->pflags |= EP_PENDING;
+	rb_dlinkAddTail(F, &F->pending_node, &ep_pending);
 }
 
-
-/* bleh..work around a glibc header bug on 32bit systems */
-struct our_signalfd_siginfo
+static void
+ep_pending_del(rb_fde_t *F)
 {
-	uint32_t signo;
-	int32_t err;
-	int32_t code;
-	uint32_t pid;
-	uint32_t uid;
-	int32_t fd;
-	uint32_t tid;
-	uint32_t band;
-	uint32_t overrun;
-	uint32_t trapno;
-	int32_t status;
-	int32_t svint;
-	uint64_t svptr;
-	uint64_t utime;
-	uint64_t stime;
-	uint64_t addr;
-	uint8_t pad[48];
-};
+	if(!(F->pflags & EP_PENDING))
+		return;
 
+	F->pflags &= ~EP_PENDING;
+	rb_dlinkDelete(&F->pending_node, &ep_pending);
+}
 
-#define SIGFDIOV_COUNT 16
+/* run whichever handlers have both a handler and a remembered edge */
 static void
-signalfd_handler(rb_fde_t *F, void *data)
+ep_dispatch(rb_fde_t *F)
 {
-	static struct our_signalfd_siginfo fdsig[SIGFDIOV_COUNT];
-	static struct iovec iov[SIGFDIOV_COUNT];
-	struct ev_entry *ev;
-	int ret, x;
+	PF *hdl;
+	void *data;
 
-	for(x = 0; x < SIGFDIOV_COUNT; x++)
+	if((F->pflags & EP_READ_READY) && F->read_handler != NULL)
 	{
-		iov[x].iov_base = &fdsig[x];
-		iov[x].iov_len = sizeof(struct our_signalfd_siginfo);
+		hdl = F->read_handler;
+		data = F->read_data;
+		F->read_handler = NULL;
+		F->read_data = NULL;
+		F->pflags &= ~EP_READ_READY;
+		hdl(F, data);
 	}
 
-	while(1)
-	{
-		ret = readv(rb_get_fd(F), iov, SIGFDIOV_COUNT);
-
-		if(ret == 0 || (ret < 0 && !rb_ignore_errno(errno)))
-		{
-			rb_close(F);
-			rb_epoll_init_event();
-			return;
-		}
-
-		if(ret < 0)
-		{
-			rb_setselect(F, RB_SELECT_READ, signalfd_handler, NULL);
-			return;
-		}
-		for(x = 0; x < ret / (int)sizeof(struct our_signalfd_siginfo); x++)
-		{
-#if __WORDSIZE == 32 && defined(__sparc__)
-			uint32_t *q = (uint32_t *)&fdsig[x].svptr;
-			ev = (struct ev_entry *)q[0];
-#else
-			ev = (struct ev_entry *)(uintptr_t)(fdsig[x].svptr);
+	if(!IsFDOpen(F))
+		return;
 
-#endif
-			if(ev == NULL)
-				continue;
-			rb_run_one_event(ev);
-		}
+	if((F->pflags & EP_WRITE_READY) && F->write_handler != NULL)
+	{
+		hdl = F->write_handler;
+		data = F->write_data;
+		F->write_handler = NULL;
+		F->write_data = NULL;
+		F->pflags &= ~EP_WRITE_READY;
+		hdl(F, data);
 	}
 }
 
 void
-rb_epoll_init_event(void)
+rb_setselect_epoll_persist(rb_fde_t *F, unsigned int type, PF * handler, void *client_data)
 {
+	struct epoll_event ep_event;
 
-	sigset_t ss;
-	rb_fde_t *F;
-	int sfd;
-	rb_epoll_supports_event();
-	if(!can_do_timerfd)
-	{
-		sigemptyset(&ss);
-		sigaddset(&ss, RTSIGNAL);
-		sigprocmask(SIG_BLOCK, &ss, 0);
-		sigemptyset(&ss);
-		sigaddset(&ss, RTSIGNAL);
-		sfd = signalfd(-1, &ss, 0);
-		if(sfd == -1)
-		{
-			can_do_event = -1;
-			return;
-		}
-		F = rb_open(sfd, RB_FD_UNKNOWN, "signalfd");
-		rb_set_nb(F);
-		signalfd_handler(F, NULL);
-	}
-}
+	lrb_assert(IsFDOpen(F));
 
-static int
-rb_epoll_sched_event_signalfd(struct ev_entry *event, int when)
-{
-	timer_t *id;
-	struct sigevent ev;
-	struct itimerspec ts;
-
-	memset(&ev, 0, sizeof(ev));
-	event->comm_ptr = rb_malloc(sizeof(timer_t));
-	id = event->comm_ptr;
-	ev.sigev_notify = SIGEV_SIGNAL;
-	ev.sigev_signo = RTSIGNAL;
-	ev.sigev_value.sival_ptr = event;
-
-	if(timer_create(CLOCK_REALTIME, &ev, id) < 0)
+	if(type & RB_SELECT_READ)
 	{
-		rb_lib_log("timer_create: %s\n", strerror(errno));
-		return 0;
+		F->read_handler = handler;
+		F->read_data = client_data;
 	}
-	memset(&ts, 0, sizeof(ts));
-	ts.it_value.tv_sec = when;
-	ts.it_value.tv_nsec = 0;
-	if(event->frequency != 0)
-		ts.it_interval = ts.it_value;
 
-	if(timer_settime(*id, 0, &ts, NULL) < 0)
+	if(type & RB_SELECT_WRITE)
 	{
-		rb_lib_log("timer_settime: %s\n", strerror(errno));
-		return 0;
+		F->write_handler = handler;
+		F->write_data = client_data;
 	}
-	return 1;
-}
 
-#ifdef USE_TIMERFD_CREATE
-static void
-rb_read_timerfd(rb_fde_t *F, void *data)
-{
-	struct ev_entry *event = (struct ev_entry *)data;
-	int retlen;
-	uint64_t count;
-
-	if(event == NULL)
+	if(F->read_handler == NULL && F->write_handler == NULL)
 	{
-		rb_close(F);
+		ep_pending_del(F);
+		if(F->pflags & EP_REGISTERED)
+		{
+			rb_io_ctl_count++;
+			if(epoll_ctl(ep_info->ep, EPOLL_CTL_DEL, F->fd, NULL) != 0)
+				rb_lib_log("rb_setselect_epoll_persist(): epoll_ctl failed: %s",
+					   strerror(errno));
+			F->pflags = 0;
+		}
 		return;
 	}
 
-	retlen = rb_read(F, &count, sizeof(count));
-
-	if(retlen == 0 || (retlen < 0 && !rb_ignore_errno(errno)))
+	if(!(F->pflags & EP_REGISTERED))
 	{
-		rb_close(F);
-		rb_lib_log("rb_read_timerfd: timerfd[%s] closed on error: %s", event->name,
-			   strerror(errno));
+		/* the add reports the current state as a first edge */
+		ep_event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ep_event.data.ptr = F;
+
+		rb_io_ctl_count++;
+		if(epoll_ctl(ep_info->ep, EPOLL_CTL_ADD, F->fd, &ep_event) != 0)
+		{
+			rb_lib_log("rb_setselect_epoll_persist(): epoll_ctl failed: %s",
+				   strerror(errno));
+			abort();
+		}
+		F->pflags = EP_REGISTERED;
 		return;
 	}
-	rb_setselect(F, RB_SELECT_READ, rb_read_timerfd, event);
-	rb_run_one_event(event);
-}
 
+	if(((F->pflags & EP_READ_READY) && F->read_handler != NULL) ||
+	   ((F->pflags & EP_WRITE_READY) && F->write_handler != NULL))
+		ep_pending_add(F);
+}
 
-static int
-rb_epoll_sched_event_timerfd(struct ev_entry *event, int when)
+int
+rb_select_epoll_persist(long delay)
 {
-	struct itimerspec ts;
-	static char buf[FD_DESC_SZ + 8];
-	int fd;
+	rb_dlink_node *ptr;
 	rb_fde_t *F;
+	unsigned long count;
+	int num, i;
+	int o_errno;
 
-	if((fd = timerfd_create(CLOCK_REALTIME, 0)) < 0)
-	{
-		rb_lib_log("timerfd_create: %s\n", strerror(errno));
-		return 0;
-	}
+	if(rb_dlink_list_length(&ep_pending) > 0)
+		delay = 0;
 
-	memset(&ts, 0, sizeof(ts));
-	ts.it_value.tv_sec = when;
-	ts.it_value.tv_nsec = 0;
-	if(event->frequency != 0)
-		ts.it_interval = ts.it_value;
+	rb_io_wait_count++;
+	num = epoll_wait(ep_info->ep, ep_info->pfd, ep_info->pfd_size, delay);
 
-	if(timerfd_settime(fd, 0, &ts, NULL) < 0)
+	/* save errno as rb_set_time() will likely clobber it */
+	o_errno = errno;
+	rb_set_time();
+	errno = o_errno;
+
+	if(num < 0 && !rb_ignore_errno(o_errno))
+		return RB_ERROR;
+
+	for(i = 0; i < num; i++)
 	{
-		rb_lib_log("timerfd_settime: %s\n", strerror(errno));
-		close(fd);
-		return 0;
-	}
-	snprintf(buf, sizeof(buf), "timerfd: %s", event->name);
-	F = rb_open(fd, RB_FD_UNKNOWN, buf);
-	rb_set_nb(F);
-	event->comm_ptr = F;
-	rb_setselect(F, RB_SELECT_READ, rb_read_timerfd, event);
-	return 1;
-}
-#endif
+		F = ep_info->pfd[i].data.ptr;
 
+		if(!IsFDOpen(F))
+			continue;
 
+		if(ep_info->pfd[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			F->pflags |= EP_READ_READY;
+		if(ep_info->pfd[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			F->pflags |= EP_WRITE_READY;
 
-int
-rb_epoll_sched_event(struct ev_entry *event, int when)
-{
-#ifdef USE_TIMERFD_CREATE
-	if(can_do_timerfd)
-	{
-		return rb_epoll_sched_event_timerfd(event, when);
+		ep_pending_del(F);
+		ep_dispatch(F);
 	}
-#endif
-	return rb_epoll_sched_event_signalfd(event, when);
-}
 
-void
-rb_epoll_unsched_event(struct ev_entry *event)
-{
-#ifdef USE_TIMERFD_CREATE
-	if(can_do_timerfd)
+	/* only those queued before now; handlers may queue more for next time */
+	for(count = rb_dlink_list_length(&ep_pending); count > 0; count--)
 	{
-		rb_close((rb_fde_t *)event->comm_ptr);
-		event->comm_ptr = NULL;
-		return;
+		if((ptr = ep_pending.head) == NULL)
+			break;
+
+		F = ptr->data;
+		ep_pending_del(F);
+		ep_dispatch(F);
 	}
-#endif
-	timer_delete(*((timer_t *) event->comm_ptr));
-	rb_free(event->comm_ptr);
-	event->comm_ptr = NULL;
+
+	return RB_OK;
 }
-#endif /* EPOLL_SCHED_EVENT */
 
 #else /* epoll not supported here */
 int
@@ -551,33 +442,25 @@ rb_setup_fd_epoll(rb_fde_t *F)
 	return -1;
 }
 
-
-#endif
-
-#if !defined(USING_EPOLL) || !defined(EPOLL_SCHED_EVENT)
-void
-rb_epoll_init_event(void)
-{
-	return;
-}
-
 int
-rb_epoll_sched_event(struct ev_entry *event, int when)
+rb_init_netio_epoll_persist(void)
 {
-	errno = ENOSYS;
-	return -1;
+	return ENOSYS;
 }
 
 void
-rb_epoll_unsched_event(struct ev_entry *event)
+rb_setselect_epoll_persist(rb_fde_t *F, unsigned int type, PF * handler, void *client_data)
 {
+	errno = ENOSYS;
 	return;
 }
 
 int
-rb_epoll_supports_event(void)
+rb_select_epoll_persist(long delay)
 {
 	errno = ENOSYS;
-	return 0;
+	return -1;
 }
-#endif /* !USING_EPOLL || !EPOLL_SCHED_EVENT */
+
+
+#endif
@@ -49,7 +49,290 @@
 static char last_event_ran[EV_NAME_LEN];
 static rb_dlink_list event_list;
 
-static time_t event_time_min = -1;
+/*
+ * Timers live on a hierarchical wheel, as in the old Linux kernel timers.
+ * A tick is RB_TW_TICK milliseconds.  Level 0 has a slot for each of the
+ * next 256 ticks; each slot of the levels above covers a whole turn of
+ * the level below, and is emptied back down into it when that turn
+ * begins.  Adding or removing a timer is a list operation, and a timer
+ * is moved at most once per level before it fires.
+ *
+ * The wheel keeps its own clock, so that when the system clock is set
+ * back rb_set_back_events() can shift it to match instead of leaving
+ * everything waiting for the clock to catch up again.
+ */
+#define RB_TW_TICK	10
+#define RB_TW_L0_BITS	8
+#define RB_TW_LN_BITS	6
+#define RB_TW_L0_SIZE	(1 << RB_TW_L0_BITS)
+#define RB_TW_LN_SIZE	(1 << RB_TW_LN_BITS)
+#define RB_TW_L0_MASK	(RB_TW_L0_SIZE - 1)
+#define RB_TW_LN_MASK	(RB_TW_LN_SIZE - 1)
+#define RB_TW_LEVELS	3
+#define RB_TW_SHIFT(n)	(RB_TW_L0_BITS + (n) * RB_TW_LN_BITS)
+#define RB_TW_INDEX(t, n) (((t) >> RB_TW_SHIFT(n)) & RB_TW_LN_MASK)
+#define RB_TW_MAX	(((uint64_t)1 << RB_TW_SHIFT(RB_TW_LEVELS)) - 1)
+#define RB_TW_NONE	UINT64_MAX
+
+static rb_dlink_list tw_l0[RB_TW_L0_SIZE];
+static rb_dlink_list tw_ln[RB_TW_LEVELS][RB_TW_LN_SIZE];
+static uint64_t tw_now;			/* next tick to be run */
+static uint64_t tw_next = RB_TW_NONE;	/* no timer fires before this */
+static int tw_next_valid = 1;
+static int64_t tw_offset;		/* wheel clock - system clock, msec */
+static unsigned long tw_count;
+static unsigned long tw_l0_count;
+
+static struct ev_entry *ev_running;
+static int ev_running_deleted;
+
+static uint64_t
+tw_clock(void)
+{
+	const struct timeval *tv = rb_current_time_tv();
+
+	return (uint64_t)((int64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000 + tw_offset);
+}
+
+static void
+tw_insert(struct rb_timer *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t delta;
+
+	if(expires < tw_now)
+		expires = tw_now;
+
+	delta = expires - tw_now;
+	if(delta < RB_TW_L0_SIZE)
+	{
+		t->slot = &tw_l0[expires & RB_TW_L0_MASK];
+		tw_l0_count++;
+	}
+	else
+	{
+		int level;
+
+		/* too far out for the wheel; it is put back when this slot
+		 * comes round, and goes further down the next time */
+		if(delta > RB_TW_MAX)
+			expires = tw_now + RB_TW_MAX;
+
+		for(level = 0; level < RB_TW_LEVELS - 1; level++)
+			if(delta < ((uint64_t)1 << RB_TW_SHIFT(level + 1)))
+				break;
+
+		t->slot = &tw_ln[level][RB_TW_INDEX(expires, level)];
+	}
+
+	rb_dlinkAddTail(t, &t->node, t->slot);
+}
+
+static void
+tw_remove(struct rb_timer *t)
+{
+	if(t->slot >= tw_l0 && t->slot < tw_l0 + RB_TW_L0_SIZE)
+		tw_l0_count--;
+
+	rb_dlinkDelete(&t->node, t->slot);
+	t->slot = NULL;
+}
+
+/* empty one slot of an upper level back down the wheel */
+static unsigned int
+tw_cascade(int level, unsigned int idx)
+{
+	rb_dlink_list *slot = &tw_ln[level][idx];
+	struct rb_timer *t;
+
+	while(slot->head != NULL)
+	{
+		t = slot->head->data;
+		tw_remove(t);
+		tw_insert(t);
+	}
+
+	return idx;
+}
+
+static uint64_t
+tw_slot_min(rb_dlink_list *slot)
+{
+	rb_dlink_node *ptr;
+	uint64_t min = RB_TW_NONE;
+
+	RB_DLINK_FOREACH(ptr, slot->head)
+	{
+		struct rb_timer *t = ptr->data;
+
+		if(t->expires < min)
+			min = t->expires;
+	}
+
+	return min;
+}
+
+/*
+ * tw_find_next - work out when the first pending timer fires
+ *
+ * Within a level, the first occupied slot after the current one holds
+ * that level's earliest timer, so this looks at one slot per level.
+ */
+static uint64_t
+tw_find_next(void)
+{
+	uint64_t next = RB_TW_NONE, min;
+	unsigned int i, idx;
+	int level;
+
+	if(tw_count == 0)
+		return RB_TW_NONE;
+
+	for(i = 0; i < RB_TW_L0_SIZE && tw_l0_count > 0; i++)
+	{
+		idx = (tw_now + i) & RB_TW_L0_MASK;
+		if(tw_l0[idx].head != NULL)
+		{
+			next = tw_slot_min(&tw_l0[idx]);
+			break;
+		}
+	}
+
+	for(level = 0; level < RB_TW_LEVELS; level++)
+	{
+		/* the current slot is still due if we sit right on its
+		 * cascade; otherwise it is a whole turn away */
+		unsigned int first = (tw_now & (((uint64_t)1 << RB_TW_SHIFT(level)) - 1)) == 0 ? 0 : 1;
+
+		for(i = first; i < first + RB_TW_LN_SIZE; i++)
+		{
+			idx = (RB_TW_INDEX(tw_now, level) + i) & RB_TW_LN_MASK;
+			if(tw_ln[level][idx].head != NULL)
+			{
+				min = tw_slot_min(&tw_ln[level][idx]);
+				if(min < next)
+					next = min;
+				break;
+			}
+		}
+	}
+
+	return next;
+}
+
+/*
+ * void rb_timer_add(struct rb_timer *t, long msec)
+ *
+ * Input: Timer, with func set, and how long from now it should fire
+ * Output: None
+ * Side Effects: (Re)schedules the timer.
+ */
+void
+rb_timer_add(struct rb_timer *t, long msec)
+{
+	if(t->slot != NULL)
+		rb_timer_del(t);
+
+	if(msec < 0)
+		msec = 0;
+
+	t->expires = (tw_clock() + msec + RB_TW_TICK - 1) / RB_TW_TICK;
+	if(t->expires < tw_now)
+		t->expires = tw_now;
+
+	tw_insert(t);
+	tw_count++;
+
+	if(t->expires < tw_next)
+		tw_next = t->expires;
+}
+
+void
+rb_timer_del(struct rb_timer *t)
+{
+	if(t->slot == NULL)
+		return;
+
+	tw_remove(t);
+	tw_count--;
+
+	/* tw_next may now be too early, which costs only a spare wakeup */
+	if(t->expires == tw_next)
+		tw_next_valid = 0;
+}
+
+/* milliseconds until the timer fires, 0 if due and -1 if not pending */
+long
+rb_timer_left(struct rb_timer *t)
+{
+	uint64_t now = tw_clock();
+	uint64_t when;
+
+	if(t->slot == NULL)
+		return -1;
+
+	when = t->expires * RB_TW_TICK;
+	return when > now ? (long)(when - now) : 0;
+}
+
+/*
+ * tw_run - run every timer due up to and including tick target
+ */
+static void
+tw_run(uint64_t target)
+{
+	rb_dlink_list work = { NULL, NULL, 0 };
+	rb_dlink_node *ptr;
+	struct rb_timer *t;
+	unsigned int idx;
+
+	while(tw_now <= target)
+	{
+		if(tw_count == 0)
+		{
+			tw_now = target + 1;
+			break;
+		}
+
+		idx = tw_now & RB_TW_L0_MASK;
+		if(idx == 0 && tw_cascade(0, RB_TW_INDEX(tw_now, 0)) == 0 &&
+		   tw_cascade(1, RB_TW_INDEX(tw_now, 1)) == 0)
+			tw_cascade(2, RB_TW_INDEX(tw_now, 2));
+
+		if(tw_l0_count == 0)
+		{
+			/* nothing can fire before the next cascade */
+			uint64_t skip = (tw_now | RB_TW_L0_MASK) + 1;
+
+			tw_now = skip <= target ? skip : target + 1;
+			continue;
+		}
+
+		tw_now++;
+
+		if(tw_l0[idx].head == NULL)
+			continue;
+
+		/* take the slot's timers off first, so anything their
+		 * callbacks add cannot land in the slot being run */
+		RB_DLINK_FOREACH(ptr, tw_l0[idx].head)
+		{
+			t = ptr->data;
+			t->slot = &work;
+		}
+		tw_l0_count -= rb_dlink_list_length(&tw_l0[idx]);
+		rb_dlinkMoveList(&tw_l0[idx], &work);
+
+		while(work.head != NULL)
+		{
+			t = work.head->data;
+			rb_dlinkDelete(&t->node, &work);
+			t->slot = NULL;
+			tw_count--;
+			t->func(t);
+		}
+	}
+}
 
 /*
  * struct ev_entry *
@@ -74,6 +357,12 @@ rb_event_find(EVH * func, void *arg)
 	return NULL;
 }
 
+static void
+rb_event_fire(struct rb_timer *t)
+{
+	rb_run_one_event((struct ev_entry *)t);
+}
+
 static
 struct ev_entry *
 rb_event_add_common(const char *name, EVH * func, void *arg, time_t when, time_t frequency)
@@ -83,15 +372,11 @@ rb_event_add_common(const char *name, EVH * func, void *arg, time_t when, time_t
 	ev->func = func;
 	ev->name = rb_strndup(name, EV_NAME_LEN);
 	ev->arg = arg;
-	ev->when = rb_current_time() + when;
-	ev->next = when;
 	ev->frequency = frequency;
-
-	if((ev->when < event_time_min) || (event_time_min == -1))
-		event_time_min = ev->when;
+	ev->timer.func = rb_event_fire;
 
 	rb_dlinkAdd(ev, &ev->node, &event_list);
-	rb_io_sched_event(ev, when);
+	rb_timer_add(&ev->timer, when * 1000);
 	return ev;
 }
 
@@ -116,10 +401,11 @@ rb_event_add(const char *name, EVH * func, void *arg, time_t when)
 	return rb_event_add_common(name, func, arg, when, when);
 }
 
+/* a delay of 0 runs the event on the next pass of the event loop */
 struct ev_entry *
 rb_event_addonce(const char *name, EVH * func, void *arg, time_t when)
 {
-	if (rb_unlikely(when <= 0)) {
+	if (rb_unlikely(when < 0)) {
 		rb_lib_log("rb_event_addonce: tried to schedule %s event to run in "
 			"%d seconds", name, (int) when);
 		when = 1;
@@ -141,8 +427,16 @@ rb_event_delete(struct ev_entry *ev)
 	if(ev == NULL)
 		return;
 
+	rb_timer_del(&ev->timer);
+
+	/* an event deleting itself is freed once its callback returns */
+	if(ev == ev_running)
+	{
+		ev_running_deleted = 1;
+		return;
+	}
+
 	rb_dlinkDelete(&ev->node, &event_list);
-	rb_io_unsched_event(ev);
 	rb_free(ev->name);
 	rb_free(ev);
 }
@@ -196,15 +490,21 @@ void
 rb_run_one_event(struct ev_entry *ev)
 {
 	rb_strlcpy(last_event_ran, ev->name, sizeof(last_event_ran));
+
+	ev_running = ev;
+	ev_running_deleted = 0;
 	ev->func(ev->arg);
-	if(!ev->frequency)
+	ev_running = NULL;
+
+	if(ev_running_deleted || !ev->frequency)
 	{
 		rb_event_delete(ev);
 		return;
 	}
-	ev->when = rb_current_time() + rb_event_frequency(ev->frequency);
-	if((ev->when < event_time_min) || (event_time_min == -1))
-		event_time_min = ev->when;
+
+	/* unless the callback rescheduled it itself */
+	if(ev->timer.slot == NULL)
+		rb_timer_add(&ev->timer, rb_event_frequency(ev->frequency) * 1000);
 }
 
 /*
@@ -212,60 +512,17 @@ rb_run_one_event(struct ev_entry *ev)
  *
  * Input: None
  * Output: None
- * Side Effects: Runs pending events in the event list
+ * Side Effects: Runs pending events and timeouts
  */
 void
 rb_event_run(void)
 {
-	rb_dlink_node *ptr, *next;
-	struct ev_entry *ev;
-
-	if(rb_io_supports_event())
-		return;
-
-	event_time_min = -1;
-	RB_DLINK_FOREACH_SAFE(ptr, next, event_list.head)
-	{
-		ev = ptr->data;
-		if(ev->when <= rb_current_time())
-		{
-			rb_strlcpy(last_event_ran, ev->name, sizeof(last_event_ran));
-			ev->func(ev->arg);
-
-			/* event is scheduled more than once */
-			if(ev->frequency)
-			{
-				ev->when = rb_current_time() + rb_event_frequency(ev->frequency);
-				if((ev->when < event_time_min) || (event_time_min == -1))
-					event_time_min = ev->when;
-			}
-			else
-			{
-				rb_dlinkDelete(&ev->node, &event_list);
-				rb_free(ev);
-			}
-		}
-		else
-		{
-			if((ev->when < event_time_min) || (event_time_min == -1))
-				event_time_min = ev->when;
-		}
-	}
-}
-
-void
-rb_event_io_register_all(void)
-{
-	rb_dlink_node *ptr;
-	struct ev_entry *ev;
-
-	if(!rb_io_supports_event())
-		return;
+	tw_run(tw_clock() / RB_TW_TICK);
 
-	RB_DLINK_FOREACH(ptr, event_list.head)
+	if(!tw_next_valid || tw_next < tw_now)
 	{
-		ev = ptr->data;
-		rb_io_sched_event(ev, ev->next);
+		tw_next = tw_find_next();
+		tw_next_valid = 1;
 	}
 }
 
@@ -280,6 +537,7 @@ void
 rb_event_init(void)
 {
 	rb_strlcpy(last_event_ran, "NONE", sizeof(last_event_ran));
+	tw_now = tw_clock() / RB_TW_TICK;
 }
 
 void
@@ -301,7 +559,7 @@ rb_dump_events(void (*func) (char *, void *), void *ptr)
 	{
 		ev = dptr->data;
 		snprintf(buf, len, "%-28s %-4ld seconds (frequency=%d)", ev->name,
-			    ev->when - (long)rb_current_time(), (int)ev->frequency);
+			    rb_timer_left(&ev->timer) / 1000, (int)ev->frequency);
 		func(buf, ptr);
 	}
 }
@@ -315,16 +573,9 @@ rb_dump_events(void (*func) (char *, void *), void *ptr)
 void
 rb_set_back_events(time_t by)
 {
-	rb_dlink_node *ptr;
-	struct ev_entry *ev;
-	RB_DLINK_FOREACH(ptr, event_list.head)
-	{
-		ev = ptr->data;
-		if(ev->when > by)
-			ev->when -= by;
-		else
-			ev->when = 0;
-	}
+	/* move the wheel's clock forward again to where it was, so
+	 * everything still fires after the same wait */
+	tw_offset += (int64_t)by * 1000;
 }
 
 void
@@ -339,13 +590,39 @@ rb_event_update(struct ev_entry *ev, time_t freq)
 	 * than the new frequency
 	 */
 	time_t next = rb_event_frequency(freq);
-	if((rb_current_time() + next) < ev->when)
-		ev->when = rb_current_time() + next;
+	long left = rb_timer_left(&ev->timer);
+	if(left < 0 || next * 1000 < left)
+		rb_timer_add(&ev->timer, next * 1000);
 	return;
 }
 
+/*
+ * long rb_event_next_delay(void)
+ *
+ * Input: None
+ * Output: Milliseconds until the next timer is due, or -1 if there are none
+ * Side Effects: None
+ */
+long
+rb_event_next_delay(void)
+{
+	uint64_t now, when;
+
+	if(tw_next == RB_TW_NONE)
+		return -1;
+
+	now = tw_clock();
+	when = tw_next * RB_TW_TICK;
+	return when > now ? (long)(when - now) : 0;
+}
+
 time_t
 rb_event_next(void)
 {
-	return event_time_min;
+	long delay = rb_event_next_delay();
+
+	if(delay < 0)
+		return -1;
+
+	return rb_current_time() + (delay + 999) / 1000;
 }
@@ -0,0 +1,1002 @@
+/*
+ *  ircd-ratbox: A slightly useful ircd.
+ *  io_uring.c: Linux io_uring network routines.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ *  USA
+ *
+ */
+
+#define _GNU_SOURCE 1
+
+#include <rb/rb.h>
+#include <rb/commio_int.h>
+#include <rb/event_int.h>
+
+#if defined(HAVE_LINUX_IO_URING_H)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <poll.h>
+
+#if defined(__NR_io_uring_setup) && defined(IORING_POLL_ADD_MULTI) && defined(IORING_FEAT_EXT_ARG)
+#define USING_IO_URING
+#endif
+#endif
+
+#ifdef USING_IO_URING
+
+/*
+ * Readiness works like the other backends: each fd gets one multishot
+ * poll for POLLIN|POLLOUT, armed the first time a handler is set and
+ * cancelled when both handlers are cleared (as rb_close() does).  The
+ * completions are edges, which are remembered in pflags, so from there on
+ * it behaves like the persistent epoll mode.  Poll adds and removes are
+ * queued in the submission ring and go to the kernel together with the
+ * wait, so a loop iteration is a single io_uring_enter() however many fds
+ * changed.
+ *
+ * Listeners get a multishot accept instead of a poll, and each completion
+ * is a new connection that goes through rb_accept_fd() like any other.
+ *
+ * Writes to TCP sockets are copied into a per-fd send queue and count as
+ * written.  Everything queued during a loop iteration goes out as one
+ * send per fd, in the same io_uring_enter() as the wait.  Only one send
+ * per fd is with the kernel at a time; anything written meanwhile waits
+ * behind it.  The queue's buffer grows with what is written, up to
+ * UR_SENDQ_MAX, and is freed once the kernel has taken it all.  When it
+ * is full, writes fail with EAGAIN and the fd is not seen as writable
+ * again until the kernel has taken some of it.  An error from a send is
+ * returned by the next write.  Other sockets (the unix socketpairs to the
+ * helpers, which also carry fds and datagrams) are written to directly.
+ *
+ * Completions carry what they are for and either the fd and a serial
+ * number for the registration, or the send queue.  Anything that arrives
+ * for a registration that has since been removed is dropped, so a late
+ * completion can never reach a freed rb_fde_t.
+ */
+#define UR_REGISTERED	0x1
+#define UR_READ_READY	0x2
+#define UR_WRITE_READY	0x4
+#define UR_PENDING	0x8
+#define UR_ACCEPTING	0x10
+#define UR_WRITE_FULL	0x20
+#define UR_SEND_CHECKED	0x40
+#define UR_SEND_QUEUED	0x80
+
+#define UR_ENTRIES	4096
+#define UR_SENDQ_MIN	512
+#define UR_SENDQ_MAX	65536
+
+#define UR_OP_POLL	0
+#define UR_OP_ACCEPT	1
+#define UR_OP_SEND	2
+
+struct ur_sendq
+{
+	rb_fde_t *F;		/* NULL once the fd has been closed */
+	rb_dlink_node node;	/* on ur_sendqs while waiting to be submitted */
+	int queued;
+	int error;
+	unsigned int len;	/* bytes waiting, from the start of buf */
+	unsigned int size;
+	unsigned int inflight;	/* bytes handed to the kernel, 0 for none */
+	char *buf;
+};
+
+struct uring_info
+{
+	int fd;
+	unsigned int sq_mask, sq_entries;
+	unsigned int *sq_head, *sq_tail, *sq_array;
+	unsigned int sq_local_tail;
+	struct io_uring_sqe *sqes;
+	unsigned int cq_mask;
+	unsigned int *cq_head, *cq_tail;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	uint32_t *serial;	/* current registration of each fd, 0 for none */
+	struct ur_sendq **sendq;
+	int serial_size;
+	uint32_t next_serial;
+	int no_accept;		/* the kernel can't do multishot accept */
+};
+
+static struct uring_info *ur_info;
+static rb_dlink_list ur_pending;
+static rb_dlink_list ur_sendqs;
+static rb_bh *ur_sendq_heap;
+
+/*
+ * The top two bits say what completed.  Polls and accepts carry the fd
+ * (getdtablesize() keeps it well under 2^30) and serial; sends carry
+ * their queue, as user space pointers leave the top bits clear.
+ */
+#define UR_DATA(op, fd, serial) (((uint64_t)(op) << 62) | ((uint64_t)(uint32_t)(fd) << 32) | (uint32_t)(serial))
+#define UR_DATA_PTR(op, ptr) (((uint64_t)(op) << 62) | (uint64_t)(uintptr_t)(ptr))
+#define UR_DATA_OP(d) ((int)((d) >> 62))
+#define UR_DATA_FD(d) ((int)(((d) >> 32) & 0x3fffffff))
+#define UR_DATA_SERIAL(d) ((uint32_t)(d))
+#define UR_DATA_SENDQ(d) ((struct ur_sendq *)(uintptr_t)((d) & ~((uint64_t)3 << 62)))
+
+static int
+uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, ur_info->fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static unsigned int
+uring_unsubmitted(void)
+{
+	return ur_info->sq_local_tail - __atomic_load_n(ur_info->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static void
+uring_publish(void)
+{
+	__atomic_store_n(ur_info->sq_tail, ur_info->sq_local_tail, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if(uring_unsubmitted() >= ur_info->sq_entries)
+	{
+		/* the ring is full of queued changes; hand them over now */
+		uring_publish();
+		if(uring_enter(uring_unsubmitted(), 0, 0, NULL, 0) < 0 ||
+		   uring_unsubmitted() >= ur_info->sq_entries)
+		{
+			rb_lib_log("uring_get_sqe(): submission failed: %s", strerror(errno));
+			abort();
+		}
+	}
+
+	idx = ur_info->sq_local_tail & ur_info->sq_mask;
+	sqe = &ur_info->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ur_info->sq_array[idx] = idx;
+	ur_info->sq_local_tail++;
+	return sqe;
+}
+
+static void
+uring_poll_add(int fd, uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+	uint32_t mask = POLLIN | POLLOUT;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+	mask = (mask << 16) | (mask >> 16);
+#endif
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = mask;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = data;
+}
+
+static void
+uring_poll_remove(uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = data;
+	sqe->user_data = 0;
+}
+
+static void
+uring_cancel(uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = data;
+	sqe->user_data = 0;
+}
+
+static void
+uring_send(struct ur_sendq *sq, int flags)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = sq->F->fd;
+	sqe->addr = (uintptr_t)sq->buf;
+	sqe->len = sq->len;
+	sqe->msg_flags = MSG_NOSIGNAL | flags;
+	sqe->user_data = UR_DATA_PTR(UR_OP_SEND, sq);
+	sq->inflight = sq->len;
+}
+
+/* hand over anything queued, without waiting for completions */
+static void
+uring_submit(void)
+{
+	uring_publish();
+	if(uring_unsubmitted() > 0)
+		uring_enter(uring_unsubmitted(), 0, 0, NULL, 0);
+}
+
+static void
+uring_free(void)
+{
+	if(ur_info->sqes != NULL && ur_info->sqes != MAP_FAILED)
+		munmap(ur_info->sqes, ur_info->sqes_size);
+	if(ur_info->cq_ring != NULL && ur_info->cq_ring != MAP_FAILED && ur_info->cq_ring != ur_info->sq_ring)
+		munmap(ur_info->cq_ring, ur_info->cq_ring_size);
+	if(ur_info->sq_ring != NULL && ur_info->sq_ring != MAP_FAILED)
+		munmap(ur_info->sq_ring, ur_info->sq_ring_size);
+	if(ur_info->fd >= 0)
+		close(ur_info->fd);
+	rb_free(ur_info->serial);
+	rb_free(ur_info->sendq);
+	rb_free(ur_info);
+	ur_info = NULL;
+}
+
+/*
+ * uring_probe - check multishot poll really works here, since older
+ * kernels accept the flag but only ever fire once
+ */
+static int
+uring_probe(void)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	int pfd[2], ok = 0;
+
+	if(pipe(pfd) < 0)
+		return 0;
+
+	if(write(pfd[1], "x", 1) == 1)
+	{
+		uring_poll_add(pfd[0], 1);
+		uring_publish();
+
+		if(uring_enter(1, 1, IORING_ENTER_GETEVENTS, NULL, 0) >= 0)
+		{
+			head = *ur_info->cq_head;
+			if(head != __atomic_load_n(ur_info->cq_tail, __ATOMIC_ACQUIRE))
+			{
+				cqe = &ur_info->cqes[head & ur_info->cq_mask];
+				if(cqe->user_data == 1 && cqe->res > 0 && (cqe->flags & IORING_CQE_F_MORE))
+					ok = 1;
+			}
+		}
+
+		uring_poll_remove(1);
+		uring_publish();
+		uring_enter(1, 2, IORING_ENTER_GETEVENTS, NULL, 0);
+		__atomic_store_n(ur_info->cq_head, __atomic_load_n(ur_info->cq_tail, __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELEASE);
+	}
+
+	close(pfd[0]);
+	close(pfd[1]);
+	return ok;
+}
+
+/*
+ * rb_init_netio_uring
+ *
+ * Set up the ring.  Anything missing (no io_uring at all, a kernel too
+ * old for extended waits or multishot poll, or a seccomp policy that
+ * forbids it) makes this fail, and rb_init_netio() moves on.
+ */
+int
+rb_init_netio_uring(void)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	ur_info = rb_malloc(sizeof(struct uring_info));
+	ur_info->serial_size = getdtablesize();
+	ur_info->serial = rb_malloc(sizeof(uint32_t) * ur_info->serial_size);
+	ur_info->sendq = rb_malloc(sizeof(struct ur_sendq *) * ur_info->serial_size);
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = UR_ENTRIES * 4;
+
+	ur_info->fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+	if(ur_info->fd < 0)
+	{
+		uring_free();
+		return -1;
+	}
+
+	if(!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP))
+	{
+		uring_free();
+		return -1;
+	}
+
+	ur_info->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ur_info->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(ur_info->cq_ring_size > ur_info->sq_ring_size)
+			ur_info->sq_ring_size = ur_info->cq_ring_size;
+		ur_info->cq_ring_size = ur_info->sq_ring_size;
+	}
+
+	ur_info->sq_ring = mmap(NULL, ur_info->sq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ur_info->fd, IORING_OFF_SQ_RING);
+	if(ur_info->sq_ring == MAP_FAILED)
+	{
+		uring_free();
+		return -1;
+	}
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		ur_info->cq_ring = ur_info->sq_ring;
+	else
+		ur_info->cq_ring = mmap(NULL, ur_info->cq_ring_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, ur_info->fd, IORING_OFF_CQ_RING);
+
+	ur_info->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur_info->sqes = mmap(NULL, ur_info->sqes_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ur_info->fd, IORING_OFF_SQES);
+
+	if(ur_info->cq_ring == MAP_FAILED || ur_info->sqes == MAP_FAILED)
+	{
+		uring_free();
+		return -1;
+	}
+
+	sq = ur_info->sq_ring;
+	cq = ur_info->cq_ring;
+	ur_info->sq_head = (unsigned int *)(void *)(sq + p.sq_off.head);
+	ur_info->sq_tail = (unsigned int *)(void *)(sq + p.sq_off.tail);
+	ur_info->sq_mask = *(unsigned int *)(void *)(sq + p.sq_off.ring_mask);
+	ur_info->sq_entries = p.sq_entries;
+	ur_info->sq_array = (unsigned int *)(void *)(sq + p.sq_off.array);
+	ur_info->sq_local_tail = *ur_info->sq_tail;
+	ur_info->cq_head = (unsigned int *)(void *)(cq + p.cq_off.head);
+	ur_info->cq_tail = (unsigned int *)(void *)(cq + p.cq_off.tail);
+	ur_info->cq_mask = *(unsigned int *)(void *)(cq + p.cq_off.ring_mask);
+	ur_info->cqes = (struct io_uring_cqe *)(void *)(cq + p.cq_off.cqes);
+
+	if(!uring_probe())
+	{
+		uring_free();
+		return -1;
+	}
+
+	ur_sendq_heap = rb_bh_create(sizeof(struct ur_sendq), 1024, "librb_uring_sendq_heap");
+	rb_open(ur_info->fd, RB_FD_UNKNOWN, "io_uring file descriptor");
+	return 0;
+}
+
+int
+rb_setup_fd_uring(rb_fde_t *F)
+{
+	return 0;
+}
+
+static void
+ur_pending_add(rb_fde_t *F)
+{
+	if(F->pflags & UR_PENDING)
+		return;
+
+	F->pflags |= UR_PENDING;
+	rb_dlinkAddTail(F, &F->pending_node, &ur_pending);
+}
+
+static void
+ur_pending_del(rb_fde_t *F)
+{
+	if(!(F->pflags & UR_PENDING))
+		return;
+
+	F->pflags &= ~UR_PENDING;
+	rb_dlinkDelete(&F->pending_node, &ur_pending);
+}
+
+static uint32_t
+ur_new_serial(rb_fde_t *F)
+{
+	if(F->fd >= ur_info->serial_size)
+	{
+		rb_lib_log("rb_setselect_uring(): fd %d out of range", (int)F->fd);
+		abort();
+	}
+
+	if(++ur_info->next_serial == 0)
+		ur_info->next_serial = 1;
+
+	ur_info->serial[F->fd] = ur_info->next_serial;
+	return ur_info->next_serial;
+}
+
+static void
+ur_register(rb_fde_t *F)
+{
+	uint32_t serial = ur_new_serial(F);
+
+	F->pflags |= UR_REGISTERED;
+	uring_poll_add(F->fd, UR_DATA(UR_OP_POLL, F->fd, serial));
+}
+
+/* run whichever handlers have both a handler and a remembered edge */
+static void
+ur_dispatch(rb_fde_t *F)
+{
+	PF *hdl;
+	void *data;
+
+	if((F->pflags & UR_READ_READY) && F->read_handler != NULL)
+	{
+		hdl = F->read_handler;
+		data = F->read_data;
+		F->read_handler = NULL;
+		F->read_data = NULL;
+		F->pflags &= ~UR_READ_READY;
+		hdl(F, data);
+	}
+
+	if(!IsFDOpen(F))
+		return;
+
+	if((F->pflags & UR_WRITE_READY) && F->write_handler != NULL)
+	{
+		hdl = F->write_handler;
+		data = F->write_data;
+		F->write_handler = NULL;
+		F->write_data = NULL;
+		F->pflags &= ~UR_WRITE_READY;
+		hdl(F, data);
+	}
+}
+
+/*
+ * rb_setselect
+ *
+ * This is a needed exported function which will be called to register
+ * and deregister interest in a pending IO state for a given FD.
+ */
+void
+rb_setselect_uring(rb_fde_t *F, unsigned int type, PF * handler, void *client_data)
+{
+	lrb_assert(IsFDOpen(F));
+
+	if(type & RB_SELECT_READ)
+	{
+		F->read_handler = handler;
+		F->read_data = client_data;
+	}
+
+	if(type & RB_SELECT_WRITE)
+	{
+		F->write_handler = handler;
+		F->write_data = client_data;
+	}
+
+	if(F->read_handler == NULL && F->write_handler == NULL)
+	{
+		ur_pending_del(F);
+		if(F->pflags & UR_REGISTERED)
+		{
+			uring_poll_remove(UR_DATA(UR_OP_POLL, F->fd, ur_info->serial[F->fd]));
+			ur_info->serial[F->fd] = 0;
+			F->pflags &= ~(UR_REGISTERED | UR_READ_READY | UR_WRITE_READY);
+		}
+		return;
+	}
+
+	if(!(F->pflags & UR_REGISTERED))
+	{
+		/* the poll reports the current state as its first completion */
+		ur_register(F);
+		return;
+	}
+
+	if(((F->pflags & UR_READ_READY) && F->read_handler != NULL) ||
+	   ((F->pflags & UR_WRITE_READY) && F->write_handler != NULL))
+		ur_pending_add(F);
+}
+
+static void
+ur_poll_complete(const struct io_uring_cqe *cqe)
+{
+	rb_fde_t *F;
+	int fd = UR_DATA_FD(cqe->user_data);
+
+	if(cqe->user_data == 0 || fd >= ur_info->serial_size)
+		return;
+
+	if(ur_info->serial[fd] != UR_DATA_SERIAL(cqe->user_data))
+		return;
+
+	F = rb_find_fd(fd);
+	if(F == NULL || !IsFDOpen(F))
+		return;
+
+	if(cqe->res < 0)
+	{
+		/* let the handlers find out what went wrong */
+		F->pflags |= UR_READ_READY | UR_WRITE_READY;
+	}
+	else
+	{
+		if(cqe->res & (POLLIN | POLLHUP | POLLERR))
+			F->pflags |= UR_READ_READY;
+		/* with a full send queue, room in the socket isn't room for us */
+		if(cqe->res & (POLLHUP | POLLERR) ||
+		   ((cqe->res & POLLOUT) && !(F->pflags & UR_WRITE_FULL)))
+			F->pflags |= UR_WRITE_READY;
+	}
+
+	if(!(cqe->flags & IORING_CQE_F_MORE))
+	{
+		/* the kernel ended this poll; start another if still wanted */
+		ur_info->serial[fd] = 0;
+		F->pflags &= ~UR_REGISTERED;
+	}
+
+	ur_pending_del(F);
+	ur_dispatch(F);
+
+	if(IsFDOpen(F) && !(F->pflags & UR_REGISTERED) && cqe->res >= 0 &&
+	   (F->read_handler != NULL || F->write_handler != NULL))
+		ur_register(F);
+}
+
+#ifdef IORING_ACCEPT_MULTISHOT
+static void
+ur_accept_arm(rb_fde_t *F)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t serial = ur_new_serial(F);
+
+	sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = F->fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = UR_DATA(UR_OP_ACCEPT, F->fd, serial);
+}
+#endif
+
+/*
+ * rb_accept_uring
+ *
+ * Called by rb_accept_tcp() to accept on the ring; returns 0 if it will.
+ */
+int
+rb_accept_uring(rb_fde_t *F)
+{
+#ifdef IORING_ACCEPT_MULTISHOT
+	if(ur_info->no_accept || F->fd >= ur_info->serial_size)
+		return -1;
+
+	F->pflags |= UR_ACCEPTING;
+	ur_accept_arm(F);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static void
+ur_accept_complete(const struct io_uring_cqe *cqe)
+{
+	struct rb_sockaddr_storage st;
+	rb_socklen_t addrlen = sizeof(st);
+	rb_fde_t *F;
+	int fd = UR_DATA_FD(cqe->user_data);
+
+	F = rb_find_fd(fd);
+	if(fd >= ur_info->serial_size || ur_info->serial[fd] != UR_DATA_SERIAL(cqe->user_data) ||
+	   F == NULL || !IsFDOpen(F) || !(F->pflags & UR_ACCEPTING))
+	{
+		/* a connection that raced with closing the listener */
+		if(cqe->res >= 0)
+			close(cqe->res);
+		return;
+	}
+
+	if(!(cqe->flags & IORING_CQE_F_MORE))
+		ur_info->serial[fd] = 0;
+
+	if(cqe->res >= 0)
+	{
+		if(getpeername(cqe->res, (struct sockaddr *)&st, &addrlen) < 0)
+			close(cqe->res);
+		else
+			rb_accept_fd(F, cqe->res, (struct sockaddr *)&st, addrlen);
+	}
+	else if(cqe->res == -EINVAL)
+	{
+		/* no multishot accept here; go back to accepting on readiness */
+		ur_info->no_accept = 1;
+		ur_info->serial[fd] = 0;
+		F->pflags &= ~UR_ACCEPTING;
+		rb_accept_tryaccept(F, NULL);
+		return;
+	}
+
+#ifdef IORING_ACCEPT_MULTISHOT
+	/* errors like EMFILE end the multishot; keep accepting */
+	if(IsFDOpen(F) && (F->pflags & UR_ACCEPTING) && ur_info->serial[fd] == 0)
+		ur_accept_arm(F);
+#endif
+}
+
+static int
+ur_sendq_usable(rb_fde_t *F)
+{
+	int proto;
+	socklen_t len = sizeof(proto);
+
+	if(!(F->pflags & UR_SEND_CHECKED))
+	{
+		F->pflags |= UR_SEND_CHECKED;
+		if(F->fd < ur_info->serial_size &&
+		   getsockopt(F->fd, SOL_SOCKET, SO_PROTOCOL, &proto, &len) == 0 && proto == IPPROTO_TCP)
+			F->pflags |= UR_SEND_QUEUED;
+	}
+	return F->pflags & UR_SEND_QUEUED;
+}
+
+static void
+ur_sendq_free(struct ur_sendq *sq)
+{
+	rb_free(sq->buf);
+	rb_bh_free(ur_sendq_heap, sq);
+}
+
+static void
+ur_sendq_push(struct ur_sendq *sq)
+{
+	if(sq->queued || sq->inflight > 0)
+		return;
+
+	sq->queued = 1;
+	rb_dlinkAddTail(sq, &sq->node, &ur_sendqs);
+}
+
+/* put this loop's writes in the submission ring, one send per fd */
+static void
+ur_sendq_flush(void)
+{
+	rb_dlink_node *ptr, *next;
+	struct ur_sendq *sq;
+
+	RB_DLINK_FOREACH_SAFE(ptr, next, ur_sendqs.head)
+	{
+		sq = ptr->data;
+		rb_dlinkDelete(ptr, &ur_sendqs);
+		sq->queued = 0;
+		uring_send(sq, 0);
+	}
+}
+
+/*
+ * rb_writev_uring
+ *
+ * rb_write() and rb_writev() for sockets.
+ */
+ssize_t
+rb_writev_uring(rb_fde_t *F, struct rb_iovec *vector, int count)
+{
+	struct ur_sendq *sq;
+	struct msghdr msg;
+	size_t n, want = 0;
+	unsigned int size;
+	ssize_t total = 0;
+	int i;
+
+	if(!ur_sendq_usable(F))
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = (struct iovec *)vector;
+		msg.msg_iovlen = count;
+		return sendmsg(F->fd, &msg, MSG_NOSIGNAL);
+	}
+
+	sq = ur_info->sendq[F->fd];
+	if(sq == NULL)
+	{
+		sq = rb_bh_alloc(ur_sendq_heap);
+		sq->F = F;
+		ur_info->sendq[F->fd] = sq;
+	}
+
+	if(sq->error)
+	{
+		errno = sq->error;
+		return -1;
+	}
+
+	for(i = 0; i < count; i++)
+		want += vector[i].iov_len;
+
+	/* the buffer can only move while the kernel isn't reading it */
+	if(sq->inflight == 0 && sq->len + want > sq->size && sq->size < UR_SENDQ_MAX)
+	{
+		size = sq->size > 0 ? sq->size : UR_SENDQ_MIN;
+		while(size < sq->len + want && size < UR_SENDQ_MAX)
+			size *= 2;
+		sq->buf = rb_realloc(sq->buf, size);
+		sq->size = size;
+	}
+
+	if(sq->len == sq->size)
+	{
+		/* ur_send_complete() says when there is room again */
+		F->pflags = (F->pflags | UR_WRITE_FULL) & ~UR_WRITE_READY;
+		errno = EAGAIN;
+		return -1;
+	}
+
+	for(i = 0; i < count && sq->len < sq->size; i++)
+	{
+		n = vector[i].iov_len;
+		if(n > sq->size - sq->len)
+			n = sq->size - sq->len;
+
+		memcpy(sq->buf + sq->len, vector[i].iov_base, n);
+		sq->len += n;
+		total += n;
+	}
+
+	if(total > 0)
+		ur_sendq_push(sq);
+	return total;
+}
+
+static void
+ur_send_complete(const struct io_uring_cqe *cqe)
+{
+	struct ur_sendq *sq = UR_DATA_SENDQ(cqe->user_data);
+	rb_fde_t *F = sq->F;
+	int res = cqe->res;
+
+	sq->inflight = 0;
+
+	if(F == NULL)
+	{
+		/* closed while the kernel had it; whatever is left is dropped */
+		ur_sendq_free(sq);
+		return;
+	}
+
+	if(res == -EAGAIN || res == -EINTR)
+		res = 0;
+
+	if(res < 0)
+	{
+		sq->error = -res;
+		sq->len = 0;
+	}
+	else
+	{
+		sq->len -= res;
+		memmove(sq->buf, sq->buf + res, sq->len);
+	}
+
+	if(sq->len > 0)
+		ur_sendq_push(sq);
+	else if(!sq->error)
+	{
+		ur_info->sendq[F->fd] = NULL;
+		ur_sendq_free(sq);
+	}
+
+	if((F->pflags & UR_WRITE_FULL) || res < 0)
+	{
+		F->pflags = (F->pflags & ~UR_WRITE_FULL) | UR_WRITE_READY;
+		ur_pending_add(F);
+	}
+}
+
+/*
+ * rb_close_uring
+ *
+ * Called by rb_close() before the fd is given up.  Whatever the fd still
+ * has queued gets one try at going out without waiting for room, as a
+ * write would have before closing; a send that is already waiting for
+ * room is cancelled.  It all goes to the kernel now, as the fd is closed
+ * before the next rb_select().
+ */
+void
+rb_close_uring(rb_fde_t *F)
+{
+	struct ur_sendq *sq;
+	int submit = 0;
+
+	if(F->fd >= ur_info->serial_size)
+		return;
+
+	if((sq = ur_info->sendq[F->fd]) != NULL)
+	{
+		ur_info->sendq[F->fd] = NULL;
+		if(sq->queued)
+		{
+			rb_dlinkDelete(&sq->node, &ur_sendqs);
+			sq->queued = 0;
+		}
+
+		if(sq->inflight > 0)
+			uring_cancel(UR_DATA_PTR(UR_OP_SEND, sq));
+		else if(sq->len > 0)
+			uring_send(sq, MSG_DONTWAIT);
+
+		if(sq->inflight > 0)
+		{
+			/* freed by ur_send_complete() */
+			sq->F = NULL;
+			submit = 1;
+		}
+		else
+			ur_sendq_free(sq);
+	}
+
+	if(F->pflags & UR_ACCEPTING)
+	{
+		if(ur_info->serial[F->fd] != 0)
+			uring_cancel(UR_DATA(UR_OP_ACCEPT, F->fd, ur_info->serial[F->fd]));
+		ur_info->serial[F->fd] = 0;
+		F->pflags &= ~UR_ACCEPTING;
+		submit = 1;
+	}
+
+	if(submit)
+		uring_submit();
+}
+
+static void
+ur_complete(const struct io_uring_cqe *cqe)
+{
+	switch(UR_DATA_OP(cqe->user_data))
+	{
+	case UR_OP_POLL:
+		ur_poll_complete(cqe);
+		break;
+	case UR_OP_ACCEPT:
+		ur_accept_complete(cqe);
+		break;
+	case UR_OP_SEND:
+		ur_send_complete(cqe);
+		break;
+	}
+}
+
+/*
+ * rb_select
+ *
+ * Called to do the new-style IO, courtesy of squid (like most of this
+ * new IO code). This routine handles the stuff we've hidden in
+ * rb_setselect and fd_table[] and calls callbacks for IO ready
+ * events.
+ */
+int
+rb_select_uring(long delay)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct io_uring_cqe cqe;
+	rb_dlink_node *ptr;
+	rb_fde_t *F;
+	unsigned long count;
+	unsigned int head, tail;
+	int num, o_errno;
+
+	if(rb_dlink_list_length(&ur_pending) > 0)
+		delay = 0;
+
+	memset(&arg, 0, sizeof(arg));
+	if(delay >= 0)
+	{
+		ts.tv_sec = delay / 1000;
+		ts.tv_nsec = (delay % 1000) * 1000000;
+		arg.ts = (uintptr_t)&ts;
+	}
+
+	ur_sendq_flush();
+	uring_publish();
+	num = uring_enter(uring_unsubmitted(), delay != 0 ? 1 : 0,
+			  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+	/* save errno as rb_set_time() will likely clobber it */
+	o_errno = errno;
+	rb_set_time();
+	errno = o_errno;
+
+	if(num < 0 && o_errno != ETIME && !rb_ignore_errno(o_errno))
+		return RB_ERROR;
+
+	head = *ur_info->cq_head;
+	tail = __atomic_load_n(ur_info->cq_tail, __ATOMIC_ACQUIRE);
+	while(head != tail)
+	{
+		cqe = ur_info->cqes[head & ur_info->cq_mask];
+		head++;
+		__atomic_store_n(ur_info->cq_head, head, __ATOMIC_RELEASE);
+		ur_complete(&cqe);
+	}
+
+	/* only those queued before now; handlers may queue more for next time */
+	for(count = rb_dlink_list_length(&ur_pending); count > 0; count--)
+	{
+		if((ptr = ur_pending.head) == NULL)
+			break;
+
+		F = ptr->data;
+		ur_pending_del(F);
+		ur_dispatch(F);
+	}
+
+	return RB_OK;
+}
+
+#else /* io_uring not supported here */
+int
+rb_init_netio_uring(void)
+{
+	return ENOSYS;
+}
+
+void
+rb_setselect_uring(rb_fde_t *F, unsigned int type, PF * handler, void *client_data)
+{
+	errno = ENOSYS;
+	return;
+}
+
+int
+rb_select_uring(long delay)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+rb_setup_fd_uring(rb_fde_t *F)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+rb_accept_uring(rb_fde_t *F)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+ssize_t
+rb_writev_uring(rb_fde_t *F, struct rb_iovec *vector, int count)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void
+rb_close_uring(rb_fde_t *F)
+{
+	return;
+}
+#endif
@@ -26,7 +26,33 @@
 #include <rb/rb.h>
 #include <rb/commio_int.h>
 
-static rb_bh *rb_linebuf_heap;
+struct _buf_line
+{
+	uint8_t terminated;	/* Whether we've terminated the buffer */
+	uint8_t raw;		/* Whether this linebuf may hold 8-bit data */
+	uint8_t sizeclass;	/* Which heap this line came from */
+	int len;		/* How much data we've got */
+	int refcount;		/* how many linked lists are we in? */
+	char buf[];		/* linebuf_sizes[sizeclass] bytes */
+};
+
+/* Capacity of each size class.  Lines read from the network always use
+ * LINEBUF_CLASS_FULL since they are filled incrementally; outbound lines
+ * take the smallest class their rendered length fits.
+ */
+#define LINEBUF_CLASS_FULL	3
+#define LINEBUF_NUM_CLASSES	5
+
+static const int linebuf_sizes[LINEBUF_NUM_CLASSES] = {
+	64, 128, 256, BUF_DATA_SIZE + 2, LINEBUF_TAGS_SIZE + BUF_DATA_SIZE + 2
+};
+
+static const char *const linebuf_heap_names[LINEBUF_NUM_CLASSES] = {
+	"librb_linebuf_heap_64", "librb_linebuf_heap_128", "librb_linebuf_heap_256",
+	"librb_linebuf_heap", "librb_linebuf_heap_tagged"
+};
+
+static rb_bh *rb_linebuf_heaps[LINEBUF_NUM_CLASSES];
 
 static int bufline_count = 0;
 
@@ -39,14 +65,32 @@ static int bufline_count = 0;
 void
 rb_linebuf_init(size_t heap_size)
 {
-	rb_linebuf_heap = rb_bh_create(sizeof(buf_line_t), heap_size, "librb_linebuf_heap");
+	int i;
+
+	for(i = 0; i < LINEBUF_NUM_CLASSES; i++)
+	{
+		/* tagged lines are rare and large, keep their blocks small */
+		size_t elems = i == LINEBUF_NUM_CLASSES - 1 ? 16 : heap_size;
+
+		rb_linebuf_heaps[i] = rb_bh_create(sizeof(buf_line_t) + linebuf_sizes[i], elems,
+						   linebuf_heap_names[i]);
+	}
 }
 
 static buf_line_t *
-rb_linebuf_allocate(void)
+rb_linebuf_allocate(int size)
 {
 	buf_line_t *t;
-	t = rb_bh_alloc(rb_linebuf_heap);
+	int i;
+
+	for(i = 0; i < LINEBUF_NUM_CLASSES - 1; i++)
+		if(size <= linebuf_sizes[i])
+			break;
+
+	lrb_assert(size <= linebuf_sizes[i]);
+
+	t = rb_bh_alloc(rb_linebuf_heaps[i]);
+	t->sizeclass = i;
 	return (t);
 
 }
@@ -54,21 +98,21 @@ rb_linebuf_allocate(void)
 static void
 rb_linebuf_free(buf_line_t * p)
 {
-	rb_bh_free(rb_linebuf_heap, p);
+	rb_bh_free(rb_linebuf_heaps[p->sizeclass], p);
 }
 
 /*
  * rb_linebuf_new_line
  *
- * Create a new line, and link it to the given linebuf.
- * It will be initially empty.
+ * Create a new line with room for size bytes, and link it to the given
+ * linebuf.  It will be initially empty.
  */
 static buf_line_t *
-rb_linebuf_new_line(buf_head_t * bufhead)
+rb_linebuf_new_line(buf_head_t * bufhead, int size)
 {
 	buf_line_t *bufline;
 
-	bufline = rb_linebuf_allocate();
+	bufline = rb_linebuf_allocate(size);
 	if(bufline == NULL)
 		return NULL;
 	++bufline_count;
@@ -122,15 +166,14 @@ static inline int
 rb_linebuf_skip_crlf(char *ch, int len)
 {
 	int orig_len = len;
+	const char *eol;
 
-	/* First, skip until the first non-CRLF */
-	for(; len; len--, ch++)
-	{
-		if(*ch == '\r')
-			break;
-		else if(*ch == '\n')
-			break;
-	}
+	/* First, skip until the first CRLF */
+	if((eol = rb_find_eol(ch, len)) == NULL)
+		return orig_len;
+
+	len -= eol - ch;
+	ch += eol - ch;
 
 	/* Then, skip until the last CRLF */
 	for(; len; len--, ch++)
@@ -372,7 +415,7 @@ rb_linebuf_parse(buf_head_t * bufhead, char *data, int len, int raw)
 	while(len > 0)
 	{
 		/* We obviously need a new buffer, so .. */
-		bufline = rb_linebuf_new_line(bufhead);
+		bufline = rb_linebuf_new_line(bufhead, linebuf_sizes[LINEBUF_CLASS_FULL]);
 
 		/* And parse */
 		if(!raw)
@@ -485,90 +528,53 @@ rb_linebuf_attach(buf_head_t * bufhead, buf_head_t * new)
 }
 
 /*
- * rb_linebuf_putmsg
- *
- * Similar to rb_linebuf_put, but designed for use by send.c.
+ * rb_linebuf_terminate
  *
- * prefixfmt is used as a format for the varargs, and is inserted first.
- * Then format/va_args is appended to the buffer.
+ * Truncate, strip any trailing CRLFs from, and CRLF-terminate the len
+ * bytes at buf, which must have room for BUF_DATA_SIZE + 2 bytes.
+ * Returns the new length, not counting the trailing '\0'.
  */
-void
-rb_linebuf_putmsg(buf_head_t * bufhead, const char *format, va_list * va_args,
-		  const char *prefixfmt, ...)
+static int
+rb_linebuf_terminate(char *buf, int len)
 {
-	buf_line_t *bufline;
-	int len = 0;
-	va_list prefix_args;
-
-	/* make sure the previous line is terminated */
-#ifndef NDEBUG
-	if(bufhead->list.tail)
-	{
-		bufline = bufhead->list.tail->data;
-		lrb_assert(bufline->terminated);
-	}
-#endif
-	/* Create a new line */
-	bufline = rb_linebuf_new_line(bufhead);
-
-	if(prefixfmt != NULL)
-	{
-		va_start(prefix_args, prefixfmt);
-		len = vsnprintf(bufline->buf, BUF_DATA_SIZE, prefixfmt, prefix_args);
-		va_end(prefix_args);
-	}
-
-	if(va_args != NULL)
-	{
-		len += vsnprintf((bufline->buf + len), (BUF_DATA_SIZE - len), format, *va_args);
-	}
-
-	bufline->terminated = 1;
-
 	/* Truncate the data if required */
 	if(rb_unlikely(len > 510))
 	{
 		len = 510;
-		bufline->buf[len++] = '\r';
-		bufline->buf[len++] = '\n';
+		buf[len++] = '\r';
+		buf[len++] = '\n';
+		buf[len] = '\0';
 	}
 	else if(rb_unlikely(len == 0))
 	{
-		bufline->buf[len++] = '\r';
-		bufline->buf[len++] = '\n';
-		bufline->buf[len] = '\0';
+		buf[len++] = '\r';
+		buf[len++] = '\n';
+		buf[len] = '\0';
 	}
 	else
 	{
 		/* Chop trailing CRLF's .. */
-		while((bufline->buf[len] == '\r') || (bufline->buf[len] == '\n')
-		      || (bufline->buf[len] == '\0'))
-		{
+		while(len >= 0 && ((buf[len] == '\r') || (buf[len] == '\n') || (buf[len] == '\0')))
 			len--;
-		}
 
-		bufline->buf[++len] = '\r';
-		bufline->buf[++len] = '\n';
-		bufline->buf[++len] = '\0';
+		buf[++len] = '\r';
+		buf[++len] = '\n';
+		buf[++len] = '\0';
 	}
 
-	bufline->len = len;
-	bufhead->len += len;
+	return len;
 }
 
 /*
- * rb_linebuf_putprefix
- *
- * Similar to rb_linebuf_put, but designed for use by send.c.
+ * rb_linebuf_put_line
  *
- * prefix is inserted first, then format/va_args is appended to the buffer.
+ * Append a finished, terminated line of len bytes to the linebuf, in a
+ * buffer just big enough to hold it.
  */
-void
-rb_linebuf_putprefix(buf_head_t * bufhead, const char *format, va_list * va_args,
-		  const char *prefix)
+static void
+rb_linebuf_put_line(buf_head_t * bufhead, const char *data, int len)
 {
 	buf_line_t *bufline;
-	int len = 0;
 
 	/* make sure the previous line is terminated */
 #ifndef NDEBUG
@@ -579,160 +585,118 @@ rb_linebuf_putprefix(buf_head_t * bufhead, const char *format, va_list * va_args
 	}
 #endif
 	/* Create a new line */
-	bufline = rb_linebuf_new_line(bufhead);
-
-	if(prefix != NULL)
-		len = rb_strlcpy(bufline->buf, prefix, BUF_DATA_SIZE);
-
-	if(va_args != NULL)
-	{
-		len += vsnprintf((bufline->buf + len), (BUF_DATA_SIZE - len), format, *va_args);
-	}
+	bufline = rb_linebuf_new_line(bufhead, len + 1);
 
+	memcpy(bufline->buf, data, len + 1);
 	bufline->terminated = 1;
+	bufline->len = len;
+	bufhead->len += len;
+}
 
-	/* Truncate the data if required */
-	if(rb_unlikely(len > 510))
-	{
-		len = 510;
-		bufline->buf[len++] = '\r';
-		bufline->buf[len++] = '\n';
-	}
-	else if(rb_unlikely(len == 0))
+/*
+ * rb_linebuf_putmsg
+ *
+ * Similar to rb_linebuf_put, but designed for use by send.c.
+ *
+ * prefixfmt is used as a format for the varargs, and is inserted first.
+ * Then format/va_args is appended to the buffer.
+ */
+void
+rb_linebuf_putmsg(buf_head_t * bufhead, const char *format, va_list * va_args,
+		  const char *prefixfmt, ...)
+{
+	char buf[BUF_DATA_SIZE + 2];
+	int len = 0;
+	va_list prefix_args;
+
+	if(prefixfmt != NULL)
 	{
-		bufline->buf[len++] = '\r';
-		bufline->buf[len++] = '\n';
-		bufline->buf[len] = '\0';
+		va_start(prefix_args, prefixfmt);
+		len = vsnprintf(buf, BUF_DATA_SIZE, prefixfmt, prefix_args);
+		va_end(prefix_args);
 	}
-	else
-	{
-		/* Chop trailing CRLF's .. */
-		while((bufline->buf[len] == '\r') || (bufline->buf[len] == '\n')
-		      || (bufline->buf[len] == '\0'))
-		{
-			len--;
-		}
 
-		bufline->buf[++len] = '\r';
-		bufline->buf[++len] = '\n';
-		bufline->buf[++len] = '\0';
+	if(va_args != NULL && len < BUF_DATA_SIZE)
+	{
+		len += vsnprintf((buf + len), (BUF_DATA_SIZE - len), format, *va_args);
 	}
 
-	bufline->len = len;
-	bufhead->len += len;
+	len = rb_linebuf_terminate(buf, len);
+	rb_linebuf_put_line(bufhead, buf, len);
 }
 
+/*
+ * rb_linebuf_putprefix
+ *
+ * Similar to rb_linebuf_put, but designed for use by send.c.
+ *
+ * prefix is inserted first, then format/va_args is appended to the buffer.
+ * A leading message-tags section in prefix does not count towards the
+ * 512 byte message limit.
+ */
 void
-rb_linebuf_putbuf(buf_head_t * bufhead, const char *buffer)
+rb_linebuf_putprefix(buf_head_t * bufhead, const char *format, va_list * va_args,
+		  const char *prefix)
 {
-	buf_line_t *bufline;
+	char buf[LINEBUF_TAGS_SIZE + BUF_DATA_SIZE + 2];
+	char *msg = buf;
+	int taglen = 0;
 	int len = 0;
 
-	/* make sure the previous line is terminated */
-#ifndef NDEBUG
-	if(bufhead->list.tail)
+	if(prefix != NULL && *prefix == '@')
 	{
-		bufline = bufhead->list.tail->data;
-		lrb_assert(bufline->terminated);
-	}
-#endif
-	/* Create a new line */
-	bufline = rb_linebuf_new_line(bufhead);
+		const char *sp = strchr(prefix, ' ');
 
-	if(rb_unlikely(buffer != NULL))
-		len = rb_strlcpy(bufline->buf, buffer, BUF_DATA_SIZE);
+		if(sp != NULL && sp - prefix < LINEBUF_TAGS_SIZE)
+		{
+			taglen = sp - prefix + 1;
+			memcpy(buf, prefix, taglen);
+			msg += taglen;
+			prefix += taglen;
+		}
+	}
 
-	bufline->terminated = 1;
+	if(prefix != NULL)
+		len = rb_strlcpy(msg, prefix, BUF_DATA_SIZE);
 
-	/* Truncate the data if required */
-	if(rb_unlikely(len > 510))
+	if(va_args != NULL && len < BUF_DATA_SIZE)
 	{
-		len = 510;
-		bufline->buf[len++] = '\r';
-		bufline->buf[len++] = '\n';
+		len += vsnprintf((msg + len), (BUF_DATA_SIZE - len), format, *va_args);
 	}
-	else if(rb_unlikely(len == 0))
-	{
-		bufline->buf[len++] = '\r';
-		bufline->buf[len++] = '\n';
-		bufline->buf[len] = '\0';
-	}
-	else
-	{
-		/* Chop trailing CRLF's .. */
-		while((bufline->buf[len] == '\r') || (bufline->buf[len] == '\n')
-		      || (bufline->buf[len] == '\0'))
-		{
-			len--;
-		}
 
-		bufline->buf[++len] = '\r';
-		bufline->buf[++len] = '\n';
-		bufline->buf[++len] = '\0';
-	}
+	len = rb_linebuf_terminate(msg, len);
+	rb_linebuf_put_line(bufhead, buf, taglen + len);
+}
 
-	bufline->len = len;
-	bufhead->len += len;
+void
+rb_linebuf_putbuf(buf_head_t * bufhead, const char *buffer)
+{
+	char buf[BUF_DATA_SIZE + 2];
+	int len = 0;
 
+	if(rb_unlikely(buffer != NULL))
+		len = rb_strlcpy(buf, buffer, BUF_DATA_SIZE);
 
+	len = rb_linebuf_terminate(buf, len);
+	rb_linebuf_put_line(bufhead, buf, len);
 }
 
 void
 rb_linebuf_put(buf_head_t * bufhead, const char *format, ...)
 {
-	buf_line_t *bufline;
+	char buf[BUF_DATA_SIZE + 2];
 	int len = 0;
 	va_list args;
 
-	/* make sure the previous line is terminated */
-#ifndef NDEBUG
-	if(bufhead->list.tail)
-	{
-		bufline = bufhead->list.tail->data;
-		lrb_assert(bufline->terminated);
-	}
-#endif
-	/* Create a new line */
-	bufline = rb_linebuf_new_line(bufhead);
-
 	if(rb_unlikely(format != NULL))
 	{
 		va_start(args, format);
-		len = vsnprintf(bufline->buf, BUF_DATA_SIZE, format, args);
+		len = vsnprintf(buf, BUF_DATA_SIZE, format, args);
 		va_end(args);
 	}
 
-	bufline->terminated = 1;
-
-	/* Truncate the data if required */
-	if(rb_unlikely(len > 510))
-	{
-		len = 510;
-		bufline->buf[len++] = '\r';
-		bufline->buf[len++] = '\n';
-	}
-	else if(rb_unlikely(len == 0))
-	{
-		bufline->buf[len++] = '\r';
-		bufline->buf[len++] = '\n';
-		bufline->buf[len] = '\0';
-	}
-	else
-	{
-		/* Chop trailing CRLF's .. */
-		while((bufline->buf[len] == '\r') || (bufline->buf[len] == '\n')
-		      || (bufline->buf[len] == '\0'))
-		{
-			len--;
-		}
-
-		bufline->buf[++len] = '\r';
-		bufline->buf[++len] = '\n';
-		bufline->buf[++len] = '\0';
-	}
-
-	bufline->len = len;
-	bufhead->len += len;
+	len = rb_linebuf_terminate(buf, len);
+	rb_linebuf_put_line(bufhead, buf, len);
 }
 
 
@@ -890,5 +854,16 @@ rb_linebuf_flush(rb_fde_t *F, buf_head_t * bufhead)
 void
 rb_count_rb_linebuf_memory(size_t *count, size_t *rb_linebuf_memory_used)
 {
-	rb_bh_usage(rb_linebuf_heap, count, NULL, rb_linebuf_memory_used, NULL);
+	size_t used, memusage;
+	int i;
+
+	*count = 0;
+	*rb_linebuf_memory_used = 0;
+
+	for(i = 0; i < LINEBUF_NUM_CLASSES; i++)
+	{
+		rb_bh_usage(rb_linebuf_heaps[i], &used, NULL, &memusage, NULL);
+		*count += used;
+		*rb_linebuf_memory_used += memusage;
+	}
 }
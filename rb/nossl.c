@@ -185,4 +185,20 @@ rb_ssl_get_cipher(rb_fde_t *F)
 	return NULL;
 }
 
+void
+rb_ssl_set_ktls(int enable)
+{
+}
+
+int
+rb_ssl_ktls(rb_fde_t *F)
+{
+	return 0;
+}
+
+void
+rb_ssl_ktls_release(rb_fde_t *F)
+{
+}
+
 #endif /* !HAVE_OPENSSL */
@@ -92,6 +92,7 @@
 static SSL_CTX *ssl_server_ctx = NULL;
 static SSL_CTX *ssl_client_ctx = NULL;
 static int librb_index = -1;
+static int ssl_ktls = 0;
 
 static unsigned long
 get_last_err(void)
@@ -244,6 +245,10 @@ rb_ssl_start_accepted(rb_fde_t *new_F, ACCB * cb, void *data, int timeout)
 	new_F->type |= RB_FD_SSL;
 	new_F->ssl = SSL_new(ssl_server_ctx);
 	new_F->accept = rb_malloc(sizeof(struct acceptdata));
+#ifdef SSL_OP_ENABLE_KTLS
+	if(ssl_ktls)
+		SSL_set_options((SSL *) new_F->ssl, SSL_OP_ENABLE_KTLS);
+#endif
 
 	new_F->accept->callback = cb;
 	new_F->accept->data = data;
@@ -880,4 +885,46 @@ rb_ssl_get_cipher(rb_fde_t *F)
 	return SSL_CIPHER_get_name(sslciph);
 }
 
+/*
+ * Kernel TLS: sessions accepted after rb_ssl_set_ktls(1) ask OpenSSL to
+ * hand their keys to the kernel once the handshake is done.  If both
+ * directions made it, and OpenSSL has nothing buffered, rb_ssl_ktls()
+ * says so and the socket can be read and written in the clear by anyone
+ * holding it.  rb_ssl_ktls_release() keeps rb_close() from ending the
+ * session when our copy of the socket goes away.
+ */
+void
+rb_ssl_set_ktls(int enable)
+{
+	ssl_ktls = enable;
+}
+
+int
+rb_ssl_ktls(rb_fde_t *F)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL *ssl;
+
+	if(F == NULL || F->ssl == NULL)
+		return 0;
+
+	ssl = (SSL *) F->ssl;
+	if(!BIO_get_ktls_send(SSL_get_wbio(ssl)) || !BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+		return 0;
+
+	return !SSL_has_pending(ssl);
+#else
+	return 0;
+#endif
+}
+
+void
+rb_ssl_ktls_release(rb_fde_t *F)
+{
+	if(F == NULL || F->ssl == NULL)
+		return;
+
+	SSL_set_quiet_shutdown((SSL *) F->ssl, 1);
+}
+
 #endif /* HAVE_OPENSSL */
@@ -562,22 +562,20 @@ rb_radixtree_elem_find(rb_radixtree *dict, const char *key, int fuzzy)
 
 	char *ckey_buf = NULL;
 	const char *ckey;
-	rb_radixtree_elem *delem;
-
-	int val, keylen;
+	rb_radixtree_leaf *leaf;
 
 	lrb_assert(dict != NULL);
 	lrb_assert(key != NULL);
 
-	keylen = strlen(key);
-
 	if (dict->canonize_cb == NULL)
 	{
 		ckey = key;
 	}
 	else
 	{
-		if (keylen >= (int) sizeof(ckey_store))
+		size_t keylen = strlen(key);
+
+		if (keylen >= sizeof(ckey_store))
 		{
 			ckey_buf = rb_strdup(key);
 			dict->canonize_cb(ckey_buf);
@@ -585,12 +583,49 @@ rb_radixtree_elem_find(rb_radixtree *dict, const char *key, int fuzzy)
 		}
 		else
 		{
-			rb_strlcpy(ckey_store, key, sizeof ckey_store);
+			memcpy(ckey_store, key, keylen + 1);
 			dict->canonize_cb(ckey_store);
 			ckey = ckey_store;
 		}
 	}
 
+	leaf = rb_radixtree_elem_find_canon(dict, ckey, fuzzy);
+
+	if (ckey_buf != NULL)
+		rb_free(ckey_buf);
+
+	return leaf;
+}
+
+/*
+ * rb_radixtree_elem_find_canon(rb_radixtree *dtree, const char *ckey, int fuzzy)
+ *
+ * As rb_radixtree_elem_find(), but the key is already canonized.
+ *
+ * Inputs:
+ *     - patricia tree object
+ *     - canonized key
+ *     - whether to do a direct or fuzzy search
+ *
+ * Outputs:
+ *     - on success, the dtree node requested
+ *     - on failure, NULL
+ *
+ * Side Effects:
+ *     - none
+ */
+rb_radixtree_leaf *
+rb_radixtree_elem_find_canon(rb_radixtree *dict, const char *ckey, int fuzzy)
+{
+	rb_radixtree_elem *delem;
+
+	int val, keylen;
+
+	lrb_assert(dict != NULL);
+	lrb_assert(ckey != NULL);
+
+	keylen = strlen(ckey);
+
 	delem = dict->root;
 
 	while (delem != NULL && !IS_LEAF(delem))
@@ -607,9 +642,6 @@ rb_radixtree_elem_find(rb_radixtree *dict, const char *key, int fuzzy)
 	if ((delem != NULL) && !fuzzy && strcmp(delem->leaf.key, ckey))
 		delem = NULL;
 
-	if (ckey_buf != NULL)
-		rb_free(ckey_buf);
-
 	return &delem->leaf;
 }
 
@@ -952,6 +984,22 @@ rb_radixtree_retrieve(rb_radixtree *dtree, const char *key)
 	return NULL;
 }
 
+/*
+ * rb_radixtree_retrieve_canon(rb_radixtree *dtree, const char *ckey)
+ *
+ * As rb_radixtree_retrieve(), but the key is already canonized.
+ */
+void *
+rb_radixtree_retrieve_canon(rb_radixtree *dtree, const char *ckey)
+{
+	rb_radixtree_leaf *delem = rb_radixtree_elem_find_canon(dtree, ckey, 0);
+
+	if (delem != NULL)
+		return delem->data;
+
+	return NULL;
+}
+
 const char *
 rb_radixtree_elem_get_key(rb_radixtree_leaf *leaf)
 {
@@ -215,23 +215,24 @@ rb_lib_init(log_cb * ilog, restart_cb * irestart, die_cb * idie, int closeall, i
 	rb_fdlist_init(closeall, maxcon, fd_heap_size);
 	rb_init_netio();
 	rb_init_rb_dlink_nodes(dh_size);
-	if(rb_io_supports_event())
-	{
-		rb_io_init_event();
-	}
 }
 
 void
 rb_lib_loop(long delay)
 {
-	time_t next;
+	long next;
 	rb_set_time();
 
-	if(delay == 0)
-		delay = -1;
-
 	while(1)
-		rb_select(-1);
+	{
+		/* sleep until the next timer, or at most delay if given */
+		next = rb_event_next_delay();
+		if(delay != 0 && (next < 0 || next > delay))
+			next = delay;
+
+		rb_select(next);
+		rb_event_run();
+	}
 }
 
 #ifndef HAVE_STRTOK_R
@@ -0,0 +1,231 @@
+/*
+ *  librb: a library used by charybdis and other things
+ *  scan.c: Vectorised byte scanning for the line and message parsers.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ *  USA
+ *
+ */
+#include <rb/rb.h>
+
+/*
+ * Each scanner has a scalar version and, on x86, SSE2 and AVX2 versions
+ * that test 16 or 32 bytes per step.  The kernel is chosen from the CPU
+ * on first use.
+ *
+ * rb_strchr2() does not know the string's length, so its vector versions
+ * read whole aligned blocks, which may run past the terminating NUL.  An
+ * aligned block never crosses a page, so this cannot fault, but address
+ * sanitizer builds use the scalar version.
+ */
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define RB_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__SANITIZE_ADDRESS__)
+#define RB_SCAN_NO_OVERREAD 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define RB_SCAN_NO_OVERREAD 1
+#endif
+#endif
+
+static const char *find_eol_select(const char *p, size_t len);
+static const char *strchr2_select(const char *s, int c1, int c2);
+
+static const char *(*find_eol_impl)(const char *, size_t) = find_eol_select;
+static const char *(*strchr2_impl)(const char *, int, int) = strchr2_select;
+static const char *scan_kernel = NULL;
+
+static const char *
+find_eol_scalar(const char *p, size_t len)
+{
+	const char *end = p + len;
+
+	for(; p < end; p++)
+		if(*p == '\r' || *p == '\n')
+			return p;
+
+	return NULL;
+}
+
+static const char *
+strchr2_scalar(const char *s, int c1, int c2)
+{
+	for(; *s != '\0' && *s != (char)c1 && *s != (char)c2; s++)
+		;
+
+	return s;
+}
+
+#ifdef RB_SCAN_X86
+static const char *
+find_eol_sse2(const char *p, size_t len)
+{
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	const char *end = p + len;
+
+	for(; end - p >= 16; p += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(const void *)p);
+		unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+								   _mm_cmpeq_epi8(v, lf)));
+		if(mask != 0)
+			return p + __builtin_ctz(mask);
+	}
+
+	return find_eol_scalar(p, end - p);
+}
+
+__attribute__((target("avx2")))
+static const char *
+find_eol_avx2(const char *p, size_t len)
+{
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	const char *end = p + len;
+
+	for(; end - p >= 32; p += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(const void *)p);
+		unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+									 _mm256_cmpeq_epi8(v, lf)));
+		if(mask != 0)
+			return p + __builtin_ctz(mask);
+	}
+
+	return find_eol_sse2(p, end - p);
+}
+
+#ifndef RB_SCAN_NO_OVERREAD
+static const char *
+strchr2_sse2(const char *s, int c1, int c2)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i a = _mm_set1_epi8((char)c1);
+	const __m128i b = _mm_set1_epi8((char)c2);
+	unsigned int off = (uintptr_t)s & 15;
+	const char *p = s - off;
+	unsigned int mask;
+
+	for(;;)
+	{
+		__m128i v = _mm_load_si128((const __m128i *)(const void *)p);
+
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, zero),
+				_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b))));
+		/* ignore the bytes before s in the first block */
+		mask = (mask >> off) << off;
+		if(mask != 0)
+			return p + __builtin_ctz(mask);
+
+		p += 16;
+		off = 0;
+	}
+}
+
+__attribute__((target("avx2")))
+static const char *
+strchr2_avx2(const char *s, int c1, int c2)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i a = _mm256_set1_epi8((char)c1);
+	const __m256i b = _mm256_set1_epi8((char)c2);
+	unsigned int off = (uintptr_t)s & 31;
+	const char *p = s - off;
+	unsigned int mask;
+
+	for(;;)
+	{
+		__m256i v = _mm256_load_si256((const __m256i *)(const void *)p);
+
+		mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, zero),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, a), _mm256_cmpeq_epi8(v, b))));
+		mask = (mask >> off) << off;
+		if(mask != 0)
+			return p + __builtin_ctz(mask);
+
+		p += 32;
+		off = 0;
+	}
+}
+#endif /* !RB_SCAN_NO_OVERREAD */
+#endif /* RB_SCAN_X86 */
+
+static void
+scan_select(void)
+{
+	find_eol_impl = find_eol_scalar;
+	strchr2_impl = strchr2_scalar;
+	scan_kernel = "scalar";
+
+#ifdef RB_SCAN_X86
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx2"))
+	{
+		find_eol_impl = find_eol_avx2;
+#ifndef RB_SCAN_NO_OVERREAD
+		strchr2_impl = strchr2_avx2;
+#endif
+		scan_kernel = "avx2";
+	}
+	else
+	{
+		find_eol_impl = find_eol_sse2;
+#ifndef RB_SCAN_NO_OVERREAD
+		strchr2_impl = strchr2_sse2;
+#endif
+		scan_kernel = "sse2";
+	}
+#endif
+}
+
+static const char *
+find_eol_select(const char *p, size_t len)
+{
+	scan_select();
+	return find_eol_impl(p, len);
+}
+
+static const char *
+strchr2_select(const char *s, int c1, int c2)
+{
+	scan_select();
+	return strchr2_impl(s, c1, c2);
+}
+
+const char *
+rb_find_eol(const char *p, size_t len)
+{
+	return find_eol_impl(p, len);
+}
+
+char *
+rb_strchr2(const char *s, int c1, int c2)
+{
+	return (char *)(uintptr_t)strchr2_impl(s, c1, c2);
+}
+
+const char *
+rb_scan_kernel(void)
+{
+	if(scan_kernel == NULL)
+		scan_select();
+
+	return scan_kernel;
+}
@@ -113,7 +113,7 @@ rb_string_to_array(char *string, char **parv, int maxpara)
 		{
 			parv[x++] = xbuf;
 			parv[x] = NULL;
-			if((p = strchr(xbuf, ' ')) != NULL)
+			if(*(p = rb_strchr2(xbuf, ' ', ' ')) != '\0')
 			{
 				*p++ = '\0';
 				xbuf = p;
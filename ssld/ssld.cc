@@ -107,6 +107,7 @@ typedef struct _conn
 #define FLAG_SSL_W_WANTS_R 0x10	/* output needs to wait until input possible */
 #define FLAG_SSL_R_WANTS_W 0x20	/* input needs to wait until output possible */
 #define FLAG_ZIPSSL	0x40
+#define FLAG_KTLS	0x80	/* offered to ircd, waiting for its answer */
 
 #define IsSSL(x) ((x)->flags & FLAG_SSL)
 #define IsZip(x) ((x)->flags & FLAG_ZIP)
@@ -115,6 +116,7 @@ typedef struct _conn
 #define IsSSLWWantsR(x) ((x)->flags & FLAG_SSL_W_WANTS_R)
 #define IsSSLRWantsW(x) ((x)->flags & FLAG_SSL_R_WANTS_W)
 #define IsZipSSL(x)	((x)->flags & FLAG_ZIPSSL)
+#define IsKTLS(x)	((x)->flags & FLAG_KTLS)
 
 #define SetSSL(x) ((x)->flags |= FLAG_SSL)
 #define SetZip(x) ((x)->flags |= FLAG_ZIP)
@@ -122,10 +124,12 @@ typedef struct _conn
 #define SetDead(x) ((x)->flags |= FLAG_DEAD)
 #define SetSSLWWantsR(x) ((x)->flags |= FLAG_SSL_W_WANTS_R)
 #define SetSSLRWantsW(x) ((x)->flags |= FLAG_SSL_R_WANTS_W)
+#define SetKTLS(x) ((x)->flags |= FLAG_KTLS)
 
 #define ClearCork(x) ((x)->flags &= ~FLAG_CORK)
 #define ClearSSLWWantsR(x) ((x)->flags &= ~FLAG_SSL_W_WANTS_R)
 #define ClearSSLRWantsW(x) ((x)->flags &= ~FLAG_SSL_R_WANTS_W)
+#define ClearKTLS(x) ((x)->flags &= ~FLAG_KTLS)
 
 #define NO_WAIT 0x0
 #define WAIT_PLAIN 0x1
@@ -369,18 +373,25 @@ conn_plain_write(conn_t * conn, void *data, size_t len)
 }
 
 static void
-mod_cmd_write_queue(mod_ctl_t * ctl, const void *data, size_t len)
+mod_cmd_write_queue_fd(mod_ctl_t * ctl, rb_fde_t *F, const void *data, size_t len)
 {
 	mod_ctl_buf_t *ctl_buf;
 	ctl_buf = (mod_ctl_buf_t *)rb_malloc(sizeof(mod_ctl_buf_t));
 	ctl_buf->buf = (uint8_t *)rb_malloc(len);
 	ctl_buf->buflen = len;
 	memcpy(ctl_buf->buf, data, len);
-	ctl_buf->nfds = 0;
+	ctl_buf->F[0] = F;
+	ctl_buf->nfds = F != NULL ? 1 : 0;
 	rb_dlinkAddTail(ctl_buf, &ctl_buf->node, &ctl->writeq);
 	mod_write_ctl(ctl->F, ctl);
 }
 
+static void
+mod_cmd_write_queue(mod_ctl_t * ctl, const void *data, size_t len)
+{
+	mod_cmd_write_queue_fd(ctl, NULL, data, len);
+}
+
 #ifdef HAVE_LIBZ
 static void
 common_zlib_deflate(conn_t * conn, void *buf, size_t len)
@@ -707,6 +718,38 @@ ssl_send_open(conn_t *conn)
 	mod_cmd_write_queue(conn->ctl, buf, 5);
 }
 
+/*
+ * ssl_send_ktls - offer ircd a copy of a socket the kernel now does TLS
+ * on.  Until ircd answers, we keep passing on what it writes to the plain
+ * side, but leave whatever the client sends in the socket for ircd.
+ */
+static bool
+ssl_send_ktls(conn_t *conn)
+{
+	uint8_t buf[5];
+	rb_fde_t *F;
+	int fd;
+
+	if(!rb_ssl_ktls(conn->mod_fd))
+		return false;
+
+	if((fd = dup(rb_get_fd(conn->mod_fd))) < 0)
+		return false;
+
+	F = rb_open(fd, RB_FD_SOCKET, "kTLS socket");
+	if(F == NULL)
+	{
+		close(fd);
+		return false;
+	}
+
+	buf[0] = 'T';
+	uint32_to_buf(&buf[1], conn->id);
+	mod_cmd_write_queue_fd(conn->ctl, F, buf, sizeof(buf));
+	SetKTLS(conn);
+	return true;
+}
+
 static void
 ssl_process_accept_cb(rb_fde_t *F, int status, struct sockaddr *addr, rb_socklen_t len, void *data)
 {
@@ -716,6 +759,11 @@ ssl_process_accept_cb(rb_fde_t *F, int status, struct sockaddr *addr, rb_socklen
 	{
 		ssl_send_cipher(conn);
 		ssl_send_certfp(conn);
+		if(ssl_send_ktls(conn))
+		{
+			conn_plain_read_cb(conn->plain_fd, conn);
+			return;
+		}
 		ssl_send_open(conn);
 		conn_mod_read_cb(conn->mod_fd, conn);
 		conn_plain_read_cb(conn->plain_fd, conn);
@@ -785,6 +833,84 @@ ssl_change_certfp_method(mod_ctl_t * ctl, mod_ctl_buf_t * ctlb)
 	certfp_method = buf_to_uint32(&ctlb->buf[1]);
 }
 
+static void
+ssl_change_ktls(mod_ctl_t * ctl, mod_ctl_buf_t * ctlb)
+{
+	rb_ssl_set_ktls(buf_to_uint32(&ctlb->buf[1]) != 0);
+}
+
+/* the last of what ircd wrote before taking the socket has gone out */
+static void
+ssl_ktls_flush(rb_fde_t *fd, void *data)
+{
+	conn_t *conn = (conn_t *)data;
+	int retlen;
+
+	if(IsDead(conn))
+		return;
+
+	while((retlen = rb_rawbuf_flush(conn->modbuf_out, conn->mod_fd)) > 0)
+		conn->mod_out += retlen;
+
+	if(retlen == 0 || (retlen < 0 && !rb_ignore_errno(errno)))
+	{
+		close_conn(conn, WAIT_PLAIN, "Write error: %s", strerror(errno));
+		return;
+	}
+
+	if(rb_rawbuf_length(conn->modbuf_out) > 0)
+	{
+		rb_setselect(conn->mod_fd, RB_SELECT_WRITE, ssl_ktls_flush, conn);
+		return;
+	}
+
+	rb_ssl_ktls_release(conn->mod_fd);
+	ssl_send_open(conn);
+	close_conn(conn, NO_WAIT, NULL);
+}
+
+/*
+ * ircd's answer to ssl_send_ktls().  If it took the socket, it has stopped
+ * writing to the plain side, so pass on what is left there and let go of
+ * the connection.  If not, carry on proxying as usual.
+ */
+static void
+ssl_process_ktls(mod_ctl_t * ctl, mod_ctl_buf_t * ctlb)
+{
+	char inbuf[READBUF_SIZE];
+	conn_t *conn;
+	int length;
+
+	conn = conn_find_by_id(buf_to_uint32(&ctlb->buf[1]));
+	if(conn == NULL || !IsKTLS(conn))
+		return;
+
+	ClearKTLS(conn);
+
+	if(!ctlb->buf[5])
+	{
+		ssl_send_open(conn);
+		conn_mod_read_cb(conn->mod_fd, conn);
+		return;
+	}
+
+	rb_setselect(conn->plain_fd, RB_SELECT_READ, NULL, NULL);
+
+	while((length = rb_read(conn->plain_fd, inbuf, sizeof(inbuf))) > 0)
+	{
+		conn->plain_in += length;
+		conn_mod_write(conn, inbuf, length);
+	}
+
+	if(length == 0 || (length < 0 && !rb_ignore_errno(errno)))
+	{
+		close_conn(conn, NO_WAIT, NULL);
+		return;
+	}
+
+	ssl_ktls_flush(conn->mod_fd, conn);
+}
+
 static void
 ssl_process_connect(mod_ctl_t * ctl, mod_ctl_buf_t * ctlb)
 {
@@ -1024,6 +1150,26 @@ mod_process_cmd_recv(mod_ctl_t * ctl)
 				ssl_change_certfp_method(ctl, ctl_buf);
 				break;
 			}
+		case 'E':
+			{
+				if (ctl_buf->buflen != 5)
+				{
+					cleanup_bad_message(ctl, ctl_buf);
+					break;
+				}
+				ssl_change_ktls(ctl, ctl_buf);
+				break;
+			}
+		case 'T':
+			{
+				if (ctl_buf->buflen != 6)
+				{
+					cleanup_bad_message(ctl, ctl_buf);
+					break;
+				}
+				ssl_process_ktls(ctl, ctl_buf);
+				break;
+			}
 		case 'K':
 			{
 				if(!ssld_ssl_ok)
@@ -0,0 +1,305 @@
+/*
+ *  banbench.cc: Connect-time K-line lookup benchmark.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ *  USA
+ */
+
+/*
+ * Loads a K-line set into the address conf tables, behind a single *@*
+ * auth block, and replays a list of connections through
+ * find_address_conf(), the lookup made when a client registers.
+ *
+ * K-lines come from a kline.conf as written by bantool -e, and connections
+ * from the ircd's user.log; either is generated when not given.  The
+ * generated set is mostly single IPv4 addresses with some /24s and host
+ * wildcards, which is roughly what a network accumulates from bots.
+ *
+ * See README.bench.
+ */
+
+#include <ircd/stdinc.h>
+#include <ircd/s_conf.h>
+#include <ircd/hostmask.h>
+#include <string>
+#include <vector>
+
+using namespace ircd;
+
+struct bb_connect
+{
+	std::string user;
+	std::string host;
+	std::string sockhost;
+	struct rb_sockaddr_storage ip;
+};
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t
+rng(void)
+{
+	/* xorshift64* */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+add_conf(int status, const char *user, const char *host)
+{
+	struct ConfItem *aconf = (struct ConfItem *)rb_malloc(sizeof(struct ConfItem));
+
+	aconf->status = status;
+	aconf->user = rb_strdup(user);
+	aconf->host = rb_strdup(host);
+	aconf->passwd = rb_strdup("banbench");
+	aconf->info.name = rb_strdup("banbench");
+	add_conf_by_address(aconf->host, status, aconf->user, NULL, aconf);
+}
+
+/* the next "field" of a bantool export line, or NULL */
+static char *
+next_field(char **p)
+{
+	char *s = *p, *e;
+
+	if(*s != '"' || (e = strchr(s + 1, '"')) == NULL)
+		return NULL;
+
+	*e = '\0';
+	*p = e[1] == ',' ? e + 2 : e + 1;
+	return s + 1;
+}
+
+static unsigned int
+load_klines(const char *path)
+{
+	char line[BUFSIZE], *p, *user, *host;
+	unsigned int count = 0;
+	FILE *f;
+
+	if((f = fopen(path, "r")) == NULL)
+	{
+		fprintf(stderr, "banbench: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	while(fgets(line, sizeof(line), f) != NULL)
+	{
+		p = line;
+		if((user = next_field(&p)) == NULL || (host = next_field(&p)) == NULL)
+			continue;
+
+		add_conf(CONF_KILL, user, host);
+		count++;
+	}
+
+	fclose(f);
+	return count;
+}
+
+static void
+make_klines(unsigned int count)
+{
+	char mask[HOSTLEN + 1];
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		if(i % 100 == 99)
+			snprintf(mask, sizeof(mask), "*.isp%u.example.net", i / 100);
+		else
+			snprintf(mask, sizeof(mask), "%u.%u.%u.%u%s",
+				 (unsigned int)(1 + rng() % 200), (unsigned int)(rng() % 256),
+				 (unsigned int)(rng() % 256), (unsigned int)(rng() % 256),
+				 i % 10 == 0 ? "/24" : "");
+
+		add_conf(CONF_KILL, "*", mask);
+	}
+}
+
+static bool
+add_connect(std::vector<struct bb_connect> &connects, const char *user,
+	    const char *host, const char *sockhost)
+{
+	struct bb_connect c;
+
+	if(rb_inet_pton_sock(sockhost, (struct sockaddr *)&c.ip) <= 0)
+		return false;
+
+	c.user = user;
+	c.host = host;
+	c.sockhost = sockhost;
+	connects.push_back(c);
+	return true;
+}
+
+/* user.log lines end in "nick!user@host sockhost sendK/receiveK" */
+static void
+load_connects(std::vector<struct bb_connect> &connects, const char *path)
+{
+	char line[BUFSIZE], *p, *at, *sockhost;
+	FILE *f;
+
+	if((f = fopen(path, "r")) == NULL)
+	{
+		fprintf(stderr, "banbench: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	while(fgets(line, sizeof(line), f) != NULL)
+	{
+		if((p = strstr(line, "): ")) == NULL || (p = strchr(p, '!')) == NULL)
+			continue;
+
+		if((at = strchr(++p, '@')) == NULL || (sockhost = strchr(at, ' ')) == NULL)
+			continue;
+
+		*at++ = '\0';
+		*sockhost++ = '\0';
+		sockhost[strcspn(sockhost, " \r\n")] = '\0';
+		add_connect(connects, p, at, sockhost);
+	}
+
+	fclose(f);
+}
+
+static void
+make_connects(std::vector<struct bb_connect> &connects, unsigned int count,
+	      unsigned int klines)
+{
+	char host[HOSTLEN + 1], sockhost[HOSTIPLEN + 1];
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		snprintf(sockhost, sizeof(sockhost), "%u.%u.%u.%u",
+			 (unsigned int)(1 + rng() % 200), (unsigned int)(rng() % 256),
+			 (unsigned int)(rng() % 256), (unsigned int)(rng() % 256));
+
+		/* a quarter without reverse DNS, the rest spread over twice as
+		 * many ISPs as make_klines() put a host wildcard on
+		 */
+		if(i % 4 == 0)
+			rb_strlcpy(host, sockhost, sizeof(host));
+		else
+			snprintf(host, sizeof(host), "host%u.dyn.isp%u.example.net",
+				 (unsigned int)rng() % 100000,
+				 (unsigned int)(rng() % (klines / 50 + 1)));
+
+		add_connect(connects, "~bench", host, sockhost);
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: banbench [options] [user.log ...]\n"
+		"  -k kline.conf  K-lines to load, as exported by bantool -e\n"
+		"  -n count       K-lines to generate without -k (200000)\n"
+		"  -c count       connections to generate without a log (100000)\n"
+		"  -r rounds      times to replay the connections (3)\n"
+		"  -S seed        random seed\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	std::vector<struct bb_connect> connects;
+	const char *klinefile = NULL;
+	unsigned int nklines = 200000, nconnects = 100000, rounds = 3;
+	uint64_t best = UINT64_MAX;
+	unsigned long banned = 0;
+	int ch;
+
+	while((ch = getopt(argc, argv, "k:n:c:r:S:h")) != -1)
+	{
+		switch(ch)
+		{
+			case 'k': klinefile = optarg; break;
+			case 'n': nklines = atoi(optarg); break;
+			case 'c': nconnects = atoi(optarg); break;
+			case 'r': rounds = atoi(optarg); break;
+			case 'S': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+			default: usage();
+		}
+	}
+
+	if(rounds == 0)
+		usage();
+
+	rb_lib_init(NULL, NULL, NULL, 0, 1024, 1024, 1024);
+	rb_set_time();
+	init_host_hash();
+
+	add_conf(CONF_CLIENT, "*", "*");
+
+	if(klinefile != NULL)
+		nklines = load_klines(klinefile);
+	else
+		make_klines(nklines);
+
+	for(int i = optind; i < argc; i++)
+		load_connects(connects, argv[i]);
+
+	if(optind == argc)
+		make_connects(connects, nconnects, nklines);
+
+	if(connects.empty())
+	{
+		fprintf(stderr, "banbench: no connections to replay\n");
+		return 1;
+	}
+
+	printf("banbench: %u K-lines, %zu connections\n", nklines, connects.size());
+
+	for(unsigned int r = 0; r < rounds; r++)
+	{
+		uint64_t t0 = now_ns(), t;
+
+		banned = 0;
+		for(struct bb_connect &c : connects)
+		{
+			const char *user = c.user.c_str();
+			struct ConfItem *aconf;
+
+			aconf = find_address_conf(c.host.c_str(), c.sockhost.c_str(), user,
+						  *user == '~' ? user + 1 : user,
+						  (struct sockaddr *)&c.ip, GET_SS_FAMILY(&c.ip), NULL);
+			if(aconf != NULL && aconf->status == CONF_KILL)
+				banned++;
+		}
+
+		t = now_ns() - t0;
+		best = std::min(best, t);
+		printf("  round %u: %.1f ms, %.1f ns per connection\n", r + 1,
+		       t / 1e6, (double)t / connects.size());
+	}
+
+	printf("\nbest: %.1f ns per connection, %lu of %zu K-lined\n",
+	       (double)best / connects.size(), banned, connects.size());
+	return 0;
+}
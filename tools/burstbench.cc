@@ -0,0 +1,323 @@
+/*
+ *  burstbench.cc: Receive path throughput benchmark on server bursts.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ *  USA
+ */
+
+/*
+ * Feeds a server burst through the same steps read_packet() takes it
+ * through on a server link: the bytes are split into lines by
+ * rb_linebuf_parse() one read buffer at a time, taken off again with
+ * rb_linebuf_get(), and tokenised by msgbuf_parse().  Command handlers are
+ * not run, so this is the cost of line and token scanning alone.
+ *
+ * With -R it instead links to a server as a leaf with no users, and
+ * records the traffic it is sent up to the PING that ends the burst.
+ * Without a recording, a burst of -u users in -c channels is generated.
+ *
+ * See README.bench.
+ */
+
+#include <ircd/stdinc.h>
+#include <ircd/msgbuf.h>
+#include <string>
+#include <vector>
+
+using namespace ircd;
+
+#define BB_LINE		16384	/* tagged lines from a server may pass 512 bytes */
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t
+rng(void)
+{
+	/* xorshift64* */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void put_line(std::string &out, const char *fmt, ...) AFP(2, 3);
+
+static void
+put_line(std::string &out, const char *fmt, ...)
+{
+	char buf[BUFSIZE];
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 2, fmt, args);
+	va_end(args);
+
+	out.append(buf, std::min<size_t>(len, sizeof(buf) - 3));
+	out.append("\r\n");
+}
+
+/* what a charybdis hub sends a leaf for users and channels, as 1AA */
+static void
+make_burst(std::string &out, unsigned int users, unsigned int channels, unsigned int joins)
+{
+	std::vector<std::vector<unsigned int>> members(channels);
+	char line[BUFSIZE];
+	time_t ts = 1500000000;
+
+	for(unsigned int i = 0; i < users; i++)
+	{
+		put_line(out, ":1AA EUID user%u 1 %ld +i ~user%u host-%u.dyn.example.net "
+			 "10.%u.%u.%u 1AA%06X * * :burstbench user %u",
+			 i, (long)(ts + i), i, (unsigned int)(rng() % 100000),
+			 i >> 16 & 255, i >> 8 & 255, i & 255, i, i);
+
+		for(unsigned int j = 0; j < joins && channels > 0; j++)
+			members[rng() % channels].push_back(i);
+	}
+
+	for(unsigned int c = 0; c < channels; c++)
+	{
+		size_t start, len;
+
+		len = start = snprintf(line, sizeof(line), ":1AA SJOIN %ld #chan%u +nt :", (long)ts, c);
+		for(unsigned int i = 0; i < members[c].size(); i++)
+		{
+			if(len + 12 > 480)
+			{
+				line[len - 1] = '\0';
+				put_line(out, "%s", line);
+				len = start;
+			}
+
+			len += snprintf(line + len, sizeof(line) - len, "%s1AA%06X ",
+					i == 0 ? "@" : "", members[c][i]);
+		}
+
+		if(len > start)
+		{
+			line[len - 1] = '\0';
+			put_line(out, "%s", line);
+		}
+
+		if(c % 4 == 0)
+			put_line(out, ":1AA TB #chan%u %ld user0 :topic of #chan%u", c, (long)ts, c);
+	}
+
+	put_line(out, "PING :1AA");
+}
+
+/* links to the server as name/sid and keeps what it sends until the
+ * PING that ends its burst
+ */
+static bool
+record_burst(std::string &out, const char *server, const char *name,
+	     const char *sid, const char *password)
+{
+	struct rb_sockaddr_storage addr;
+	char host[HOSTIPLEN + 1], buf[65536], *port;
+	std::string link;
+	size_t scanned = 0;
+	ssize_t len;
+	int fd;
+
+	rb_strlcpy(host, server, sizeof(host));
+	if((port = strrchr(host, ':')) == NULL)
+		return false;
+
+	*port++ = '\0';
+	if(rb_inet_pton_sock(host, (struct sockaddr *)&addr) <= 0)
+		return false;
+
+	SET_SS_PORT(&addr, htons(atoi(port)));
+	if((fd = socket(GET_SS_FAMILY(&addr), SOCK_STREAM, 0)) < 0 ||
+	   connect(fd, (struct sockaddr *)&addr, GET_SS_LEN(&addr)) < 0)
+	{
+		fprintf(stderr, "burstbench: %s: %s\n", server, strerror(errno));
+		return false;
+	}
+
+	put_line(link, "PASS %s TS 6 :%s", password, sid);
+	put_line(link, "CAPAB :QS EX CHW IE KLN KNOCK TB UNKLN CLUSTER ENCAP SERVICES "
+		 "RSFNC SAVE EUID EOPMOD BAN MLOCK");
+	put_line(link, "SERVER %s 1 :burstbench", name);
+	put_line(link, "SVINFO 6 6 0 :%ld", (long)time(NULL));
+	if(write(fd, link.data(), link.size()) != (ssize_t)link.size())
+		return false;
+
+	while((len = read(fd, buf, sizeof(buf))) > 0)
+	{
+		size_t eol;
+
+		out.append(buf, len);
+		while((eol = out.find('\n', scanned)) != std::string::npos)
+		{
+			if(out.compare(scanned, 6, "ERROR ") == 0)
+			{
+				fprintf(stderr, "burstbench: %s", out.substr(scanned, eol - scanned + 1).c_str());
+				close(fd);
+				return false;
+			}
+
+			if(out.compare(scanned, 5, "PING ") == 0)
+			{
+				out.resize(eol + 1);
+				close(fd);
+				return true;
+			}
+
+			scanned = eol + 1;
+		}
+	}
+
+	fprintf(stderr, "burstbench: %s closed the link before the end of its burst\n", server);
+	close(fd);
+	return false;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: burstbench [options] [burst]\n"
+		"  -b bytes       read size to feed the line buffer in (16384)\n"
+		"  -r rounds      times to parse the burst (5)\n"
+		"  -u users       users to generate without a recording (50000)\n"
+		"  -c channels    channels to generate without a recording (5000)\n"
+		"  -j joins       channels each generated user is in (5)\n"
+		"  -S seed        random seed\n"
+		"  -R addr:port   record the burst from this server into the file given\n"
+		"  -N name        server name to link as when recording (burstbench.)\n"
+		"  -I sid         SID to link as when recording (9BB)\n"
+		"  -P password    link password when recording\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *record = NULL, *name = "burstbench.", *sid = "9BB", *password = "";
+	unsigned int chunk = 16384, rounds = 5, users = 50000, channels = 5000, joins = 5;
+	std::string burst;
+	static char line[BB_LINE];
+	uint64_t best = UINT64_MAX;
+	unsigned long lines = 0, params = 0;
+	int ch;
+
+	while((ch = getopt(argc, argv, "b:r:u:c:j:S:R:N:I:P:h")) != -1)
+	{
+		switch(ch)
+		{
+			case 'b': chunk = atoi(optarg); break;
+			case 'r': rounds = atoi(optarg); break;
+			case 'u': users = atoi(optarg); break;
+			case 'c': channels = atoi(optarg); break;
+			case 'j': joins = atoi(optarg); break;
+			case 'S': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+			case 'R': record = optarg; break;
+			case 'N': name = optarg; break;
+			case 'I': sid = optarg; break;
+			case 'P': password = optarg; break;
+			default: usage();
+		}
+	}
+
+	if(chunk == 0 || rounds == 0 || (record != NULL && optind + 1 != argc))
+		usage();
+
+	if(record != NULL)
+	{
+		FILE *f;
+
+		if(!record_burst(burst, record, name, sid, password))
+			return 1;
+
+		if((f = fopen(argv[optind], "w")) == NULL ||
+		   fwrite(burst.data(), 1, burst.size(), f) != burst.size() || fclose(f) != 0)
+		{
+			fprintf(stderr, "burstbench: %s: %s\n", argv[optind], strerror(errno));
+			return 1;
+		}
+
+		printf("burstbench: recorded %zu bytes from %s\n", burst.size(), record);
+		return 0;
+	}
+
+	if(optind < argc)
+	{
+		char buf[65536];
+		size_t len;
+		FILE *f;
+
+		if((f = fopen(argv[optind], "r")) == NULL)
+		{
+			fprintf(stderr, "burstbench: %s: %s\n", argv[optind], strerror(errno));
+			return 1;
+		}
+
+		while((len = fread(buf, 1, sizeof(buf), f)) > 0)
+			burst.append(buf, len);
+		fclose(f);
+	}
+	else
+		make_burst(burst, users, channels, joins);
+
+	rb_lib_init(NULL, NULL, NULL, 0, 1024, 1024, 1024);
+	rb_linebuf_init(2048);
+
+	for(unsigned int r = 0; r < rounds; r++)
+	{
+		std::vector<char> copy(burst.begin(), burst.end());
+		struct MsgBuf msgbuf;
+		buf_head_t recvq;
+		uint64_t t0, t;
+		int len;
+
+		lines = params = 0;
+		rb_linebuf_newbuf(&recvq);
+
+		t0 = now_ns();
+		for(size_t off = 0; off < copy.size(); off += chunk)
+		{
+			rb_linebuf_parse(&recvq, &copy[off], std::min<size_t>(chunk, copy.size() - off), 0);
+
+			while((len = rb_linebuf_get(&recvq, line, BB_LINE, LINEBUF_COMPLETE, LINEBUF_PARSED)) > 0)
+			{
+				if(msgbuf_parse(&msgbuf, line) == 0)
+					params += msgbuf.n_para;
+				lines++;
+			}
+		}
+		t = now_ns() - t0;
+
+		rb_linebuf_donebuf(&recvq);
+		best = std::min(best, t);
+		printf("  round %u: %.1f ms, %.1f MB/s, %.0f lines/s\n", r + 1, t / 1e6,
+		       burst.size() * 1e3 / t, lines * 1e9 / t);
+	}
+
+	printf("\nburstbench: %zu bytes, %lu lines, %lu parameters; best %.1f MB/s, %.0f lines/s\n",
+	       burst.size(), lines, params, burst.size() * 1e3 / best, lines * 1e9 / best);
+	return 0;
+}
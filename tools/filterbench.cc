@@ -0,0 +1,304 @@
+/*
+ *  filterbench.cc: Spamfilter expression matching benchmark.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ *  USA
+ */
+
+/*
+ * Loads a set of expressions into spamfilter_expr and runs a corpus of
+ * channel messages past them, once through match_any_expr(), which is what
+ * the spamfilter_query hook calls, and once by running every expression in
+ * turn, which is what it did before the literal prefilter.  Both must pick
+ * the same expression for every message.
+ *
+ * The module is compiled in rather than loaded, so its static functions can
+ * be called without a server around them.  Expressions come from a file with
+ * one pattern per line and messages from a file with one per line, or raw
+ * PRIVMSG lines; either is generated when not given.
+ *
+ * See README.bench.
+ */
+
+#include "../extensions/spamfilter_expr.cc"
+#include <string>
+#include <vector>
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+static std::vector<std::string> spam_words;	/* the words make_exprs() used */
+
+static uint64_t
+rng(void)
+{
+	/* xorshift64* */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* a word of two to four syllables, the same for the same n */
+static std::string
+word(unsigned int n)
+{
+	static const char *const syl[] =
+	{
+		"ka", "lo", "mi", "ne", "ru", "sa", "ti", "vo", "zen", "tor",
+		"bel", "dar", "fin", "gul", "hes", "jor", "mek", "pol", "qua", "wis",
+	};
+	std::string w;
+
+	for(unsigned int i = 0; i < 2 + n % 3; i++, n /= 20)
+		w += syl[n % 20];
+
+	return w;
+}
+
+/* the shapes of expression a network collects against spam bots */
+static void
+make_exprs(std::vector<std::string> &out, unsigned int count, bool literal)
+{
+	/* the shapes the prefilter finds a literal in */
+	static const unsigned int literal_shapes[] = { 0, 1, 2, 3, 4, 5, 8 };
+	char buf[BUFSIZE];
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		/* longer than any word make_corpus() uses, so not found inside one */
+		const std::string a = word(rng()) + word(rng()), b = word(rng()) + word(rng());
+
+		spam_words.push_back(a);
+		spam_words.push_back(b);
+
+		switch(literal ? literal_shapes[i % 7] : i % 10)
+		{
+			case 0: snprintf(buf, sizeof(buf), "%s\\s+%s", a.c_str(), b.c_str()); break;
+			case 1: snprintf(buf, sizeof(buf), "https?://[a-z0-9.-]*%s\\.(com|net|org)", a.c_str()); break;
+			case 2: snprintf(buf, sizeof(buf), "%s[0-9]{2,}", a.c_str()); break;
+			case 3: snprintf(buf, sizeof(buf), "^.{0,20}%s.*%s", a.c_str(), b.c_str()); break;
+			case 4: snprintf(buf, sizeof(buf), "\\b%s\\b", a.c_str()); break;
+			case 5: snprintf(buf, sizeof(buf), "join #%s(-\\w+)?", a.c_str()); break;
+			case 6: snprintf(buf, sizeof(buf), "%s|%s", a.c_str(), b.c_str()); break;
+			case 7: snprintf(buf, sizeof(buf), "(?i)%s %s", a.c_str(), b.c_str()); break;
+			case 8: snprintf(buf, sizeof(buf), "[%c%c]%s", a[0], toupper(a[0]), a.c_str() + 1); break;
+			case 9: snprintf(buf, sizeof(buf), "(.)\\1{%u,}", 8 + i / 10); break;
+		}
+
+		out.push_back(buf);
+	}
+}
+
+/* chatter over a thousand common words, with one word in a hundred taken
+ * from the generated expressions
+ */
+static void
+make_corpus(std::vector<std::string> &out, unsigned int count)
+{
+	for(unsigned int i = 0; i < count; i++)
+	{
+		unsigned int words = 3 + rng() % 18;
+		std::string msg;
+
+		for(unsigned int j = 0; j < words; j++)
+		{
+			if(j > 0)
+				msg += ' ';
+
+			if(!spam_words.empty() && rng() % 100 == 0)
+				msg += spam_words[rng() % spam_words.size()];
+			else
+				msg += word(rng() % 1000);
+		}
+
+		out.push_back(msg);
+	}
+}
+
+static void
+load_lines(std::vector<std::string> &out, const char *path, bool privmsg)
+{
+	char line[BUFSIZE * 2], *p;
+	FILE *f;
+
+	if((f = fopen(path, "r")) == NULL)
+	{
+		fprintf(stderr, "filterbench: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	while(fgets(line, sizeof(line), f) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+
+		p = line;
+		if(privmsg && strstr(line, "PRIVMSG ") != NULL && (p = strstr(line, " :")) != NULL)
+			p += 2;
+
+		if(*p != '\0')
+			out.push_back(p);
+	}
+
+	fclose(f);
+}
+
+/* what match_any_expr() did before the prefilter */
+static struct Expr *
+match_every_expr(const char *const text, const size_t len)
+{
+	void *elem;
+	rb_dictionary_iter state;
+
+	RB_DICTIONARY_FOREACH(elem, &state, exprs)
+	{
+		auto *const expr(reinterpret_cast<Expr *>(elem));
+		if(match_expr(expr, text, len, 0, 0) > 0)
+			return expr;
+	}
+
+	return NULL;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: filterbench [options]\n"
+		"  -e file        expressions, one pattern per line\n"
+		"  -n count       expressions to generate without -e (300)\n"
+		"  -l             generate only expressions with a literal in them\n"
+		"  -m file        messages, one per line or as PRIVMSG lines\n"
+		"  -c count       messages to generate without -m (100000)\n"
+		"  -r rounds      times to run the corpus (3)\n"
+		"  -S seed        random seed\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	std::vector<std::string> patterns, corpus;
+	const char *exprfile = NULL, *corpusfile = NULL;
+	unsigned int nexprs = 300, nmessages = 100000, rounds = 3;
+	uint64_t best_all = UINT64_MAX, best_pf = UINT64_MAX;
+	unsigned long matched = 0;
+	bool literal = false;
+	int ch;
+
+	while((ch = getopt(argc, argv, "e:n:lm:c:r:S:h")) != -1)
+	{
+		switch(ch)
+		{
+			case 'e': exprfile = optarg; break;
+			case 'n': nexprs = atoi(optarg); break;
+			case 'l': literal = true; break;
+			case 'm': corpusfile = optarg; break;
+			case 'c': nmessages = atoi(optarg); break;
+			case 'r': rounds = atoi(optarg); break;
+			case 'S': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+			default: usage();
+		}
+	}
+
+	if(rounds == 0)
+		usage();
+
+	rb_lib_init(NULL, NULL, NULL, 0, 1024, 1024, 1024);
+	rb_set_time();
+
+	/* what modinit() sets up, without the conf blocks and the server */
+	exprs = rb_dictionary_create("exprs", exprs_comparator);
+	gctx = pcre2_general_context_create(expr_malloc_cb, expr_free_cb, NULL);
+	conf_spamfilter_expr_end(NULL);
+
+	if(exprfile != NULL)
+		load_lines(patterns, exprfile, false);
+	else
+		make_exprs(patterns, nexprs, literal);
+
+	if(corpusfile != NULL)
+		load_lines(corpus, corpusfile, true);
+	else
+		make_corpus(corpus, nmessages);
+
+	conf_limit = patterns.size();
+	for(const std::string &pattern : patterns)
+	{
+		char errbuf[BUFSIZE];
+		size_t erroff;
+		int errcode;
+
+		if(activate_new_expr(pattern.c_str(), conf_compile_opts, conf_match_opts, conf_jit_opts,
+				     NULL, &errcode, &erroff, errbuf, sizeof(errbuf)) == NULL &&
+		   errcode != EXPR_ERROR_EXISTS)
+			fprintf(stderr, "filterbench: %s: %s\n", pattern.c_str(), errbuf);
+	}
+
+	if(corpus.empty() || rb_dictionary_size(exprs) == 0)
+	{
+		fprintf(stderr, "filterbench: nothing to match\n");
+		return 1;
+	}
+
+	printf("filterbench: %u expressions, %zu messages, %s\n\n",
+	       rb_dictionary_size(exprs), corpus.size(), jstack ? "JIT" : "no JIT");
+
+	std::vector<struct Expr *> expect(corpus.size());
+	for(unsigned int r = 0; r < rounds; r++)
+	{
+		uint64_t t0, t_all, t_pf;
+
+		t0 = now_ns();
+		for(size_t i = 0; i < corpus.size(); i++)
+			expect[i] = match_every_expr(corpus[i].c_str(), corpus[i].size());
+		t_all = now_ns() - t0;
+
+		matched = 0;
+		t0 = now_ns();
+		for(size_t i = 0; i < corpus.size(); i++)
+		{
+			struct Expr *const expr = match_any_expr(corpus[i].c_str(), corpus[i].size(), 0, 0);
+
+			if(expr != expect[i])
+			{
+				fprintf(stderr, "filterbench: \"%s\" matched #%u, every expression #%u\n",
+					corpus[i].c_str(), expr ? expr->id : 0, expect[i] ? expect[i]->id : 0);
+				return 1;
+			}
+
+			matched += expr != NULL;
+		}
+		t_pf = now_ns() - t0;
+
+		best_all = std::min(best_all, t_all);
+		best_pf = std::min(best_pf, t_pf);
+		printf("  round %u: every expression %.1f ns, match_any_expr %.1f ns per message\n",
+		       r + 1, (double)t_all / corpus.size(), (double)t_pf / corpus.size());
+	}
+
+	printf("\nbest: every expression %.1f ns, match_any_expr %.1f ns per message (%.1fx), "
+	       "%lu of %zu matched\n",
+	       (double)best_all / corpus.size(), (double)best_pf / corpus.size(),
+	       (double)best_all / best_pf, matched, corpus.size());
+	return 0;
+}
@@ -0,0 +1,1577 @@
+/*
+ *  ircbench.cc: Load generator and latency benchmark for charybdis.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ *  USA
+ */
+
+/*
+ * One process drives every client through librb's event loop (epoll on
+ * Linux).  Clients connect at a fixed rate, register, and join channels
+ * drawn from a Zipf distribution.  Once every client is ready and the
+ * warmup has passed, commands are issued at a fixed total rate from a
+ * weighted mix, and for the length of the run we record:
+ *
+ *  - PRIVMSG delivery latency, from the timestamp the sender embeds in
+ *    the message to its arrival at every other member of the channel,
+ *  - the reply latency of every other command, from the reply it gets
+ *    (its own echo, RPL_ENDOFWHO or RPL_CHANNELMODEIS),
+ *  - the CPU time and resident size of the server processes given,
+ *  - with -O, the epoll_ctl() and epoll_wait() calls each server made,
+ *    from STATS R before and after, read by an opered client on each.
+ *
+ * With -L, clients[0] then opers up and relinks the named server to its
+ * hub a number of times.  Each split is timed from SQUIT to the reply to
+ * a PING sent right behind it, which the hub only reads once it has exited
+ * every user behind the server; each relink from CONNECT to the hub's
+ * "End of burst" notice for it.
+ *
+ * See README.ircbench.
+ */
+
+#include <rb/rb.h>
+#include <sys/resource.h>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#define IB_READBUF	65536
+#define IB_RING		4	/* outstanding timed commands per type per client */
+#define IB_HIST		1024	/* log-linear buckets, 16 per power of two */
+#define IB_NICKLEN	16
+#define IB_MAXSERVERS	16
+#define IB_PREFIX	"#ib"
+#define IB_DRAIN	2000000	/* microseconds to wait for replies after the run */
+
+enum ib_state
+{
+	IB_NEW,
+	IB_CONNECTING,
+	IB_REGISTERING,
+	IB_JOINING,
+	IB_READY,
+	IB_DEAD,
+};
+
+enum ib_cmd
+{
+	CMD_PRIVMSG,
+	CMD_JOIN,
+	CMD_PART,
+	CMD_NICK,
+	CMD_WHO,
+	CMD_MODE,
+	CMD_MAX
+};
+
+static const char *const cmd_names[CMD_MAX] =
+{
+	"privmsg", "join", "part", "nick", "who", "mode"
+};
+
+enum ib_phase
+{
+	PHASE_CONNECT,
+	PHASE_WARMUP,
+	PHASE_MEASURE,
+	PHASE_DRAIN,
+	PHASE_BURST,
+	PHASE_DONE,
+};
+
+enum ib_burst_state
+{
+	BURST_OPER,
+	BURST_SQUIT,
+	BURST_CONNECT,
+	BURST_LINKING,
+	BURST_PAUSE,
+};
+
+struct ib_hist
+{
+	uint64_t count;
+	uint64_t max;
+	uint64_t bucket[IB_HIST];
+};
+
+struct ib_server
+{
+	char name[HOSTIPLEN + 8];
+	struct rb_sockaddr_storage addr;
+	unsigned int clients;
+	struct ib_client *oper;		/* reads STATS R, with -O */
+	unsigned int io_samples;
+	char iotype[32];
+	unsigned long io_ctl[2];
+	unsigned long io_wait[2];
+};
+
+struct ib_client
+{
+	unsigned int id;
+	rb_fde_t *F;
+	unsigned char state;
+	unsigned char server;
+	unsigned char nickgen;
+	unsigned char want;		/* channels to join before it is ready */
+	char nick[IB_NICKLEN];
+	uint64_t started;
+	std::vector<uint32_t> chans;
+	std::string partial;		/* an incomplete line from the last read */
+	std::string sendq;
+	uint64_t sent[CMD_MAX][IB_RING];
+	unsigned char head[CMD_MAX];
+	unsigned char queued[CMD_MAX];
+};
+
+static struct
+{
+	unsigned int clients = 1000;
+	unsigned int connect_rate = 1000;
+	unsigned int channels = 100;
+	unsigned int joins = 3;
+	double skew = 1.0;
+	unsigned int rate = 1000;
+	unsigned int duration = 30;
+	unsigned int warmup = 5;
+	unsigned int weight[CMD_MAX] = { 80, 4, 4, 4, 4, 4 };
+	unsigned int weight_total = 100;
+	unsigned int sources = 0;
+	struct rb_sockaddr_storage source;
+	std::vector<pid_t> pids;
+	const char *leaf = NULL;
+	const char *oper = NULL;
+	unsigned int rounds = 3;
+	uint64_t seed = 0;
+}
+conf;
+
+static struct
+{
+	unsigned int connected;
+	unsigned int registered;
+	unsigned int ready;
+	unsigned int failed;
+	unsigned int lost;
+	uint64_t sent[CMD_MAX];
+	uint64_t replies[CMD_MAX];
+	uint64_t errors[CMD_MAX];
+	uint64_t untimed;
+	uint64_t expected;
+	uint64_t delivered;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	struct ib_hist connect;
+	struct ib_hist delivery;
+	struct ib_hist reply[CMD_MAX];
+	std::vector<uint64_t> splits;
+	std::vector<uint64_t> bursts;
+}
+stats;
+
+static std::vector<struct ib_server> servers;
+static std::vector<struct ib_client> clients;
+static std::vector<double> chan_cdf;
+static std::vector<uint32_t> chan_members;
+static std::vector<unsigned int> ready_list;
+
+static enum ib_phase phase = PHASE_CONNECT;
+static uint64_t phase_start;
+static unsigned int next_connect;
+static double connect_tokens;
+static double command_tokens;
+static uint64_t last_tick;
+static uint64_t measured;
+static bool measuring;
+
+static enum ib_burst_state burst_state = BURST_OPER;
+static uint64_t burst_at;
+static uint64_t burst_t0;
+static uint64_t split_t0;
+static uint64_t burst_deadline;
+
+static uint64_t cpu_start[IB_MAXSERVERS];
+static uint64_t cpu_end[IB_MAXSERVERS];
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static void ib_close(struct ib_client *c, const char *why);
+
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t
+rnd(void)
+{
+	/* xorshift64* */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double
+rnd_unit(void)
+{
+	return (rnd() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/*
+ * Latency histograms
+ */
+
+static void
+hist_add(struct ib_hist *h, uint64_t us)
+{
+	unsigned int idx;
+
+	if(us < 16)
+		idx = us;
+	else
+	{
+		unsigned int b = 63 - __builtin_clzll(us);
+		idx = (b - 3) * 16 + ((us >> (b - 4)) & 15);
+	}
+
+	h->bucket[idx]++;
+	h->count++;
+	if(us > h->max)
+		h->max = us;
+}
+
+/* upper bound of a bucket, in microseconds */
+static uint64_t
+hist_bound(unsigned int idx)
+{
+	if(idx < 16)
+		return idx;
+
+	unsigned int b = idx / 16 + 3;
+	uint64_t m = idx % 16;
+	return ((16 + m + 1) << (b - 4)) - 1;
+}
+
+static uint64_t
+hist_pct(const struct ib_hist *h, double pct)
+{
+	uint64_t want = (uint64_t)(h->count * pct / 100.0);
+	uint64_t seen = 0;
+
+	if(want >= h->count)
+		return h->max;
+
+	for(unsigned int i = 0; i < IB_HIST; i++)
+	{
+		seen += h->bucket[i];
+		if(seen > want)
+			return std::min(hist_bound(i), h->max);
+	}
+
+	return h->max;
+}
+
+static void
+hist_print(const char *name, const struct ib_hist *h)
+{
+	if(h->count == 0)
+	{
+		printf("  %-10s %10s\n", name, "-");
+		return;
+	}
+
+	printf("  %-10s %10" PRIu64 "  p50 %9.3f  p90 %9.3f  p99 %9.3f  p99.9 %9.3f  max %9.3f ms\n",
+	       name, h->count,
+	       hist_pct(h, 50) / 1000.0, hist_pct(h, 90) / 1000.0,
+	       hist_pct(h, 99) / 1000.0, hist_pct(h, 99.9) / 1000.0,
+	       h->max / 1000.0);
+}
+
+
+/*
+ * Server processes
+ */
+
+static bool
+read_proc(pid_t pid, uint64_t *cpu, uint64_t *rss_kb, uint64_t *hwm_kb)
+{
+	char path[64], buf[1024];
+	unsigned long utime, stime;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if((f = fopen(path, "r")) == NULL)
+		return false;
+
+	if(fgets(buf, sizeof(buf), f) == NULL)
+	{
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+
+	/* the command name may hold spaces; fields resume after its ')' */
+	const char *p = strrchr(buf, ')');
+	if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			       &utime, &stime) != 2)
+		return false;
+
+	*cpu = utime + stime;
+	*rss_kb = *hwm_kb = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if((f = fopen(path, "r")) == NULL)
+		return true;
+
+	while(fgets(buf, sizeof(buf), f) != NULL)
+	{
+		sscanf(buf, "VmRSS: %" SCNu64, rss_kb);
+		sscanf(buf, "VmHWM: %" SCNu64, hwm_kb);
+	}
+	fclose(f);
+	return true;
+}
+
+
+/*
+ * Channels
+ */
+
+static void
+build_channels(void)
+{
+	double sum = 0;
+
+	chan_cdf.resize(conf.channels);
+	chan_members.assign(conf.channels, 0);
+
+	for(unsigned int i = 0; i < conf.channels; i++)
+	{
+		sum += 1.0 / pow(i + 1, conf.skew);
+		chan_cdf[i] = sum;
+	}
+
+	for(auto &v : chan_cdf)
+		v /= sum;
+}
+
+static uint32_t
+pick_channel(void)
+{
+	auto it = std::lower_bound(chan_cdf.begin(), chan_cdf.end(), rnd_unit());
+
+	if(it == chan_cdf.end())
+		return conf.channels - 1;
+
+	return it - chan_cdf.begin();
+}
+
+static bool
+on_channel(const struct ib_client *c, uint32_t chan)
+{
+	return std::find(c->chans.begin(), c->chans.end(), chan) != c->chans.end();
+}
+
+static bool
+parse_channel(const char *name, uint32_t *chan)
+{
+	char *end;
+
+	if(*name == ':')
+		name++;
+
+	if(strncmp(name, IB_PREFIX, sizeof(IB_PREFIX) - 1) != 0)
+		return false;
+
+	unsigned long v = strtoul(name + sizeof(IB_PREFIX) - 1, &end, 10);
+	if(end == name + sizeof(IB_PREFIX) - 1 || v >= conf.channels)
+		return false;
+
+	*chan = v;
+	return true;
+}
+
+
+/*
+ * Output
+ */
+
+static void
+ib_flush(rb_fde_t *F, void *data)
+{
+	struct ib_client *c = (struct ib_client *)data;
+	ssize_t len;
+
+	while(!c->sendq.empty())
+	{
+		len = rb_write(F, c->sendq.data(), c->sendq.size());
+		if(len < 0)
+		{
+			if(rb_ignore_errno(errno))
+				break;
+
+			ib_close(c, "write error");
+			return;
+		}
+
+		stats.bytes_out += len;
+		c->sendq.erase(0, len);
+	}
+
+	if(!c->sendq.empty())
+		rb_setselect(F, RB_SELECT_WRITE, ib_flush, c);
+}
+
+static void __attribute__((format(printf, 2, 3)))
+ib_send(struct ib_client *c, const char *fmt, ...)
+{
+	char buf[512];
+	va_list args;
+	int len;
+
+	if(c->state == IB_DEAD || c->F == NULL)
+		return;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 2, fmt, args);
+	va_end(args);
+
+	if(len < 0)
+		return;
+	if(len > (int)sizeof(buf) - 3)
+		len = sizeof(buf) - 3;
+
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+
+	bool idle = c->sendq.empty();
+	c->sendq.append(buf, len);
+
+	if(idle)
+		ib_flush(c->F, c);
+}
+
+
+/*
+ * Timed commands
+ */
+
+static void
+timed_push(struct ib_client *c, int cmd, uint64_t when)
+{
+	if(c->queued[cmd] == IB_RING)
+	{
+		stats.untimed++;
+		return;
+	}
+
+	c->sent[cmd][(c->head[cmd] + c->queued[cmd]) % IB_RING] = when;
+	c->queued[cmd]++;
+}
+
+static void
+timed_pop(struct ib_client *c, int cmd, bool error)
+{
+	if(c->queued[cmd] == 0)
+		return;
+
+	uint64_t when = c->sent[cmd][c->head[cmd]];
+	c->head[cmd] = (c->head[cmd] + 1) % IB_RING;
+	c->queued[cmd]--;
+
+	if(!measuring || when == 0)
+		return;
+
+	if(error)
+		stats.errors[cmd]++;
+	else
+	{
+		stats.replies[cmd]++;
+		hist_add(&stats.reply[cmd], now_us() - when);
+	}
+}
+
+
+/*
+ * Client state
+ */
+
+static void
+set_nick(struct ib_client *c)
+{
+	if(c->nickgen == 0)
+		snprintf(c->nick, sizeof(c->nick), "i%x", c->id);
+	else
+		snprintf(c->nick, sizeof(c->nick), "i%xg%x", c->id, c->nickgen);
+}
+
+static void
+join_channel(struct ib_client *c, uint32_t chan)
+{
+	c->chans.push_back(chan);
+	chan_members[chan]++;
+}
+
+static void
+part_channel(struct ib_client *c, uint32_t chan)
+{
+	auto it = std::find(c->chans.begin(), c->chans.end(), chan);
+
+	if(it == c->chans.end())
+		return;
+
+	*it = c->chans.back();
+	c->chans.pop_back();
+	chan_members[chan]--;
+}
+
+static void
+become_ready(struct ib_client *c)
+{
+	c->state = IB_READY;
+	stats.ready++;
+	ready_list.push_back(c->id);
+}
+
+static void
+ib_close(struct ib_client *c, const char *why)
+{
+	if(c->state == IB_DEAD)
+		return;
+
+	if(c->state == IB_NEW || c->state == IB_CONNECTING)
+		stats.failed++;
+	else
+		stats.lost++;
+
+	if(stats.failed + stats.lost <= 10)
+		fprintf(stderr, "ircbench: client %u (%s) closed: %s\n", c->id, c->nick, why);
+
+	if(c->state == IB_READY)
+		stats.ready--;
+
+	for(uint32_t chan : c->chans)
+		chan_members[chan]--;
+	c->chans.clear();
+
+	c->state = IB_DEAD;
+	if(c->F != NULL)
+	{
+		rb_close(c->F);
+		c->F = NULL;
+	}
+
+	/* ready_list is pruned lazily, by pick_ready() */
+}
+
+
+/*
+ * Input
+ */
+
+static void
+burst_notice(struct ib_client *c, const char *text)
+{
+	if(phase != PHASE_BURST || c->id != 0)
+		return;
+
+	if(burst_state == BURST_LINKING)
+	{
+		if(strstr(text, "End of burst") != NULL && strstr(text, conf.leaf) != NULL)
+		{
+			stats.bursts.push_back(now_us() - burst_t0);
+			burst_state = BURST_PAUSE;
+			burst_at = now_us() + 2000000;
+			return;
+		}
+
+		/* the split hasn't finished, or a connect is already underway */
+		if(strstr(text, "already exists") != NULL || strstr(text, "Couldn't connect") != NULL)
+		{
+			burst_state = BURST_CONNECT;
+			burst_at = now_us() + 250000;
+		}
+	}
+}
+
+/* "nick R :IO epoll: N interest changes, N waits" */
+static void
+io_sample(struct ib_client *c, char *args)
+{
+	struct ib_server *s = &servers[c->server];
+	unsigned long ctl, waits;
+	char iotype[32];
+	char *p;
+
+	if(c != s->oper || s->io_samples >= 2 || (p = strstr(args, " :IO ")) == NULL)
+		return;
+
+	if(sscanf(p + 5, "%31[^:]: %lu interest changes, %lu waits", iotype, &ctl, &waits) != 3)
+		return;
+
+	rb_strlcpy(s->iotype, iotype, sizeof(s->iotype));
+	s->io_ctl[s->io_samples] = ctl;
+	s->io_wait[s->io_samples] = waits;
+	s->io_samples++;
+}
+
+static void
+handle_numeric(struct ib_client *c, int numeric, char *args)
+{
+	switch(numeric)
+	{
+		case 1:
+			c->state = IB_JOINING;
+			stats.registered++;
+			if(measuring || phase == PHASE_CONNECT)
+				hist_add(&stats.connect, now_us() - c->started);
+
+			if(c->want == 0)
+			{
+				become_ready(c);
+				break;
+			}
+
+			{
+				/* counted as members once the echoes arrive */
+				std::vector<uint32_t> picked;
+
+				for(unsigned int tries = 0; picked.size() < c->want && tries < c->want * 8u; tries++)
+				{
+					uint32_t chan = pick_channel();
+
+					if(std::find(picked.begin(), picked.end(), chan) != picked.end())
+						continue;
+
+					ib_send(c, "JOIN " IB_PREFIX "%u", chan);
+					picked.push_back(chan);
+				}
+
+				c->want = picked.size();
+				if(c->want == 0)
+					become_ready(c);
+			}
+			break;
+
+		case 315:	/* RPL_ENDOFWHO */
+			timed_pop(c, CMD_WHO, false);
+			break;
+
+		case 324:	/* RPL_CHANNELMODEIS */
+			timed_pop(c, CMD_MODE, false);
+			break;
+
+		case 263:	/* RPL_LOAD2HI */
+			timed_pop(c, CMD_WHO, true);
+			break;
+
+		case 249:	/* RPL_STATSDEBUG */
+			io_sample(c, args);
+			break;
+
+		case 381:	/* RPL_YOUREOPER */
+			if(phase == PHASE_BURST && c->id == 0)
+			{
+				ib_send(c, "MODE %s +s +s", c->nick);
+				burst_state = BURST_SQUIT;
+				burst_at = now_us();
+			}
+			break;
+
+		case 464:	/* ERR_PASSWDMISMATCH */
+		case 491:	/* ERR_NOOPERHOST */
+			if(phase == PHASE_BURST && c->id == 0)
+			{
+				fprintf(stderr, "ircbench: OPER failed, skipping link bursts\n");
+				phase = PHASE_DONE;
+			}
+			else if(c == servers[c->server].oper)
+			{
+				fprintf(stderr, "ircbench: OPER failed on %s, not counting its IO\n",
+					servers[c->server].name);
+				servers[c->server].oper = NULL;
+			}
+			break;
+
+		case 432:	/* ERR_ERRONEUSNICKNAME */
+		case 433:	/* ERR_NICKNAMEINUSE */
+		case 438:	/* ERR_NICKTOOFAST */
+			if(c->state == IB_REGISTERING)
+			{
+				c->nickgen++;
+				set_nick(c);
+				ib_send(c, "NICK %s", c->nick);
+			}
+			else
+			{
+				/* the nick we asked for is not ours */
+				timed_pop(c, CMD_NICK, true);
+			}
+			break;
+
+		case 403:	/* ERR_NOSUCHCHANNEL */
+		case 405:	/* ERR_TOOMANYCHANNELS */
+		case 471:	/* ERR_CHANNELISFULL */
+		case 473:	/* ERR_INVITEONLYCHAN */
+		case 474:	/* ERR_BANNEDFROMCHAN */
+		case 475:	/* ERR_BADCHANNELKEY */
+		case 477:	/* ERR_NEEDREGGEDNICK */
+			if(c->state == IB_JOINING && c->want > 0 && --c->want == c->chans.size())
+				become_ready(c);
+			else
+				timed_pop(c, CMD_JOIN, true);
+			break;
+
+		case 402:	/* ERR_NOSUCHSERVER */
+			/* nothing was split, so there is nothing to time */
+			if(phase == PHASE_BURST && c->id == 0)
+				split_t0 = 0;
+			break;
+
+		case 442:	/* ERR_NOTONCHANNEL */
+			timed_pop(c, CMD_PART, true);
+			break;
+
+		default:
+			break;
+	}
+}
+
+static void
+ib_parse(struct ib_client *c, char *line)
+{
+	char *prefix = NULL, *cmd, *args, *p;
+
+	if(*line == '@')
+	{
+		if((line = strchr(line, ' ')) == NULL)
+			return;
+		line++;
+	}
+
+	if(*line == ':')
+	{
+		prefix = line + 1;
+		if((line = strchr(line, ' ')) == NULL)
+			return;
+		*line++ = '\0';
+	}
+
+	cmd = line;
+	if((args = strchr(cmd, ' ')) != NULL)
+		*args++ = '\0';
+	else
+		args = cmd + strlen(cmd);
+
+	if(prefix == NULL)
+	{
+		if(!strcmp(cmd, "PING"))
+			ib_send(c, "PONG %s", args);
+		else if(!strcmp(cmd, "ERROR"))
+			ib_close(c, args);
+		return;
+	}
+
+	if(isdigit((unsigned char)cmd[0]) && isdigit((unsigned char)cmd[1]) && isdigit((unsigned char)cmd[2]) && cmd[3] == '\0')
+	{
+		handle_numeric(c, atoi(cmd), args);
+		return;
+	}
+
+	/* from here on, everything is from a user: nick!user@host */
+	char *bang = strchr(prefix, '!');
+	bool self = bang != NULL && (size_t)(bang - prefix) == strlen(c->nick) &&
+		    !strncmp(prefix, c->nick, bang - prefix);
+
+	if(!strcmp(cmd, "PRIVMSG"))
+	{
+		if((p = strstr(args, " :ib ")) == NULL)
+			return;
+
+		uint64_t when = strtoull(p + 5, NULL, 10);
+		if(measuring && when != 0)
+		{
+			stats.delivered++;
+			hist_add(&stats.delivery, now_us() - when);
+		}
+	}
+	else if(!strcmp(cmd, "NOTICE"))
+	{
+		if((p = strstr(args, " :")) != NULL)
+			burst_notice(c, p + 2);
+	}
+	else if(!strcmp(cmd, "PONG"))
+	{
+		if(phase == PHASE_BURST && c->id == 0 && split_t0 != 0 && strstr(args, ":ibsplit") != NULL)
+		{
+			stats.splits.push_back(now_us() - split_t0);
+			split_t0 = 0;
+		}
+	}
+	else if(self && !strcmp(cmd, "JOIN"))
+	{
+		uint32_t chan;
+
+		if((p = strchr(args, ' ')) != NULL)
+			*p = '\0';
+		if(!parse_channel(args, &chan))
+			return;
+
+		join_channel(c, chan);
+
+		if(c->state == IB_JOINING)
+		{
+			if(c->chans.size() >= c->want)
+				become_ready(c);
+		}
+		else
+			timed_pop(c, CMD_JOIN, false);
+	}
+	else if(self && !strcmp(cmd, "PART"))
+	{
+		uint32_t chan;
+
+		if((p = strchr(args, ' ')) != NULL)
+			*p = '\0';
+		if(parse_channel(args, &chan))
+			part_channel(c, chan);
+
+		timed_pop(c, CMD_PART, false);
+	}
+	else if(self && !strcmp(cmd, "NICK"))
+	{
+		if(*args == ':')
+			args++;
+
+		rb_strlcpy(c->nick, args, sizeof(c->nick));
+		timed_pop(c, CMD_NICK, false);
+	}
+}
+
+static void
+ib_read(rb_fde_t *F, void *data)
+{
+	static char buf[IB_READBUF];
+	struct ib_client *c = (struct ib_client *)data;
+	ssize_t len;
+
+	for(;;)
+	{
+		len = rb_read(F, buf, sizeof(buf));
+		if(len == 0)
+		{
+			ib_close(c, "connection closed by server");
+			return;
+		}
+
+		if(len < 0)
+		{
+			if(rb_ignore_errno(errno))
+				break;
+
+			ib_close(c, strerror(errno));
+			return;
+		}
+
+		stats.bytes_in += len;
+
+		const char *p = buf, *end = buf + len, *eol;
+		while(p < end && (eol = rb_find_eol(p, end - p)) != NULL)
+		{
+			c->partial.append(p, eol - p);
+			p = eol + 1;
+
+			if(!c->partial.empty())
+			{
+				ib_parse(c, &c->partial[0]);
+				if(c->state == IB_DEAD)
+					return;
+			}
+			c->partial.clear();
+		}
+
+		c->partial.append(p, end - p);
+		if(c->partial.size() > 8192)
+		{
+			ib_close(c, "line too long");
+			return;
+		}
+	}
+
+	rb_setselect(F, RB_SELECT_READ, ib_read, c);
+}
+
+
+/*
+ * Connections
+ */
+
+static void
+ib_connected(rb_fde_t *F, int status, void *data)
+{
+	struct ib_client *c = (struct ib_client *)data;
+
+	if(status != RB_OK)
+	{
+		ib_close(c, rb_errstr(status));
+		return;
+	}
+
+	c->state = IB_REGISTERING;
+	stats.connected++;
+
+	ib_send(c, "NICK %s", c->nick);
+	ib_send(c, "USER ircbench 0 * :ircbench client %u", c->id);
+	rb_setselect(F, RB_SELECT_READ, ib_read, c);
+}
+
+static void
+ib_connect(struct ib_client *c)
+{
+	struct ib_server *s = &servers[c->server];
+	struct rb_sockaddr_storage local;
+	struct sockaddr *bindaddr = NULL;
+
+	c->started = now_us();
+	c->state = IB_CONNECTING;
+
+	if((c->F = rb_socket(GET_SS_FAMILY(&s->addr), SOCK_STREAM, 0, "ircbench client")) == NULL)
+	{
+		ib_close(c, "no more file descriptors");
+		return;
+	}
+
+	/* spread clients over several loopback sources, so we don't run
+	 * out of ephemeral ports to one listener */
+	if(conf.sources > 0)
+	{
+		memcpy(&local, &conf.source, sizeof(local));
+		if(GET_SS_FAMILY(&local) == AF_INET)
+		{
+			struct sockaddr_in *in = (struct sockaddr_in *)&local;
+			in->sin_addr.s_addr = htonl(ntohl(in->sin_addr.s_addr) + c->id % conf.sources);
+		}
+		bindaddr = (struct sockaddr *)&local;
+	}
+
+	rb_connect_tcp(c->F, (struct sockaddr *)&s->addr, bindaddr, ib_connected, c, 30);
+}
+
+
+/*
+ * Command mix
+ */
+
+static struct ib_client *
+pick_ready(void)
+{
+	while(!ready_list.empty())
+	{
+		size_t i = rnd() % ready_list.size();
+		struct ib_client *c = &clients[ready_list[i]];
+
+		if(c->state == IB_READY)
+			return c;
+
+		ready_list[i] = ready_list.back();
+		ready_list.pop_back();
+	}
+
+	return NULL;
+}
+
+static void
+issue_command(void)
+{
+	struct ib_client *c = pick_ready();
+	unsigned int w = rnd() % conf.weight_total;
+	uint64_t now = now_us();
+	uint32_t chan;
+	int cmd = 0;
+
+	if(c == NULL)
+		return;
+
+	while(w >= conf.weight[cmd])
+		w -= conf.weight[cmd++];
+
+	/* commands that need a channel fall back to joining one */
+	if(c->chans.empty() && cmd != CMD_NICK)
+		cmd = CMD_JOIN;
+
+	switch(cmd)
+	{
+		case CMD_PRIVMSG:
+			chan = c->chans[rnd() % c->chans.size()];
+			stats.expected += chan_members[chan] - 1;
+			ib_send(c, "PRIVMSG " IB_PREFIX "%u :ib %" PRIu64 " %u", chan, now, c->id);
+			break;
+
+		case CMD_JOIN:
+			/* a second JOIN before the echo of the first could repeat it */
+			if(c->queued[CMD_JOIN] > 0)
+				return;
+
+			chan = pick_channel();
+			if(on_channel(c, chan) || c->chans.size() >= conf.joins + 2)
+			{
+				/* nothing to join, leave one instead */
+				if(c->chans.size() <= 1)
+					return;
+				cmd = CMD_PART;
+				chan = c->chans[rnd() % c->chans.size()];
+				ib_send(c, "PART " IB_PREFIX "%u", chan);
+				break;
+			}
+			ib_send(c, "JOIN " IB_PREFIX "%u", chan);
+			break;
+
+		case CMD_PART:
+			/* keep a channel to talk in */
+			if(c->chans.size() <= 1)
+				return;
+			chan = c->chans[rnd() % c->chans.size()];
+			ib_send(c, "PART " IB_PREFIX "%u", chan);
+			break;
+
+		case CMD_NICK:
+			c->nickgen++;
+			ib_send(c, "NICK i%xg%x", c->id, c->nickgen);
+			break;
+
+		case CMD_WHO:
+			ib_send(c, "WHO " IB_PREFIX "%u", c->chans[rnd() % c->chans.size()]);
+			break;
+
+		case CMD_MODE:
+			ib_send(c, "MODE " IB_PREFIX "%u", c->chans[rnd() % c->chans.size()]);
+			break;
+	}
+
+	stats.sent[cmd]++;
+	if(cmd != CMD_PRIVMSG)
+		timed_push(c, cmd, now);
+}
+
+
+/*
+ * Link bursts
+ */
+
+static void
+burst_tick(uint64_t now)
+{
+	struct ib_client *c = &clients[0];
+
+	if(c->state == IB_DEAD)
+	{
+		fprintf(stderr, "ircbench: lost the oper client, skipping link bursts\n");
+		phase = PHASE_DONE;
+		return;
+	}
+
+	if(now > burst_deadline)
+	{
+		fprintf(stderr, "ircbench: %s did not finish bursting\n", conf.leaf);
+		phase = PHASE_DONE;
+		return;
+	}
+
+	if(now < burst_at)
+		return;
+
+	switch(burst_state)
+	{
+		case BURST_OPER:
+		case BURST_LINKING:
+			break;
+
+		case BURST_PAUSE:
+			if(stats.bursts.size() >= conf.rounds)
+			{
+				phase = PHASE_DONE;
+				break;
+			}
+			/* fall through */
+
+		case BURST_SQUIT:
+			ib_send(c, "SQUIT %s :ircbench link burst", conf.leaf);
+			ib_send(c, "PING :ibsplit");
+			split_t0 = now;
+			burst_state = BURST_CONNECT;
+			burst_at = now + 500000;
+			burst_deadline = now + 120000000;
+			break;
+
+		case BURST_CONNECT:
+			ib_send(c, "CONNECT %s", conf.leaf);
+			burst_state = BURST_LINKING;
+			burst_t0 = now;
+			break;
+	}
+}
+
+
+/*
+ * Phases
+ */
+
+/* opers a ready client on each server to read STATS R, and takes it out
+ * of the load so its requests are not queued behind its own commands
+ */
+static void
+io_oper(void)
+{
+	const char *sep = strchr(conf.oper, ':');
+
+	for(struct ib_client &c : clients)
+	{
+		struct ib_server *s = &servers[c.server];
+		auto it = std::find(ready_list.begin(), ready_list.end(), c.id);
+
+		if(c.state != IB_READY || s->oper != NULL || it == ready_list.end())
+			continue;
+
+		*it = ready_list.back();
+		ready_list.pop_back();
+
+		s->oper = &c;
+		ib_send(&c, "OPER %.*s %s", (int)(sep - conf.oper), conf.oper, sep + 1);
+	}
+}
+
+static void
+io_stats(void)
+{
+	for(struct ib_server &s : servers)
+		if(s.oper != NULL && s.oper->state == IB_READY)
+			ib_send(s.oper, "STATS R");
+}
+
+static void
+sample_cpu(uint64_t *cpu)
+{
+	uint64_t rss, hwm;
+
+	for(size_t i = 0; i < conf.pids.size(); i++)
+		if(!read_proc(conf.pids[i], &cpu[i], &rss, &hwm))
+			cpu[i] = 0;
+}
+
+static void
+report(uint64_t elapsed)
+{
+	double secs = elapsed / 1000000.0;
+	struct rusage ru;
+
+	printf("\nclients: %u connected, %u registered, %u ready, %u failed, %u lost\n",
+	       stats.connected, stats.registered, stats.ready, stats.failed, stats.lost);
+	hist_print("register", &stats.connect);
+
+	if(secs > 0)
+	{
+		printf("\ncommands over %.1f seconds (%u/s requested):\n", secs, conf.rate);
+		for(int i = 0; i < CMD_MAX; i++)
+		{
+			if(stats.sent[i] == 0)
+				continue;
+
+			printf("  %-10s %10" PRIu64 " sent  %10" PRIu64 " replies  %8" PRIu64 " errors\n",
+			       cmd_names[i], stats.sent[i], stats.replies[i], stats.errors[i]);
+		}
+		if(stats.untimed > 0)
+			printf("  %" PRIu64 " commands were not timed (too many outstanding)\n", stats.untimed);
+
+		printf("\nPRIVMSG delivery: %" PRIu64 " of %" PRIu64 " expected (%.1f%%), %.0f/s\n",
+		       stats.delivered, stats.expected,
+		       stats.expected ? 100.0 * stats.delivered / stats.expected : 0.0,
+		       stats.delivered / secs);
+		hist_print("delivery", &stats.delivery);
+
+		printf("\nreply latency:\n");
+		for(int i = 1; i < CMD_MAX; i++)
+			if(stats.sent[i] > 0)
+				hist_print(cmd_names[i], &stats.reply[i]);
+
+		printf("\ntraffic: %.1f KiB/s in, %.1f KiB/s out\n",
+		       stats.bytes_in / 1024.0 / secs, stats.bytes_out / 1024.0 / secs);
+
+		for(size_t i = 0; i < conf.pids.size(); i++)
+		{
+			uint64_t cpu, rss, hwm;
+
+			if(!read_proc(conf.pids[i], &cpu, &rss, &hwm))
+			{
+				printf("server %d: not running\n", (int)conf.pids[i]);
+				continue;
+			}
+
+			printf("server %d: cpu %.1f%%, rss %.1f MiB (peak %.1f MiB)\n",
+			       (int)conf.pids[i],
+			       100.0 * (cpu_end[i] - cpu_start[i]) / sysconf(_SC_CLK_TCK) / secs,
+			       rss / 1024.0, hwm / 1024.0);
+		}
+
+		for(const struct ib_server &s : servers)
+		{
+			if(s.io_samples < 2)
+			{
+				if(s.oper != NULL)
+					printf("server %s: no IO counts\n", s.name);
+				continue;
+			}
+
+			printf("server %s: %s, %lu epoll_ctl (%.0f/s), %lu epoll_wait (%.0f/s)\n",
+			       s.name, s.iotype,
+			       s.io_ctl[1] - s.io_ctl[0], (s.io_ctl[1] - s.io_ctl[0]) / secs,
+			       s.io_wait[1] - s.io_wait[0], (s.io_wait[1] - s.io_wait[0]) / secs);
+		}
+	}
+
+	if(!stats.splits.empty())
+	{
+		struct ib_hist h;
+
+		memset(&h, 0, sizeof(h));
+		for(uint64_t us : stats.splits)
+			hist_add(&h, us);
+
+		printf("\nsplits of %s from the hub:\n", conf.leaf);
+		hist_print("split", &h);
+	}
+
+	if(!stats.bursts.empty())
+	{
+		struct ib_hist h;
+
+		memset(&h, 0, sizeof(h));
+		for(uint64_t us : stats.bursts)
+			hist_add(&h, us);
+
+		printf("\nlink bursts of %s with %u users on the hub:\n",
+		       conf.leaf, servers[0].clients);
+		hist_print("relink", &h);
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("\nircbench: %.1f s user, %.1f s system\n",
+	       ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0,
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0);
+}
+
+static void
+tick(void)
+{
+	uint64_t now = now_us();
+	double dt = (now - last_tick) / 1000000.0;
+
+	last_tick = now;
+
+	switch(phase)
+	{
+		case PHASE_CONNECT:
+			connect_tokens = std::min(connect_tokens + dt * conf.connect_rate,
+						  conf.connect_rate / 10.0 + 1);
+			for(; connect_tokens >= 1 && next_connect < conf.clients; connect_tokens--)
+				ib_connect(&clients[next_connect++]);
+
+			if(next_connect == conf.clients &&
+			   stats.ready + stats.failed + stats.lost == conf.clients)
+			{
+				printf("ircbench: %u clients ready after %.1f seconds\n",
+				       stats.ready, (now - phase_start) / 1000000.0);
+				phase = PHASE_WARMUP;
+				phase_start = now;
+
+				if(conf.oper != NULL)
+					io_oper();
+			}
+			break;
+
+		case PHASE_WARMUP:
+			if(now - phase_start < conf.warmup * 1000000ULL)
+				break;
+
+			phase = PHASE_MEASURE;
+			phase_start = now;
+			measuring = true;
+			command_tokens = 0;
+			sample_cpu(cpu_start);
+			io_stats();
+			break;
+
+		case PHASE_MEASURE:
+			command_tokens = std::min(command_tokens + dt * conf.rate, conf.rate / 10.0 + 1);
+			for(; command_tokens >= 1; command_tokens--)
+				issue_command();
+
+			if(now - phase_start < conf.duration * 1000000ULL)
+				break;
+
+			/* stop issuing, but give what is in flight time to arrive */
+			phase = PHASE_DRAIN;
+			measured = now - phase_start;
+			phase_start = now;
+			sample_cpu(cpu_end);
+			io_stats();
+			break;
+
+		case PHASE_DRAIN:
+			if(now - phase_start < IB_DRAIN)
+				break;
+
+			measuring = false;
+			report(measured);
+
+			if(conf.leaf == NULL)
+			{
+				phase = PHASE_DONE;
+				break;
+			}
+
+			phase = PHASE_BURST;
+			burst_deadline = now + 120000000;
+			{
+				const char *sep = strchr(conf.oper, ':');
+				ib_send(&clients[0], "OPER %.*s %s", (int)(sep - conf.oper), conf.oper, sep + 1);
+			}
+			break;
+
+		case PHASE_BURST:
+			burst_tick(now);
+			if(phase == PHASE_DONE && !stats.bursts.empty())
+				report(0);
+			break;
+
+		case PHASE_DONE:
+			break;
+	}
+}
+
+
+/*
+ * Setup
+ */
+
+static bool
+parse_servers(char *list)
+{
+	char *tok, *save = NULL, *port;
+
+	for(tok = rb_strtok_r(list, ",", &save); tok; tok = rb_strtok_r(NULL, ",", &save))
+	{
+		struct ib_server s;
+
+		memset(&s, 0, sizeof(s));
+		rb_strlcpy(s.name, tok, sizeof(s.name));
+
+		if((port = strrchr(tok, ':')) == NULL || strchr(tok, ':') != port)
+		{
+			fprintf(stderr, "ircbench: server %s must be given as ipv4:port\n", tok);
+			return false;
+		}
+		*port++ = '\0';
+
+		if(rb_inet_pton_sock(tok, (struct sockaddr *)&s.addr) <= 0)
+		{
+			fprintf(stderr, "ircbench: bad server address %s\n", tok);
+			return false;
+		}
+
+		((struct sockaddr_in *)&s.addr)->sin_port = htons(atoi(port));
+		if(servers.size() == IB_MAXSERVERS)
+		{
+			fprintf(stderr, "ircbench: at most %d servers\n", IB_MAXSERVERS);
+			return false;
+		}
+		servers.push_back(s);
+	}
+
+	return !servers.empty();
+}
+
+static bool
+parse_mix(char *mix)
+{
+	char *tok, *save = NULL, *eq;
+
+	memset(conf.weight, 0, sizeof(conf.weight));
+	conf.weight_total = 0;
+
+	for(tok = rb_strtok_r(mix, ",", &save); tok; tok = rb_strtok_r(NULL, ",", &save))
+	{
+		int i;
+
+		if((eq = strchr(tok, '=')) == NULL)
+			return false;
+		*eq++ = '\0';
+
+		for(i = 0; i < CMD_MAX && strcasecmp(tok, cmd_names[i]); i++)
+			;
+		if(i == CMD_MAX)
+		{
+			fprintf(stderr, "ircbench: unknown command %s in mix\n", tok);
+			return false;
+		}
+
+		conf.weight[i] = atoi(eq);
+		conf.weight_total += conf.weight[i];
+	}
+
+	return conf.weight_total > 0;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: ircbench [options]\n"
+		"  -s addr:port[,...]  servers to spread clients over (127.0.0.1:7601)\n"
+		"  -c clients          number of clients (1000)\n"
+		"  -r rate             connections started per second (1000)\n"
+		"  -C channels         number of channels (100)\n"
+		"  -j joins            channels each client joins (3)\n"
+		"  -z skew             Zipf exponent of channel popularity, 0 is uniform (1.0)\n"
+		"  -m mix              command weights (privmsg=80,join=4,part=4,nick=4,who=4,mode=4)\n"
+		"  -R rate             commands per second over all clients (1000)\n"
+		"  -d seconds          length of the measured run (30)\n"
+		"  -w seconds          warmup between registration and measuring (5)\n"
+		"  -p pid[,...]        server processes to report CPU and memory for\n"
+		"  -b addr             first loopback address to connect from (127.0.1.1)\n"
+		"  -B count            number of source addresses (one per 20000 clients)\n"
+		"  -L server           after the run, relink this server to the first one\n"
+		"  -O name:password    oper block to use for -L and for IO counts\n"
+		"  -n rounds           number of relinks (3)\n"
+		"  -S seed             random seed\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char defserver[] = "127.0.0.1:7601";
+	const char *source = "127.0.1.1";
+	char *serverlist = defserver;
+	struct rlimit rl;
+	int ch;
+
+	while((ch = getopt(argc, argv, "s:c:r:C:j:z:m:R:d:w:p:b:B:L:O:n:S:h")) != -1)
+	{
+		switch(ch)
+		{
+			case 's': serverlist = optarg; break;
+			case 'c': conf.clients = atoi(optarg); break;
+			case 'r': conf.connect_rate = atoi(optarg); break;
+			case 'C': conf.channels = atoi(optarg); break;
+			case 'j': conf.joins = atoi(optarg); break;
+			case 'z': conf.skew = atof(optarg); break;
+			case 'm':
+				if(!parse_mix(optarg))
+					usage();
+				break;
+			case 'R': conf.rate = atoi(optarg); break;
+			case 'd': conf.duration = atoi(optarg); break;
+			case 'w': conf.warmup = atoi(optarg); break;
+			case 'p':
+			{
+				char *tok, *save = NULL;
+				for(tok = rb_strtok_r(optarg, ",", &save); tok; tok = rb_strtok_r(NULL, ",", &save))
+					if(conf.pids.size() < IB_MAXSERVERS)
+						conf.pids.push_back(atoi(tok));
+				break;
+			}
+			case 'b': source = optarg; break;
+			case 'B': conf.sources = atoi(optarg); break;
+			case 'L': conf.leaf = optarg; break;
+			case 'O': conf.oper = optarg; break;
+			case 'n': conf.rounds = atoi(optarg); break;
+			case 'S': conf.seed = strtoull(optarg, NULL, 0); break;
+			default: usage();
+		}
+	}
+
+	if(!parse_servers(serverlist) || conf.clients == 0 || conf.channels == 0 ||
+	   conf.connect_rate == 0 || conf.rate == 0)
+		usage();
+
+	if(conf.leaf != NULL && conf.oper == NULL)
+	{
+		fprintf(stderr, "ircbench: -L needs -O name:password\n");
+		usage();
+	}
+
+	if(conf.oper != NULL && strchr(conf.oper, ':') == NULL)
+		usage();
+
+	if(conf.sources == 0)
+		conf.sources = conf.clients / 20000 + 1;
+
+	if(rb_inet_pton_sock(source, (struct sockaddr *)&conf.source) <= 0 ||
+	   GET_SS_FAMILY(&conf.source) != AF_INET)
+	{
+		fprintf(stderr, "ircbench: bad source address %s\n", source);
+		return 1;
+	}
+
+	if(conf.seed != 0)
+		rng_state = conf.seed;
+
+	/* every client needs a descriptor */
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < conf.clients + 64)
+	{
+		rl.rlim_cur = std::min<rlim_t>(conf.clients + 64, rl.rlim_max);
+		setrlimit(RLIMIT_NOFILE, &rl);
+		if(rl.rlim_cur < conf.clients + 64)
+			fprintf(stderr, "ircbench: descriptor limit %lu is below %u clients\n",
+				(unsigned long)rl.rlim_cur, conf.clients);
+	}
+
+	rb_lib_init(NULL, NULL, NULL, 0, conf.clients + 64, 1024, 4096);
+	rb_set_time();
+
+	build_channels();
+	clients.resize(conf.clients);
+	for(unsigned int i = 0; i < conf.clients; i++)
+	{
+		struct ib_client *c = &clients[i];
+
+		c->id = i;
+		c->server = i % servers.size();
+		c->want = std::min(conf.joins, conf.channels);
+		set_nick(c);
+		servers[c->server].clients++;
+	}
+
+	printf("ircbench: %u clients over %zu servers, %u channels, %u commands/s for %u seconds\n",
+	       conf.clients, servers.size(), conf.channels, conf.rate, conf.duration);
+
+	phase_start = last_tick = now_us();
+	while(phase != PHASE_DONE)
+	{
+		rb_select(5);
+		rb_set_time();
+		rb_event_run();
+		tick();
+	}
+
+	return 0;
+}
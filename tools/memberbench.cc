@@ -0,0 +1,231 @@
+/*
+ *  memberbench.cc: Channel membership lookup benchmark.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ *  USA
+ */
+
+/*
+ * Builds channels of several sizes out of remote clients that are each in
+ * -j channels, then times find_channel_membership() on random members and
+ * non-members of every channel.  Without a membership index a lookup walks
+ * the shorter of the channel's member list and the client's channel list,
+ * so its cost grows with both until one of them runs out.
+ *
+ * See README.bench.
+ */
+
+#include <ircd/stdinc.h>
+#include <ircd/channel.h>
+#include <ircd/msg.h>
+#include <ircd/client.h>
+#include <ircd/hook.h>
+#include <ircd/ircd.h>
+#include <vector>
+
+using namespace ircd;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t
+rng(void)
+{
+	/* xorshift64*, plenty for picking clients */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct Client *
+bench_client(unsigned int i)
+{
+	struct Client *client_p = make_client(&me);
+
+	snprintf(client_p->name, sizeof(client_p->name), "mb%u", i);
+	make_user(client_p);
+	SetClient(client_p);
+	return client_p;
+}
+
+static struct Channel *
+bench_channel(const char *prefix, unsigned int n)
+{
+	char name[CHANNELLEN + 1];
+
+	snprintf(name, sizeof(name), "#%s%u", prefix, n);
+	return allocate_channel(name);
+}
+
+/* times lookups of the clients in who[], returning ns per lookup */
+static double
+time_lookups(struct Channel *chptr, const std::vector<struct Client *> &who,
+	     unsigned int rounds, bool expect)
+{
+	uint64_t t0;
+	unsigned long found = 0;
+
+	t0 = now_ns();
+	for(unsigned int r = 0; r < rounds; r++)
+		for(struct Client *client_p : who)
+			found += find_channel_membership(chptr, client_p) != NULL;
+
+	if(found != (expect ? (unsigned long)rounds * who.size() : 0))
+	{
+		fprintf(stderr, "memberbench: %s lookups in %s found %lu\n",
+			expect ? "member" : "non-member", chptr->chname, found);
+		exit(1);
+	}
+
+	return (double)(now_ns() - t0) / ((double)rounds * who.size());
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: memberbench [options]\n"
+		"  -s size[,...]  channel sizes to time (10,100,1000,10000,50000)\n"
+		"  -j joins       channels each client is in besides the timed one (20)\n"
+		"  -l lookups     lookups per size, half members and half not (1000000)\n"
+		"  -S seed        random seed\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	std::vector<unsigned int> sizes;
+	unsigned int joins = 20, lookups = 1000000, maxsize = 0;
+	std::vector<struct Client *> pool;
+	std::vector<struct Channel *> filler;
+	int ch;
+
+	while((ch = getopt(argc, argv, "s:j:l:S:h")) != -1)
+	{
+		switch(ch)
+		{
+			case 's':
+			{
+				char *tok, *save = NULL;
+				for(tok = rb_strtok_r(optarg, ",", &save); tok; tok = rb_strtok_r(NULL, ",", &save))
+					if(atoi(tok) > 0)
+						sizes.push_back(atoi(tok));
+				break;
+			}
+			case 'j': joins = atoi(optarg); break;
+			case 'l': lookups = atoi(optarg); break;
+			case 'S': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+			default: usage();
+		}
+	}
+
+	if(sizes.empty())
+		sizes = { 10, 100, 1000, 10000, 50000 };
+
+	if(lookups < 2)
+		usage();
+
+	for(unsigned int size : sizes)
+		maxsize = std::max(maxsize, size);
+
+	rb_lib_init(NULL, NULL, NULL, 0, 1024, 1024, 1024);
+	rb_set_time();
+	init_hook();
+	init_client();
+	init_channels();
+
+	/* twice the largest channel, so there are as many non-members */
+	for(unsigned int i = 0; i < maxsize * 2; i++)
+		pool.push_back(bench_client(i));
+
+	/* every client is in joins other channels, 64 clients to each */
+	for(unsigned int i = 0; i < (maxsize * 2 * joins + 63) / 64; i++)
+		filler.push_back(bench_channel("mbfill", i));
+
+	std::vector<std::vector<struct Channel *>> chans(pool.size());
+	for(unsigned int i = 0; i < pool.size(); i++)
+		for(unsigned int j = 0; j < joins; j++)
+			chans[i].push_back(filler[(i + j * pool.size()) / 64]);
+
+	/* each timed channel is a random subset of the pool, the rest of
+	 * which are the non-members
+	 */
+	std::vector<struct Channel *> timed;
+	std::vector<std::vector<unsigned int>> order;
+	for(unsigned int size : sizes)
+	{
+		std::vector<unsigned int> o(pool.size());
+
+		for(unsigned int i = 0; i < o.size(); i++)
+			o[i] = i;
+
+		for(size_t i = o.size() - 1; i > 0; i--)
+			std::swap(o[i], o[rng() % (i + 1)]);
+
+		timed.push_back(bench_channel("mbsize", timed.size()));
+		for(unsigned int i = 0; i < size; i++)
+			chans[o[i]].push_back(timed.back());
+
+		order.push_back(std::move(o));
+	}
+
+	/* join in a random order, so the timed channel is not always at the
+	 * same end of a client's own channel list
+	 */
+	for(unsigned int i = 0; i < pool.size(); i++)
+	{
+		for(size_t j = chans[i].size(); j > 1; j--)
+			std::swap(chans[i][j - 1], chans[i][rng() % j]);
+
+		for(struct Channel *chptr : chans[i])
+			add_user_to_channel(chptr, pool[i], CHFL_PEON);
+	}
+
+	printf("memberbench: clients in %u other channels, %u lookups per size\n\n",
+	       joins, lookups);
+	printf("  %8s %14s %14s\n", "members", "member ns", "non-member ns");
+
+	for(unsigned int n = 0; n < sizes.size(); n++)
+	{
+		std::vector<struct Client *> in, out;
+		unsigned int size = sizes[n], rounds;
+		double hit, miss;
+
+		/* probe in a different order from the one they joined in */
+		for(unsigned int i = 0; i < 4096 && i < lookups / 2; i++)
+		{
+			in.push_back(pool[order[n][rng() % size]]);
+			out.push_back(pool[order[n][size + rng() % (pool.size() - size)]]);
+		}
+
+		rounds = (lookups / 2 + in.size() - 1) / in.size();
+		hit = time_lookups(timed[n], in, rounds, true);
+		miss = time_lookups(timed[n], out, rounds, false);
+
+		printf("  %8u %14.1f %14.1f\n", size, hit, miss);
+	}
+
+	return 0;
+}
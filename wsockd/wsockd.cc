@@ -23,6 +23,11 @@
 #include <ircd/stdinc.h>
 #include "sha1.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define WS_UNMASK_SSE2 1
+#endif
+
 using namespace ircd::defaults;
 
 #define MAXPASSFD 4
@@ -95,38 +100,38 @@ typedef struct _conn
 	uint8_t flags;
 
 	char client_key[37];		/* maximum 36 bytes + nul */
+
+	/* the frame being received; its payload is unmasked as it arrives */
+	uint8_t frame_hdr[14];		/* header bytes collected so far */
+	uint8_t frame_hdrlen;
+	uint8_t frame_opcode;
+	bool frame_masked;
+	uint8_t frame_mask[4];
+	uint64_t frame_left;		/* payload bytes still to come */
+	uint64_t frame_pos;		/* payload bytes already seen */
+	uint8_t ctl_payload[125];	/* payload of a control frame */
 } conn_t;
 
+#define WEBSOCKET_OPCODE_CONTINUATION_FRAME  0
 #define WEBSOCKET_OPCODE_TEXT_FRAME          1
+#define WEBSOCKET_OPCODE_BINARY_FRAME        2
+#define WEBSOCKET_OPCODE_CLOSE_FRAME         8
+#define WEBSOCKET_OPCODE_PING_FRAME          9
+#define WEBSOCKET_OPCODE_PONG_FRAME          10
 
 #define WEBSOCKET_MASK_LENGTH 4
 
 #define WEBSOCKET_MAX_UNEXTENDED_PAYLOAD_DATA_LENGTH 125
+#define WEBSOCKET_MAX_HEADER_LENGTH 10		/* unmasked, 64-bit length */
+
+/* lines going to the client are batched into frames of up to this much */
+#define WEBSOCKET_BATCH_SIZE (READBUF_SIZE * 2)
 
 typedef struct {
 	uint8_t opcode_rsv_fin; // opcode: 4, rsv1: 1, rsv2: 1, rsv3: 1, fin: 1
 	uint8_t payload_length_mask; // payload_length: 7, mask: 1
 } ws_frame_hdr_t;
 
-typedef struct {
-	ws_frame_hdr_t header;
-	uint8_t payload_data[WEBSOCKET_MAX_UNEXTENDED_PAYLOAD_DATA_LENGTH];
-} ws_frame_payload_t;
-
-typedef struct {
-	ws_frame_hdr_t header;
-} ws_frame_t;
-
-typedef struct {
-	ws_frame_hdr_t header;
-	uint16_t payload_length_extended;
-} ws_frame_ext_t;
-
-typedef struct {
-	ws_frame_hdr_t header;
-	uint64_t payload_length_extended;
-} ws_frame_ext2_t;
-
 static inline void
 ws_frame_set_opcode(ws_frame_hdr_t *header, int opcode)
 {
@@ -326,48 +331,53 @@ conn_mod_write(conn_t * conn, void *data, size_t len)
 	rb_rawbuf_append(conn->modbuf_out, data, len);
 }
 
-static void
-conn_mod_write_short_frame(conn_t * conn, void *data, int len)
+/*
+ * ws_frame_header - build an unmasked frame header for a payload of len
+ * bytes ending at end, and return where it starts.  There must be room
+ * for WEBSOCKET_MAX_HEADER_LENGTH bytes before end.
+ */
+static uint8_t *
+ws_frame_header(uint8_t *end, int opcode, uint64_t len)
 {
-	ws_frame_hdr_t hdr;
+	ws_frame_hdr_t hdr = { 0, 0 };
+	uint8_t *p = end;
+	int i;
 
-	ws_frame_set_opcode(&hdr, WEBSOCKET_OPCODE_TEXT_FRAME);
+	ws_frame_set_opcode(&hdr, opcode);
 	ws_frame_set_fin(&hdr, 1);
-	hdr.payload_length_mask = (len + 2) & 0x7f;
 
-	conn_mod_write(conn, &hdr, sizeof(hdr));
-	conn_mod_write(conn, data, len);
-	conn_mod_write(conn, (void *)"\r\n", 2);
-}
+	if(len <= WEBSOCKET_MAX_UNEXTENDED_PAYLOAD_DATA_LENGTH)
+		hdr.payload_length_mask = len;
+	else if(len <= UINT16_MAX)
+	{
+		for(i = 0; i < 2; i++, len >>= 8)
+			*--p = len & 0xff;
 
-static void
-conn_mod_write_long_frame(conn_t * conn, void *data, int len)
-{
-	ws_frame_ext_t hdr;
+		hdr.payload_length_mask = 126;
+	}
+	else
+	{
+		for(i = 0; i < 8; i++, len >>= 8)
+			*--p = len & 0xff;
 
-	ws_frame_set_opcode(&hdr.header, WEBSOCKET_OPCODE_TEXT_FRAME);
-	ws_frame_set_fin(&hdr.header, 1);
-	hdr.header.payload_length_mask = 126;
-	hdr.payload_length_extended = htons(len + 2);
+		hdr.payload_length_mask = 127;
+	}
 
-	conn_mod_write(conn, &hdr, sizeof(hdr));
-	conn_mod_write(conn, data, len);
-	conn_mod_write(conn, (void *)"\r\n", 2);
+	p -= sizeof(hdr);
+	memcpy(p, &hdr, sizeof(hdr));
+	return p;
 }
 
 static void
-conn_mod_write_frame(conn_t *conn, void *data, int len)
+conn_mod_write_control(conn_t *conn, int opcode, const uint8_t *data, size_t len)
 {
-	if(IsDead(conn))	/* no point in queueing to a dead man */
-		return;
-
-	if (len < 123)
-	{
-		conn_mod_write_short_frame(conn, data, len);
-		return;
-	}
+	uint8_t buf[WEBSOCKET_MAX_HEADER_LENGTH + WEBSOCKET_MAX_UNEXTENDED_PAYLOAD_DATA_LENGTH];
+	uint8_t *payload = buf + WEBSOCKET_MAX_HEADER_LENGTH;
+	uint8_t *p;
 
-	conn_mod_write_long_frame(conn, data, len);
+	memcpy(payload, data, len);
+	p = ws_frame_header(payload, opcode, len);
+	conn_mod_write(conn, p, payload + len - p);
 }
 
 static void
@@ -484,124 +494,227 @@ cleanup_bad_message(mod_ctl_t * ctl, mod_ctl_buf_t * ctlb)
 		rb_close(ctlb->F[i]);
 }
 
+/*
+ * ws_frame_unmask - unmask len bytes of payload in place, given how far
+ * into the frame they start.  The key is widened to a whole register so
+ * the bulk of the payload goes sixteen or eight bytes at a time.
+ */
 static void
-ws_frame_unmask(char *msg, int length, uint8_t maskval[WEBSOCKET_MASK_LENGTH])
+ws_frame_unmask(uint8_t *msg, size_t length, const uint8_t maskval[WEBSOCKET_MASK_LENGTH], uint64_t pos)
 {
-	int i;
+	uint8_t key[16];
+	uint64_t key64;
+	size_t i;
 
-	for (i = 0; i < length; i++)
-		msg[i] = msg[i] ^ maskval[i % 4];
-}
-
-static void
-conn_mod_process_frame(conn_t *conn, ws_frame_hdr_t *hdr, int masked)
-{
-	char msg[WEBSOCKET_MAX_UNEXTENDED_PAYLOAD_DATA_LENGTH];
-	uint8_t maskval[WEBSOCKET_MASK_LENGTH];
-	int dolen;
+	for(i = 0; i < sizeof(key); i++)
+		key[i] = maskval[(pos + i) % WEBSOCKET_MASK_LENGTH];
 
-	/* if we're masked, we get to collect the masking key for this frame */
-	if (masked)
+	i = 0;
+#ifdef WS_UNMASK_SSE2
 	{
-		dolen = rb_rawbuf_get(conn->modbuf_in, maskval, sizeof(maskval));
-		if (!dolen)
+		const __m128i k = _mm_loadu_si128((const __m128i *)(const void *)key);
+
+		for(; i + 16 <= length; i += 16)
 		{
-			close_conn(conn, WAIT_PLAIN, "websocket error: fault unpacking unmask key");
-			return;
+			__m128i v = _mm_loadu_si128((const __m128i *)(const void *)(msg + i));
+			_mm_storeu_si128((__m128i *)(void *)(msg + i), _mm_xor_si128(v, k));
 		}
 	}
+#endif
+	memcpy(&key64, key, sizeof(key64));
+	for(; i + 8 <= length; i += 8)
+	{
+		uint64_t v;
+
+		memcpy(&v, msg + i, sizeof(v));
+		v ^= key64;
+		memcpy(msg + i, &v, sizeof(v));
+	}
 
-	dolen = rb_rawbuf_get(conn->modbuf_in, msg, hdr->payload_length_mask);
-	if (!dolen)
+	for(; i < length; i++)
+		msg[i] ^= key[i % WEBSOCKET_MASK_LENGTH];
+}
+
+/* bytes of header needed, given the first have bytes of it */
+static size_t
+ws_frame_header_length(const uint8_t *hdr, size_t have)
+{
+	size_t need = sizeof(ws_frame_hdr_t);
+
+	if(have < need)
+		return need;
+
+	switch(hdr[1] & 0x7f)
 	{
-		close_conn(conn, WAIT_PLAIN, "websocket error: fault unpacking message");
-		return;
+	case 126:
+		need += 2;
+		break;
+	case 127:
+		need += 8;
+		break;
 	}
 
-	if (masked)
-		ws_frame_unmask(msg, dolen, maskval);
+	if(hdr[1] & 0x80)
+		need += WEBSOCKET_MASK_LENGTH;
 
-	rb_linebuf_parse(&conn->plainbuf_out, msg, dolen, 1);
+	return need;
 }
 
-static void
-conn_mod_process_large(conn_t *conn, ws_frame_hdr_t *hdr, int masked)
+/*
+ * conn_mod_start_frame - take apart a complete frame header.  Returns
+ * false, having closed the connection, if the frame is not acceptable.
+ */
+static bool
+conn_mod_start_frame(conn_t *conn)
 {
-	char msg[READBUF_SIZE];
-	uint16_t msglen;
-	uint8_t maskval[WEBSOCKET_MASK_LENGTH];
-	int dolen;
+	const uint8_t *p = conn->frame_hdr + sizeof(ws_frame_hdr_t);
+	bool fin = (conn->frame_hdr[0] & 0x80) != 0;
+	uint64_t len;
+	int i;
 
-	memset(msg, 0, sizeof msg);
+	conn->frame_opcode = conn->frame_hdr[0] & 0xf;
 
-	dolen = rb_rawbuf_get(conn->modbuf_in, &msglen, sizeof(msglen));
-	if (!dolen)
+	if(conn->frame_hdr[0] & 0x70)
 	{
-		close_conn(conn, WAIT_PLAIN, "websocket error: fault unpacking message size");
-		return;
+		close_conn(conn, WAIT_PLAIN, "websocket error: reserved bits set");
+		return false;
 	}
 
-	msglen = ntohs(msglen);
-
-	if (masked)
+	switch(conn->frame_hdr[1] & 0x7f)
 	{
-		dolen = rb_rawbuf_get(conn->modbuf_in, maskval, sizeof(maskval));
-		if (!dolen)
+	case 126:
+		len = ((uint64_t)p[0] << 8) | p[1];
+		p += 2;
+		break;
+	case 127:
+		for(len = 0, i = 0; i < 8; i++)
+			len = (len << 8) | p[i];
+
+		p += 8;
+
+		if(len >> 63)
 		{
-			close_conn(conn, WAIT_PLAIN, "websocket error: fault unpacking unmask key");
-			return;
+			close_conn(conn, WAIT_PLAIN, "websocket error: bad frame length");
+			return false;
 		}
+		break;
+	default:
+		len = conn->frame_hdr[1] & 0x7f;
+		break;
 	}
 
-	dolen = rb_rawbuf_get(conn->modbuf_in, msg, msglen);
-	if (!dolen)
+	conn->frame_masked = (conn->frame_hdr[1] & 0x80) != 0;
+	if(conn->frame_masked)
+		memcpy(conn->frame_mask, p, WEBSOCKET_MASK_LENGTH);
+
+	switch(conn->frame_opcode)
 	{
-		close_conn(conn, WAIT_PLAIN, "websocket error: fault unpacking message");
-		return;
-	}
+	case WEBSOCKET_OPCODE_CONTINUATION_FRAME:
+	case WEBSOCKET_OPCODE_TEXT_FRAME:
+	case WEBSOCKET_OPCODE_BINARY_FRAME:
+		break;
+
+	case WEBSOCKET_OPCODE_CLOSE_FRAME:
+	case WEBSOCKET_OPCODE_PING_FRAME:
+	case WEBSOCKET_OPCODE_PONG_FRAME:
+		if(!fin || len > WEBSOCKET_MAX_UNEXTENDED_PAYLOAD_DATA_LENGTH)
+		{
+			close_conn(conn, WAIT_PLAIN, "websocket error: bad control frame");
+			return false;
+		}
+		break;
 
-	if (masked)
-		ws_frame_unmask(msg, dolen, maskval);
+	default:
+		close_conn(conn, WAIT_PLAIN, "websocket error: unknown opcode %d", conn->frame_opcode);
+		return false;
+	}
 
-	rb_linebuf_parse(&conn->plainbuf_out, msg, dolen, 1);
+	conn->frame_left = len;
+	conn->frame_pos = 0;
+	return true;
 }
 
+/* the whole payload of the current frame has been seen */
 static void
-conn_mod_process_huge(conn_t *conn, ws_frame_hdr_t *hdr, int masked)
+conn_mod_end_frame(conn_t *conn)
 {
-	/* XXX implement me */
+	switch(conn->frame_opcode)
+	{
+	case WEBSOCKET_OPCODE_CLOSE_FRAME:
+		conn_mod_write_control(conn, WEBSOCKET_OPCODE_CLOSE_FRAME, conn->ctl_payload, conn->frame_pos);
+		close_conn(conn, WAIT_PLAIN, "%s", remote_closed);
+		break;
+
+	case WEBSOCKET_OPCODE_PING_FRAME:
+		conn_mod_write_control(conn, WEBSOCKET_OPCODE_PONG_FRAME, conn->ctl_payload, conn->frame_pos);
+		conn_mod_write_sendq(conn->mod_fd, conn);
+		break;
+	}
 }
 
+/*
+ * conn_mod_process - take frames apart straight out of the read buffer.
+ * Payloads are unmasked in place and handed to the linebuf, which joins
+ * up lines across fragments and across reads, so frames never need to be
+ * gathered up whole and can be of any length.
+ */
 static void
-conn_mod_process(conn_t *conn)
+conn_mod_process(conn_t *conn, uint8_t *buf, size_t len)
 {
-	ws_frame_hdr_t hdr;
+	size_t need, n;
 
-	while (1)
+	while(len > 0 && !IsDead(conn))
 	{
-		int masked;
-		int dolen = rb_rawbuf_get(conn->modbuf_in, &hdr, sizeof(hdr));
-		if (dolen != sizeof(hdr))
-			break;
+		if(conn->frame_left == 0)
+		{
 
-		masked = (hdr.payload_length_mask >> 7) == 1;
+			while((need = ws_frame_header_length(conn->frame_hdr, conn->frame_hdrlen)) > conn->frame_hdrlen && len > 0)
+			{
+				n = need - conn->frame_hdrlen;
+				if(n > len)
+					n = len;
+
+				memcpy(conn->frame_hdr + conn->frame_hdrlen, buf, n);
+				conn->frame_hdrlen += n;
+				buf += n;
+				len -= n;
+			}
 
-		hdr.payload_length_mask &= 0x7f;
-		switch (hdr.payload_length_mask)
-		{
-		case 126:
-			conn_mod_process_large(conn, &hdr, masked);
-			break;
-		case 127:
-			conn_mod_process_huge(conn, &hdr, masked);
-			break;
-		default:
-			conn_mod_process_frame(conn, &hdr, masked);
-			break;
+			if(conn->frame_hdrlen < need)
+				break;
+
+			conn->frame_hdrlen = 0;
+
+			if(!conn_mod_start_frame(conn))
+				return;
+
+			if(conn->frame_left == 0)
+				conn_mod_end_frame(conn);
+
+			continue;
 		}
+
+		n = len < conn->frame_left ? len : (size_t)conn->frame_left;
+
+		if(conn->frame_masked)
+			ws_frame_unmask(buf, n, conn->frame_mask, conn->frame_pos);
+
+		if(conn->frame_opcode & 0x8)
+			memcpy(conn->ctl_payload + conn->frame_pos, buf, n);
+		else
+			rb_linebuf_parse(&conn->plainbuf_out, (char *)buf, n, 1);
+
+		conn->frame_pos += n;
+		conn->frame_left -= n;
+		buf += n;
+		len -= n;
+
+		if(conn->frame_left == 0)
+			conn_mod_end_frame(conn);
 	}
 
-	conn_plain_write_sendq(conn->plain_fd, conn);
+	if(!IsDead(conn))
+		conn_plain_write_sendq(conn->plain_fd, conn);
 }
 
 static void
@@ -671,9 +784,7 @@ conn_mod_handshake_process(conn_t *conn)
 static void
 conn_mod_read_cb(rb_fde_t *fd, void *data)
 {
-	char inbuf[READBUF_SIZE];
-
-	memset(inbuf, 0, sizeof inbuf);
+	uint8_t inbuf[READBUF_SIZE];
 
 	conn_t *conn = (conn_t *)data;
 	int length = 0;
@@ -708,11 +819,13 @@ conn_mod_read_cb(rb_fde_t *fd, void *data)
 			return;
 		}
 
-		rb_rawbuf_append(conn->modbuf_in, inbuf, length);
 		if (!IsKeyed(conn))
+		{
+			rb_rawbuf_append(conn->modbuf_in, inbuf, length);
 			conn_mod_handshake_process(conn);
+		}
 		else
-			conn_mod_process(conn);
+			conn_mod_process(conn, inbuf, length);
 
 		if ((size_t) length < sizeof(inbuf))
 		{
@@ -740,20 +853,42 @@ plain_check_cork(conn_t * conn)
 	return false;
 }
 
+/*
+ * conn_plain_process_recvq - send the client every complete line we have,
+ * as few frames as possible, each holding as many lines as fit.
+ */
 static void
 conn_plain_process_recvq(conn_t *conn)
 {
-	char inbuf[READBUF_SIZE];
-
-	memset(inbuf, 0, sizeof inbuf);
+	static uint8_t buf[WEBSOCKET_MAX_HEADER_LENGTH + WEBSOCKET_BATCH_SIZE];
+	uint8_t *payload = buf + WEBSOCKET_MAX_HEADER_LENGTH;
+	uint8_t *end = buf + sizeof(buf);
+	size_t len = 0;
+	bool more = true;
 
-	while (1)
+	while (more && !IsDead(conn))
 	{
-		int dolen = rb_linebuf_get(&conn->plainbuf_in, inbuf, sizeof inbuf, LINEBUF_COMPLETE, LINEBUF_PARSED);
-		if (!dolen)
-			break;
+		/* leave room for a whole line and its CRLF */
+		while (len + READBUF_SIZE + 2 <= WEBSOCKET_BATCH_SIZE)
+		{
+			int dolen = rb_linebuf_get(&conn->plainbuf_in, (char *)payload + len, end - payload - len - 2, LINEBUF_COMPLETE, LINEBUF_PARSED);
+			if (!dolen)
+			{
+				more = false;
+				break;
+			}
 
-		conn_mod_write_frame(conn, inbuf, dolen);
+			len += dolen;
+			payload[len++] = '\r';
+			payload[len++] = '\n';
+		}
+
+		if (len > 0)
+		{
+			uint8_t *p = ws_frame_header(payload, WEBSOCKET_OPCODE_TEXT_FRAME, len);
+			conn_mod_write(conn, p, payload + len - p);
+			len = 0;
+		}
 	}
 
 	if (IsKeyed(conn))